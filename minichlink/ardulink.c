@@ -171,6 +171,7 @@ void * TryInit_Ardulink(const init_hints_t* hints)
 	MCF.Control3v3 = ArdulinkControl3v3;
 	MCF.DelayUS = ArdulinkDelayUS;
 	MCF.Exit = ArdulinkExit;
+	MCF.Close = ArdulinkExit;
 	MCF.SetupInterface = ArdulinkSetupInterface;
 
 	return ctx;
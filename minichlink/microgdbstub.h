@@ -33,10 +33,13 @@ int RVSendGDBHaltReason( void * dev );
 void RVNetConnect( void * dev );
 int RVGetNumRegisters( void * dev );
 int RVReadCPURegister( void * dev, int regno, uint32_t * regret );
+int RVReadAllCPURegisters( void * dev, uint32_t * regret ); // All RVGetNumRegisters() of them, then PC.
 int RVWriteCPURegister( void * dev, int regno, uint32_t value );
 int RVDebugExec( void * dev, enum HaltResetResumeType halt_reset_or_resume, int resume_from_other_address, uint32_t address );
+int RVRangeStep( void * dev, uint32_t start, uint32_t end ); // Step until PC leaves [start, end), reply comes from RVNetPoll.
 int RVReadMem( void * dev, uint32_t memaddy, uint8_t * payload, int len );
-int RVHandleBreakpoint( void * dev, int set, uint32_t address );
+int RVMemoryCRC( void * dev, uint32_t memaddy, uint32_t len, uint32_t * crc ); // GDB's CRC-32, for compare-sections.
+int RVHandleBreakpoint( void * dev, int type, int set, uint32_t address, uint32_t kind ); // type as in Z packets. Positive return = type not supported.
 int RVWriteRAM(void * dev, uint32_t memaddy, uint32_t length, uint8_t * payload );
 void RVCommandResetPart( void * dev, int mode );
 void RVHandleDisconnect( void * dev );
@@ -45,11 +48,13 @@ void RVHandleUnsolicitedGDBBreakRequest( void * dev );
 void RVHandleKillRequest( void * dev );
 int RVErase( void * dev, uint32_t memaddy, uint32_t length );
 int RVWriteFlash( void * dev, uint32_t memaddy, uint32_t length, uint8_t * payload );
+int RVFlashDone( void * dev ); // Flash writes may be buffered until this.
 
 #ifdef MICROGDBSTUB_SOCKETS
 int MicroGDBPollServer( void * dev );
 int MicroGDBStubStartup( void * dev );
 void MicroGDBExitServer( void * dev );
+int MicroGDBPollFD( void ); // Socket to wait on for activity, or -1.
 #endif
 
 // If you are not a network socket, you can pass in this data.
@@ -94,7 +99,11 @@ int WSAAPI WSAPoll(struct pollfd * fdArray, ULONG	   fds, INT		 timeout );
 #include <linux/in.h>
 #endif
 
+// Largest packet either way, advertised in qSupported.
+#define MICROGDBSTUB_PACKET_SIZE 0xf000
+
 char gdbbuffer[65536];
+char gdbreply[MICROGDBSTUB_PACKET_SIZE*2]; // Replies are built in place here, see SendReplyInPlace.
 uint8_t gdbchecksum = 0;
 int gdbbufferplace = 0;
 int gdbbufferstate = 0;
@@ -116,24 +125,91 @@ static int fromhex( char c )
 	return c;
 }
 
-// output must have length of len / 2.
+// For bulk memory transfers, so every byte is a couple of lookups.
+static char gdbhexpairs[512];   // Two hex digits per byte value.
+static int8_t gdbhexvalues[256]; // Value of a hex digit, -1 if not one.
+
+static void GDBHexTablesInit( void )
+{
+	static int done;
+	if( done ) return;
+	int i;
+	for( i = 0; i < 256; i++ )
+	{
+		gdbhexpairs[i*2+0] = ToHEXNibble( i >> 4 );
+		gdbhexpairs[i*2+1] = ToHEXNibble( i );
+		gdbhexvalues[i] = fromhex( i );
+	}
+	done = 1;
+}
+
+// output must have length of len / 2.  output may be hexstr itself, to decode in place.
 static int DecodeHexToBytes(const char* hexstr, size_t string_len, void* output, size_t out_len) {
 	// 2 hex chars make up one byte. out buffer needs to have >= slen/2 bytes.
 	// further, we only want to decode even-length strings
 	if (out_len < (string_len / 2) || (string_len % 2) != 0)
 		return -1;
+	GDBHexTablesInit();
+	const uint8_t* in = (const uint8_t*) hexstr;
 	uint8_t* out = (uint8_t*) output;
-	for(size_t i = 0; i < string_len; i += 2) {
-		int nibble1, nibble2;
-		if((nibble1 = fromhex(hexstr[i])) < 0)
-			return nibble1; // error
-		if((nibble2 = fromhex(hexstr[i + 1])) < 0)
-			return nibble2; // error
-		out[i / 2] = ((uint8_t)nibble1 << 4u) | ((uint8_t)nibble2);
+	for(size_t i = 0; i < string_len / 2; i++) {
+		int hi = gdbhexvalues[in[i*2]];
+		int lo = gdbhexvalues[in[i*2+1]];
+		if( ( hi | lo ) < 0 )
+			return -1; // error
+		out[i] = ( hi << 4 ) | lo;
 	}
 	return string_len / 2; // number of output bytes written
 }
 
+// Writes len*2 hex digits.  in may be inside output too, as long as it starts at output + len or later.
+static void EncodeBytesToHex( char * output, const uint8_t * in, int len )
+{
+	GDBHexTablesInit();
+	int i;
+	for( i = 0; i < len; i++ )
+	{
+		const char * pair = gdbhexpairs + in[i] * 2;
+		output[i*2+0] = pair[0];
+		output[i*2+1] = pair[1];
+	}
+}
+
+// GDB's run length encoding, "c*n" is c followed by n-29 more of it.  The count
+// can't be '#' or '$', and the second half of an escaped "}x" can't be repeated.
+// Works in place, returns the new length.
+static int GDBRunLengthEncode( char * buf, int len )
+{
+	int in = 0;
+	int out = 0;
+	while( in < len )
+	{
+		char c = buf[in];
+		if( c == '}' && in + 1 < len )
+		{
+			buf[out++] = buf[in++];
+			buf[out++] = buf[in++];
+			continue;
+		}
+		int run = 1;
+		while( in + run < len && buf[in+run] == c && run < 98 ) run++;
+		int repeat = run - 1;
+		if( repeat == 6 || repeat == 7 ) repeat = 5;
+		buf[out++] = c;
+		if( repeat > 3 )
+		{
+			buf[out++] = '*';
+			buf[out++] = repeat + 29;
+			in += repeat + 1;
+		}
+		else
+		{
+			in++;
+		}
+	}
+	return out;
+}
+
 // if (numhex < 0) 
 static int ReadHex( char ** instr, int numhex, uint32_t * outwrite )
 {
@@ -185,6 +261,21 @@ void SendReplyFull( const char * replyMessage )
 	MicroGDBStubSendReply( replyMessage, -1, '$' );
 }
 
+// Sends the len bytes at gdbreply + 1 (may be binary), framing and compressing them in place.
+static void SendReplyInPlace( int len )
+{
+	uint8_t checksum = 0;
+	int i;
+	len = GDBRunLengthEncode( gdbreply + 1, len );
+	for( i = 1; i <= len; i++ )
+		checksum += (uint8_t)gdbreply[i];
+	gdbreply[0] = '$';
+	gdbreply[len+1] = '#';
+	gdbreply[len+2] = ToHEXNibble( checksum >> 4 );
+	gdbreply[len+3] = ToHEXNibble( checksum );
+	MicroGDBStubSendReply( gdbreply, len + 4, 0 );
+}
+
 void MakeGDBPrintText(const char* msg) {
 	// ASCII to hex conversion doubles size, plus 'O', plus NUL
 	size_t buf_len = 2 * strlen(msg) + 2;
@@ -221,7 +312,19 @@ void HandleGDBPacket( void * dev, char * data, int len )
 		if( StringMatch( data, "Attached" ) )
 			SendReplyFull( "1" ); //Attached to an existing process.
 		else if( StringMatch( data, "Supported" ) ) // qXfer:threads:
-			SendReplyFull( "PacketSize=f000;hwbreak+;vContSupported+;qXfer:memory-map:read+;read+;QStartNoAckMode+" );
+			SendReplyFull( "PacketSize=f000;binary-upload+;hwbreak+;vContSupported+;qXfer:memory-map:read+;read+;QStartNoAckMode+" );
+		else if( StringMatch( data, "CRC:" ) ) // qCRC:addr,length, only the checksum comes back.
+		{
+			uint32_t address = 0, length = 0, crc = 0;
+			char st[12];
+			data += 4;
+			if( ReadHex( &data, -1, &address ) < 0 ) goto err;
+			if( *(data++) != ',' ) goto err;
+			if( ReadHex( &data, -1, &length ) < 0 ) goto err;
+			if( RVMemoryCRC( dev, address, length, &crc ) < 0 ) goto err;
+			sprintf( st, "C%08x", crc );
+			SendReplyFull( st );
+		}
 		else if( StringMatch( data, "C") ) // Get Current Thread ID. (Can't be -1 or 0.  Those are special)
 			SendReplyFull( "QC1" );
 		else if( StringMatch( data, "fThreadInfo" ) )  // Query all active thread IDs (Can't be 0 or 1)
@@ -357,18 +460,20 @@ void HandleGDBPacket( void * dev, char * data, int len )
 	case 'Z': // set
 	case 'z': // unset
 	{
+		// 0 = software breakpoint, 1 = hardware breakpoint, 2/3/4 = write/read/access watchpoint.
 		uint32_t type = 0;
 		uint32_t addr = 0;
-		uint32_t time = 0;
+		uint32_t kind = 0;
 		if( ReadHex( &data, -1, &type ) < 0 ) goto err;
 		if( *(data++) != ',' ) goto err;
 		if( ReadHex( &data, -1, &addr ) < 0 ) goto err;
 		if( *(data++) != ',' ) goto err;
-		if( ReadHex( &data, -1, &time ) < 0 ) goto err;
-		if( RVHandleBreakpoint( dev, cmd == 'Z', addr ) == 0 )
-		{
+		if( ReadHex( &data, -1, &kind ) < 0 ) goto err;
+		int r = RVHandleBreakpoint( dev, type, cmd == 'Z', addr, kind );
+		if( r == 0 )
 			SendReplyFull( "OK" );
-		}
+		else if( r > 0 )
+			SendReplyFull( "" ); // Unsupported, GDB will work around it.
 		else
 			goto err;
 		break;
@@ -382,16 +487,50 @@ void HandleGDBPacket( void * dev, char * data, int len )
 		if( *(data++) != ',' ) goto err;
 		if( ReadHex( &data, -1, &length_to_read ) < 0 ) goto err;
 
-		uint8_t * pl = alloca( length_to_read * 2 );
+		// GDB takes short replies and asks again for the rest.
+		if( length_to_read > ( MICROGDBSTUB_PACKET_SIZE - 8 ) / 2 )
+			length_to_read = ( MICROGDBSTUB_PACKET_SIZE - 8 ) / 2;
+
+		// Read into the back half of the reply, then hex encode it forwards over itself.
+		uint8_t * pl = (uint8_t*)gdbreply + 1 + length_to_read;
 		if( RVReadMem( dev, address_to_read, pl, length_to_read ) < 0 )
 			goto err;
-		char * repl = alloca( length_to_read * 2 );
-		int i;
-		for( i = 0; i < length_to_read; i++ )
+		EncodeBytesToHex( gdbreply + 1, pl, length_to_read );
+		SendReplyInPlace( length_to_read * 2 );
+		break;
+	}
+	case 'x':
+	{
+		// Read memory (Binary), the reply is 'b' then the escaped bytes.
+		uint32_t address_to_read = 0;
+		uint32_t length_to_read = 0;
+		if( ReadHex( &data, -1, &address_to_read ) < 0 ) goto err;
+		if( *(data++) != ',' ) goto err;
+		if( ReadHex( &data, -1, &length_to_read ) < 0 ) goto err;
+		if( length_to_read > MICROGDBSTUB_PACKET_SIZE - 8 )
+			length_to_read = MICROGDBSTUB_PACKET_SIZE - 8;
+
+		// Same trick as 'm', escaping at most doubles each byte.
+		uint8_t * pl = (uint8_t*)gdbreply + 2 + length_to_read;
+		if( RVReadMem( dev, address_to_read, pl, length_to_read ) < 0 )
+			goto err;
+		char * out = gdbreply + 1;
+		char * outend = gdbreply + MICROGDBSTUB_PACKET_SIZE - 8;
+		*(out++) = 'b';
+		for( i = 0; i < length_to_read && out < outend; i++ )
 		{
-			sprintf( repl + i * 2, "%02x", pl[i] );
+			uint8_t c = pl[i];
+			if( c == '#' || c == '$' || c == '}' || c == '*' )
+			{
+				*(out++) = '}';
+				*(out++) = c ^ 0x20;
+			}
+			else
+			{
+				*(out++) = c;
+			}
 		}
-		SendReplyFull( repl );
+		SendReplyInPlace( out - ( gdbreply + 1 ) );
 		break;
 	}
 	case 'M':
@@ -403,15 +542,10 @@ void HandleGDBPacket( void * dev, char * data, int len )
 		if( ReadHex( &data, -1, &length_to_write ) < 0 ) goto err;
 		if( *(data++) != ':' ) goto err;
 
-		uint8_t * meml = alloca( length_to_write );
-		int i;
-		for( i = 0; i < length_to_write; i++ )
-		{
-			uint32_t rv;
-			if( ReadHex( &data, 2, &rv ) < 0 ) goto err;
-			meml[i] = rv;
-		}
-		if( RVWriteRAM( dev, address_to_write, length_to_write, meml ) < 0 ) goto err;
+		// Decoded in place, over the hex.
+		if( odata + len - 1 - data < length_to_write * 2 ) goto err;
+		if( DecodeHexToBytes( data, length_to_write * 2, data, length_to_write ) < 0 ) goto err;
+		if( RVWriteRAM( dev, address_to_write, length_to_write, (uint8_t*)data ) < 0 ) goto err;
 		SendReplyFull( "OK" );
 		break;
 	}
@@ -441,7 +575,7 @@ void HandleGDBPacket( void * dev, char * data, int len )
 				{
 					// Request a list of actions supported by the ‘vCont’ packet. 
 					// We don't support vCont
-					SendReplyFull( "vCont;c;C;s;S" ); //no ;t because we don't implement them.
+					SendReplyFull( "vCont;c;C;s;S;r" ); //no ;t because we don't implement them.
 					break;
 				}
 				else if( de0 == ';' )
@@ -465,6 +599,17 @@ void HandleGDBPacket( void * dev, char * data, int len )
 							RVSendGDBHaltReason( dev );
 							fprintf( stderr, "Step.\n" );
 							break;
+						case 'r':
+						{
+							// Range step, r<start>,<end>, stepped here without a round trip per instruction.
+							uint32_t start, end;
+							de++;
+							if( ReadHex( &de, -1, &start ) < 0 ) goto err;
+							if( *(de++) != ',' ) goto err;
+							if( ReadHex( &de, -1, &end ) < 0 ) goto err;
+							if( RVRangeStep( dev, start, end ) ) goto err;
+							break;
+						}
 						default:
 							SendReplyFull( "E 98" );
 							break;
@@ -494,7 +639,10 @@ void HandleGDBPacket( void * dev, char * data, int len )
 		}
 		else if( StringMatch( data, "FlashDone" ) )   //vFlashDone
 		{
-			SendReplyFull( "OK" );
+			if( RVFlashDone( dev ) == 0 )
+				SendReplyFull( "OK" );
+			else
+				SendReplyFull( "E 93" );
 		}
 		else if( StringMatch( data, "Kill" ) )   //vKill
 		{
@@ -546,14 +694,20 @@ void HandleGDBPacket( void * dev, char * data, int len )
 		// Register Read (All regs)
 		int num_regs = RVGetNumRegisters( dev );
 
-		char cts[num_regs*8+1];
+		// Target byte order (little endian), hex encoded in place like 'm'.
+		uint8_t * regs = (uint8_t*)gdbreply + 1 + ( num_regs + 1 ) * 4;
+		uint32_t all[33];
+		if( num_regs > 32 || RVReadAllCPURegisters( dev, all ) ) goto err;
 		for( i = 0; i < num_regs+1; i++ )
 		{
-			uint32_t regret;
-			if( RVReadCPURegister( dev, i, &regret ) ) goto err;
-			sprintf( cts + i * 8, "%08x", (uint32_t)htonl( regret ) );
+			uint32_t regret = all[i];
+			regs[i*4+0] = regret;
+			regs[i*4+1] = regret >> 8;
+			regs[i*4+2] = regret >> 16;
+			regs[i*4+3] = regret >> 24;
 		}
-		SendReplyFull( cts );
+		EncodeBytesToHex( gdbreply + 1, regs, ( num_regs + 1 ) * 4 );
+		SendReplyInPlace( ( num_regs + 1 ) * 8 );
 		break;
 	}
 	case 'p':
@@ -631,7 +785,6 @@ void MicroGDBStubHandleClientData( void * dev, const uint8_t * rxdata, int len )
 			{
 				char escaped = c ^ 0x20;
 				gdbbuffer[gdbbufferplace++] = escaped;
-				fprintf( stderr, "ESCAPED @ %02x -> %c [%d]\n", gdbbufferplace, escaped, escaped );
 				gdbbufferstate = 1;
 			}
 			break;
@@ -765,6 +918,11 @@ static int GDBListen( void * dev )
 	return 0;
 }
 
+int MicroGDBPollFD( void )
+{
+	return serverSocket ? serverSocket : -1;
+}
+
 int MicroGDBPollServer( void * dev )
 {
 	if( !serverSocket ) return -4;
@@ -0,0 +1,616 @@
+// Host side cache of target memory, in front of MCF.ReadBinaryBlob.
+//
+// Memory is cached in 64-byte blocks.  What a block is allowed to hold depends
+// on where it is:
+//   Flash (0x08xxxxxx, 0x1FFFxxxx)  Valid until the host writes or erases it.
+//   Flash alias (0x00xxxxxx)        Same, but also dropped on reset, since the
+//                                   mapping can change with the boot mode.
+//   RAM (0x2xxxxxxx)                Only cached while the core is halted,
+//                                   dropped on any resume, step or reset.
+//   Everything else                 Never cached, reads of peripherals can
+//                                   have side effects.
+//
+// Anything we don't understand the effect of (unbrick, option bytes, vendor
+// commands) drops the whole cache.
+//
+// Writes to user flash can be held back as well, merged into a host copy of
+// each sector they touch.  That's only turned on for the GDB server, through
+// MemoryCacheSetWriteBack(), the command line writes straight through so it
+// can say whether a write worked when it's asked for.  Dirty sectors are only
+// programmed by MemoryCacheFlush(), which happens before the core is resumed,
+// stepped or reset, when GDB sends vFlashDone or detaches, and at exit.  That
+// way a handful of breakpoints or an unaligned load costs one erase and
+// program per sector, not one per write.  Sectors which end up the same as
+// they started aren't written at all.
+//
+// Whatever is about to go to the target calls the access hook first.  Most
+// programmers use CPU registers to move memory, so the GDB server uses it to
+// save those registers only when they really are about to be clobbered.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "minichlink.h"
+
+#define CACHE_BLOCK 64
+#define CACHE_ENTRIES 1024     // Must be a power of two.
+#define CACHE_MAX_RUN 4096     // Most we fetch at once on a miss.
+#define CACHE_STACK_WINDOW 256 // Read above SP on the first stack access after a halt.
+
+enum CacheRegion
+{
+	CACHE_NONE,
+	CACHE_FLASH,
+	CACHE_ALIAS,
+	CACHE_RAM,
+};
+
+struct CacheEntry
+{
+	uint32_t address;
+	int valid;
+	uint8_t data[CACHE_BLOCK];
+};
+
+static struct CacheEntry * cache;
+static int cache_halted;
+static uint32_t cache_stack_sp; // Nonzero until the stack has been read since the last halt.
+static void (*cache_access_hook)( void * dev, int whole_core );
+
+static struct MiniChlinkFunctions Uncached;
+
+struct PendingSector
+{
+	uint32_t address;
+	uint8_t * data;
+	uint8_t * original; // What the target holds, if it had to be read, to skip unchanged sectors.
+};
+
+static struct PendingSector * pending;
+static int pending_count;
+static int pending_alloc;
+static void * cache_dev;
+static int cache_write_back;
+
+static enum CacheRegion CacheRegionOf( uint32_t address )
+{
+	if( address < 0x01000000 ) return CACHE_ALIAS;
+	if( ( address & 0xff000000 ) == 0x08000000 ) return CACHE_FLASH;
+	if( ( address & 0xffff0000 ) == 0x1fff0000 ) return CACHE_FLASH;
+	if( ( address & 0xf0000000 ) == 0x20000000 ) return CACHE_RAM;
+	return CACHE_NONE;
+}
+
+static int CacheRangeAllowed( uint32_t address, uint32_t size )
+{
+	uint32_t last = address + size - 1;
+	if( size == 0 || last < address ) return 0;
+	enum CacheRegion region = CacheRegionOf( address );
+	if( region == CACHE_NONE || region != CacheRegionOf( last ) ) return 0;
+	if( region == CACHE_RAM && !cache_halted ) return 0;
+	return 1;
+}
+
+static struct CacheEntry * CacheSlot( uint32_t block )
+{
+	return &cache[ ( ( block >> 6 ) ^ ( block >> 22 ) ) & ( CACHE_ENTRIES - 1 ) ];
+}
+
+static struct CacheEntry * CacheLookup( uint32_t block )
+{
+	struct CacheEntry * e = CacheSlot( block );
+	return ( e->valid && e->address == block ) ? e : 0;
+}
+
+// Drops every block overlapping [start, end).
+static void CacheInvalidateRange( uint32_t start, uint32_t end )
+{
+	int i;
+	start &= ~( CACHE_BLOCK - 1 );
+	for( i = 0; i < CACHE_ENTRIES; i++ )
+	{
+		if( cache[i].valid && cache[i].address >= start && cache[i].address < end )
+			cache[i].valid = 0;
+	}
+}
+
+// Flash is visible both at its real address and through the alias at 0.
+static void CacheInvalidateFlash( uint32_t address, uint32_t size )
+{
+	uint32_t offset = address & 0x00ffffff;
+	if( CacheRegionOf( address ) == CACHE_FLASH && ( address & 0xff000000 ) != 0x08000000 )
+	{
+		CacheInvalidateRange( address, address + size );
+		return;
+	}
+	CacheInvalidateRange( offset, offset + size );
+	CacheInvalidateRange( 0x08000000 | offset, ( 0x08000000 | offset ) + size );
+}
+
+static void CacheInvalidateRAM( void )
+{
+	CacheInvalidateRange( 0x20000000, 0x30000000 );
+}
+
+void MemoryCacheInvalidate( void )
+{
+	if( cache ) memset( cache, 0, sizeof( struct CacheEntry ) * CACHE_ENTRIES );
+}
+
+// Copies the part of a block that overlaps [address, end) into the caller's buffer.
+static void CacheCopyOut( const uint8_t * data, uint32_t block, uint32_t address, uint32_t end, uint8_t * blob )
+{
+	uint32_t lo = ( block > address ) ? block : address;
+	uint32_t hi = ( block + CACHE_BLOCK < end ) ? block + CACHE_BLOCK : end;
+	memcpy( blob + ( lo - address ), data + ( lo - block ), hi - lo );
+}
+
+// Flash at 0x00000000 is the same as 0x08000000, as far as writes are concerned.
+static uint32_t FlashAddress( uint32_t address )
+{
+	return ( address < 0x01000000 ) ? ( address | 0x08000000 ) : address;
+}
+
+static int SectorSize( void * dev )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	return iss->sector_size;
+}
+
+static struct PendingSector * PendingFind( uint32_t sector )
+{
+	int i;
+	for( i = 0; i < pending_count; i++ )
+		if( pending[i].address == sector ) return &pending[i];
+	return 0;
+}
+
+// Pending writes are newer than whatever the target has, so reads see them.
+static void PendingOverlay( void * dev, uint32_t address, uint32_t size, uint8_t * blob )
+{
+	int i;
+	int sector_size = SectorSize( dev );
+	uint32_t start = FlashAddress( address );
+	uint32_t end = start + size;
+	if( !pending_count || ( start & 0xff000000 ) != 0x08000000 ) return;
+	for( i = 0; i < pending_count; i++ )
+	{
+		uint32_t s = pending[i].address;
+		if( s >= end || s + sector_size <= start ) continue;
+		uint32_t lo = ( s > start ) ? s : start;
+		uint32_t hi = ( s + sector_size < end ) ? s + sector_size : end;
+		memcpy( blob + ( lo - start ), pending[i].data + ( lo - s ), hi - lo );
+	}
+}
+
+// Forgets pending writes to [start, end), i.e. because it was erased or rewritten.
+static void PendingDrop( void * dev, uint32_t start, uint32_t end )
+{
+	int i;
+	int sector_size = SectorSize( dev );
+	for( i = 0; i < pending_count; )
+	{
+		uint32_t s = pending[i].address;
+		if( s < end && s + sector_size > start )
+		{
+			free( pending[i].data );
+			free( pending[i].original );
+			pending[i] = pending[--pending_count];
+			continue;
+		}
+		i++;
+	}
+}
+
+// whole_core is for anything that may reset the part or run a loader from RAM, flash writes on
+// some programmers do both, so it's not only the program buffer registers that are lost.
+static void CacheTouchTarget( void * dev, int whole_core )
+{
+	if( cache_access_hook ) cache_access_hook( dev, whole_core );
+}
+
+static int CachedReadTarget( void * dev, uint32_t address_to_read_from, uint32_t read_size, uint8_t * blob );
+
+// A debugger unwinding asks for the stack a few words at a time, so on the first
+// read that touches it, take everything up to CACHE_STACK_WINDOW above SP at once.
+// RAM sizes are all multiples of 2kB, so never read past the next 2kB boundary,
+// SP usually starts right at the end of RAM.
+static void CacheReadStackWindow( void * dev, uint32_t address, uint32_t size )
+{
+	uint32_t sp = cache_stack_sp;
+	uint32_t start = sp & ~( CACHE_BLOCK - 1 );
+	uint32_t end = sp + CACHE_STACK_WINDOW;
+	uint32_t limit = ( ( sp - 1 ) | 2047 ) + 1;
+	if( end > limit ) end = limit;
+	if( end <= start || address >= end || address + size <= start ) return;
+	cache_stack_sp = 0;
+	uint8_t scratch[CACHE_STACK_WINDOW + CACHE_BLOCK];
+	CachedReadTarget( dev, start, end - start, scratch );
+}
+
+static int CachedReadTarget( void * dev, uint32_t address_to_read_from, uint32_t read_size, uint8_t * blob )
+{
+	if( !CacheRangeAllowed( address_to_read_from, read_size ) )
+	{
+		CacheTouchTarget( dev, 0 );
+		return Uncached.ReadBinaryBlob( dev, address_to_read_from, read_size, blob );
+	}
+
+	if( cache_stack_sp && CacheRegionOf( address_to_read_from ) == CACHE_RAM )
+		CacheReadStackWindow( dev, address_to_read_from, read_size );
+
+	uint32_t end = address_to_read_from + read_size;
+	uint32_t block = address_to_read_from & ~( CACHE_BLOCK - 1 );
+	while( block < end )
+	{
+		struct CacheEntry * e = CacheLookup( block );
+		if( e )
+		{
+			CacheCopyOut( e->data, block, address_to_read_from, end, blob );
+			block += CACHE_BLOCK;
+			continue;
+		}
+
+		// Misses are gathered up, the programmers are much faster at one long read than many short ones.
+		uint32_t start = block;
+		uint32_t run = block + CACHE_BLOCK;
+		while( run < end && run - start < CACHE_MAX_RUN && !CacheLookup( run ) )
+			run += CACHE_BLOCK;
+
+		uint8_t fetched[CACHE_MAX_RUN];
+		CacheTouchTarget( dev, 0 );
+		if( Uncached.ReadBinaryBlob( dev, start, run - start, fetched ) )
+		{
+			// Could be a block hanging off the end of real memory, let the programmer deal with exactly what was asked.
+			return Uncached.ReadBinaryBlob( dev, address_to_read_from, read_size, blob );
+		}
+
+		for( ; block < run; block += CACHE_BLOCK )
+		{
+			const uint8_t * data = fetched + ( block - start );
+			e = CacheSlot( block );
+			e->address = block;
+			e->valid = 1;
+			memcpy( e->data, data, CACHE_BLOCK );
+			CacheCopyOut( data, block, address_to_read_from, end, blob );
+		}
+	}
+	return 0;
+}
+
+static int CachedReadBinaryBlob( void * dev, uint32_t address_to_read_from, uint32_t read_size, uint8_t * blob )
+{
+	int r = CachedReadTarget( dev, address_to_read_from, read_size, blob );
+	if( !r ) PendingOverlay( dev, address_to_read_from, read_size, blob );
+	return r;
+}
+
+static int WriteThrough( void * dev, uint32_t address_to_write, uint32_t blob_size, const uint8_t * blob )
+{
+	CacheTouchTarget( dev, CacheRegionOf( address_to_write ) != CACHE_RAM );
+	int r = Uncached.WriteBinaryBlob( dev, address_to_write, blob_size, blob );
+	if( CacheRegionOf( address_to_write ) == CACHE_RAM )
+	{
+		CacheInvalidateRange( address_to_write, address_to_write + blob_size );
+	}
+	else if( CacheRegionOf( address_to_write ) == CACHE_NONE )
+	{
+		// Peripherals, the flash controller or DMA for instance, could change anything.
+		MemoryCacheInvalidate();
+	}
+	else
+	{
+		// Flash writes may run a helper out of target RAM, and we can't know what it touched.
+		CacheInvalidateFlash( address_to_write, blob_size );
+		CacheInvalidateRAM();
+	}
+	return r;
+}
+
+static int PendingCompare( const void * a, const void * b )
+{
+	uint32_t aa = ((const struct PendingSector *)a)->address;
+	uint32_t ba = ((const struct PendingSector *)b)->address;
+	return ( aa > ba ) - ( aa < ba );
+}
+
+static int PendingUnchanged( struct PendingSector * p, int sector_size )
+{
+	return p->original && memcmp( p->original, p->data, sector_size ) == 0;
+}
+
+int MemoryCacheFlush( void * dev )
+{
+	if( !pending_count ) return 0;
+
+	// Take the list first, programming may call back into Erase.
+	struct PendingSector * list = pending;
+	int count = pending_count;
+	pending = 0;
+	pending_count = pending_alloc = 0;
+
+	int sector_size = SectorSize( dev );
+	int ret = 0;
+	int i, j;
+	qsort( list, count, sizeof( struct PendingSector ), PendingCompare );
+	for( i = 0; i < count; i = j )
+	{
+		j = i + 1;
+		if( PendingUnchanged( &list[i], sector_size ) ) continue;
+
+		// Runs of adjacent sectors go in one write, the programmers are faster at that.
+		while( j < count && list[j].address == list[j-1].address + sector_size && !PendingUnchanged( &list[j], sector_size ) )
+			j++;
+		uint32_t len = ( j - i ) * sector_size;
+		uint8_t * run = malloc( len );
+		int k;
+		for( k = i; k < j; k++ )
+			memcpy( run + ( k - i ) * sector_size, list[k].data, sector_size );
+		int r = WriteThrough( dev, list[i].address, len, run );
+		if( r )
+		{
+			fprintf( stderr, "Error: Failed writing flash at %08x (%d)\n", list[i].address, r );
+			if( !ret ) ret = r;
+		}
+		free( run );
+	}
+
+	for( i = 0; i < count; i++ )
+	{
+		free( list[i].data );
+		free( list[i].original );
+	}
+	free( list );
+	return ret;
+}
+
+void MemoryCacheSetWriteBack( void * dev, int enable )
+{
+	cache_write_back = enable;
+	if( !enable )
+		MemoryCacheFlush( dev );
+}
+
+static void MemoryCacheAtExit( void )
+{
+	if( pending_count && cache_dev )
+		MemoryCacheFlush( cache_dev );
+}
+
+static int CachedWriteBinaryBlob( void * dev, uint32_t address_to_write, uint32_t blob_size, const uint8_t * blob )
+{
+	int sector_size = SectorSize( dev );
+	uint32_t start = FlashAddress( address_to_write );
+	uint32_t end = start + blob_size;
+
+	// Only user flash is held back.  Option bytes and the bootloader have their own rules.
+	if( !cache_write_back || blob_size == 0 || sector_size <= 0 || ( start & 0xff000000 ) != 0x08000000 || ( ( end - 1 ) & 0xff000000 ) != 0x08000000 )
+		return WriteThrough( dev, address_to_write, blob_size, blob );
+
+	// Whole sectors gain nothing from waiting, i.e. writing a firmware image.
+	if( ( start % sector_size ) == 0 && ( blob_size % sector_size ) == 0 )
+	{
+		PendingDrop( dev, start, end );
+		return WriteThrough( dev, start, blob_size, blob );
+	}
+
+	uint32_t sector;
+	for( sector = start - ( start % sector_size ); sector < end; sector += sector_size )
+	{
+		struct PendingSector * p = PendingFind( sector );
+		uint32_t lo = ( sector > start ) ? sector : start;
+		uint32_t hi = ( sector + sector_size < end ) ? sector + sector_size : end;
+		if( !p )
+		{
+			if( pending_count == pending_alloc )
+			{
+				pending_alloc = pending_alloc ? pending_alloc * 2 : 64;
+				pending = realloc( pending, sizeof( struct PendingSector ) * pending_alloc );
+			}
+			p = &pending[pending_count];
+			p->address = sector;
+			p->data = malloc( sector_size );
+			p->original = 0;
+			if( lo != sector || hi != sector + sector_size )
+			{
+				int r = CachedReadTarget( dev, sector, sector_size, p->data );
+				if( r )
+				{
+					free( p->data );
+					return r;
+				}
+				p->original = malloc( sector_size );
+				memcpy( p->original, p->data, sector_size );
+			}
+			pending_count++;
+		}
+		memcpy( p->data + ( lo - sector ), blob + ( lo - start ), hi - lo );
+	}
+	return 0;
+}
+
+// Single writes only drop what they hit, except for the flash controller, through
+// which option bytes get rewritten.
+static void CacheInvalidateWrite( uint32_t address, uint32_t size )
+{
+	if( ( address & 0xfffffc00 ) == 0x40022000 )
+		MemoryCacheInvalidate();
+	else if( CacheRegionOf( address ) == CACHE_RAM )
+		CacheInvalidateRange( address, address + size );
+	else if( CacheRegionOf( address ) != CACHE_NONE )
+		CacheInvalidateFlash( address, size );
+}
+
+static int CachedWriteWord( void * dev, uint32_t address_to_write, uint32_t data )
+{
+	CacheTouchTarget( dev, 0 );
+	int r = Uncached.WriteWord( dev, address_to_write, data );
+	CacheInvalidateWrite( address_to_write, 4 );
+	return r;
+}
+
+static int CachedWriteHalfWord( void * dev, uint32_t address_to_write, uint16_t data )
+{
+	CacheTouchTarget( dev, 0 );
+	int r = Uncached.WriteHalfWord( dev, address_to_write, data );
+	CacheInvalidateWrite( address_to_write, 2 );
+	return r;
+}
+
+static int CachedWriteByte( void * dev, uint32_t address_to_write, uint8_t data )
+{
+	CacheTouchTarget( dev, 0 );
+	int r = Uncached.WriteByte( dev, address_to_write, data );
+	CacheInvalidateWrite( address_to_write, 1 );
+	return r;
+}
+
+static int CachedErase( void * dev, uint32_t address, uint32_t length, int type )
+{
+	// Erase is by sector, so it wipes out anything pending in any sector it touches.
+	if( type == 1 )
+		PendingDrop( dev, 0, 0xffffffff );
+	else
+		PendingDrop( dev, FlashAddress( address ), FlashAddress( address ) + length );
+	CacheTouchTarget( dev, 1 );
+	int r = Uncached.Erase( dev, address, length, type );
+	MemoryCacheInvalidate();
+	return r;
+}
+
+static int CachedHaltMode( void * dev, int mode )
+{
+	// The core must never run from flash we still owe it.
+	if( mode != HALT_MODE_HALT_BUT_NO_RESET )
+		MemoryCacheFlush( dev );
+	int r = Uncached.HaltMode( dev, mode );
+	switch( mode )
+	{
+	case HALT_MODE_HALT_BUT_NO_RESET:
+		cache_halted = 1;
+		break;
+	case HALT_MODE_HALT_AND_RESET:
+		CacheInvalidateRAM();
+		CacheInvalidateRange( 0, 0x01000000 );
+		cache_halted = 1;
+		break;
+	case HALT_MODE_RESUME:
+		CacheInvalidateRAM();
+		cache_halted = 0;
+		break;
+	default:
+		CacheInvalidateRAM();
+		CacheInvalidateRange( 0, 0x01000000 );
+		cache_halted = 0;
+		break;
+	}
+	if( !cache_halted ) cache_stack_sp = 0;
+	return r;
+}
+
+static int CachedUnbrick( void * dev )
+{
+	PendingDrop( dev, 0, 0xffffffff );
+	CacheTouchTarget( dev, 1 );
+	int r = Uncached.Unbrick( dev );
+	MemoryCacheInvalidate();
+	return r;
+}
+
+static int CachedConfigureNRSTAsGPIO( void * dev, int one_if_yes_gpio )
+{
+	MemoryCacheFlush( dev );
+	CacheTouchTarget( dev, 1 );
+	int r = Uncached.ConfigureNRSTAsGPIO( dev, one_if_yes_gpio );
+	MemoryCacheInvalidate();
+	return r;
+}
+
+static int CachedConfigureReadProtection( void * dev, int one_if_yes_protect )
+{
+	MemoryCacheFlush( dev );
+	CacheTouchTarget( dev, 1 );
+	int r = Uncached.ConfigureReadProtection( dev, one_if_yes_protect );
+	MemoryCacheInvalidate();
+	return r;
+}
+
+static int CachedSetSplit( void * dev, enum RAMSplit split )
+{
+	MemoryCacheFlush( dev );
+	CacheTouchTarget( dev, 1 );
+	int r = Uncached.SetSplit( dev, split );
+	MemoryCacheInvalidate();
+	return r;
+}
+
+static int CachedVendorCommand( void * dev, const char * command )
+{
+	MemoryCacheFlush( dev );
+	CacheTouchTarget( dev, 1 );
+	int r = Uncached.VendorCommand( dev, command );
+	MemoryCacheInvalidate();
+	return r;
+}
+
+void MemoryCacheHalted( void * dev, uint32_t sp )
+{
+	if( !cache ) return;
+	cache_halted = 1;
+	cache_stack_sp = ( CacheRegionOf( sp ) == CACHE_RAM ) ? sp : 0;
+}
+
+void MemoryCacheSetAccessHook( void (*hook)( void * dev, int whole_core ) )
+{
+	cache_access_hook = hook;
+}
+
+int MemoryCacheInstall( void * dev )
+{
+	static int atexit_registered;
+	if( cache ) return 0;
+	if( !MCF.ReadBinaryBlob )
+		return -1;
+	cache = calloc( CACHE_ENTRIES, sizeof( struct CacheEntry ) );
+	if( !cache )
+		return -2;
+
+	// Everything that can change memory behind the cache's back has to go through here.
+	cache_dev = dev;
+	if( !atexit_registered )
+		atexit( MemoryCacheAtExit );
+	atexit_registered = 1;
+	Uncached = MCF;
+	MCF.ReadBinaryBlob = CachedReadBinaryBlob;
+	if( MCF.WriteBinaryBlob ) MCF.WriteBinaryBlob = CachedWriteBinaryBlob;
+	if( MCF.WriteWord ) MCF.WriteWord = CachedWriteWord;
+	if( MCF.WriteHalfWord ) MCF.WriteHalfWord = CachedWriteHalfWord;
+	if( MCF.WriteByte ) MCF.WriteByte = CachedWriteByte;
+	if( MCF.Erase ) MCF.Erase = CachedErase;
+	if( MCF.HaltMode ) MCF.HaltMode = CachedHaltMode;
+	if( MCF.Unbrick ) MCF.Unbrick = CachedUnbrick;
+	if( MCF.ConfigureNRSTAsGPIO ) MCF.ConfigureNRSTAsGPIO = CachedConfigureNRSTAsGPIO;
+	if( MCF.ConfigureReadProtection ) MCF.ConfigureReadProtection = CachedConfigureReadProtection;
+	if( MCF.SetSplit ) MCF.SetSplit = CachedSetSplit;
+	if( MCF.VendorCommand ) MCF.VendorCommand = CachedVendorCommand;
+	return 0;
+}
+
+// Before the programmer is closed.  Whatever is still held back is dropped, the device is gone or going.
+void MemoryCacheUninstall( void )
+{
+	int i;
+	if( !cache ) return;
+	MCF = Uncached;
+	for( i = 0; i < pending_count; i++ )
+	{
+		free( pending[i].data );
+		free( pending[i].original );
+	}
+	pending_count = 0;
+	free( cache );
+	cache = 0;
+	cache_dev = 0;
+	cache_halted = 0;
+	cache_stack_sp = 0;
+}
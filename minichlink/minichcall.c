@@ -0,0 +1,407 @@
+// Calls firmware functions from the command line, --call, and benchmarks them,
+// --bench, through MCF.CallFunctions.  All the calls given in one --call share a single halt:
+//
+//   minichlink --call firmware.elf "selftest();calibrate(3,0x40)"
+//
+// Arguments are integers, up to six, in a0-a5.  Each result is printed as a0,
+// and a1 for functions returning 64-bit values.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "minichlink.h"
+#include "minichelf.h"
+
+#define CALL_MAX 64
+
+static int CallParse( struct MiniElf * elf, char * spec, struct MiniChlinkCall * c )
+{
+	char * args = strchr( spec, '(' );
+	int n = 0;
+
+	memset( c, 0, sizeof( *c ) );
+	if( args )
+	{
+		char * close = strchr( args, ')' );
+		if( !close )
+		{
+			fprintf( stderr, "Error: --call %s is missing a )\n", spec );
+			return -1;
+		}
+		*close = 0;
+		*(args++) = 0;
+		while( *args )
+		{
+			char * comma = strchr( args, ',' );
+			if( comma ) *comma = 0;
+			if( n == 6 )
+			{
+				fprintf( stderr, "Error: --call can pass at most 6 arguments\n" );
+				return -1;
+			}
+			c->args[n++] = SimpleReadNumberInt( args, 0 );
+			if( !comma ) break;
+			args = comma + 1;
+		}
+	}
+
+	if( spec[0] >= '0' && spec[0] <= '9' )
+		c->address = SimpleReadNumberInt( spec, 0 );
+	else if( !elf || MiniElfFindSymbol( elf, spec, &c->address, 0 ) )
+	{
+		fprintf( stderr, "Error: --call can't find %s%s\n", spec, elf ? " in the ELF" : ", it needs the firmware's ELF file" );
+		return -1;
+	}
+	return n;
+}
+
+int RunCalls( void * dev, const char * elffile, const char * calls, int timeout_ms )
+{
+	struct MiniChlinkCall c[CALL_MAX];
+	char * names[CALL_MAX];
+	int nargs[CALL_MAX];
+	struct MiniElf elf;
+	int have_elf = strcmp( elffile, "-" ) != 0;
+	int count = 0, i, j, r = 0;
+
+	if( !MCF.CallFunctions )
+	{
+		fprintf( stderr, "Error: This programmer can't call functions on the target\n" );
+		return -5;
+	}
+	if( have_elf && MiniElfLoad( &elf, elffile ) )
+		return -9;
+
+	char * list = strdup( calls );
+	char * spec = strtok( list, ";" );
+	while( spec && !r )
+	{
+		while( *spec == ' ' ) spec++;
+		char * e = spec + strlen( spec );
+		while( e > spec && e[-1] == ' ' ) *(--e) = 0;
+		if( !*spec )
+		{
+			spec = strtok( 0, ";" );
+			continue;
+		}
+		if( count == CALL_MAX )
+		{
+			fprintf( stderr, "Error: --call can take at most %d calls at once\n", CALL_MAX );
+			r = -9;
+			break;
+		}
+		names[count] = spec;
+		nargs[count] = CallParse( have_elf ? &elf : 0, spec, &c[count] );
+		if( nargs[count] < 0 )
+			r = -9;
+		count++;
+		spec = strtok( 0, ";" );
+	}
+	if( have_elf ) MiniElfFree( &elf );
+
+	if( !r && count )
+	{
+		MCF.CallFunctions( dev, c, count, timeout_ms );
+		for( i = 0; i < count; i++ )
+		{
+			printf( "%s(", names[i] );
+			for( j = 0; j < nargs[i]; j++ )
+				printf( "%s%d", j ? ", " : "", (int)c[i].args[j] );
+			printf( ")" );
+			switch( c[i].status )
+			{
+			case 0:
+				printf( " = %d (0x%08x), a1 = 0x%08x\n", (int)c[i].ret[0], c[i].ret[0], c[i].ret[1] );
+				break;
+			case -1:
+				printf( " timed out after %d ms at 0x%08x\n", timeout_ms, c[i].stopped_at );
+				break;
+			case -2:
+				printf( " stopped at 0x%08x instead of returning\n", c[i].stopped_at );
+				break;
+			case -4:
+				printf( " not called, could not set up its registers\n" );
+				break;
+			default:
+				printf( " not called\n" );
+				break;
+			}
+			if( c[i].status ) r = -9;
+		}
+	}
+	free( list );
+	return r;
+}
+
+// Microbenchmark, --bench.  A small loop goes in RAM, below the stack, and is
+// run through MCF.CallFunctions.  It reads mcycle and minstret right around
+// calling the function n times, so the halt, the resume and the USB link are
+// never part of the count.  The same loop calling an empty function gives
+// the harness overhead, and each repetition of the real one is paired with a
+// run of that.  Interrupts are masked (mstatus.MIE) for the whole batch.
+//
+//   block: +0 function, +4..+24 a0-a5, +28 saved ra, +32 mcycle, +36 minstret
+//   entry: a0 = count, a1 = block, a2 = stack, returns cycles in a0 and instructions in a1
+//
+// Both runs get the same stack, below both blocks, so a callee's frame can't
+// reach the other run's function and arguments.
+
+#define BENCH_BLOCK 48
+#define BENCH_CODE_WORDS 27
+#define BENCH_REGION ( 2 * BENCH_BLOCK + BENCH_CODE_WORDS * 4 )
+#define BENCH_STACK 256
+
+#define RV_I( imm, rs1, f3, rd, op ) ( ( (uint32_t)(imm) << 20 ) | ( (rs1) << 15 ) | ( (f3) << 12 ) | ( (rd) << 7 ) | (op) )
+#define RV_S( imm, rs2, rs1 ) ( ( ( (uint32_t)(imm) >> 5 ) << 25 ) | ( (rs2) << 20 ) | ( (rs1) << 15 ) | ( 2 << 12 ) | ( ( (imm) & 0x1f ) << 7 ) | 0x23 )
+#define RV_ADDI( rd, rs1, imm ) RV_I( (imm) & 0xfff, rs1, 0, rd, 0x13 )
+#define RV_LW( rd, rs1, imm ) RV_I( imm, rs1, 2, rd, 0x03 )
+#define RV_SW( rs2, rs1, imm ) RV_S( imm, rs2, rs1 )
+#define RV_CSRR( rd, csr ) RV_I( csr, 0, 2, rd, 0x73 )
+#define RV_SUB( rd, rs1, rs2 ) ( ( 0x20 << 25 ) | ( (rs2) << 20 ) | ( (rs1) << 15 ) | ( (rd) << 7 ) | 0x33 )
+#define RV_JALR( rd, rs1 ) RV_I( 0, rs1, 0, rd, 0x67 )
+
+static int bench_repetitions = 10;
+
+void BenchSetRepetitions( int reps )
+{
+	bench_repetitions = reps;
+}
+
+static int BenchCode( uint32_t * code )
+{
+	int n = 0, loop, i;
+	code[n++] = RV_ADDI( 8, 10, 0 );       // mv s0, a0
+	code[n++] = RV_ADDI( 9, 11, 0 );       // mv s1, a1
+	code[n++] = RV_ADDI( 2, 12, 0 );       // mv sp, a2
+	code[n++] = RV_SW( 1, 9, 28 );         // sw ra, 28(s1)
+	code[n++] = RV_CSRR( 5, 0xb00 );       // csrr t0, mcycle
+	code[n++] = RV_SW( 5, 9, 32 );
+	code[n++] = RV_CSRR( 5, 0xb02 );       // csrr t0, minstret
+	code[n++] = RV_SW( 5, 9, 36 );
+	loop = n;
+	for( i = 0; i < 6; i++ )
+		code[n++] = RV_LW( 10 + i, 9, 4 + i * 4 ); // lw a0-a5
+	code[n++] = RV_LW( 5, 9, 0 );          // lw t0, 0(s1)
+	code[n++] = RV_JALR( 1, 5 );           // jalr t0
+	code[n++] = RV_ADDI( 8, 8, -1 );       // addi s0, s0, -1
+	{
+		// bnez s0, loop
+		int off = ( loop - n ) * 4;
+		code[n++] = ( ( ( off >> 12 ) & 1 ) << 31 ) | ( ( ( off >> 5 ) & 0x3f ) << 25 ) | ( 8 << 15 ) | ( 1 << 12 ) |
+			( ( ( off >> 1 ) & 0xf ) << 8 ) | ( ( ( off >> 11 ) & 1 ) << 7 ) | 0x63;
+	}
+	code[n++] = RV_CSRR( 6, 0xb02 );       // csrr t1, minstret
+	code[n++] = RV_CSRR( 5, 0xb00 );       // csrr t0, mcycle
+	code[n++] = RV_LW( 10, 9, 32 );
+	code[n++] = RV_SUB( 10, 5, 10 );       // a0 = cycles
+	code[n++] = RV_LW( 11, 9, 36 );
+	code[n++] = RV_SUB( 11, 6, 11 );       // a1 = instructions
+	code[n++] = RV_LW( 1, 9, 28 );         // lw ra, 28(s1)
+	code[n++] = RV_JALR( 0, 1 );           // ret
+	code[n++] = RV_JALR( 0, 1 );           // The empty function for calibration.
+	return n;
+}
+
+struct BenchStats
+{
+	double mean, stddev, min, max;
+};
+
+static void BenchStatistics( const double * v, int n, struct BenchStats * s )
+{
+	int i;
+	double sum = 0, sq = 0;
+	s->min = s->max = v[0];
+	for( i = 0; i < n; i++ )
+	{
+		sum += v[i];
+		if( v[i] < s->min ) s->min = v[i];
+		if( v[i] > s->max ) s->max = v[i];
+	}
+	s->mean = sum / n;
+	for( i = 0; i < n; i++ )
+		sq += ( v[i] - s->mean ) * ( v[i] - s->mean );
+	s->stddev = ( n > 1 ) ? sqrt( sq / ( n - 1 ) ) : 0;
+}
+
+static void BenchJSONStats( FILE * f, const char * name, struct BenchStats * s )
+{
+	fprintf( f, "\t\"%s\": { \"mean\": %.3f, \"variance\": %.3f, \"stddev\": %.3f, \"min\": %.3f, \"max\": %.3f },\n",
+		name, s->mean, s->stddev * s->stddev, s->stddev, s->min, s->max );
+}
+
+int RunBench( void * dev, const char * elffile, const char * call, int iterations, const char * jsonfile, int timeout_ms )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	struct MiniChlinkCall target;
+	struct MiniElf elf;
+	int have_elf = strcmp( elffile, "-" ) != 0;
+	int reps = bench_repetitions;
+	int i, nargs, r = 0;
+	uint32_t code[BENCH_CODE_WORDS];
+	uint32_t sp = 0, mstatus = 0, probe;
+	struct TargetHold hold;
+
+	if( !MCF.CallFunctions || !MCF.ReadCPURegister || !MCF.WriteCPURegister || !MCF.WriteWord )
+	{
+		fprintf( stderr, "Error: This programmer can't call functions on the target\n" );
+		return -5;
+	}
+	if( iterations < 1 || reps < 1 )
+	{
+		fprintf( stderr, "Error: --bench needs at least one iteration and one repetition\n" );
+		return -9;
+	}
+	if( have_elf && MiniElfLoad( &elf, elffile ) )
+		return -9;
+	char * spec = strdup( call );
+	nargs = CallParse( have_elf ? &elf : 0, spec, &target );
+	if( have_elf ) MiniElfFree( &elf );
+	if( nargs < 0 )
+	{
+		free( spec );
+		return -9;
+	}
+
+	// Writing the loop to RAM goes through the program buffer.  The hold saves x8-x15
+	// first, CallFunctions() below only sees them clobbered, the release puts them back.
+	MemoryCacheFlush( dev );
+	if( TargetHold( dev, &hold, 0 ) )
+	{
+		fprintf( stderr, "Error: Could not stop the core\n" );
+		free( spec );
+		return -5;
+	}
+
+	// Not every core has the counters, and the loop would just trap without them.
+	if( MCF.ReadCPURegister( dev, 0xb00, &probe ) || MCF.ReadCPURegister( dev, 0xb02, &probe ) )
+	{
+		fprintf( stderr, "Error: This core has no mcycle/minstret to benchmark with\n" );
+		r = -5;
+		goto release;
+	}
+
+	r |= MCF.ReadCPURegister( dev, 0x1002, &sp );
+	r |= MCF.ReadCPURegister( dev, 0x300, &mstatus );
+	if( r )
+	{
+		fprintf( stderr, "Error: Could not read the core's registers\n" );
+		r = -5;
+		goto release;
+	}
+
+	// Under where CallFunctions puts its return trampoline, with room below for the callee's stack.
+	if( sp < iss->ram_base + 64 + BENCH_REGION + BENCH_STACK || ( sp & 0xf0000000 ) != ( iss->ram_base & 0xf0000000 ) )
+		sp = iss->ram_base + iss->ram_size;
+	uint32_t base = ( ( sp - 32 ) - BENCH_REGION ) & ~15; // Also the top of the loop's stack.
+	uint32_t calib_block = base, target_block = base + BENCH_BLOCK;
+	uint32_t entry = base + 2 * BENCH_BLOCK;
+	int ncode = BenchCode( code );
+	uint32_t empty = entry + ( ncode - 1 ) * 4;
+
+	for( i = 0; i < ncode; i++ )
+		r |= MCF.WriteWord( dev, entry + i * 4, code[i] );
+	r |= MCF.WriteWord( dev, calib_block, empty );
+	r |= MCF.WriteWord( dev, target_block, target.address );
+	for( i = 0; i < 6; i++ )
+	{
+		r |= MCF.WriteWord( dev, calib_block + 4 + i * 4, target.args[i] );
+		r |= MCF.WriteWord( dev, target_block + 4 + i * 4, target.args[i] );
+	}
+	if( r )
+	{
+		fprintf( stderr, "Error: Could not put the benchmark loop in RAM at 0x%08x\n", base );
+		r = -5;
+		goto release;
+	}
+	MCF.WriteCPURegister( dev, 0x300, mstatus & ~(1<<3) );
+
+	// Calibration and measurement alternate, so slow drift hits both alike.
+	struct MiniChlinkCall * calls = calloc( reps * 2, sizeof( struct MiniChlinkCall ) );
+	for( i = 0; i < reps * 2; i++ )
+	{
+		calls[i].address = entry;
+		calls[i].args[0] = iterations;
+		calls[i].args[1] = ( i & 1 ) ? target_block : calib_block;
+		calls[i].args[2] = base;
+	}
+	int cr = MCF.CallFunctions( dev, calls, reps * 2, timeout_ms );
+	MCF.WriteCPURegister( dev, 0x300, mstatus );
+
+	if( cr )
+	{
+		for( i = 0; i < reps * 2 - 1 && !calls[i].status; i++ );
+		if( calls[i].status == -1 )
+			fprintf( stderr, "Error: %s timed out, %d calls took longer than %d ms, see --call-timeout\n", spec, iterations, timeout_ms );
+		else if( calls[i].status == -2 )
+			fprintf( stderr, "Error: %s stopped at 0x%08x instead of returning\n", spec, calls[i].stopped_at );
+		else
+			fprintf( stderr, "Error: Could not set up the core's registers to run the benchmark loop\n" );
+		free( calls );
+		r = -9;
+		goto release;
+	}
+
+	double * cycles = malloc( sizeof( double ) * reps * 4 );
+	double * instret = cycles + reps;
+	double * oh_cycles = instret + reps;
+	double * oh_instret = oh_cycles + reps;
+	struct BenchStats sc, si, soc, soi;
+	for( i = 0; i < reps; i++ )
+	{
+		// Counters are 32 bits, the subtraction on the target already took care of one wrap.
+		oh_cycles[i] = calls[i*2].ret[0] / (double)iterations;
+		oh_instret[i] = calls[i*2].ret[1] / (double)iterations;
+		cycles[i] = calls[i*2+1].ret[0] / (double)iterations - oh_cycles[i];
+		instret[i] = calls[i*2+1].ret[1] / (double)iterations - oh_instret[i];
+	}
+	BenchStatistics( cycles, reps, &sc );
+	BenchStatistics( instret, reps, &si );
+	BenchStatistics( oh_cycles, reps, &soc );
+	BenchStatistics( oh_instret, reps, &soi );
+
+	fprintf( stderr, "%s, %d calls x %d repetitions\n", spec, iterations, reps );
+	fprintf( stderr, "  Cycles per call       %10.2f  (stddev %.2f, min %.2f, max %.2f)\n", sc.mean, sc.stddev, sc.min, sc.max );
+	fprintf( stderr, "  Instructions per call %10.2f  (stddev %.2f, min %.2f, max %.2f)\n", si.mean, si.stddev, si.min, si.max );
+	fprintf( stderr, "  Harness overhead      %10.2f cycles, %.2f instructions per call, subtracted\n", soc.mean, soi.mean );
+
+	// JSON to a file, or - for stdout, the summary above went to stderr.
+	{
+		FILE * f = strcmp( jsonfile, "-" ) ? fopen( jsonfile, "w" ) : stdout;
+		if( !f )
+		{
+			fprintf( stderr, "Error: Could not open %s\n", jsonfile );
+			r = -9;
+		}
+		else
+		{
+			fprintf( f, "{\n\t\"function\": \"" );
+			for( i = 0; spec[i]; i++ )
+				fprintf( f, ( spec[i] == '"' || spec[i] == '\\' ) ? "\\%c" : "%c", spec[i] );
+			fprintf( f, "\",\n\t\"address\": \"0x%08x\",\n\t\"args\": [", target.address );
+			for( i = 0; i < nargs; i++ )
+				fprintf( f, "%s%u", i ? ", " : "", target.args[i] );
+			fprintf( f, "],\n\t\"iterations\": %d,\n\t\"repetitions\": %d,\n", iterations, reps );
+			BenchJSONStats( f, "cycles_per_call", &sc );
+			BenchJSONStats( f, "instructions_per_call", &si );
+			BenchJSONStats( f, "overhead_cycles_per_call", &soc );
+			BenchJSONStats( f, "overhead_instructions_per_call", &soi );
+			fprintf( f, "\t\"runs\": [\n" );
+			for( i = 0; i < reps; i++ )
+			{
+				fprintf( f, "\t\t{ \"cycles\": %u, \"instructions\": %u, \"overhead_cycles\": %u, \"overhead_instructions\": %u }%s\n",
+					calls[i*2+1].ret[0], calls[i*2+1].ret[1], calls[i*2].ret[0], calls[i*2].ret[1], ( i < reps - 1 ) ? "," : "" );
+			}
+			fprintf( f, "\t]\n}\n" );
+			if( f != stdout ) fclose( f );
+		}
+	}
+	free( cycles );
+	free( calls );
+
+release:
+	TargetRelease( dev, &hold );
+	free( spec );
+	return r;
+}
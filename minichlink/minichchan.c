@@ -0,0 +1,453 @@
+// Virtual channels over the debug terminal link, see minichchan.h for the
+// firmware side and the wire format.
+//
+// Only active if a --chan option was given, otherwise the terminal stream is
+// left alone.  Unframed bytes and channel 0 are the console, which always goes
+// to the normal terminal output and is never dropped.  Every other channel
+// has its own sink and flow control policy:
+//   drop      Data which doesn't fit in the sink's backlog is thrown away.
+//   block     Wait for the sink, this will stall the whole terminal.
+//   throttle  Ask the target to pause the channel when the backlog is getting
+//             full, and resume it once drained.  Drops if it overflows anyway.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "minichlink.h"
+
+#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+#define CHANNEL_NO_SOCKETS
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+#define CHANNEL_FRAME_MARKER 0xfe   // Must match MINICHCHAN_FRAME_MARKER
+#define CHANNEL_CMD_PAUSE 0
+#define CHANNEL_CMD_RESUME 1
+#define CHANNEL_MAX 16
+#define CHANNEL_BACKLOG (1<<16)      // Must be a power of two.
+
+enum ChannelSinkType
+{
+	CHANNEL_STDOUT,
+	CHANNEL_FILE,
+	CHANNEL_UNIX,
+	CHANNEL_FIFO,
+};
+
+enum ChannelPolicy
+{
+	CHANNEL_DROP,
+	CHANNEL_BLOCK,
+	CHANNEL_THROTTLE,
+};
+
+struct TerminalChannel
+{
+	int configured;
+	enum ChannelSinkType type;
+	enum ChannelPolicy policy;
+	int binary;
+	char * path;
+	FILE * file;
+	int fd;              // Connected consumer for unix: and fifo:, or -1
+	int listenfd;        // unix: only
+	int fifo_readfd;     // fifo: only, held open so writes never raise SIGPIPE.
+	uint8_t * backlog;
+	uint32_t head, tail;
+	int paused;
+	int at_line_start;
+	uint64_t dropped;
+};
+
+static struct TerminalChannel channels[CHANNEL_MAX];
+static int channels_active;
+static uint64_t channels_unrouted;   // Bytes for channels nobody configured.
+
+// Stream parser state.
+static int chan_state;               // 0 = console text, 1 = channel number, 2 = length, 3 = payload
+static int chan_current;
+static int chan_remain;
+
+int ChannelsActive( void )
+{
+	return channels_active;
+}
+
+static void ChannelSendControl( int chan, int cmd )
+{
+	uint8_t msg[3] = { CHANNEL_FRAME_MARKER, chan, cmd };
+	TerminalQueueInput( msg, 3 );
+}
+
+#ifndef CHANNEL_NO_SOCKETS
+static int ChannelOpenUnix( struct TerminalChannel * c )
+{
+	struct sockaddr_un sa;
+	memset( &sa, 0, sizeof( sa ) );
+	sa.sun_family = AF_UNIX;
+	if( strlen( c->path ) >= sizeof( sa.sun_path ) )
+	{
+		fprintf( stderr, "Error: Socket path too long: %s\n", c->path );
+		return -1;
+	}
+	strcpy( sa.sun_path, c->path );
+	unlink( c->path );
+	c->listenfd = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( c->listenfd < 0 || bind( c->listenfd, (struct sockaddr*)&sa, sizeof( sa ) ) || listen( c->listenfd, 1 ) )
+	{
+		fprintf( stderr, "Error: Could not listen on %s\n", c->path );
+		return -1;
+	}
+	fcntl( c->listenfd, F_SETFL, O_NONBLOCK );
+	return 0;
+}
+
+static int ChannelOpenFifo( struct TerminalChannel * c )
+{
+	if( mkfifo( c->path, 0666 ) && errno != EEXIST )
+	{
+		fprintf( stderr, "Error: Could not create FIFO %s\n", c->path );
+		return -1;
+	}
+	c->fifo_readfd = open( c->path, O_RDONLY | O_NONBLOCK );
+	c->fd = open( c->path, O_WRONLY | O_NONBLOCK );
+	if( c->fifo_readfd < 0 || c->fd < 0 )
+	{
+		fprintf( stderr, "Error: Could not open FIFO %s\n", c->path );
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+// --chan N:sink[,bin|text][,drop|block|throttle]
+// where sink is stdout, file:path, unix:path or fifo:path
+int ChannelConfigure( const char * spec )
+{
+	char * end;
+	int n = strtol( spec, &end, 0 );
+	if( end == spec || *end != ':' || n < 1 || n >= CHANNEL_MAX )
+	{
+		fprintf( stderr, "Error: Channel must be 1 to %d, i.e. --chan 1:file:telemetry.bin,bin\n", CHANNEL_MAX - 1 );
+		return -1;
+	}
+	struct TerminalChannel * c = &channels[n];
+	if( c->configured )
+	{
+		fprintf( stderr, "Error: Channel %d configured twice\n", n );
+		return -1;
+	}
+	memset( c, 0, sizeof( *c ) );
+	c->fd = c->listenfd = c->fifo_readfd = -1;
+	c->at_line_start = 1;
+
+	int r = 0;
+	char * sink = strdup( end + 1 );
+	char * opt = strchr( sink, ',' );
+	if( opt ) *(opt++) = 0;
+	while( opt )
+	{
+		char * next = strchr( opt, ',' );
+		if( next ) *(next++) = 0;
+		if( strcmp( opt, "bin" ) == 0 ) c->binary = 1;
+		else if( strcmp( opt, "text" ) == 0 ) c->binary = 0;
+		else if( strcmp( opt, "drop" ) == 0 ) c->policy = CHANNEL_DROP;
+		else if( strcmp( opt, "block" ) == 0 ) c->policy = CHANNEL_BLOCK;
+		else if( strcmp( opt, "throttle" ) == 0 ) c->policy = CHANNEL_THROTTLE;
+		else
+		{
+			fprintf( stderr, "Error: Unknown channel option \"%s\"\n", opt );
+			r = -1;
+			goto fail;
+		}
+		opt = next;
+	}
+
+	if( strcmp( sink, "stdout" ) == 0 )
+	{
+		c->type = CHANNEL_STDOUT;
+	}
+	else if( strncmp( sink, "file:", 5 ) == 0 )
+	{
+		c->type = CHANNEL_FILE;
+		c->path = sink + 5;
+		c->file = fopen( c->path, c->binary ? "wb" : "w" );
+		if( !c->file )
+		{
+			fprintf( stderr, "Error: Could not open %s\n", c->path );
+			r = -1;
+			goto fail;
+		}
+		setvbuf( c->file, 0, c->binary ? _IOFBF : _IOLBF, CHANNEL_BACKLOG );
+	}
+#ifndef CHANNEL_NO_SOCKETS
+	else if( strncmp( sink, "unix:", 5 ) == 0 )
+	{
+		c->type = CHANNEL_UNIX;
+		c->path = sink + 5;
+		r = ChannelOpenUnix( c );
+	}
+	else if( strncmp( sink, "fifo:", 5 ) == 0 )
+	{
+		c->type = CHANNEL_FIFO;
+		c->path = sink + 5;
+		r = ChannelOpenFifo( c );
+	}
+#endif
+	else
+	{
+		fprintf( stderr, "Error: Unknown channel sink \"%s\"\n", sink );
+		r = -1;
+	}
+	if( r )
+		goto fail;
+
+	c->backlog = malloc( CHANNEL_BACKLOG );
+	c->configured = 1;
+	if( !channels_active ) atexit( ChannelsClose );
+	channels_active = 1;
+	return 0;
+
+fail:
+	// The path points into sink, nothing of this channel is kept.
+#ifndef CHANNEL_NO_SOCKETS
+	if( c->listenfd >= 0 ) close( c->listenfd );
+	if( c->fifo_readfd >= 0 ) close( c->fifo_readfd );
+	if( c->fd >= 0 ) close( c->fd );
+	c->fd = c->listenfd = c->fifo_readfd = -1;
+#endif
+	c->path = 0;
+	free( sink );
+	return r;
+}
+
+// Tries to push out the backlog without blocking.  Returns bytes still waiting.
+static int ChannelFlush( struct TerminalChannel * c )
+{
+#ifndef CHANNEL_NO_SOCKETS
+	while( c->head != c->tail && c->fd >= 0 )
+	{
+		uint32_t start = c->tail & ( CHANNEL_BACKLOG - 1 );
+		uint32_t len = c->head - c->tail;
+		if( start + len > CHANNEL_BACKLOG ) len = CHANNEL_BACKLOG - start;
+		int w;
+		if( c->type == CHANNEL_UNIX )
+			w = send( c->fd, c->backlog + start, len, MSG_NOSIGNAL | MSG_DONTWAIT );
+		else
+			w = write( c->fd, c->backlog + start, len );
+		if( w < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+			break;
+		if( w <= 0 )
+		{
+			// Consumer went away.  What it didn't get is lost.
+			fprintf( stderr, "Channel consumer on %s disconnected\n", c->path );
+			close( c->fd );
+			c->fd = -1;
+			c->tail = c->head;
+			break;
+		}
+		c->tail += w;
+	}
+#endif
+	return c->head - c->tail;
+}
+
+static void ChannelWaitWritable( struct TerminalChannel * c )
+{
+#ifndef CHANNEL_NO_SOCKETS
+	struct pollfd pfd = { c->fd, POLLOUT, 0 };
+	poll( &pfd, 1, 100 );
+#endif
+}
+
+static void ChannelDeliver( int chan, const uint8_t * data, int len )
+{
+	struct TerminalChannel * c = &channels[chan];
+	if( !c->configured )
+	{
+		// Nobody asked for it, count it, but don't make noise on the console.
+		channels_unrouted += len;
+		return;
+	}
+
+	if( c->type == CHANNEL_STDOUT )
+	{
+		if( c->binary )
+		{
+			TerminalOutput( data, len );
+			return;
+		}
+		// Text channels on stdout get tagged at the start of every line.
+		while( len > 0 )
+		{
+			if( c->at_line_start )
+			{
+				char tag[16];
+				int tl = snprintf( tag, sizeof( tag ), "[%d] ", chan );
+				TerminalOutput( tag, tl );
+				c->at_line_start = 0;
+			}
+			const uint8_t * nl = memchr( data, '\n', len );
+			int run = nl ? ( nl - data + 1 ) : len;
+			TerminalOutput( data, run );
+			if( nl ) c->at_line_start = 1;
+			data += run;
+			len -= run;
+		}
+		return;
+	}
+
+	if( c->type == CHANNEL_FILE )
+	{
+		fwrite( data, len, 1, c->file );
+		return;
+	}
+
+	// unix: and fifo: go through the backlog.
+	if( c->fd < 0 )
+	{
+		c->dropped += len;
+		return;
+	}
+	while( len > 0 )
+	{
+		uint32_t space = CHANNEL_BACKLOG - ( c->head - c->tail );
+		if( space == 0 && c->policy == CHANNEL_BLOCK && c->fd >= 0 )
+		{
+			ChannelWaitWritable( c );
+			ChannelFlush( c );
+			continue;
+		}
+		if( space == 0 )
+		{
+			c->dropped += len;
+			break;
+		}
+		uint32_t start = c->head & ( CHANNEL_BACKLOG - 1 );
+		uint32_t chunk = len;
+		if( chunk > space ) chunk = space;
+		if( chunk > CHANNEL_BACKLOG - start ) chunk = CHANNEL_BACKLOG - start;
+		memcpy( c->backlog + start, data, chunk );
+		c->head += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+	int pending = ChannelFlush( c );
+	if( c->policy == CHANNEL_THROTTLE && !c->paused && pending > CHANNEL_BACKLOG * 3 / 4 )
+	{
+		ChannelSendControl( chan, CHANNEL_CMD_PAUSE );
+		c->paused = 1;
+	}
+}
+
+void ChannelsFeed( const uint8_t * data, int len, void (*console)( const uint8_t * data, int len ) )
+{
+	int i = 0;
+	while( i < len )
+	{
+		switch( chan_state )
+		{
+		case 0:
+		{
+			int start = i;
+			while( i < len && data[i] != CHANNEL_FRAME_MARKER ) i++;
+			if( i > start ) console( data + start, i - start );
+			if( i < len )
+			{
+				chan_state = 1;
+				i++;
+			}
+			break;
+		}
+		case 1:
+			chan_current = data[i++] % CHANNEL_MAX;
+			chan_state = 2;
+			break;
+		case 2:
+			chan_remain = data[i++];
+			chan_state = chan_remain ? 3 : 0;
+			break;
+		case 3:
+		{
+			int run = len - i;
+			if( run > chan_remain ) run = chan_remain;
+			if( chan_current == 0 )
+				console( data + i, run );
+			else
+				ChannelDeliver( chan_current, data + i, run );
+			i += run;
+			chan_remain -= run;
+			if( chan_remain == 0 ) chan_state = 0;
+			break;
+		}
+		}
+	}
+}
+
+// Call regularly.  Accepts consumers, drains backlogs and resumes throttled
+// channels.  Returns nonzero if any channel still has data waiting.
+int ChannelsPoll( void )
+{
+	int i;
+	int waiting = 0;
+	for( i = 1; i < CHANNEL_MAX; i++ )
+	{
+		struct TerminalChannel * c = &channels[i];
+		if( !c->configured ) continue;
+#ifndef CHANNEL_NO_SOCKETS
+		if( c->type == CHANNEL_UNIX && c->fd < 0 )
+		{
+			c->fd = accept( c->listenfd, 0, 0 );
+			if( c->fd >= 0 )
+			{
+				fcntl( c->fd, F_SETFL, O_NONBLOCK );
+				fprintf( stderr, "Channel %d connected on %s\n", i, c->path );
+			}
+		}
+#endif
+		if( c->file ) continue;
+		int pending = ChannelFlush( c );
+		if( c->paused && pending < CHANNEL_BACKLOG / 4 )
+		{
+			ChannelSendControl( i, CHANNEL_CMD_RESUME );
+			c->paused = 0;
+		}
+		if( pending ) waiting = 1;
+	}
+	return waiting;
+}
+
+void ChannelsClose( void )
+{
+	int i;
+	for( i = 1; i < CHANNEL_MAX; i++ )
+	{
+		struct TerminalChannel * c = &channels[i];
+		if( !c->configured ) continue;
+		if( c->dropped )
+			fprintf( stderr, "Channel %d dropped %llu bytes\n", i, (unsigned long long)c->dropped );
+		if( c->file ) fclose( c->file );
+#ifndef CHANNEL_NO_SOCKETS
+		if( c->fd >= 0 ) close( c->fd );
+		if( c->listenfd >= 0 )
+		{
+			close( c->listenfd );
+			unlink( c->path );
+		}
+		if( c->fifo_readfd >= 0 ) close( c->fifo_readfd );
+#endif
+		c->configured = 0;
+	}
+	if( channels_unrouted )
+		fprintf( stderr, "%llu bytes arrived on unconfigured channels\n", (unsigned long long)channels_unrouted );
+}
@@ -0,0 +1,103 @@
+// Virtual channels over the debug terminal, firmware side.  The host side is
+// minichlink -T with one or more --chan N:sink[,bin|text][,drop|block|throttle]
+//
+// Target to host, a channel frame is:
+//   0xFE, channel, length, payload[length]
+// Anything outside a frame, and channel 0, is the regular console.  Channels
+// 1 to 15 go wherever the host was told to send them.
+//
+// Host to target, flow control for "throttle" channels arrives mixed in with
+// console input as:
+//   0xFE, channel, 0 (pause) or 1 (resume)
+// Feed every input byte through minichchan_input(), it returns 1 for bytes
+// which were part of a control message, i.e.
+//
+//   void handle_debug_input( int numbytes, uint8_t * data )
+//   {
+//       while( numbytes-- )
+//       {
+//           uint8_t c = *(data++);
+//           if( !minichchan_input( c ) ) my_console_input( c );
+//       }
+//   }
+//
+// minichchan_write() returns 0 without sending anything while the host has the
+// channel paused, so high rate telemetry can just keep calling it.
+//
+// #define MINICHCHAN_IMPLEMENTATION in exactly one file before including.
+
+#ifndef _MINICHCHAN_H
+#define _MINICHCHAN_H
+
+#include <stdint.h>
+
+#define MINICHCHAN_FRAME_MARKER 0xfe
+#define MINICHCHAN_MAX 16
+#ifndef MINICHCHAN_MAX_PAYLOAD
+#define MINICHCHAN_MAX_PAYLOAD 60   // Per _write call, keeps the stack use down.
+#endif
+
+extern volatile uint32_t minichchan_paused; // Bit per channel.
+
+// Returns number of bytes sent, 0 if the channel is paused.
+int minichchan_write( int channel, const void * data, int len );
+
+// Returns 1 if the byte was consumed as part of a control message.
+int minichchan_input( uint8_t c );
+
+#ifdef MINICHCHAN_IMPLEMENTATION
+
+int _write(int fd, const char *buf, int size);
+
+volatile uint32_t minichchan_paused;
+
+int minichchan_write( int channel, const void * data, int len )
+{
+	const uint8_t * d = (const uint8_t *)data;
+	uint8_t frame[MINICHCHAN_MAX_PAYLOAD + 3];
+	int sent = 0;
+	while( len > 0 )
+	{
+		if( minichchan_paused & ( 1 << channel ) ) break;
+		int run = ( len > MINICHCHAN_MAX_PAYLOAD ) ? MINICHCHAN_MAX_PAYLOAD : len;
+		int i;
+		frame[0] = MINICHCHAN_FRAME_MARKER;
+		frame[1] = channel;
+		frame[2] = run;
+		for( i = 0; i < run; i++ )
+			frame[i+3] = d[i];
+		_write( 0, (const char *)frame, run + 3 );
+		d += run;
+		len -= run;
+		sent += run;
+	}
+	return sent;
+}
+
+int minichchan_input( uint8_t c )
+{
+	static int state;
+	static int channel;
+	switch( state )
+	{
+	case 0:
+		if( c != MINICHCHAN_FRAME_MARKER ) return 0;
+		state = 1;
+		return 1;
+	case 1:
+		channel = c % MINICHCHAN_MAX;
+		state = 2;
+		return 1;
+	default:
+		if( c == 0 )
+			minichchan_paused |= 1 << channel;
+		else
+			minichchan_paused &= ~( 1 << channel );
+		state = 0;
+		return 1;
+	}
+}
+
+#endif
+
+#endif
@@ -0,0 +1,290 @@
+// Output encoders for -r.
+//
+// Memory is handed over a chunk at a time, as it comes back from the
+// programmer, and formatted by hand into one large buffer which is written out
+// whenever it fills up.  A 256kB dump in any of the text formats is a handful
+// of writes, not one printf per byte.
+//
+// Which encoder is picked from the file name:
+//   -                 Raw binary to stdout.
+//   +                 Hex dump with ASCII to stdout.
+//   hexdump:, ihex:,  Force a format, the rest is a file name or - for
+//   srec:, c:, bin:   stdout.
+//   *.hex, *.ihex     Intel HEX.
+//   *.srec, *.s19,    Motorola S-records, always with 32 bit addresses.
+//   *.s28, *.s37, *.mot
+//   *.c, *.h          A C array.
+//   anything else     Raw binary.
+//
+// Every text format is made of lines of up to DUMP_LINE bytes.  A line is held
+// back until it is full, so chunk boundaries never show in the output.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "minichlink.h"
+
+#define DUMP_BUFFER 65536
+#define DUMP_LINE 16
+#define DUMP_LINE_MAX 128 // Longest line any encoder makes, with room to spare.
+
+enum DumpFormat
+{
+	DUMP_BINARY,
+	DUMP_HEXDUMP,
+	DUMP_IHEX,
+	DUMP_SREC,
+	DUMP_C,
+};
+
+struct DumpEncoder
+{
+	enum DumpFormat format;
+	FILE * f;
+	uint32_t address;           // Of line[0].
+	uint32_t start;
+	uint32_t upper;             // Intel HEX extended linear address currently in effect.
+	uint32_t total;
+	int line_len;
+	int failed;
+	uint8_t line[DUMP_LINE];
+	uint32_t out_len;
+	char out[DUMP_BUFFER];
+};
+
+static const char dump_hex[] = "0123456789abcdef";
+static const char dump_hex_upper[] = "0123456789ABCDEF";
+
+static const struct
+{
+	const char * prefix;
+	enum DumpFormat format;
+} dump_prefixes[] = {
+	{ "bin:", DUMP_BINARY }, { "hexdump:", DUMP_HEXDUMP }, { "ihex:", DUMP_IHEX }, { "srec:", DUMP_SREC }, { "c:", DUMP_C },
+};
+
+static const struct
+{
+	const char * extension;
+	enum DumpFormat format;
+} dump_extensions[] = {
+	{ ".hex", DUMP_IHEX }, { ".ihex", DUMP_IHEX }, { ".srec", DUMP_SREC }, { ".s19", DUMP_SREC }, { ".s28", DUMP_SREC },
+	{ ".s37", DUMP_SREC }, { ".mot", DUMP_SREC }, { ".c", DUMP_C }, { ".h", DUMP_C },
+};
+
+static void DumpFlush( struct DumpEncoder * e )
+{
+	if( e->out_len && !e->failed && fwrite( e->out, e->out_len, 1, e->f ) != 1 )
+	{
+		fprintf( stderr, "Error: Could not write dump output\n" );
+		e->failed = 1;
+	}
+	e->out_len = 0;
+}
+
+static inline char * DumpByte( char * o, uint8_t b, const char * digits )
+{
+	o[0] = digits[b>>4];
+	o[1] = digits[b&15];
+	return o + 2;
+}
+
+// One Intel HEX or S-record line.  Both are a count, the address, the data
+// and a checksum, all as hex.  S-records put the type up front and count the
+// address and checksum too, Intel HEX puts it after the address and only
+// counts the data.
+static char * DumpRecord( char * o, int srec, uint8_t type, const uint8_t * address, int address_len, const uint8_t * data, int len )
+{
+	uint8_t count = srec ? address_len + len + 1 : len;
+	uint8_t sum = count;
+	int i;
+	*(o++) = srec ? 'S' : ':';
+	if( srec ) *(o++) = '0' + type;
+	o = DumpByte( o, count, dump_hex_upper );
+	for( i = 0; i < address_len; i++ )
+	{
+		o = DumpByte( o, address[i], dump_hex_upper );
+		sum += address[i];
+	}
+	if( !srec )
+	{
+		o = DumpByte( o, type, dump_hex_upper );
+		sum += type;
+	}
+	for( i = 0; i < len; i++ )
+	{
+		o = DumpByte( o, data[i], dump_hex_upper );
+		sum += data[i];
+	}
+	o = DumpByte( o, srec ? (uint8_t)~sum : (uint8_t)-sum, dump_hex_upper );
+	*(o++) = '\n';
+	return o;
+}
+
+static void DumpLine( struct DumpEncoder * e )
+{
+	char * o = e->out + e->out_len;
+	int i, n = e->line_len;
+	uint32_t a = e->address;
+
+	switch( e->format )
+	{
+	case DUMP_BINARY: // Never buffered, see DumpWrite().
+		break;
+	case DUMP_HEXDUMP:
+		for( i = 28; i >= 0; i -= 4 )
+			*(o++) = dump_hex[(a>>i)&15];
+		*(o++) = ':';
+		*(o++) = ' ';
+		for( i = 0; i < DUMP_LINE; i++ )
+		{
+			if( i < n )
+				o = DumpByte( o, e->line[i], dump_hex );
+			else
+				*(o++) = ' ', *(o++) = ' ';
+			*(o++) = ' ';
+		}
+		*(o++) = '|';
+		for( i = 0; i < n; i++ )
+			*(o++) = ( e->line[i] >= 0x20 && e->line[i] < 0x7f ) ? e->line[i] : '.';
+		*(o++) = '|';
+		*(o++) = '\n';
+		break;
+	case DUMP_IHEX:
+		if( ( a >> 16 ) != e->upper )
+		{
+			uint8_t zero[2] = { 0, 0 }, upper[2] = { a >> 24, a >> 16 };
+			e->upper = a >> 16;
+			o = DumpRecord( o, 0, 4, zero, 2, upper, 2 ); // Extended linear address
+		}
+		{
+			uint8_t address[2] = { a >> 8, a };
+			o = DumpRecord( o, 0, 0, address, 2, e->line, n );
+		}
+		break;
+	case DUMP_SREC:
+		{
+			uint8_t address[4] = { a >> 24, a >> 16, a >> 8, a };
+			o = DumpRecord( o, 1, 3, address, 4, e->line, n );
+		}
+		break;
+	case DUMP_C:
+		*(o++) = '\t';
+		for( i = 0; i < n; i++ )
+		{
+			*(o++) = '0';
+			*(o++) = 'x';
+			o = DumpByte( o, e->line[i], dump_hex );
+			*(o++) = ',';
+			if( i != n - 1 ) *(o++) = ' ';
+		}
+		*(o++) = '\n';
+		break;
+	}
+	e->out_len = o - e->out;
+	e->address += n;
+	e->line_len = 0;
+	if( e->out_len > DUMP_BUFFER - DUMP_LINE_MAX )
+		DumpFlush( e );
+}
+
+struct DumpEncoder * DumpOpen( const char * fname, uint32_t address )
+{
+	struct DumpEncoder * e = calloc( 1, sizeof( struct DumpEncoder ) );
+	int i, len;
+
+	e->format = DUMP_BINARY;
+	if( strcmp( fname, "+" ) == 0 )
+	{
+		e->format = DUMP_HEXDUMP;
+		fname = "-";
+	}
+	for( i = 0; i < sizeof( dump_prefixes ) / sizeof( dump_prefixes[0] ); i++ )
+	{
+		len = strlen( dump_prefixes[i].prefix );
+		if( strncmp( fname, dump_prefixes[i].prefix, len ) == 0 )
+		{
+			e->format = dump_prefixes[i].format;
+			fname += len;
+			break;
+		}
+	}
+	if( i == sizeof( dump_prefixes ) / sizeof( dump_prefixes[0] ) )
+	{
+		for( i = 0; i < sizeof( dump_extensions ) / sizeof( dump_extensions[0] ); i++ )
+		{
+			int flen = strlen( fname );
+			len = strlen( dump_extensions[i].extension );
+			if( flen > len && strcmp( fname + flen - len, dump_extensions[i].extension ) == 0 )
+				e->format = dump_extensions[i].format;
+		}
+	}
+
+	e->f = strcmp( fname, "-" ) == 0 ? stdout : fopen( fname, "wb" );
+	if( !e->f )
+	{
+		fprintf( stderr, "Error: can't open write file \"%s\"\n", fname );
+		free( e );
+		return 0;
+	}
+	e->address = e->start = address;
+
+	if( e->format == DUMP_SREC )
+	{
+		static const uint8_t header[] = "minichlink";
+		uint8_t zero[2] = { 0, 0 };
+		e->out_len = DumpRecord( e->out, 1, 0, zero, 2, header, sizeof( header ) - 1 ) - e->out;
+	}
+	else if( e->format == DUMP_C )
+		e->out_len = sprintf( e->out, "// Read from 0x%08x by minichlink\nconst unsigned char dump_%08x[] = {\n", address, address );
+	return e;
+}
+
+int DumpWrite( struct DumpEncoder * e, const uint8_t * data, uint32_t len )
+{
+	if( e->format == DUMP_BINARY )
+	{
+		// Nothing to format, straight through once what's buffered is out.
+		DumpFlush( e );
+		if( !e->failed && len && fwrite( data, len, 1, e->f ) != 1 )
+		{
+			fprintf( stderr, "Error: Could not write dump output\n" );
+			e->failed = 1;
+		}
+		e->total += len;
+		return e->failed ? -1 : 0;
+	}
+	while( len-- )
+	{
+		e->line[e->line_len++] = *(data++);
+		e->total++;
+		// Intel HEX data records can't cross a 64kB boundary.
+		if( e->line_len == DUMP_LINE || ( e->format == DUMP_IHEX && ( ( e->address + e->line_len ) & 0xffff ) == 0 ) )
+			DumpLine( e );
+	}
+	return e->failed ? -1 : 0;
+}
+
+int DumpClose( struct DumpEncoder * e )
+{
+	int r;
+	if( e->line_len )
+		DumpLine( e );
+	if( e->format == DUMP_IHEX )
+		e->out_len += sprintf( e->out + e->out_len, ":00000001FF\n" );
+	else if( e->format == DUMP_SREC )
+	{
+		uint8_t start[4] = { e->start >> 24, e->start >> 16, e->start >> 8, e->start };
+		e->out_len = DumpRecord( e->out + e->out_len, 1, 7, start, 4, 0, 0 ) - e->out;
+	}
+	else if( e->format == DUMP_C )
+		e->out_len += sprintf( e->out + e->out_len, "};\nconst unsigned int dump_%08x_size = %u;\n", e->start, e->total );
+	DumpFlush( e );
+	if( e->f != stdout )
+		fclose( e->f );
+	else
+		fflush( stdout );
+	r = e->failed ? -1 : 0;
+	free( e );
+	return r;
+}
@@ -0,0 +1,537 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "minichelf.h"
+
+#define SHT_SYMTAB 2
+#define SHT_NOBITS 8
+#define STT_OBJECT 1
+#define STT_FUNC   2
+
+static uint32_t ElfRead32( const uint8_t * p )
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static uint32_t ElfRead16( const uint8_t * p )
+{
+	return p[0] | (p[1]<<8);
+}
+
+int MiniElfLoad( struct MiniElf * elf, const char * filename )
+{
+	memset( elf, 0, sizeof( *elf ) );
+	FILE * f = fopen( filename, "rb" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: Could not open %s\n", filename );
+		return -55;
+	}
+	fseek( f, 0, SEEK_END );
+	long len = ftell( f );
+	fseek( f, 0, SEEK_SET );
+	elf->data = malloc( len > 0 ? len : 1 );
+	elf->size = len;
+	int status = len > 0 && fread( elf->data, len, 1, f ) == 1;
+	fclose( f );
+	if( !status )
+	{
+		fprintf( stderr, "Error: File I/O Fault reading %s\n", filename );
+		MiniElfFree( elf );
+		return -10;
+	}
+
+	const uint8_t * d = elf->data;
+	// 32-bit (1), little endian (1)
+	if( elf->size < 52 || memcmp( d, "\x7f" "ELF", 4 ) != 0 || d[4] != 1 || d[5] != 1 )
+	{
+		fprintf( stderr, "Error: %s is not a 32-bit little endian ELF\n", filename );
+		MiniElfFree( elf );
+		return -11;
+	}
+
+	elf->shoff = ElfRead32( d + 32 );
+	elf->shentsize = ElfRead16( d + 46 );
+	elf->shnum = ElfRead16( d + 48 );
+	elf->shstrndx = ElfRead16( d + 50 );
+	// Core files have no sections, just segments.
+	if( ( elf->shnum && elf->shentsize < 40 ) || (uint64_t)elf->shoff + (uint64_t)elf->shnum * elf->shentsize > elf->size )
+	{
+		fprintf( stderr, "Error: %s has a corrupt section table\n", filename );
+		MiniElfFree( elf );
+		return -11;
+	}
+	elf->type = ElfRead16( d + 16 );
+	elf->phoff = ElfRead32( d + 28 );
+	elf->phentsize = ElfRead16( d + 42 );
+	elf->phnum = ElfRead16( d + 44 );
+	if( ( elf->phnum && elf->phentsize < 32 ) || (uint64_t)elf->phoff + (uint64_t)elf->phnum * elf->phentsize > elf->size )
+	{
+		fprintf( stderr, "Error: %s has a corrupt program header table\n", filename );
+		MiniElfFree( elf );
+		return -11;
+	}
+	return 0;
+}
+
+void MiniElfFree( struct MiniElf * elf )
+{
+	free( elf->data );
+	memset( elf, 0, sizeof( *elf ) );
+}
+
+static const char * ElfString( struct MiniElf * elf, uint32_t strtab_index, uint32_t offset )
+{
+	struct MiniElfSection strtab;
+	if( MiniElfGetSection( elf, strtab_index, &strtab ) || !strtab.data || offset >= strtab.size )
+		return "";
+	const char * s = (const char*)strtab.data + offset;
+	// Make sure it's terminated inside the table.
+	if( !memchr( s, 0, strtab.size - offset ) ) return "";
+	return s;
+}
+
+int MiniElfGetSection( struct MiniElf * elf, uint32_t index, struct MiniElfSection * sec )
+{
+	if( index >= elf->shnum ) return -1;
+	const uint8_t * sh = elf->data + elf->shoff + index * elf->shentsize;
+	uint32_t offset = ElfRead32( sh + 16 );
+
+	sec->type = ElfRead32( sh + 4 );
+	sec->flags = ElfRead32( sh + 8 );
+	sec->addr = ElfRead32( sh + 12 );
+	sec->size = ElfRead32( sh + 20 );
+	sec->data = 0;
+	if( sec->type != SHT_NOBITS )
+	{
+		if( (uint64_t)offset + sec->size > elf->size ) return -2;
+		sec->data = elf->data + offset;
+	}
+	// Looking up the name of .shstrtab itself would recurse.
+	sec->name = ( index == elf->shstrndx ) ? ".shstrtab" : ElfString( elf, elf->shstrndx, ElfRead32( sh ) );
+	return 0;
+}
+
+int MiniElfGetSegment( struct MiniElf * elf, uint32_t index, struct MiniElfSegment * seg )
+{
+	if( index >= elf->phnum ) return -1;
+	const uint8_t * ph = elf->data + elf->phoff + index * elf->phentsize;
+	uint32_t offset = ElfRead32( ph + 4 );
+
+	seg->type = ElfRead32( ph );
+	seg->vaddr = ElfRead32( ph + 8 );
+	seg->filesz = ElfRead32( ph + 16 );
+	seg->memsz = ElfRead32( ph + 20 );
+	seg->flags = ElfRead32( ph + 24 );
+	if( (uint64_t)offset + seg->filesz > elf->size ) return -2;
+	seg->data = elf->data + offset;
+	return 0;
+}
+
+int MiniElfFindSection( struct MiniElf * elf, const char * name, struct MiniElfSection * sec )
+{
+	uint32_t i;
+	for( i = 1; i < elf->shnum; i++ )
+	{
+		if( MiniElfGetSection( elf, i, sec ) == 0 && strcmp( sec->name, name ) == 0 )
+			return 0;
+	}
+	return -1;
+}
+
+// Calls back for every symbol in .symtab, stops if cb returns nonzero.
+static int ElfForEachSymbol( struct MiniElf * elf, int (*cb)( void * opaque, const char * name, uint32_t value, uint32_t size, int type ), void * opaque )
+{
+	uint32_t i, j;
+	for( i = 1; i < elf->shnum; i++ )
+	{
+		struct MiniElfSection symtab;
+		if( MiniElfGetSection( elf, i, &symtab ) || symtab.type != SHT_SYMTAB || !symtab.data ) continue;
+		const uint8_t * sh = elf->data + elf->shoff + i * elf->shentsize;
+		uint32_t strtab_index = ElfRead32( sh + 24 ); // sh_link
+		for( j = 1; j < symtab.size / 16; j++ )
+		{
+			const uint8_t * sym = symtab.data + j * 16;
+			int r = cb( opaque, ElfString( elf, strtab_index, ElfRead32( sym ) ), ElfRead32( sym + 4 ), ElfRead32( sym + 8 ), sym[12] & 0xf );
+			if( r ) return r;
+		}
+	}
+	return 0;
+}
+
+struct ElfSymbolQuery
+{
+	const char * name;
+	uint32_t address;
+	uint32_t size;
+	const char * found;
+	uint32_t best;
+};
+
+static int ElfMatchName( void * opaque, const char * name, uint32_t value, uint32_t size, int type )
+{
+	struct ElfSymbolQuery * q = opaque;
+	if( strcmp( name, q->name ) ) return 0;
+	q->address = value;
+	q->size = size;
+	return 1;
+}
+
+int MiniElfFindSymbol( struct MiniElf * elf, const char * name, uint32_t * address, uint32_t * size )
+{
+	struct ElfSymbolQuery q = { name, 0, 0, 0, 0 };
+	if( !ElfForEachSymbol( elf, ElfMatchName, &q ) ) return -1;
+	if( address ) *address = q.address;
+	if( size ) *size = q.size;
+	return 0;
+}
+
+static int ElfMatchAddress( void * opaque, const char * name, uint32_t value, uint32_t size, int type )
+{
+	struct ElfSymbolQuery * q = opaque;
+	if( ( type != STT_FUNC && type != STT_OBJECT ) || !name[0] ) return 0;
+	// Closest symbol at or before the address wins.
+	if( value <= q->address && ( !q->found || value > q->best ) )
+	{
+		q->found = name;
+		q->best = value;
+	}
+	return 0;
+}
+
+const char * MiniElfSymbolForAddress( struct MiniElf * elf, uint32_t address, uint32_t * offset )
+{
+	struct ElfSymbolQuery q = { 0, address, 0, 0, 0 };
+	ElfForEachSymbol( elf, ElfMatchAddress, &q );
+	if( q.found && offset ) *offset = address - q.best;
+	return q.found;
+}
+
+// .debug_line, just the address -> file:line part of it.
+
+#define SHF_EXECINSTR 4
+
+static uint32_t ElfULEB( const uint8_t ** p, const uint8_t * end )
+{
+	uint32_t v = 0;
+	int shift = 0;
+	while( *p < end )
+	{
+		uint8_t b = *((*p)++);
+		if( shift < 32 ) v |= (uint32_t)( b & 0x7f ) << shift;
+		shift += 7;
+		if( !( b & 0x80 ) ) break;
+	}
+	return v;
+}
+
+static int32_t ElfSLEB( const uint8_t ** p, const uint8_t * end )
+{
+	uint32_t v = 0;
+	int shift = 0;
+	uint8_t b = 0;
+	while( *p < end )
+	{
+		b = *((*p)++);
+		if( shift < 32 ) v |= (uint32_t)( b & 0x7f ) << shift;
+		shift += 7;
+		if( !( b & 0x80 ) ) break;
+	}
+	if( shift < 32 && ( b & 0x40 ) ) v |= ~0U << shift;
+	return (int32_t)v;
+}
+
+static const char * ElfSectionString( struct MiniElfSection * sec, uint32_t offset )
+{
+	if( !sec->data || offset >= sec->size ) return "?";
+	const char * s = (const char*)sec->data + offset;
+	if( !memchr( s, 0, sec->size - offset ) ) return "?";
+	return s;
+}
+
+struct ElfLineState
+{
+	struct MiniElfLines * lines;
+	int alloc;
+	int sequence_start;    // First row of the sequence being decoded.
+	int keep_zero;         // Code really lives at 0, so sequences starting there are real.
+	const char ** files;
+	int nfiles;
+	int file_base;         // 1 before DWARF 5, 0 after.
+};
+
+static void ElfLineEmit( struct ElfLineState * st, uint32_t address, uint32_t file, uint32_t line )
+{
+	struct MiniElfLines * l = st->lines;
+	// Several rows at one address, i.e. from is_stmt changes, the last one is the one that counts.
+	if( l->count > st->sequence_start && l->rows[l->count-1].address == address )
+		l->count--;
+	if( l->count == st->alloc )
+	{
+		st->alloc = st->alloc ? st->alloc * 2 : 1024;
+		l->rows = realloc( l->rows, st->alloc * sizeof( struct MiniElfLine ) );
+	}
+	uint32_t idx = file - st->file_base;
+	struct MiniElfLine * r = &l->rows[l->count++];
+	r->address = address;
+	r->line = line;
+	r->file = ( idx < (uint32_t)st->nfiles ) ? st->files[idx] : "?";
+}
+
+static void ElfLineEndSequence( struct ElfLineState * st, uint32_t address )
+{
+	struct MiniElfLines * l = st->lines;
+	// Functions dropped by --gc-sections keep their line programs, relocated to 0.
+	if( l->count > st->sequence_start && l->rows[st->sequence_start].address == 0 && !st->keep_zero )
+		l->count = st->sequence_start;
+	else
+		ElfLineEmit( st, address, 0, 0 );
+	st->sequence_start = l->count;
+}
+
+// Reads one attribute of a DWARF 5 directory or file entry.  Returns nonzero on forms we don't know how to skip.
+static int ElfLineForm( const uint8_t ** p, const uint8_t * end, uint32_t form, struct MiniElfSection * str, struct MiniElfSection * line_str, const char ** s )
+{
+	uint32_t skip = 0;
+	switch( form )
+	{
+	case 0x08: // DW_FORM_string
+	{
+		const uint8_t * z = memchr( *p, 0, end - *p );
+		if( !z ) return -1;
+		*s = (const char*)*p;
+		*p = z + 1;
+		return 0;
+	}
+	case 0x0e: // DW_FORM_strp
+	case 0x1f: // DW_FORM_line_strp
+		if( end - *p < 4 ) return -1;
+		*s = ElfSectionString( form == 0x0e ? str : line_str, ElfRead32( *p ) );
+		*p += 4;
+		return 0;
+	case 0x0f: ElfULEB( p, end ); return 0; // DW_FORM_udata
+	case 0x09: skip = ElfULEB( p, end ); break; // DW_FORM_block
+	case 0x0b: skip = 1; break; // DW_FORM_data1
+	case 0x05: skip = 2; break; // DW_FORM_data2
+	case 0x06: skip = 4; break; // DW_FORM_data4
+	case 0x07: skip = 8; break; // DW_FORM_data8
+	case 0x1e: skip = 16; break; // DW_FORM_data16
+	default: return -1;
+	}
+	if( (uint32_t)( end - *p ) < skip ) return -1;
+	*p += skip;
+	return 0;
+}
+
+// Collects the file names of a DWARF 5 header, returns 0 if OK.
+static int ElfLineV5Entries( struct ElfLineState * st, const uint8_t ** p, const uint8_t * end, struct MiniElfSection * str, struct MiniElfSection * line_str, int is_files )
+{
+	uint32_t formats[16][2];
+	uint32_t i, j;
+	if( *p >= end ) return -1;
+	uint32_t nformats = *((*p)++);
+	if( nformats > 16 ) return -1;
+	for( i = 0; i < nformats; i++ )
+	{
+		formats[i][0] = ElfULEB( p, end );
+		formats[i][1] = ElfULEB( p, end );
+	}
+	uint32_t count = ElfULEB( p, end );
+	for( i = 0; i < count; i++ )
+	{
+		const char * path = "?";
+		for( j = 0; j < nformats; j++ )
+		{
+			const char * s = 0;
+			if( ElfLineForm( p, end, formats[j][1], str, line_str, &s ) ) return -1;
+			if( formats[j][0] == 1 && s ) path = s; // DW_LNCT_path
+		}
+		if( is_files )
+		{
+			st->files = realloc( st->files, ( st->nfiles + 1 ) * sizeof( const char * ) );
+			st->files[st->nfiles++] = path;
+		}
+	}
+	return 0;
+}
+
+static void ElfLineUnit( struct ElfLineState * st, const uint8_t * p, const uint8_t * end, struct MiniElfSection * str, struct MiniElfSection * line_str )
+{
+	if( end - p < 2 ) return;
+	uint32_t version = ElfRead16( p );
+	p += 2;
+	if( version < 2 || version > 5 ) return;
+	if( version >= 5 )
+	{
+		// address_size, segment_selector_size
+		if( end - p < 2 || p[0] != 4 ) return;
+		p += 2;
+	}
+	if( end - p < 4 ) return;
+	const uint8_t * program = p + 4 + ElfRead32( p );
+	p += 4;
+	if( program > end || program - p < ( version >= 4 ? 6 : 5 ) ) return;
+
+	uint32_t min_inst = *(p++);
+	if( version >= 4 ) p++; // maximum_operations_per_instruction, always 1 on RISC-V
+	p++; // default_is_stmt
+	int line_base = (int8_t)*(p++);
+	uint32_t line_range = *(p++);
+	uint32_t opcode_base = *(p++);
+	const uint8_t * std_lengths = p;
+	if( !line_range || !opcode_base || (uint32_t)( program - p ) < opcode_base - 1 ) return;
+	p += opcode_base - 1;
+
+	st->nfiles = 0;
+	if( version >= 5 )
+	{
+		st->file_base = 0;
+		if( ElfLineV5Entries( st, &p, program, str, line_str, 0 ) ||
+			ElfLineV5Entries( st, &p, program, str, line_str, 1 ) )
+			return;
+	}
+	else
+	{
+		st->file_base = 1;
+		// include_directories, then file_names, each ended by an empty string.
+		while( p < program && *p )
+		{
+			const uint8_t * z = memchr( p, 0, program - p );
+			if( !z ) return;
+			p = z + 1;
+		}
+		p++;
+		while( p < program && *p )
+		{
+			const uint8_t * z = memchr( p, 0, program - p );
+			if( !z ) return;
+			st->files = realloc( st->files, ( st->nfiles + 1 ) * sizeof( const char * ) );
+			st->files[st->nfiles++] = (const char*)p;
+			p = z + 1;
+			ElfULEB( &p, program ); // directory
+			ElfULEB( &p, program ); // mtime
+			ElfULEB( &p, program ); // length
+		}
+	}
+
+	uint32_t address = 0, file = 1, line = 1, i;
+	p = program;
+	st->sequence_start = st->lines->count;
+	while( p < end )
+	{
+		uint32_t op = *(p++);
+		if( op >= opcode_base )
+		{
+			uint32_t adj = op - opcode_base;
+			address += ( adj / line_range ) * min_inst;
+			line += line_base + (int)( adj % line_range );
+			ElfLineEmit( st, address, file, line );
+			continue;
+		}
+		switch( op )
+		{
+		case 0: // Extended
+		{
+			uint32_t len = ElfULEB( &p, end );
+			if( !len || len > (uint32_t)( end - p ) ) return;
+			const uint8_t * next = p + len;
+			if( *p == 1 ) // DW_LNE_end_sequence
+			{
+				ElfLineEndSequence( st, address );
+				address = 0;
+				file = 1;
+				line = 1;
+			}
+			else if( *p == 2 && len >= 5 ) // DW_LNE_set_address
+				address = ElfRead32( p + 1 );
+			p = next;
+			break;
+		}
+		case 1: ElfLineEmit( st, address, file, line ); break; // DW_LNS_copy
+		case 2: address += ElfULEB( &p, end ) * min_inst; break; // DW_LNS_advance_pc
+		case 3: line += ElfSLEB( &p, end ); break; // DW_LNS_advance_line
+		case 4: file = ElfULEB( &p, end ); break; // DW_LNS_set_file
+		case 8: address += ( ( 255 - opcode_base ) / line_range ) * min_inst; break; // DW_LNS_const_add_pc
+		case 9: // DW_LNS_fixed_advance_pc
+			if( end - p < 2 ) return;
+			address += ElfRead16( p );
+			p += 2;
+			break;
+		default:
+			// Column, basic block, prologue end, etc. don't matter to us.
+			for( i = 0; i < std_lengths[op-1]; i++ )
+				ElfULEB( &p, end );
+			break;
+		}
+	}
+	// A unit that ends mid-sequence is broken, don't let it cover the rest of the address space.
+	st->lines->count = st->sequence_start;
+}
+
+static int ElfLineCompare( const void * a, const void * b )
+{
+	const struct MiniElfLine * la = a, * lb = b;
+	if( la->address != lb->address ) return ( la->address < lb->address ) ? -1 : 1;
+	// Where one sequence ends and the next begins, the beginning wins.
+	return ( la->line != 0 ) - ( lb->line != 0 );
+}
+
+int MiniElfLoadLines( struct MiniElf * elf, struct MiniElfLines * lines )
+{
+	struct MiniElfSection debug_line, str, line_str, sec;
+	struct ElfLineState st;
+	uint32_t i;
+
+	memset( lines, 0, sizeof( *lines ) );
+	if( MiniElfFindSection( elf, ".debug_line", &debug_line ) || !debug_line.data ) return 0;
+	if( MiniElfFindSection( elf, ".debug_str", &str ) ) str.data = 0;
+	if( MiniElfFindSection( elf, ".debug_line_str", &line_str ) ) line_str.data = 0;
+
+	memset( &st, 0, sizeof( st ) );
+	st.lines = lines;
+	for( i = 1; i < elf->shnum; i++ )
+	{
+		if( MiniElfGetSection( elf, i, &sec ) == 0 && ( sec.flags & SHF_EXECINSTR ) && sec.addr == 0 && sec.size )
+			st.keep_zero = 1;
+	}
+
+	const uint8_t * p = debug_line.data;
+	const uint8_t * end = p + debug_line.size;
+	while( end - p >= 4 )
+	{
+		uint32_t unit_length = ElfRead32( p );
+		p += 4;
+		// 0xffffffff is 64-bit DWARF, which no 32-bit toolchain emits.
+		if( unit_length > (uint32_t)( end - p ) ) break;
+		ElfLineUnit( &st, p, p + unit_length, &str, &line_str );
+		p += unit_length;
+	}
+	free( st.files );
+
+	qsort( lines->rows, lines->count, sizeof( struct MiniElfLine ), ElfLineCompare );
+	return 0;
+}
+
+void MiniElfFreeLines( struct MiniElfLines * lines )
+{
+	free( lines->rows );
+	memset( lines, 0, sizeof( *lines ) );
+}
+
+int MiniElfLineForAddress( struct MiniElfLines * lines, uint32_t address, const char ** file, uint32_t * line )
+{
+	// Last row at or before address.
+	int lo = 0, hi = lines->count;
+	while( lo < hi )
+	{
+		int mid = ( lo + hi ) / 2;
+		if( lines->rows[mid].address <= address )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if( lo == 0 || lines->rows[lo-1].line == 0 ) return -1;
+	if( file ) *file = lines->rows[lo-1].file;
+	if( line ) *line = lines->rows[lo-1].line;
+	return 0;
+}
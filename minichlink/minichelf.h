@@ -0,0 +1,79 @@
+#ifndef _MINICHELF_H
+#define _MINICHELF_H
+
+// Just enough of a 32-bit little endian ELF reader to pull sections and
+// symbols out of firmware images.  Nothing here touches the target.
+
+#include <stdint.h>
+
+struct MiniElf
+{
+	uint8_t * data;
+	uint32_t size;
+	uint32_t shoff;
+	uint32_t shnum;
+	uint32_t shentsize;
+	uint32_t shstrndx;
+	uint32_t type;         // ET_EXEC = 2, ET_CORE = 4
+	uint32_t phoff;
+	uint32_t phnum;
+	uint32_t phentsize;
+};
+
+struct MiniElfSection
+{
+	const char * name;
+	const uint8_t * data;  // 0 for NOBITS sections.
+	uint32_t addr;
+	uint32_t size;
+	uint32_t flags;        // SHF_* bits, i.e. 2 = ALLOC
+	uint32_t type;
+};
+
+/* returns 0 if OK */
+int MiniElfLoad( struct MiniElf * elf, const char * filename );
+void MiniElfFree( struct MiniElf * elf );
+
+struct MiniElfSegment
+{
+	const uint8_t * data;
+	uint32_t type;         // PT_LOAD = 1, PT_NOTE = 4
+	uint32_t vaddr;
+	uint32_t filesz;
+	uint32_t memsz;
+	uint32_t flags;
+};
+
+/* returns 0 if OK */
+int MiniElfGetSection( struct MiniElf * elf, uint32_t index, struct MiniElfSection * sec );
+/* returns 0 if OK */
+int MiniElfGetSegment( struct MiniElf * elf, uint32_t index, struct MiniElfSegment * seg );
+/* returns 0 if found */
+int MiniElfFindSection( struct MiniElf * elf, const char * name, struct MiniElfSection * sec );
+
+/* returns 0 if found, address and size may be 0 if not wanted */
+int MiniElfFindSymbol( struct MiniElf * elf, const char * name, uint32_t * address, uint32_t * size );
+/* returns the function or object containing address, or 0.  offset may be 0 */
+const char * MiniElfSymbolForAddress( struct MiniElf * elf, uint32_t address, uint32_t * offset );
+
+// Address to source line, from the DWARF .debug_line section (versions 2-5).
+struct MiniElfLine
+{
+	uint32_t address;
+	uint32_t line;         // 0 marks the end of a sequence, nothing maps here.
+	const char * file;     // Points into the ELF, valid until MiniElfFree.
+};
+
+struct MiniElfLines
+{
+	struct MiniElfLine * rows; // Sorted by address.
+	int count;
+};
+
+/* returns 0 if OK, lines is left empty if there's no line info */
+int MiniElfLoadLines( struct MiniElf * elf, struct MiniElfLines * lines );
+void MiniElfFreeLines( struct MiniElfLines * lines );
+/* returns 0 if found */
+int MiniElfLineForAddress( struct MiniElfLines * lines, uint32_t address, const char ** file, uint32_t * line );
+
+#endif
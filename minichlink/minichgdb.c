@@ -38,6 +38,18 @@ void SendReplyFull( const char * replyMessage );
 int shadow_running_state = 1;
 int last_halt_reason = 5;
 uint32_t backup_regs[33]; //0..15 + PC, or 0..32 + PC
+
+// backup_regs is filled in lazily.  On a halt only PC and SP are read, anything
+// else when GDB asks for it, or right before a memory access could clobber it.
+// Only registers which were changed (or clobbered) get written back.
+uint64_t backup_regs_valid;
+uint64_t backup_regs_dirty;
+int backup_regs_live; // Between RVCommandPrologue and RVCommandEpilogue.
+int dcsr_single_step = -1; // What DCSR.step was last set to, -1 if unknown.
+int debug_state_lost; // A flash write may have reset the part, DCSR and the triggers need writing again.
+
+// The programmers move memory with the program buffer, using up to x8-x15.
+#define SCRATCH_REGISTERS 0xff00ULL
 int gdbasserting_break = 0;
 
 #define MAX_SOFTWARE_BREAKPOINTS 128
@@ -46,14 +58,123 @@ uint8_t  software_breakpoint_type[MAX_SOFTWARE_BREAKPOINTS]; // 0 = not in use,
 uint32_t software_breakpoint_addy[MAX_SOFTWARE_BREAKPOINTS];
 uint32_t previous_word_at_breakpoint_address[MAX_SOFTWARE_BREAKPOINTS];
 
+// Trigger module, for breakpoints that don't need flash rewritten and for watchpoints.
+#define CSR_TSELECT 0x7a0
+#define CSR_TDATA1  0x7a1
+#define CSR_TDATA2  0x7a2
+#define MCONTROL_TYPE   (2<<28)
+#define MCONTROL_DMODE  (1<<27)
+#define MCONTROL_HIT    (1<<20)
+#define MCONTROL_ACTION_DEBUG (1<<12)
+#define MCONTROL_NAPOT  (1<<7)
+#define MCONTROL_M      (1<<6)
+#define MCONTROL_U      (1<<3)
+#define MCONTROL_EXECUTE (1<<2)
+#define MCONTROL_STORE  (1<<1)
+#define MCONTROL_LOAD   (1<<0)
+
+#define MAX_HARDWARE_TRIGGERS 8
+int num_hardware_triggers = -1; // -1 until probed.
+int hardware_trigger_maskmax;    // log2 of the largest range one trigger can watch.
+uint8_t  hardware_trigger_type[MAX_HARDWARE_TRIGGERS]; // 0 = not in use, otherwise Z packet type + 1.
+uint32_t hardware_trigger_addy[MAX_HARDWARE_TRIGGERS];
+uint32_t hardware_trigger_tdata1[MAX_HARDWARE_TRIGGERS];
+uint32_t hardware_trigger_tdata2[MAX_HARDWARE_TRIGGERS];
+int halt_watch_trigger = -1; // Watchpoint that caused the last halt, if we know.
+
+#define RANGE_STEP_BATCH 64 // Steps per RVNetPoll, so a break from GDB still gets through.
+int range_step_active;
+uint32_t range_step_start, range_step_end;
+uint32_t range_step_pc;
+
 int IsGDBServerInShadowHaltState( void * dev ) { return !shadow_running_state; }
+int IsGDBServerBusy( void * dev ) { return range_step_active; }
 
 static int InternalClearFlashOfSoftwareBreakpoint( void * dev, int i );
 static int InternalWriteBreakpointIntoAddress( void * v, int i );
+static void RVProbeTriggers( void * dev );
+static void RVFindWatchHit( void * dev );
+static void RVRangeStepPoll( void * dev );
+static void RVRestoreDebugState( void * dev );
+
+
+static int RVRegisterNumber( void * dev, int i )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	return ( i == iss->nr_registers_for_debug ) ? 0x7b1 : ( 0x1000 | i );
+}
+
+// Makes sure the registers in mask are in backup_regs.
+static int RVFetchRegisters( void * dev, uint64_t mask )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int nrregs = iss->nr_registers_for_debug;
+	int count = 0;
+	int r = 0;
+	int i;
+
+	mask &= ~backup_regs_valid & ( ( 2ULL << nrregs ) - 1 );
+	if( !mask ) return 0;
+	for( i = 0; i <= nrregs; i++ )
+		if( mask & ( 1ULL << i ) ) count++;
+
+	// One by one is two DMI ops each, all of them at once is about one each.
+	if( count * 2 > nrregs + 6 && MCF.ReadAllCPURegisters )
+	{
+		uint32_t all[33];
+		MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable autoexec.
+		if( ( r = MCF.ReadAllCPURegisters( dev, all ) ) ) return r;
+		for( i = 0; i <= nrregs; i++ )
+			if( mask & ( 1ULL << i ) ) backup_regs[i] = all[i];
+	}
+	else
+	{
+		for( i = 0; i <= nrregs; i++ )
+			if( ( mask & ( 1ULL << i ) ) && ( r = MCF.ReadCPURegister( dev, RVRegisterNumber( dev, i ), &backup_regs[i] ) ) )
+				return r;
+	}
+	backup_regs_valid |= mask;
+	return 0;
+}
+
+static int RVWriteBackRegisters( void * dev )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int nrregs = iss->nr_registers_for_debug;
+	uint64_t dirty = backup_regs_dirty & backup_regs_valid & ~1ULL;
+	int r = 0;
+	int i;
+	for( i = 1; i <= nrregs; i++ )
+		if( dirty & ( 1ULL << i ) )
+			r |= MCF.WriteCPURegister( dev, RVRegisterNumber( dev, i ), backup_regs[i] );
+	backup_regs_dirty = 0;
+	return r;
+}
 
+// Called by the memory cache before anything goes to the target.  Flash writes
+// can reset the part and run a loader in RAM (LEWriteBinaryBlob on the V20x and
+// V30x does), so then every register and the PC have to be put back, and DCSR
+// and the triggers are rewritten by RVRestoreDebugState() once it's done.
+static void RVBeforeTargetAccess( void * dev, int whole_core )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	uint64_t clobbered = whole_core ? ( 2ULL << iss->nr_registers_for_debug ) - 2 : SCRATCH_REGISTERS;
+	if( whole_core ) debug_state_lost = 1;
+	if( !backup_regs_live ) return;
+	if( RVFetchRegisters( dev, clobbered ) == 0 )
+		backup_regs_dirty |= clobbered;
+}
+
+static void RVSetSingleStep( void * dev, int single_step )
+{
+	if( dcsr_single_step == single_step ) return;
+	MCF.SetEnableBreakpoints( dev, 1, single_step );
+	dcsr_single_step = single_step;
+}
 
 void RVCommandPrologue( void * dev )
 {
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
 	if( !MCF.ReadCPURegister )
 	{
 		fprintf( stderr, "Error: Programmer does not support register reading\n" );
@@ -61,17 +182,27 @@ void RVCommandPrologue( void * dev )
 	}
 
 	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 );     // Disable autoexec.
-	if( MCF.ReadAllCPURegisters( dev, backup_regs ) )
+	backup_regs[0] = 0;
+	backup_regs_valid = 1;
+	backup_regs_dirty = 0;
+	backup_regs_live = 1;
+	int r = RVFetchRegisters( dev, ( 1ULL << 2 ) | ( 1ULL << iss->nr_registers_for_debug ) ); // SP and PC
+	if( r )
 	{
 		fprintf( stderr, "WARNING: failed to preserve registers\n" );
 	}
 	MCF.VoidHighLevelState( dev );
+	MemoryCacheHalted( dev, r ? 0 : backup_regs[2] );
 }
 
 void RVCommandEpilogue( void * dev )
 {
+	// Flash writes use the program buffer too, so have them done before the registers go back.
+	MemoryCacheFlush( dev );
 	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 );   // Disable autoexec.
-	MCF.WriteAllCPURegisters( dev, backup_regs );
+	RVRestoreDebugState( dev );
+	RVWriteBackRegisters( dev );
+	backup_regs_live = 0;
 	MCF.VoidHighLevelState( dev );
 	MCF.WriteReg32( dev, DMDATA0, 0 );
 }
@@ -79,6 +210,8 @@ void RVCommandEpilogue( void * dev )
 void RVCommandResetPart( void * dev , int mode)
 {
 	MCF.HaltMode( dev, mode );
+	if( mode != HALT_MODE_HALT_BUT_NO_RESET && mode != HALT_MODE_RESUME )
+		dcsr_single_step = -1; // Reset clears DCSR.
 	RVCommandPrologue( dev );
 }
 
@@ -87,21 +220,45 @@ void RVNetConnect( void * dev )
 	// ??? Should we actually halt?
 	MCF.HaltMode( dev, 5 );
 	MCF.SetEnableBreakpoints( dev, 1, 0 );
+	dcsr_single_step = 0;
+	debug_state_lost = 0;
+	MemoryCacheSetAccessHook( RVBeforeTargetAccess );
+	MemoryCacheSetWriteBack( dev, 1 ); // GDB writes breakpoints and loads a piece at a time, flushed on resume and vFlashDone.
 	RVCommandPrologue( dev );
+	RVProbeTriggers( dev );
 	shadow_running_state = 0;
 }
 
+// Appends "nn:value;" for a register GDB will want straight away, so it need not ask.
+static char * RVExpediteRegister( void * dev, char * st, int gdbregno, int i )
+{
+	if( !backup_regs_live || !( backup_regs_valid & ( 1ULL << i ) ) ) return st;
+	uint32_t v = backup_regs[i];
+	return st + sprintf( st, "%02x:%02x%02x%02x%02x;", gdbregno, v & 0xff, ( v >> 8 ) & 0xff, ( v >> 16 ) & 0xff, v >> 24 );
+}
+
 int RVSendGDBHaltReason( void * dev )
 { 
-	char st[5];
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	char st[64];
+	char * e = st;
 	if( gdbasserting_break )
 	{
 		gdbasserting_break = 0;
-		sprintf( st, "T%02x", 2 );
-		SendReplyFull( st );
-		return 0;
+		e += sprintf( e, "T%02x", 2 );
 	}
-	sprintf( st, "T%02x", last_halt_reason );
+	else if( halt_watch_trigger >= 0 )
+	{
+		static const char * watchnames[] = { "watch", "rwatch", "awatch" };
+		int t = halt_watch_trigger;
+		e += sprintf( e, "T%02x%s:%08x;", last_halt_reason, watchnames[hardware_trigger_type[t] - 3], hardware_trigger_addy[t] );
+	}
+	else
+	{
+		e += sprintf( e, "T%02x", last_halt_reason );
+	}
+	e = RVExpediteRegister( dev, e, 32, iss->nr_registers_for_debug ); // PC
+	e = RVExpediteRegister( dev, e, 2, 2 ); // SP
 	SendReplyFull( st );
 	return 0;
 }
@@ -114,6 +271,12 @@ void RVNetPoll(void * dev )
 		return;
 	}
 
+	if( range_step_active )
+	{
+		RVRangeStepPoll( dev );
+		return;
+	}
+
 	uint32_t status;
 	if( MCF.ReadReg32( dev, DMSTATUS, &status ) )
 	{
@@ -133,8 +296,12 @@ void RVNetPoll(void * dev )
 		// If was running but now is halted.
 		if( statusrunning == 0 )
 		{
+			// Semihosting calls are answered and the core let go, GDB never hears of them.
+			if( SemihostHalted( dev ) )
+				return;
 			RVCommandPrologue( dev );
 			last_halt_reason = 5;//((dscr>>6)&3)+5;
+			RVFindWatchHit( dev );
 			RVSendGDBHaltReason( dev );
 		}
 		else
@@ -152,7 +319,7 @@ int RVGetNumRegisters( void * dev )
 	return iss->nr_registers_for_debug;
 }
 
-int RVReadCPURegister( void * dev, int regno, uint32_t * regret )
+static int RVRegisterIndex( void * dev, int regno )
 {
 	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
 	int nrregs = iss->nr_registers_for_debug;
@@ -167,57 +334,63 @@ int RVReadCPURegister( void * dev, int regno, uint32_t * regret )
 	if( nrregs == 16 )
 	{
 		if( regno == 32 ) regno = 16; // Hack - Make 32 also 16 for old GDBs.
-		if( regno > 16 ) return 0; // Invalid register.
+		if( regno > 16 ) return -1; // Invalid register.
 	}
 	else
 	{
-		if( regno > nrregs ) return 0;
+		if( regno > nrregs ) return -1;
 	}
-
-	*regret = backup_regs[regno];
-	return 0;
+	return regno;
 }
 
-
-int RVWriteCPURegister( void * dev, int regno, uint32_t value )
+int RVReadCPURegister( void * dev, int regno, uint32_t * regret )
 {
-	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
-	int nrregs = iss->nr_registers_for_debug;
+	int i = RVRegisterIndex( dev, regno );
+	if( i < 0 ) return 0;
 
-	if( shadow_running_state )
+	int r = RVFetchRegisters( dev, 1ULL << i );
+	if( r )
 	{
-		MCF.HaltMode( dev, 5 );
-		RVCommandPrologue( dev );
-		shadow_running_state = 0;
+		fprintf( stderr, "Error: Could not read register %d (%d)\n", regno, r );
+		return r;
 	}
+	*regret = backup_regs[i];
+	return 0;
+}
 
-	if( nrregs == 16 )
-	{
-		if( regno == 32 ) regno = 16; // Hack - Make 32 also 16 for old GDBs.
-		if( regno > 16 ) return 0; // Invalid register.
-	}
-	else
+int RVReadAllCPURegisters( void * dev, uint32_t * regret )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	RVRegisterIndex( dev, 0 ); // Halts if it needs to.
+	int r = RVFetchRegisters( dev, ~0ULL );
+	if( r )
 	{
-		if( regno > nrregs ) return 0;
+		fprintf( stderr, "Error: Could not read registers (%d)\n", r );
+		return r;
 	}
+	memcpy( regret, backup_regs, ( iss->nr_registers_for_debug + 1 ) * sizeof( uint32_t ) );
+	return 0;
+}
 
-	backup_regs[regno] = value;
+int RVWriteCPURegister( void * dev, int regno, uint32_t value )
+{
+	int i = RVRegisterIndex( dev, regno );
+	if( i <= 0 ) return 0;
 
-	if( !MCF.WriteAllCPURegisters )
+	if( !MCF.WriteCPURegister )
 	{
-		fprintf( stderr, "ERROR: MCF.WriteAllCPURegisters is not implemented on this platform\n" );
+		fprintf( stderr, "ERROR: MCF.WriteCPURegister is not implemented on this platform\n" );
 		return -99;
 	}
 
-	int r;
-	if( ( r = MCF.WriteAllCPURegisters( dev, backup_regs ) ) )
-	{
-		fprintf( stderr, "Error: WriteAllCPURegisters failed (%d)\n", r );
-		return r;
-	}
+	// Goes to the target when the core next runs.
+	backup_regs[i] = value;
+	backup_regs_valid |= 1ULL << i;
+	backup_regs_dirty |= 1ULL << i;
 	return 0;
 }
 
+
 int RVDebugExec( void * dev, enum HaltResetResumeType halt_reset_or_resume, int resume_from_other_address, uint32_t address )
 {
 	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
@@ -228,15 +401,17 @@ int RVDebugExec( void * dev, enum HaltResetResumeType halt_reset_or_resume, int
 		fprintf( stderr, "Error: Can't alter halt mode with this programmer.\n" );
 		exit( -6 );
 	}
-	
+
+	halt_watch_trigger = -1;
+
 	if( halt_reset_or_resume == HALT_TYPE_SINGLE_STEP )
 	{
-		MCF.SetEnableBreakpoints( dev, 1, 1 );
+		// DCSR.step is left set, so stepping again costs nothing.  Continuing clears it.
+		RVSetSingleStep( dev, 1 );
 		RVCommandEpilogue( dev );
 		MCF.HaltMode( dev, HALT_MODE_RESUME );
 		MCF.HaltMode( dev, HALT_MODE_HALT_BUT_NO_RESET );
 		RVCommandPrologue( dev );
-		MCF.SetEnableBreakpoints( dev, 1, 0 );
 		//printf( "STEP PC: %08x\n", backup_regs[iss->nr_registers_for_debug] );
 		return 0;
 	}
@@ -263,35 +438,27 @@ int RVDebugExec( void * dev, enum HaltResetResumeType halt_reset_or_resume, int
 		{
 			// This is a known breakpoint.  Need to set it back.  Single Step.  Then continue.
 			InternalClearFlashOfSoftwareBreakpoint( dev, matchingbreakpoint );
-			MCF.SetEnableBreakpoints( dev, 1, 1 );
+			RVSetSingleStep( dev, 1 );
 			InternalWriteBreakpointIntoAddress( dev, matchingbreakpoint );
 		}
 		else
 		{
 			// Unknown breakpoint (was originally in the firmware)
 			// Just proceed past it.
-			if( exceptionptr & 2 )
-			{
-				uint32_t part1, part2;
-				MCF.ReadWord( dev, exceptionptr & ~3, &part1 );
-				MCF.ReadWord( dev, (exceptionptr & ~3)+4, &part2 );
-				instruction = (part1 >> 16) | (part2 << 16);
-			}
-			else
-			{
-				MCF.ReadWord( dev, exceptionptr, &instruction );
-			}
+			// Through the cache, this is almost always in flash it already has.
+			uint8_t ib[4];
+			if( MCF.ReadBinaryBlob( dev, exceptionptr, 4, ib ) == 0 )
+				instruction = ib[0] | ( ib[1] << 8 ) | ( ib[2] << 16 ) | ( (uint32_t)ib[3] << 24 );
 			if( instruction == 0x00100073 )
 				backup_regs[nrregs]+=4;
 			else if( ( instruction & 0xffff ) == 0x9002 )
 				backup_regs[nrregs]+=2;
 			else
 				; //No change, it is a normal instruction.
+			if( backup_regs[nrregs] != exceptionptr )
+				backup_regs_dirty |= 1ULL << nrregs;
 
-			if( halt_reset_or_resume == HALT_TYPE_CONTINUE_WITH_SIGNAL )
-			{
-				MCF.SetEnableBreakpoints( dev, 1, 1 );
-			}
+			RVSetSingleStep( dev, halt_reset_or_resume == HALT_TYPE_CONTINUE_WITH_SIGNAL );
 		}
 
 		halt_reset_or_resume = HALT_MODE_RESUME;
@@ -315,6 +482,75 @@ int RVDebugExec( void * dev, enum HaltResetResumeType halt_reset_or_resume, int
 	return 0;
 }
 
+// Leaves DCSR.step set and resumes, RVRangeStepPoll takes it from there.
+int RVRangeStep( void * dev, uint32_t start, uint32_t end )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	if( shadow_running_state || !MCF.HaltMode || !MCF.ReadReg32 )
+		return -1;
+
+	halt_watch_trigger = -1;
+	range_step_start = start;
+	range_step_end = end;
+	range_step_pc = backup_regs[iss->nr_registers_for_debug];
+	RVSetSingleStep( dev, 1 );
+	RVCommandEpilogue( dev );
+	MCF.HaltMode( dev, HALT_MODE_RESUME ); // The first step the normal way, which flushes and tells the cache.
+	range_step_active = 1;
+	return 0;
+}
+
+static int RVIsBreakpointAddress( uint32_t pc )
+{
+	int i;
+	for( i = 0; i < MAX_SOFTWARE_BREAKPOINTS; i++ )
+		if( software_breakpoint_type[i] && software_breakpoint_addy[i] == pc )
+			return 1;
+	for( i = 0; i < num_hardware_triggers; i++ )
+		if( hardware_trigger_type[i] && hardware_trigger_type[i] <= 2 && hardware_trigger_addy[i] == pc )
+			return 1;
+	return 0;
+}
+
+// Each step is just a resume request, a DMSTATUS check and reading DPC.  The registers
+// stay on the target until we stop.  Stops when PC leaves the range, lands on a
+// breakpoint, or doesn't move (an ebreak, a watchpoint firing, or a jump to itself).
+static void RVRangeStepPoll( void * dev )
+{
+	int n;
+	for( n = 0; n < RANGE_STEP_BATCH; n++ )
+	{
+		uint32_t status = 0;
+		uint32_t pc = 0;
+		int tries;
+		if( gdbasserting_break ) break;
+		for( tries = 0; tries < 100; tries++ )
+		{
+			if( MCF.ReadReg32( dev, DMSTATUS, &status ) == 0 && ( status & (1<<9) ) )
+				break;
+		}
+		if( !( status & (1<<9) ) )
+		{
+			fprintf( stderr, "Error: Core did not halt while range stepping\n" );
+			break;
+		}
+		if( MCF.ReadCPURegister( dev, 0x7b1, &pc ) )
+			break;
+		if( pc < range_step_start || pc >= range_step_end || pc == range_step_pc || RVIsBreakpointAddress( pc ) )
+			break;
+		range_step_pc = pc;
+		MCF.WriteReg32( dev, DMCONTROL, 0x40000001 ); // resumereq, DCSR.step brings it straight back.
+	}
+	if( n == RANGE_STEP_BATCH ) return; // Still going, the next one picks up from here.
+
+	range_step_active = 0;
+	MCF.HaltMode( dev, HALT_MODE_HALT_BUT_NO_RESET );
+	RVCommandPrologue( dev );
+	last_halt_reason = 5;
+	RVFindWatchHit( dev );
+	RVSendGDBHaltReason( dev );
+}
+
 int RVReadMem( void * dev, uint32_t memaddy, uint8_t * payload, int len )
 {
 	if( !MCF.ReadBinaryBlob )
@@ -337,6 +573,150 @@ int RVReadMem( void * dev, uint32_t memaddy, uint8_t * payload, int len )
 	return ret;
 }
 
+// GDB's compare-sections wants CRC-32/MPEG-2 (MSB first, no final xor) of the target's memory.
+#define GDB_CRC_POLY 0x04c11db7
+#define CRC_ON_TARGET_MIN 1024 // Below this, reading it back is quicker than running code.
+
+// crc = CRC of [a0, a1) continuing from a2, with the polynomial in a3.  Bitwise, so it
+// needs no table in RAM, and only x5-x7/x10-x13 so it runs on RV32EC parts too.
+static const uint32_t crc_routine[] = {
+	0x00054283, // 1: lbu  t0, 0(a0)
+	0x00150513, //    addi a0, a0, 1
+	0x01829293, //    slli t0, t0, 24
+	0x00564633, //    xor  a2, a2, t0
+	0x00800313, //    li   t1, 8
+	0x41f65393, // 2: srai t2, a2, 31
+	0x00d3f3b3, //    and  t2, t2, a3
+	0x00161613, //    slli a2, a2, 1
+	0x00764633, //    xor  a2, a2, t2
+	0xfff30313, //    addi t1, t1, -1
+	0xfe0316e3, //    bnez t1, 2b
+	0xfcb51ae3, //    bne  a0, a1, 1b
+	0x00100073, //    ebreak
+};
+
+static uint32_t HostCRC( uint32_t crc, const uint8_t * data, int len )
+{
+	static uint32_t table[256];
+	int i, b;
+	if( !table[1] )
+	{
+		for( i = 0; i < 256; i++ )
+		{
+			uint32_t c = i << 24;
+			for( b = 0; b < 8; b++ )
+				c = ( c << 1 ) ^ ( ( c & 0x80000000 ) ? GDB_CRC_POLY : 0 );
+			table[i] = c;
+		}
+	}
+	for( i = 0; i < len; i++ )
+		crc = ( crc << 8 ) ^ table[( ( crc >> 24 ) ^ data[i] ) & 0xff];
+	return crc;
+}
+
+// Runs a routine ending in ebreak from the start of RAM with interrupts off, a0-a3 in and
+// out of regs.  What was in RAM and all the registers are put back afterwards.
+static int RVRunRAMRoutine( void * dev, const uint32_t * code, int words, uint32_t * regs, int timeout_ms )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	uint32_t base = iss->ram_base;
+	uint8_t saved[64];
+	uint8_t image[64];
+	uint32_t mstatus, status = 0;
+	uint64_t clobbered = 0x3ce0ULL | ( 1ULL << iss->nr_registers_for_debug ); // t0-t2, a0-a3 and PC
+	int len = words * 4;
+	int r, i;
+
+	if( !MCF.ReadCPURegister || !MCF.WriteCPURegister || !MCF.ReadReg32 || len > (int)sizeof( image ) )
+		return -99;
+
+	for( i = 0; i < len; i++ )
+		image[i] = code[i/4] >> ( ( i & 3 ) * 8 );
+
+	// Nothing may use the program buffer once a0-a3 are set up, and resuming would flush.
+	if( MemoryCacheFlush( dev ) ) return -1;
+	if( RVFetchRegisters( dev, clobbered ) ) return -1;
+	if( MCF.ReadBinaryBlob( dev, base, len, saved ) ) return -1;
+	if( ( r = MCF.WriteBinaryBlob( dev, base, len, image ) ) ) goto restore;
+	if( ( r = MCF.ReadCPURegister( dev, 0x300, &mstatus ) ) ) goto restore;
+
+	// Anything pending would be taken as soon as we resume.
+	r |= MCF.WriteCPURegister( dev, 0x300, mstatus & ~8 ); // mstatus.MIE
+	for( i = 0; i < 4; i++ )
+		r |= MCF.WriteCPURegister( dev, 0x100a + i, regs[i] );
+	r |= MCF.WriteCPURegister( dev, 0x7b1, base ); // DPC
+	RVSetSingleStep( dev, 0 );
+	if( r ) goto restore_mstatus;
+
+	MCF.HaltMode( dev, HALT_MODE_RESUME );
+	for( i = 0; i < timeout_ms; i++ )
+	{
+		if( MCF.ReadReg32( dev, DMSTATUS, &status ) == 0 && ( status & (1<<9) ) )
+			break;
+		MCF.DelayUS( dev, 1000 );
+	}
+	MCF.HaltMode( dev, HALT_MODE_HALT_BUT_NO_RESET );
+	if( !( status & (1<<9) ) )
+	{
+		fprintf( stderr, "Error: Routine in RAM did not finish\n" );
+		r = -5;
+		goto restore_mstatus;
+	}
+
+	for( i = 0; i < 4; i++ )
+		r |= MCF.ReadCPURegister( dev, 0x100a + i, &regs[i] );
+
+restore_mstatus:
+	MCF.WriteCPURegister( dev, 0x300, mstatus );
+restore:
+	MCF.WriteBinaryBlob( dev, base, len, saved );
+	backup_regs_dirty |= clobbered;
+	RVWriteBackRegisters( dev );
+	MCF.VoidHighLevelState( dev );
+	return r;
+}
+
+int RVMemoryCRC( void * dev, uint32_t memaddy, uint32_t len, uint32_t * crc )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+
+	if( shadow_running_state )
+	{
+		MCF.HaltMode( dev, HALT_MODE_HALT_BUT_NO_RESET );
+		RVCommandPrologue( dev );
+		shadow_running_state = 0;
+	}
+
+	*crc = 0xffffffff;
+	if( len == 0 ) return 0;
+
+	// Crunch it on the target, so only the result crosses the link.  Not if the range covers
+	// where the routine goes, and it can always fall back to reading the memory.
+	uint32_t scratch_end = iss->ram_base + sizeof( crc_routine );
+	if( len >= CRC_ON_TARGET_MIN &&
+		( memaddy >= scratch_end || memaddy + len <= iss->ram_base ) && memaddy + len > memaddy )
+	{
+		uint32_t regs[4] = { memaddy, memaddy + len, 0xffffffff, GDB_CRC_POLY };
+		if( RVRunRAMRoutine( dev, crc_routine, sizeof( crc_routine ) / 4, regs, 100 + len / 128 ) == 0 && regs[0] == memaddy + len )
+		{
+			*crc = regs[2];
+			return 0;
+		}
+		fprintf( stderr, "Warning: CRC on target failed, reading memory instead\n" );
+	}
+
+	uint8_t buf[4096];
+	while( len )
+	{
+		int chunk = ( len > sizeof( buf ) ) ? sizeof( buf ) : len;
+		if( RVReadMem( dev, memaddy, buf, chunk ) < 0 ) return -1;
+		*crc = HostCRC( *crc, buf, chunk );
+		memaddy += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
 static int InternalClearFlashOfSoftwareBreakpoint( void * dev, int i )
 {
 	int r;
@@ -383,7 +763,7 @@ static int InternalDisableBreakpoint( void * dev, int i )
 	return r;
 }
 
-int RVHandleBreakpoint( void * dev, int set, uint32_t address )
+static int RVHandleSoftwareBreakpoint( void * dev, int set, uint32_t address )
 {
 	int i;
 	int first_free = -1;
@@ -445,6 +825,244 @@ int RVHandleBreakpoint( void * dev, int set, uint32_t address )
 	return 0;
 }
 
+// Abstract command access to a CSR which may not exist.  Unlike ReadCPURegister,
+// this checks (and clears) cmderr, so a missing CSR is an error and not garbage.
+static int RVTriggerCSR( void * dev, int write, uint32_t csr, uint32_t * value )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	uint32_t abstractcs;
+	iss->statetag = STTAG( "TRIG" );
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 );
+	if( write ) MCF.WriteReg32( dev, DMDATA0, *value );
+	MCF.WriteReg32( dev, DMCOMMAND, ( write ? 0x00230000 : 0x00220000 ) | csr );
+	if( MCF.ReadReg32( dev, DMABSTRACTCS, &abstractcs ) ) return -1;
+	if( abstractcs & 0x700 )
+	{
+		MCF.WriteReg32( dev, DMABSTRACTCS, 0x700 ); // Clear cmderr
+		return -2;
+	}
+	if( !write && MCF.ReadReg32( dev, DMDATA0, value ) ) return -1;
+	return 0;
+}
+
+static int RVSelectTrigger( void * dev, int t )
+{
+	uint32_t tselect = t;
+	if( RVTriggerCSR( dev, 1, CSR_TSELECT, &tselect ) ) return -1;
+	if( RVTriggerCSR( dev, 0, CSR_TSELECT, &tselect ) || tselect != t ) return -1;
+	return 0;
+}
+
+// Counts the address match triggers, and clears any left over from an earlier session.
+static void RVProbeTriggers( void * dev )
+{
+	int t;
+	num_hardware_triggers = 0;
+	if( !MCF.WriteReg32 || !MCF.ReadReg32 ) return;
+	for( t = 0; t < MAX_HARDWARE_TRIGGERS; t++ )
+	{
+		uint32_t tdata1;
+		if( RVSelectTrigger( dev, t ) ) break;
+		if( RVTriggerCSR( dev, 0, CSR_TDATA1, &tdata1 ) ) break;
+		if( ( tdata1 & 0xf0000000 ) != MCONTROL_TYPE ) break;
+		if( t == 0 ) hardware_trigger_maskmax = ( tdata1 >> 21 ) & 0x3f;
+		tdata1 = MCONTROL_TYPE | MCONTROL_DMODE;
+		RVTriggerCSR( dev, 1, CSR_TDATA1, &tdata1 );
+		hardware_trigger_type[t] = 0;
+	}
+	num_hardware_triggers = t;
+	MCF.VoidHighLevelState( dev );
+	fprintf( stderr, "Target has %d hardware breakpoint/watchpoint triggers\n", t );
+}
+
+static int RVWriteTrigger( void * dev, int t, uint32_t tdata1, uint32_t tdata2 )
+{
+	uint32_t off = MCONTROL_TYPE | MCONTROL_DMODE;
+	uint32_t readback;
+	int r = RVSelectTrigger( dev, t );
+	// Disable first, so there is never a half written trigger armed.
+	if( !r ) r = RVTriggerCSR( dev, 1, CSR_TDATA1, &off );
+	if( !r && tdata1 )
+	{
+		r = RVTriggerCSR( dev, 1, CSR_TDATA2, &tdata2 );
+		if( !r ) r = RVTriggerCSR( dev, 1, CSR_TDATA1, &tdata1 );
+		// The bits are WARL, make sure the kind of match we asked for stuck.  U may not exist.
+		uint32_t important = ~( MCONTROL_U | MCONTROL_HIT | 0x07e00000 );
+		if( !r ) r = RVTriggerCSR( dev, 0, CSR_TDATA1, &readback );
+		if( !r && ( readback & important ) != ( tdata1 & important ) )
+		{
+			RVTriggerCSR( dev, 1, CSR_TDATA1, &off );
+			r = -3;
+		}
+	}
+	MCF.VoidHighLevelState( dev );
+	return r;
+}
+
+static int RVFreeTrigger( void * dev, int t )
+{
+	hardware_trigger_type[t] = 0;
+	return RVWriteTrigger( dev, t, 0, 0 );
+}
+
+static int RVFindTrigger( int type, uint32_t address )
+{
+	int t;
+	for( t = 0; t < num_hardware_triggers; t++ )
+	{
+		if( !hardware_trigger_type[t] || hardware_trigger_addy[t] != address ) continue;
+		// Z0 and Z1 both end up as execute triggers, so they are interchangeable.
+		if( type < 2 ? ( hardware_trigger_type[t] <= 2 ) : ( hardware_trigger_type[t] == type + 1 ) )
+			return t;
+	}
+	return -1;
+}
+
+static int RVAllocTrigger( void * dev, int type, uint32_t address, uint32_t kind )
+{
+	int t;
+	for( t = 0; t < num_hardware_triggers; t++ )
+		if( !hardware_trigger_type[t] ) break;
+	if( t == num_hardware_triggers ) return -1;
+
+	uint32_t tdata1 = MCONTROL_TYPE | MCONTROL_DMODE | MCONTROL_ACTION_DEBUG | MCONTROL_M | MCONTROL_U;
+	uint32_t tdata2 = address;
+	switch( type )
+	{
+	case 0: case 1: tdata1 |= MCONTROL_EXECUTE; break;
+	case 2: tdata1 |= MCONTROL_STORE; break;
+	case 3: tdata1 |= MCONTROL_LOAD; break;
+	default: tdata1 |= MCONTROL_LOAD | MCONTROL_STORE; break;
+	}
+	if( type >= 2 && kind > 1 && ( kind & ( kind - 1 ) ) == 0 && ( address & ( kind - 1 ) ) == 0 &&
+		hardware_trigger_maskmax && kind <= ( 1u << hardware_trigger_maskmax ) )
+	{
+		// Naturally aligned power of two, the trigger can cover all of it.
+		tdata1 |= MCONTROL_NAPOT;
+		tdata2 |= ( kind >> 1 ) - 1;
+	}
+	if( RVWriteTrigger( dev, t, tdata1, tdata2 ) ) return -1;
+	hardware_trigger_type[t] = type + 1;
+	hardware_trigger_addy[t] = address;
+	hardware_trigger_tdata1[t] = tdata1;
+	hardware_trigger_tdata2[t] = tdata2;
+	return t;
+}
+
+// After a flash write that may have reset the part, DCSR (ebreakm, step) and the
+// triggers are back to their reset values, while we still think they're set.
+static void RVRestoreDebugState( void * dev )
+{
+	int step = dcsr_single_step;
+	int t;
+	if( !debug_state_lost ) return;
+	debug_state_lost = 0;
+	dcsr_single_step = -1;
+	RVSetSingleStep( dev, ( step < 0 ) ? 0 : step );
+	for( t = 0; t < num_hardware_triggers; t++ )
+	{
+		if( hardware_trigger_type[t] && RVWriteTrigger( dev, t, hardware_trigger_tdata1[t], hardware_trigger_tdata2[t] ) )
+			fprintf( stderr, "Warning: Could not re-arm hardware trigger %d at 0x%08x after writing flash\n", t, hardware_trigger_addy[t] );
+	}
+}
+
+// Watchpoints can only be done in hardware, so they may take a trigger over from
+// a breakpoint, which then goes into flash instead.
+static int RVStealTriggerFromBreakpoint( void * dev )
+{
+	int t;
+	for( t = 0; t < num_hardware_triggers; t++ )
+	{
+		if( hardware_trigger_type[t] == 1 || hardware_trigger_type[t] == 2 )
+		{
+			uint32_t address = hardware_trigger_addy[t];
+			RVFreeTrigger( dev, t );
+			if( RVHandleSoftwareBreakpoint( dev, 1, address ) ) return -1;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Works out which watchpoint, if any, the core just stopped on.
+static void RVFindWatchHit( void * dev )
+{
+	int t;
+	int nwatch = 0;
+	int lastwatch = -1;
+	halt_watch_trigger = -1;
+	for( t = 0; t < num_hardware_triggers; t++ )
+	{
+		if( hardware_trigger_type[t] > 2 )
+		{
+			nwatch++;
+			lastwatch = t;
+		}
+	}
+	if( !nwatch ) return;
+
+	uint32_t dcsr = 0;
+	if( MCF.ReadCPURegister( dev, 0x7b0, &dcsr ) || ( ( dcsr >> 6 ) & 7 ) != 2 ) return; // Not a trigger.
+
+	for( t = 0; t < num_hardware_triggers; t++ )
+	{
+		uint32_t tdata1;
+		if( hardware_trigger_type[t] <= 2 ) continue;
+		if( RVSelectTrigger( dev, t ) || RVTriggerCSR( dev, 0, CSR_TDATA1, &tdata1 ) ) continue;
+		if( tdata1 & MCONTROL_HIT )
+		{
+			tdata1 = hardware_trigger_tdata1[t];
+			RVTriggerCSR( dev, 1, CSR_TDATA1, &tdata1 );
+			halt_watch_trigger = t;
+			break;
+		}
+	}
+	MCF.VoidHighLevelState( dev );
+
+	// The hit bit is optional, but with a single watchpoint there is no question.
+	if( halt_watch_trigger < 0 && nwatch == 1 )
+		halt_watch_trigger = lastwatch;
+}
+
+int RVHandleBreakpoint( void * dev, int type, int set, uint32_t address, uint32_t kind )
+{
+	if( num_hardware_triggers < 0 )
+		RVProbeTriggers( dev );
+
+	int t = RVFindTrigger( type, address );
+
+	if( type >= 2 )
+	{
+		if( type > 4 ) return 1;
+		if( !set )
+		{
+			if( t >= 0 ) RVFreeTrigger( dev, t );
+			return 0;
+		}
+		if( t >= 0 ) return 0;
+		if( num_hardware_triggers == 0 ) return 1; // Let GDB fall back to single stepping.
+		if( RVAllocTrigger( dev, type, address, kind ) >= 0 ) return 0;
+		if( RVStealTriggerFromBreakpoint( dev ) ) return -1;
+		return ( RVAllocTrigger( dev, type, address, kind ) >= 0 ) ? 0 : -1;
+	}
+
+	if( !set )
+	{
+		if( t >= 0 ) RVFreeTrigger( dev, t );
+		return RVHandleSoftwareBreakpoint( dev, 0, address );
+	}
+	if( t >= 0 ) return 0;
+	for( t = 0; t < MAX_SOFTWARE_BREAKPOINTS; t++ )
+		if( software_breakpoint_type[t] && software_breakpoint_addy[t] == address ) return 0;
+
+	// Prefer a trigger in flash, where a software breakpoint costs a sector erase and
+	// program to set and again to clear.  In RAM, ebreak is cheaper than using up a trigger.
+	int in_flash = IsAddressFlash( address ) || address < 0x01000000;
+	if( ( type == 1 || in_flash ) && RVAllocTrigger( dev, type, address, kind ) >= 0 )
+		return 0;
+	return RVHandleSoftwareBreakpoint( dev, 1, address );
+}
+
 int RVWriteRAM(void * dev, uint32_t memaddy, uint32_t length, uint8_t * payload )
 {
 	if( !MCF.WriteBinaryBlob )
@@ -467,6 +1085,11 @@ int RVWriteFlash(void * dev, uint32_t memaddy, uint32_t length, uint8_t * payloa
 	return RVWriteRAM( dev, memaddy, length, payload );
 }
 
+int RVFlashDone( void * dev )
+{
+	return MemoryCacheFlush( dev );
+}
+
 int RVErase( void * dev, uint32_t memaddy, uint32_t length )
 {
 	if( !MCF.Erase )
@@ -481,8 +1104,11 @@ int RVErase( void * dev, uint32_t memaddy, uint32_t length )
 
 void RVHandleDisconnect( void * dev )
 {
+	MemoryCacheSetWriteBack( dev, 0 ); // Back to writing through, programs anything still held back.
 	MCF.HaltMode( dev, 5 );
 	MCF.SetEnableBreakpoints( dev, 0, 0 );
+	dcsr_single_step = -1;
+	range_step_active = 0;
 
 	int i;
 	for( i = 0; i < MAX_SOFTWARE_BREAKPOINTS; i++ )
@@ -492,6 +1118,14 @@ void RVHandleDisconnect( void * dev )
 			InternalDisableBreakpoint( dev, i );
 		}
 	}
+	for( i = 0; i < num_hardware_triggers; i++ )
+	{
+		if( hardware_trigger_type[i] )
+		{
+			RVFreeTrigger( dev, i );
+		}
+	}
+	halt_watch_trigger = -1;
 
 	if( shadow_running_state == 0 )
 	{
@@ -523,6 +1157,11 @@ void ExitGDBServer( void * dev )
 	MicroGDBExitServer( dev );
 }
 
+int GetGDBServerPollFD( void * dev )
+{
+	return MicroGDBPollFD();
+}
+
 
 int SetupGDBServer( void * dev )
 {
@@ -13,7 +13,6 @@
 #include "ch32fun.h"
 
 #if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
-extern int isatty(int);
 #if !defined(_SYNCHAPI_H_) && !defined(__TINYC__)
 void Sleep(uint32_t dwMilliseconds);
 #endif
@@ -26,7 +25,6 @@ void Sleep(uint32_t dwMilliseconds);
 static int64_t StringToMemoryAddress( const char * number ) __attribute__((used));
 static void StaticUpdatePROGBUFRegs( void * dev ) __attribute__((used));
 int DefaultReadBinaryBlob( void * dev, uint32_t address_to_read_from, uint32_t read_size, uint8_t * blob );
-void PostSetupConfigureInterface( void * dev );
 void TestFunction(void * v );
 struct MiniChlinkFunctions MCF;
 
@@ -35,6 +33,8 @@ void * MiniCHLinkInitAsDLL( struct MiniChlinkFunctions ** MCFO, const init_hints
 	void * dev = 0;
 	
 	const char * specpgm = init_hints->specific_programmer;
+	if( init_hints->usb_serial || init_hints->usb_path )
+		ProgrammerSelect( init_hints->usb_serial, init_hints->usb_path );
 	if( specpgm )
 	{
 		if( strcmp( specpgm, "linke" ) == 0 )
@@ -50,19 +50,23 @@ void * MiniCHLinkInitAsDLL( struct MiniChlinkFunctions ** MCFO, const init_hints
 	}
 	else
 	{
-		if( (dev = TryInit_WCHLinkE()) )
+		// One look at the bus, then only the backend for what's there is tried.
+		uint32_t b003_id = SimpleReadNumberInt( init_hints->serial_port, 0x1209b003 );
+		ProgrammerScan( b003_id );
+		if( ( ProgrammerFind( PROGRAMMER_LINKE ) || ProgrammerFind( PROGRAMMER_LINKE_ARM ) || ProgrammerFind( PROGRAMMER_LINKE_IAP ) ) &&
+			(dev = TryInit_WCHLinkE()) )
 		{
 			fprintf( stderr, "Found WCH Link\n" );
 		}
-		else if( (dev = TryInit_ESP32S2CHFUN()) )
+		else if( ProgrammerFind( PROGRAMMER_ESP32S2 ) && (dev = TryInit_ESP32S2CHFUN()) )
 		{
 			fprintf( stderr, "Found ESP32S2-Style Programmer\n" );
 		}
-		else if ((dev = TryInit_NHCLink042()))
+		else if( ProgrammerFind( PROGRAMMER_NHCLINK ) && (dev = TryInit_NHCLink042()) )
 		{
 			fprintf( stderr, "Found NHC-Link042 Programmer\n" );
 		}
-		else if ((dev = TryInit_B003Fun(SimpleReadNumberInt(init_hints->serial_port, 0x1209b003))))
+		else if( ( ProgrammerFind( PROGRAMMER_B003FUN ) || ProgrammerFind( PROGRAMMER_RV003USB ) ) && (dev = TryInit_B003Fun( b003_id )) )
 		{
 			fprintf( stderr, "Found B003Fun Bootloader\n" );
 		}
@@ -90,6 +94,7 @@ void * MiniCHLinkInitAsDLL( struct MiniChlinkFunctions ** MCFO, const init_hints
 	iss->ram_size = 2048;
 	iss->sector_size = 64;
 	iss->target_chip_type = 0;
+	iss->terminal_input_max = 7;
 
 	SetupAutomaticHighLevelFunctions( dev );
 
@@ -100,6 +105,17 @@ void * MiniCHLinkInitAsDLL( struct MiniChlinkFunctions ** MCFO, const init_hints
 	return dev;
 }
 
+void MiniCHLinkClose( void * dev )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	MemoryCacheUninstall();
+	free( iss );
+	if( MCF.Close )
+		MCF.Close( dev );
+	// The next programmer may be a different kind, nothing of this one's can be left behind.
+	memset( &MCF, 0, sizeof( MCF ) );
+}
+
 #if !defined( MINICHLINK_AS_LIBRARY ) && !defined( MINICHLINK_IMPORT )
 int main( int argc, char ** argv )
 {
@@ -109,8 +125,19 @@ int main( int argc, char ** argv )
 	{
 		goto help;
 	}
+	if( argc > 1 && strcmp( argv[1], "--trace-dump" ) == 0 )
+	{
+		// Offline, no programmer needed.
+		if( argc < 3 )
+		{
+			fprintf( stderr, "Error: --trace-dump needs a trace file, and optionally the firmware's ELF file\n" );
+			goto help;
+		}
+		return TraceDump( argv[2], ( argc > 3 ) ? argv[3] : 0 ) ? -9 : 0;
+	}
 	init_hints_t hints;
 	memset(&hints, 0, sizeof(hints));
+	int station = 0;
 
 	// Scan for possible hints.
 	for( i = 0; i < argc; i++ )
@@ -134,6 +161,20 @@ int main( int argc, char ** argv )
 			if( i < argc )
 				hints.specific_programmer = argv[i];
 		}
+		else if( strcmp( v, "--serial" ) == 0 && i + 1 < argc )
+			hints.usb_serial = argv[++i];
+		else if( strcmp( v, "--usb-path" ) == 0 && i + 1 < argc )
+			hints.usb_path = argv[++i];
+		else if( strcmp( v, "--slot" ) == 0 && i + 2 < argc )
+		{
+			if( ProgrammerResolveSlot( argv[i+1], argv[i+2], &hints.usb_serial, &hints.usb_path ) )
+				return -9;
+			i += 2;
+		}
+		else if( strcmp( v, "--list-programmers" ) == 0 )
+			return ProgrammerList() ? 0 : -32;
+		else if( strcmp( v, "--station" ) == 0 )
+			station = 1;
 	}
 
 #if !defined(WINDOWS) && !defined(WIN32) && !defined(_WIN32) && !defined(__APPLE__)
@@ -160,7 +201,8 @@ int main( int argc, char ** argv )
 	}
 #endif
 
-	void * dev = MiniCHLinkInitAsDLL( 0, &hints );
+	// A station waits for its programmer to be plugged in, and sets up each board as it comes.
+	void * dev = station ? StationConnect( &hints ) : MiniCHLinkInitAsDLL( 0, &hints );
 	if( !dev )
 	{
 		// fprintf( stderr, "Error: Could not initialize any supported programmers\n" );
@@ -178,7 +220,8 @@ int main( int argc, char ** argv )
 		(argc > 1 && argv[1][0] == '-' && argv[1][1] == 'h' ) |
 		(argc > 1 && argv[1][0] == '-' && argv[1][1] == 't' ) |
 		(argc > 1 && argv[1][0] == '-' && argv[1][1] == 'f' ) |
-		(argc > 1 && argv[1][0] == '-' && argv[1][1] == 'X' );
+		(argc > 1 && argv[1][0] == '-' && argv[1][1] == 'X' ) |
+		station;
 
 	if( !skip_startup && MCF.SetupInterface )
 	{
@@ -191,9 +234,12 @@ int main( int argc, char ** argv )
 	}
 
 	PostSetupConfigureInterface( dev );
+	MemoryCacheInstall( dev );
 
 	int iarg = 1;
 	const char * lastcommand = 0;
+	uint64_t capture_limit = 0;
+	int call_timeout_ms = 1000;
 	for( ; iarg < argc; iarg++ )
 	{
 		char * argchar = argv[iarg];
@@ -360,230 +406,279 @@ keep_going:
 				MCF.SetSplit(dev, split);
 				break;
 			}
-			case 'G':
-			case 'T':
+			case '-':
 			{
-				if( !MCF.PollTerminal )
-					goto unimplemented;
-
-				if( argchar[1] == 'G' && SetupGDBServer( dev ) )
+				// Long options, these configure things used by later commands, i.e. --capture log.bin -T
+				if( strcmp( argchar, "--serial" ) == 0 || strcmp( argchar, "--usb-path" ) == 0 || strcmp( argchar, "--slot" ) == 0 )
 				{
-					fprintf( stderr, "Error: can't start GDB server\n" );
-					return -1;
+					// Already used to pick the programmer, just skip the arguments.
+					iarg += ( argchar[3] == 'l' ) ? 2 : 1;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: %s needs %s\n", argchar, ( argchar[3] == 'l' ) ? "a slot file and a slot name" : "a value" );
+						goto help;
+					}
 				}
-				if( argchar[1] == 'G' )
+				else
+				if( strcmp( argchar, "--capture" ) == 0 )
 				{
-					fprintf( stderr, "GDBServer Running\n" );
+					iarg++;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --capture needs a file name\n" );
+						goto help;
+					}
+					if( TerminalSetCapture( argv[iarg], capture_limit ) )
+						return -9;
 				}
-				else if( argchar[1] == 'T' )
+				else if( strcmp( argchar, "--capture-limit" ) == 0 )
 				{
-					// In case we aren't running already.
-					MCF.HaltMode( dev, 2 );
+					iarg++;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --capture-limit needs a size in bytes\n" );
+						goto help;
+					}
+					capture_limit = SimpleReadNumberInt( argv[iarg], 0 );
 				}
-
-				CaptureKeyboardInput();
-				printf( "Terminal started\n\n" );
-
-#if TERMINAL_INPUT_BUFFER
-				char pline_buf[256]; // Buffer that contains current line that is being printed to
-				char input_buf[128]; // Buffer that contains user input until it is sent out
-				memset( pline_buf, 0, sizeof(pline_buf) );
-				memset( input_buf, 0, sizeof(input_buf) );
-				uint8_t input_pos = 0;
-				uint8_t to_send = 0;
-				uint8_t nice_terminal = isatty( fileno(stdout) );
-#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
-				unsigned long console_mode;
-				void* handle_output = GetStdHandle(STD_OUTPUT_HANDLE);
-				GetConsoleMode(handle_output, &console_mode);
-				console_mode |= ENABLE_PROCESSED_OUTPUT | ENABLE_VIRTUAL_TERMINAL_PROCESSING;
-				uint8_t set_result = SetConsoleMode(handle_output, console_mode);
-				if ( set_result == 0 ) nice_terminal = 0;
-#else
-				if( nice_terminal > 0 )
+				else if( strcmp( argchar, "--chan" ) == 0 )
 				{
-					fflush( stdin );
-					fprintf( stdout, "\x1b[6n" );
-					fflush( stdout );
-					read( fileno(stdin), input_buf, 10 );
-					if (input_buf[0] != 27)
+					iarg++;
+					if( iarg >= argc )
 					{
-						nice_terminal = 0;
+						fprintf( stderr, "Error: --chan needs a channel, i.e. 1:fifo:/tmp/telemetry,bin,throttle\n" );
+						goto help;
 					}
-					else
+					if( ChannelConfigure( argv[iarg] ) )
+						return -9;
+				}
+				else if( strcmp( argchar, "--pty" ) == 0 )
+				{
+					iarg++;
+					if( iarg >= argc )
 					{
-						printf( TERMINAL_SEND_LABEL );
-						fflush( stdout );
+						fprintf( stderr, "Error: --pty needs a path for the symlink, i.e. /tmp/ttyCH32\n" );
+						goto help;
 					}
-					memset( input_buf, 0, sizeof(input_buf) );
+					if( TerminalRemoteSetupPTY( argv[iarg] ) )
+						return -9;
 				}
-#endif
-#endif
-				uint32_t appendword = 0;
-				do
+				else if( strcmp( argchar, "--tcp" ) == 0 )
 				{
-					uint8_t buffer[256];
-#if TERMINAL_INPUT_BUFFER
-					char print_buf[TERMINAL_BUFFER_SIZE]; // Buffer that is filled with everything and will be written to stdout (basically it's for formatting)
-					uint8_t update = 0;
-#endif
-					if( !IsGDBServerInShadowHaltState( dev ) )
+					iarg++;
+					if( iarg >= argc )
 					{
-						// Handle keyboard input.
-#if TERMINAL_INPUT_BUFFER
-						if ( nice_terminal > 0 ) 
-						{
-							if( IsKBHit() && to_send == 0 )
-							{
-								uint8_t c = ReadKBByte();
-								if ( c == 8 || c == 127 )
-								{
-									input_buf[input_pos - 1] = 0;
-									if ( input_pos > 0 ) input_pos--;
-								}
-								else if ( c > 31 && c < 127 )
-								{
-									input_buf[input_pos] = c;
-									input_pos++;
-								}
-								else if ( c == '\n' || c == 10 )
-								{
-									to_send = input_pos;
-								}
-								update = 1;
-							}
-							// Process incomming buffer during sending
-							if( to_send > 0 && appendword == 0 )
-							{
-								for( int i = 0; i < 3; i++ )
-								{
-									appendword |= input_buf[input_pos - to_send] << ( i * 8 + 8 );
-									to_send--;
-									if ( to_send == 0 ) break;
-								}
-								if( to_send == 0 )
-								{
-									snprintf(print_buf, TERMINAL_BUFFER_SIZE - 1, "%s%s%s\n%s%s", TERMINAL_CLEAR_CUR, TERMIANL_INPUT_SENT, input_buf, pline_buf, TERMINAL_SEND_LABEL);
-									fwrite( print_buf, strlen( print_buf ), 1, stdout );
-									fflush( stdout );
-									input_pos = 0;
-									memset( input_buf, 0, sizeof( input_buf ) );
-								}
-								appendword |= i + 4;
-							}
-						}
+						fprintf( stderr, "Error: --tcp needs a port\n" );
+						goto help;
+					}
+					if( TerminalRemoteSetupTCP( SimpleReadNumberInt( argv[iarg], 0 ) ) )
+						return -9;
+				}
+				else if( strcmp( argchar, "--profile-rate" ) == 0 )
+				{
+					iarg++;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --profile-rate needs a rate in Hz\n" );
+						goto help;
+					}
+					ProfileSetRate( SimpleReadNumberInt( argv[iarg], 0 ) );
+				}
+				else if( strcmp( argchar, "--profile" ) == 0 )
+				{
+					iarg += 3;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --profile needs the firmware's ELF file, a time in seconds and an output file (or -)\n" );
+						goto help;
+					}
+					if( RunProfile( dev, argv[iarg-2], SimpleReadNumberInt( argv[iarg-1], 10 ), argv[iarg] ) )
+						return -9;
+				}
+				else if( strcmp( argchar, "--watch-rate" ) == 0 )
+				{
+					iarg++;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --watch-rate needs a rate in Hz\n" );
+						goto help;
+					}
+					WatchSetRate( SimpleReadNumberInt( argv[iarg], 0 ) );
+				}
+				else if( strcmp( argchar, "--watch" ) == 0 )
+				{
+					iarg += 3;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --watch needs the firmware's ELF file, a list of variables, i.e. error,fill:u16,0x20000010:f32 and an output file or tcp:port\n" );
+						goto help;
+					}
+					if( WatchConfigure( argv[iarg-2], argv[iarg-1], argv[iarg] ) )
+						return -9;
+				}
+				else if( strcmp( argchar, "--trace-regs" ) == 0 )
+				{
+					TraceSetRegisters( 1 );
+				}
+				else if( strcmp( argchar, "--trace-wait" ) == 0 )
+				{
+					iarg++;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --trace-wait needs a time in milliseconds\n" );
+						goto help;
+					}
+					TraceSetWaitTimeout( SimpleReadNumberInt( argv[iarg], 10000 ) );
+				}
+				else if( strcmp( argchar, "--trace" ) == 0 )
+				{
+					iarg += 4;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --trace needs the firmware's ELF file (or -), where to start (symbol, address or here), a number of instructions and an output file\n" );
+						goto help;
+					}
+					if( RunTrace( dev, argv[iarg-3], argv[iarg-2], SimpleReadNumberInt( argv[iarg-1], 0 ), argv[iarg] ) )
+						return -9;
+				}
+				else if( strcmp( argchar, "--call-timeout" ) == 0 )
+				{
+					iarg++;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --call-timeout needs a time in milliseconds\n" );
+						goto help;
+					}
+					call_timeout_ms = SimpleReadNumberInt( argv[iarg], 1000 );
+				}
+				else if( strcmp( argchar, "--call" ) == 0 )
+				{
+					iarg += 2;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --call needs the firmware's ELF file (or -) and the calls, i.e. \"selftest();calibrate(3,4)\"\n" );
+						goto help;
+					}
+					if( RunCalls( dev, argv[iarg-1], argv[iarg], call_timeout_ms ) )
+						return -9;
+				}
+				else if( strcmp( argchar, "--bench-reps" ) == 0 )
+				{
+					iarg++;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --bench-reps needs a number of repetitions\n" );
+						goto help;
+					}
+					BenchSetRepetitions( SimpleReadNumberInt( argv[iarg], 10 ) );
+				}
+				else if( strcmp( argchar, "--bench" ) == 0 )
+				{
+					iarg += 4;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --bench needs the firmware's ELF file (or -), the call, i.e. \"fir(64)\", a number of calls per run and a JSON output file (or -)\n" );
+						goto help;
+					}
+					if( RunBench( dev, argv[iarg-3], argv[iarg-2], SimpleReadNumberInt( argv[iarg-1], 0 ), argv[iarg], call_timeout_ms ) )
+						return -9;
+				}
+				else if( strcmp( argchar, "--semihost" ) == 0 )
+				{
+					SemihostEnable();
+				}
+				else if( strcmp( argchar, "--snapshot" ) == 0 || strcmp( argchar, "--restore" ) == 0 )
+				{
+					iarg++;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: %s needs a core file\n", argchar );
+						goto help;
+					}
+					if( ( argchar[2] == 's' ? RunSnapshot : RunRestore )( dev, argv[iarg] ) )
+						return -9;
+				}
+				else if( strcmp( argchar, "--periph" ) == 0 || strcmp( argchar, "--periph-diff" ) == 0 )
+				{
+					iarg += 2;
+					if( iarg >= argc )
+					{
+						if( argchar[8] )
+							fprintf( stderr, "Error: --periph-diff needs a capture from --periph and another capture, or - to compare with the board\n" );
 						else
-						{
-							if( appendword == 0 )
-							{
-								int i;
-								for( i = 0; i < 3; i++ )
-								{
-									if( !IsKBHit() ) break;
-									appendword |= ReadKBByte() << (i*8+8);
-								}
-								appendword |= i+4; // Will go into DATA0.
-							}
-						}
-#else
-						if( appendword == 0 )
-						{
-							int i;
-							for( i = 0; i < 3; i++ )
-							{
-								if( !IsKBHit() ) break;
-								appendword |= ReadKBByte() << (i*8+8);
-							}
-							appendword |= i+4; // Will go into DATA0.
-						}
-#endif
-						int r = MCF.PollTerminal( dev, buffer, sizeof( buffer ), appendword, 0 );
-#if TERMINAL_INPUT_BUFFER
-						if( (nice_terminal > 0) && ( r == -1 || r == 0 ) && update > 0 )
-						{
-							strncpy( print_buf, TERMINAL_CLEAR_CUR, TERMINAL_BUFFER_SIZE - 1 );
-							if ( to_send > 0 ) strncat( print_buf, TERMINAL_DIM, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) );
-							strncat( print_buf, TERMINAL_SEND_LABEL, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) );
-							strncat( print_buf, input_buf, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) );
-							fwrite( print_buf, strlen( print_buf ), 1, stdout );
-							fflush( stdout );
-						}
-#endif
-						if( r < -5 )
-						{
-							fprintf( stderr, "Terminal dead.  code %d\n", r );
-							return -32;
-						}
-						else if( r < 0 )
-						{
-							// Other end ack'd without printf. (Or there is another situation)
-							appendword = 0;
-						}
-						else if( r > 0 )
-						{
-#if TERMINAL_INPUT_BUFFER
-							if ( nice_terminal )
-							{
-								int new_line = -1;
-								for( int i = r; i > 0; i-- )
-								{
-									if( buffer[i-1] == '\n' )
-									{
-										new_line = r - i;
-										break;
-									}
-								}
-								if( new_line < 0 )
-								{
-									strncpy( print_buf, TERMINAL_CLEAR_PREV, TERMINAL_BUFFER_SIZE - 1 ); //  Go one line up and erase it
-									strncat( pline_buf, (char *)buffer, r); // Add newly received chars to line buffer
-								}
-								else
-								{
-									strncpy( print_buf, TERMINAL_CLEAR_CUR, TERMINAL_BUFFER_SIZE - 1 ); // Go to the start of the line and erase it
-									strncat( pline_buf, (char *)buffer, r - new_line ); // Add newly received chars to line buffer
-								}
-								strncat( print_buf, pline_buf, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) ); // Add line to buffer
-								if( new_line >= 0 )
-								{
-									memset( pline_buf, 0, sizeof( pline_buf ) );
-								}
-								if( new_line > 0)
-								{
-									strncat( pline_buf, (char *)buffer+r-new_line, new_line );
-									strncat( print_buf, pline_buf, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) ); // Add line to buffer
-								}
-								
-								if( to_send > 0 ) strncat( print_buf, TERMINAL_DIM, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) );
-								strncat( print_buf, TERMINAL_SEND_LABEL, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) ); // Print styled "Send" label
-								strncat( print_buf, input_buf, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) ); // Print current input
-								fwrite( print_buf, strlen( print_buf ), 1, stdout );
-								print_buf[0] = 0;
-								// memset( print_buf, 0, sizeof( print_buf ) );
-								
-							}
-							else
-							{
-								fwrite( buffer, r, 1, stdout );
-							}
-#else
-							fwrite( buffer, r, 1, stdout );
-#endif
-							fflush( stdout );
-							// Otherwise it's basically just an ack for appendword.
-							appendword = 0;
-						}
+							fprintf( stderr, "Error: --periph needs a list of peripherals, i.e. RCC,GPIOD or all, and a file to save them to, or -\n" );
+						goto help;
 					}
-
-					if( argchar[1] == 'G' )
+					if( ( argchar[8] ? RunPeriphDiff : RunPeriph )( dev, argv[iarg-1], argv[iarg] ) )
+						return -9;
+				}
+				else if( strcmp( argchar, "--station-serial" ) == 0 )
+				{
+					iarg += 2;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --station-serial needs an address for the serial number and a file holding the next one\n" );
+						goto help;
+					}
+					uint64_t address = StringToMemoryAddress( argv[iarg-1] );
+					if( address > 0xffffffff || StationSetSerial( address, argv[iarg] ) )
+						return -9;
+				}
+				else if( strcmp( argchar, "--station-hook" ) == 0 )
+				{
+					iarg++;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --station-hook needs a command\n" );
+						goto help;
+					}
+					StationSetHook( argv[iarg] );
+				}
+				else if( strcmp( argchar, "--station" ) == 0 )
+				{
+					iarg += 3;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --station needs a binary image, an address and a CSV log file (or -)\n" );
+						goto help;
+					}
+					uint64_t address = StringToMemoryAddress( argv[iarg-1] );
+					if( address > 0xffffffff )
 					{
-						PollGDBServer( dev );
+						fprintf( stderr, "Error: Invalid offset (%s)\n", argv[iarg-1] );
+						return -9;
 					}
-				} while( 1 );
+					// Only comes back if it can't go on.
+					return RunStation( dev, &hints, argv[iarg-2], address, argv[iarg] );
+				}
+				else if( strcmp( argchar, "--log-elf" ) == 0 )
+				{
+					iarg++;
+					if( iarg >= argc )
+					{
+						fprintf( stderr, "Error: --log-elf needs the firmware's ELF file\n" );
+						goto help;
+					}
+					if( LogDecoderLoad( argv[iarg] ) )
+						return -9;
+				}
+				else
+				{
+					fprintf( stderr, "Error: Unknown option %s\n", argchar );
+					goto help;
+				}
+				argchar = 0; // Stop advancing
+				break;
+			}
+			case 'G':
+			case 'T':
+			{
+				if( !MCF.PollTerminal )
+					goto unimplemented;
 
-				// Currently unreachable - consider reachable-ing
-				if( argchar[1] == 'G' )
-					ExitGDBServer( dev );
+				// Only comes back if the terminal died.
+				int r = RunTerminal( dev, argchar[1] == 'G' );
+				if( r ) return r;
 				break;
 			}
 			case 's':
@@ -697,56 +792,35 @@ keep_going:
 					return -9;
 				}
 
-				FILE * f = 0;
-				int hex = 0;
-				if( strcmp( fname, "-" ) == 0 )
-					f = stdout;
-				else if( strcmp( fname, "+" ) == 0 )
-					f = stdout, hex = 1;
-				else
-					f = fopen( fname, "wb" );
-				if( !f )
-				{
-					fprintf( stderr, "Error: can't open write file \"%s\"\n", fname );
+				if( !MCF.ReadBinaryBlob )
+					goto unimplemented;
+
+				struct DumpEncoder * dump = DumpOpen( fname, offset );
+				if( !dump )
 					return -9;
-				}
-				uint8_t * readbuff = malloc( amount );
 
-				if( MCF.ReadBinaryBlob )
+				// Read a chunk at a time and hand each to the encoder, instead of holding the whole image.
+				uint32_t done = 0;
+				uint8_t * readbuff = malloc( DUMP_READ_CHUNK );
+				while( done < amount )
 				{
-					if( MCF.ReadBinaryBlob( dev, offset, amount, readbuff ) < 0 )
+					uint32_t chunk = ( amount - done > DUMP_READ_CHUNK ) ? DUMP_READ_CHUNK : amount - done;
+					if( MCF.ReadBinaryBlob( dev, offset + done, chunk, readbuff ) < 0 )
 					{
 						fprintf( stderr, "Fault reading device\n" );
+						free( readbuff );
+						DumpClose( dump );
 						return -12;
 					}
-				}				
-				else
-				{
-					goto unimplemented;
+					if( DumpWrite( dump, readbuff, chunk ) )
+						break;
+					done += chunk;
 				}
-
-				printf( "Read %d bytes\n", (int)amount );
-
-				if( hex )
-				{
-					int i;
-					for( i = 0; i < amount; i++ )
-					{
-						if( ( i & 0xf ) == 0 )
-						{
-							if( i != 0 ) printf( "\n" );
-							printf( "%08x: ", (uint32_t)(offset + i) );
-						}
-						printf( "%02x ", readbuff[i] );
-					}
-					printf( "\n" );
-				}
-				else
-					fwrite( readbuff, amount, 1, f );
-
 				free( readbuff );
 
-				if( f != stdout ) fclose( f );
+				if( DumpClose( dump ) || done < amount )
+					return -9;
+				fprintf( stderr, "Read %d bytes\n", (int)amount );
 				break;
 			}
 			case 'w':
@@ -845,7 +919,7 @@ keep_going:
 				if( MCF.WriteBinaryBlob )
 				{
 					printf("Writing image\n");
-					if( MCF.WriteBinaryBlob( dev, offset, len, image ) )
+					if( MCF.WriteBinaryBlob( dev, offset, len, image ) || MemoryCacheFlush( dev ) )
 					{
 						fprintf( stderr, "Error: Fault writing image.\n" );
 						return -13;
@@ -866,6 +940,12 @@ keep_going:
 		if( argchar && argchar[2] != 0 ) { argchar++; goto keep_going; }
 	}
 
+	if( MemoryCacheFlush( dev ) )
+	{
+		fprintf( stderr, "Error: Fault writing image.\n" );
+		return -13;
+	}
+
 	if( MCF.FlushLLCommands )
 		MCF.FlushLLCommands( dev );
 
@@ -885,6 +965,13 @@ help:
 	fprintf( stderr, " -k Skip programmer initialization\n" );
 	fprintf( stderr, " -c [serial port for Ardulink, try /dev/ttyACM0 or COM11 etc] or [VID+PID of USB for b003boot, try 0x1209b003]\n" );
 	fprintf( stderr, " -C [specified programmer, eg. b003boot, ardulink, esp32s2chfun]\n" );
+	fprintf( stderr, " --serial [USB serial number] Only use the programmer with this serial number\n" );
+	fprintf( stderr, " --usb-path [bus-port.port...] Only use the programmer plugged into this USB port\n" );
+	fprintf( stderr, " --slot [slots file] [name] Use the programmer bound to this slot, lines of name then USB path or serial:NUMBER\n" );
+	fprintf( stderr, " --list-programmers List the programmers plugged in, with their USB path and serial number and exit\n" );
+	fprintf( stderr, " --station [binary image] [address] [log.csv or -] Flash and verify every board connected, logging each one, waits for programmers and boards to be plugged in (must be last arg)\n" );
+	fprintf( stderr, " --station-serial [address] [counter file] Also write a 32 bit serial number there, the next one is kept in the file, place before --station\n" );
+	fprintf( stderr, " --station-hook [command] Run \"command pass|fail board serial\" after each board, place before --station\n" );
 	fprintf( stderr, " -u Clear all code flash - by power off (also can unbrick)\n" );
 	fprintf( stderr, " -E Erase chip\n" );
 	fprintf( stderr, " -b Reboot out of Halt\n" );
@@ -898,6 +985,28 @@ help:
 	fprintf( stderr, " -m [debug register]\n" );
 	fprintf( stderr, " -T Terminal Only (must be last arg)\n" );
 	fprintf( stderr, " -G Terminal + GDB (must be last arg)\n" );
+	fprintf( stderr, " --capture [file] Write terminal output with timestamps to file instead of stdout, place before -T\n" );
+	fprintf( stderr, " --capture-limit [bytes] Rotate capture file to file.1, file.2... at this size, place before --capture\n" );
+	fprintf( stderr, " --pty [path] Also publish the terminal as a pseudo-terminal, symlinked at path, place before -T\n" );
+	fprintf( stderr, " --tcp [port] Also publish the terminal on a TCP port, place before -T\n" );
+	fprintf( stderr, " --log-elf [firmware.elf] Decode minichlog.h binary logs in the terminal using the ELF's .minichlog section, place before -T\n" );
+	fprintf( stderr, " --profile [firmware.elf] [seconds] [folded output file, or -] Sample the PC while the target runs, print a flat profile\n" );
+	fprintf( stderr, " --profile-rate [Hz] Limit the --profile sampling rate, default is as fast as the programmer goes, place before --profile\n" );
+	fprintf( stderr, " --watch [firmware.elf] [var,var[+offset][:u8|i8|u16|i16|u32|i32|f32],0xaddress:type...] [output.csv or tcp:port] Sample variables while the terminal runs, place before -T\n" );
+	fprintf( stderr, " --watch-rate [Hz] How often --watch samples, default 10, place before --watch\n" );
+	fprintf( stderr, " --trace [firmware.elf or -] [start symbol, address or here] [instructions] [output.trace] Run to start, then single step and record the PC, leaves the core halted\n" );
+	fprintf( stderr, " --trace-regs Also record changed registers with --trace (slower), place before --trace\n" );
+	fprintf( stderr, " --trace-wait [ms] How long --trace waits for the core to reach the start, default 10000, 0 = forever, place before --trace\n" );
+	fprintf( stderr, " --trace-dump [file.trace] [firmware.elf] Print a trace, symbolized, no programmer needed (must be first arg)\n" );
+	fprintf( stderr, " --snapshot [file.core] Save RAM, registers, CSRs and core peripherals as an ELF core file for GDB\n" );
+	fprintf( stderr, " --restore [file.core] Write RAM, registers and CSRs back from a --snapshot, leaves the core halted\n" );
+	fprintf( stderr, " --periph [RCC,GPIOD,...|all] [capture.txt or -] Show peripheral registers decoded, without stopping the core for long\n" );
+	fprintf( stderr, " --periph-diff [before.txt] [after.txt or -] Show which peripheral registers changed, - compares with the board now\n" );
+	fprintf( stderr, " --semihost Serve RISC-V semihosting calls (file I/O, console, exit) from the firmware, place before -T or -G\n" );
+	fprintf( stderr, " --call [firmware.elf or -] [\"function(args...);0xaddress(args...)...\"] Call firmware functions, all in one halt, prints what they return\n" );
+	fprintf( stderr, " --call-timeout [ms] How long a --call may take, default 1000, place before --call\n" );
+	fprintf( stderr, " --bench [firmware.elf or -] [\"function(args...)\"] [calls per run] [output.json or -] Measure cycles and instructions per call with mcycle/minstret\n" );
+	fprintf( stderr, " --bench-reps [n] How many runs --bench makes, default 10, place before --bench\n" );
 	fprintf( stderr, " -P Enable Read Protection\n" );
 	fprintf( stderr, " -p Disable Read Protection\n" );
 	fprintf( stderr, " -S set FLASH/SRAM split [FLASH kbytes] [SRAM kbytes]\n" );
@@ -905,6 +1014,8 @@ help:
 	fprintf( stderr, " -r [output binary image] [memory address, decimal or 0x, try 0x08000000] [size, decimal or 0x, try 16384]\n" );
 	fprintf( stderr, "   Note: for memory addresses, you can use 'flash' 'launcher' 'bootloader' 'option' 'ram' and say \"ram+0x10\" for instance\n" );
 	fprintf( stderr, "   For filename, you can use - for raw (terminal) or + for hex (inline).\n" );
+	fprintf( stderr, "   .hex, .srec/.s19/.mot and .c/.h files are written as Intel HEX, S-records or a C array,\n" );
+	fprintf( stderr, "   or force one with ihex:, srec:, c:, hexdump: or bin: before the name, i.e. ihex:- for stdout.\n" );
 	fprintf( stderr, " -X [programmer-specific command, for esp32-s2 programmer, -X ECLK:1:0:0:8:3 for 24MHz clock out]\n" );
 
 	return -1;	
@@ -2212,16 +2323,24 @@ void PostSetupConfigureInterface( void * dev )
 {
 	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
 	iss->nr_registers_for_debug = 32;
+	// RAM sizes are the smallest part in each family, unless the programmer told us the flash size.
+	// Reading past the end of RAM faults, so too small is better than too big.
+	int flash_kb = iss->flash_size / 1024;
 	switch( iss->target_chip_type )
 	{
 	case CHIP_CH32V20x:
+		iss->sector_size = 256;
+		iss->ram_size = ( flash_kb && flash_kb <= 32 ) ? 10*1024 : ( flash_kb > 64 ) ? 64*1024 : 20*1024;
+		break;
 	case CHIP_CH32V30x:
 		iss->sector_size = 256;
+		iss->ram_size = ( flash_kb > 128 ) ? 64*1024 : 32*1024;
 		break;
 	case CHIP_CH32X03x:
 	case CHIP_CH32L10x:
 	case CHIP_CH643:
 		iss->sector_size = 256;  // ??? The X035 datasheet clearly says this is 128 bytes, but fast page erases do 256?
+		iss->ram_size = 20*1024;
 		break;
 	case CHIP_CH57x:
 	case CHIP_CH56x:
@@ -2233,6 +2352,7 @@ void PostSetupConfigureInterface( void * dev )
 	case CHIP_CH641:
 		iss->sector_size = 64;
 		iss->nr_registers_for_debug = 16;
+		iss->ram_size = 2048;
 		break;
 	case CHIP_CH32V002:
 	case CHIP_CH32V004:
@@ -2240,6 +2360,7 @@ void PostSetupConfigureInterface( void * dev )
 	case CHIP_CH32V006:
 		iss->sector_size = 256;
 		iss->nr_registers_for_debug = 16;
+		iss->ram_size = ( iss->target_chip_type == CHIP_CH32V002 ) ? 4*1024 : ( iss->target_chip_type == CHIP_CH32V004 ) ? 6*1024 : 8*1024;
 		break;
 	}
 }
@@ -2322,12 +2443,9 @@ int DefaultReadCPURegister( void * dev, uint32_t regno, uint32_t * regret )
 	return r;
 }
 
-int DefaultReadAllCPURegisters( void * dev, uint32_t * regret )
+static int ReadAllCPURegistersOneByOne( void * dev, uint32_t * regret )
 {
 	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
-	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0x00000000 ); // Disable Autoexec.
-	MCF.DetermineChipType( dev );
-	iss->statetag = STTAG( "RER2" );
 	int i;
 	for( i = 0; i < iss->nr_registers_for_debug; i++ )
 	{
@@ -2342,12 +2460,9 @@ int DefaultReadAllCPURegisters( void * dev, uint32_t * regret )
 	return r;
 }
 
-int DefaultWriteAllCPURegisters( void * dev, uint32_t * regret )
+static int WriteAllCPURegistersOneByOne( void * dev, uint32_t * regret )
 {
 	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
-	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0x00000000 ); // Disable Autoexec.
-	MCF.DetermineChipType( dev );
-	iss->statetag = STTAG( "WER2" );
 	int i;
 	for( i = 0; i < iss->nr_registers_for_debug; i++ )
 	{
@@ -2362,6 +2477,104 @@ int DefaultWriteAllCPURegisters( void * dev, uint32_t * regret )
 	return r;
 }
 
+static int CheckAbstractCommandError( void * dev )
+{
+	uint32_t abstractcs = 0;
+	if( MCF.ReadReg32( dev, DMABSTRACTCS, &abstractcs ) ) return -5;
+	if( !( abstractcs & 0x700 ) ) return 0;
+	MCF.WriteReg32( dev, DMABSTRACTCS, 0x00000700 ); // Clear cmderr.
+	return -5;
+}
+
+// With aarpostincrement and autoexec, each DATA0 access moves one register and
+// kicks off the command for the next, so it's one DMI op per register, not two.
+static int ReadAllCPURegistersBulk( void * dev, uint32_t * regret )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int nrregs = iss->nr_registers_for_debug;
+	int r = 0;
+	int i;
+	regret[0] = 0;
+	MCF.WriteReg32( dev, DMCOMMAND, 0x00220000 | (1<<19) | 0x1001 ); // Read x1 into DATA0, then regno++.
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0x00000001 ); // Reading DATA0 reads the next one.
+	for( i = 1; i < nrregs - 1; i++ )
+		r |= MCF.ReadReg32( dev, DMDATA0, regret + i );
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0x00000000 ); // Don't run off the end of the register file.
+	r |= MCF.ReadReg32( dev, DMDATA0, regret + i );
+	MCF.WriteReg32( dev, DMCOMMAND, 0x00220000 | 0x7b1 ); // Read DPC into DATA0.
+	r |= MCF.ReadReg32( dev, DMDATA0, regret + nrregs );
+	if( r ) return -5;
+	return CheckAbstractCommandError( dev );
+}
+
+static int WriteAllCPURegistersBulk( void * dev, uint32_t * regret )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int nrregs = iss->nr_registers_for_debug;
+	int r = 0;
+	int i;
+	r |= MCF.WriteReg32( dev, DMDATA0, regret[1] );
+	r |= MCF.WriteReg32( dev, DMCOMMAND, 0x00230000 | (1<<19) | 0x1001 ); // Write x1 from DATA0, then regno++.
+	r |= MCF.WriteReg32( dev, DMABSTRACTAUTO, 0x00000001 ); // Writing DATA0 writes the next one.
+	for( i = 2; i < nrregs; i++ )
+		r |= MCF.WriteReg32( dev, DMDATA0, regret[i] );
+	r |= MCF.WriteReg32( dev, DMABSTRACTAUTO, 0x00000000 );
+	r |= MCF.WriteReg32( dev, DMDATA0, regret[nrregs] );
+	r |= MCF.WriteReg32( dev, DMCOMMAND, 0x00230000 | 0x7b1 ); // Write DPC from DATA0.
+	if( r ) return -5;
+	return CheckAbstractCommandError( dev );
+}
+
+// Not every debug module has aarpostincrement, and one without it would quietly
+// hit x1 over and over.  So, once, write distinct values through the bulk path,
+// read them back the same way, then put the real registers back.
+static void ProbeBulkCPURegisters( void * dev, uint32_t * regs )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int nrregs = iss->nr_registers_for_debug;
+	uint32_t pattern[33];
+	uint32_t check[33];
+	int i;
+	pattern[0] = 0;
+	for( i = 1; i < nrregs; i++ )
+		pattern[i] = 0xa5000000 | ( i * 0x00010203 );
+	pattern[nrregs] = regs[nrregs];
+
+	int works = WriteAllCPURegistersBulk( dev, pattern ) == 0 &&
+		ReadAllCPURegistersBulk( dev, check ) == 0 &&
+		memcmp( pattern, check, ( nrregs + 1 ) * sizeof( uint32_t ) ) == 0;
+
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0x00000000 );
+	CheckAbstractCommandError( dev );
+	WriteAllCPURegistersOneByOne( dev, regs );
+	iss->bulk_register_access = works ? 1 : -1;
+}
+
+int DefaultReadAllCPURegisters( void * dev, uint32_t * regret )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0x00000000 ); // Disable Autoexec.
+	MCF.DetermineChipType( dev );
+	iss->statetag = STTAG( "RER2" );
+	if( iss->bulk_register_access > 0 )
+		return ReadAllCPURegistersBulk( dev, regret );
+	int r = ReadAllCPURegistersOneByOne( dev, regret );
+	if( r == 0 && iss->bulk_register_access == 0 )
+		ProbeBulkCPURegisters( dev, regret );
+	return r;
+}
+
+int DefaultWriteAllCPURegisters( void * dev, uint32_t * regret )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0x00000000 ); // Disable Autoexec.
+	MCF.DetermineChipType( dev );
+	iss->statetag = STTAG( "WER2" );
+	if( iss->bulk_register_access > 0 )
+		return WriteAllCPURegistersBulk( dev, regret );
+	return WriteAllCPURegistersOneByOne( dev, regret );
+}
+
 
 int DefaultWriteCPURegister( void * dev, uint32_t regno, uint32_t value )
 {
@@ -2402,6 +2615,184 @@ int DefaultSetEnableBreakpoints( void * dev, int is_enabled, int single_step )
 }
 
 
+// For reading (or writing) memory while the firmware runs.  The program buffer
+// moves memory through x8-x11 and keeps FLASH->STATR and the BUF_LOAD mask in
+// x12/x13 (see StaticUpdatePROGBUFRegs), some programmers use up to x15.  So
+// x8-x15 are saved here and put back by TargetRelease().  A core that was
+// already halted stays halted.
+int TargetHold( void * dev, struct TargetHold * h, int flags )
+{
+	uint32_t dmstatus = 0;
+	int i, r = 0;
+
+	memset( h, 0, sizeof( *h ) );
+	h->flags = flags;
+	if( !MCF.ReadCPURegister || !MCF.WriteCPURegister || MCF.ReadReg32( dev, DMSTATUS, &dmstatus ) )
+		return -5;
+	h->was_running = !( dmstatus & (1<<9) );
+	if( h->was_running )
+	{
+		MCF.WriteReg32( dev, DMCONTROL, 0x80000001 ); // Request halt
+		if( MCF.ReadReg32( dev, DMSTATUS, &dmstatus ) || !( dmstatus & (1<<9) ) )
+		{
+			// Asleep or otherwise not stopping, so nothing can be done without hurting it.
+			MCF.WriteReg32( dev, DMCONTROL, 0x40000001 );
+			if( MCF.FlushLLCommands ) MCF.FlushLLCommands( dev );
+			return -1;
+		}
+	}
+
+	// Halted now, so the firmware can't post anything while we hold them.
+	if( flags & TARGET_HOLD_MAILBOX )
+	{
+		if( MCF.ReadReg32( dev, DMDATA0, &h->data0 ) || MCF.ReadReg32( dev, DMDATA1, &h->data1 ) )
+			r = -5;
+		else if( ( flags & TARGET_HOLD_MAILBOX_IDLE ) && ( h->data0 & 0x80 ) )
+			r = 1;
+	}
+
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 );
+	for( i = 0; i < TARGET_HOLD_SCRATCH_COUNT && !r; i++ )
+		if( MCF.ReadCPURegister( dev, 0x1000 + TARGET_HOLD_SCRATCH_FIRST + i, &h->scratch[i] ) )
+			r = -5;
+	if( r )
+	{
+		MCF.WriteReg32( dev, DMABSTRACTCS, 0x00000700 ); // Clear cmderr.
+		if( h->was_running )
+			MCF.WriteReg32( dev, DMCONTROL, 0x40000001 ); // Request resume
+		if( MCF.FlushLLCommands ) MCF.FlushLLCommands( dev );
+	}
+	return r;
+}
+
+void TargetRelease( void * dev, struct TargetHold * h )
+{
+	int i;
+	MCF.WriteReg32( dev, DMABSTRACTCS, 0x00000700 ); // Clear cmderr, in case an access faulted.
+	for( i = 0; i < TARGET_HOLD_SCRATCH_COUNT; i++ )
+		MCF.WriteCPURegister( dev, 0x1000 + TARGET_HOLD_SCRATCH_FIRST + i, h->scratch[i] );
+	// The program buffer registers were just put back, so nothing set up for memory access is valid anymore.
+	if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+	if( h->flags & TARGET_HOLD_MAILBOX )
+	{
+		// Last, the register accesses go through DMDATA0 too.
+		MCF.WriteReg32( dev, DMDATA1, h->data1 );
+		MCF.WriteReg32( dev, DMDATA0, h->data0 );
+	}
+	if( h->was_running )
+		MCF.WriteReg32( dev, DMCONTROL, 0x40000001 ); // Request resume
+	if( MCF.FlushLLCommands ) MCF.FlushLLCommands( dev );
+}
+
+// Each call runs with the firmware's own registers, except a0-a5, sp, and ra,
+// which points at a c.ebreak just below the stack pointer.  So when the
+// function returns, the core halts right there, and a0/a1 can be picked up.
+// Interrupts stay however the firmware had them, in case the function needs them.
+int DefaultCallFunctions( void * dev, struct MiniChlinkCall * calls, int count, int timeout_ms )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	uint32_t saved[33];
+	uint32_t dmstatus = 0, dcsr = 0;
+	int i, j, r = 0;
+
+	if( !MCF.ReadAllCPURegisters || !MCF.WriteAllCPURegisters || !MCF.WriteCPURegister || !MCF.ReadCPURegister || !MCF.WriteWord )
+	{
+		fprintf( stderr, "Error: Can't call functions on this programmer, it can't access CPU registers\n" );
+		return -5;
+	}
+
+	// Anything held back has to be in flash before code runs.
+	MemoryCacheFlush( dev );
+	MCF.ReadReg32( dev, DMSTATUS, &dmstatus );
+	int was_running = !( dmstatus & (1<<9) );
+	if( was_running )
+		MCF.HaltMode( dev, HALT_MODE_HALT_BUT_NO_RESET );
+
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 );
+	if( MCF.ReadAllCPURegisters( dev, saved ) || MCF.ReadCPURegister( dev, 0x7b0, &dcsr ) )
+	{
+		// Nothing was changed yet, only put it back to running if it was.
+		fprintf( stderr, "Error: Could not save the core's registers\n" );
+		MCF.WriteReg32( dev, DMABSTRACTCS, 0x00000700 ); // Clear cmderr.
+		if( was_running )
+			MCF.HaltMode( dev, HALT_MODE_RESUME );
+		return -5;
+	}
+
+	for( i = 0; i < count; i++ )
+		calls[i].status = -3;
+
+	// Below the stack is free.  If it doesn't point at RAM, i.e. straight out of reset, use the top of RAM.
+	uint32_t sp = saved[2];
+	if( sp < iss->ram_base + 64 || ( sp & 0xf0000000 ) != ( iss->ram_base & 0xf0000000 ) )
+		sp = iss->ram_base + iss->ram_size;
+	uint32_t trampoline = ( sp - 16 ) & ~15;
+	if( !iss->ram_size || MCF.WriteWord( dev, trampoline, 0x90029002 ) ) // c.ebreak; c.ebreak
+	{
+		fprintf( stderr, "Error: Could not put the return trampoline in RAM\n" );
+		r = -5;
+	}
+	MCF.SetEnableBreakpoints( dev, 1, 0 ); // ebreak has to come to us, not the firmware's trap handler.
+
+	for( i = 0; i < count && !r; i++ )
+	{
+		struct MiniChlinkCall * c = &calls[i];
+		int rr = 0;
+		c->status = -1;
+		for( j = 0; j < 6; j++ )
+			rr |= MCF.WriteCPURegister( dev, 0x100a + j, c->args[j] );
+		rr |= MCF.WriteCPURegister( dev, 0x1001, trampoline ); // ra
+		rr |= MCF.WriteCPURegister( dev, 0x1002, trampoline - 16 ); // sp
+		rr |= MCF.WriteCPURegister( dev, 0x7b1, c->address ); // DPC
+		if( rr )
+		{
+			c->status = -4;
+			r = -5;
+			break;
+		}
+
+		MCF.WriteReg32( dev, DMCONTROL, 0x40000001 ); // resumereq
+		MCF.FlushLLCommands( dev );
+		uint64_t start = GetTimeMicroseconds();
+		do
+		{
+			if( MCF.ReadReg32( dev, DMSTATUS, &dmstatus ) ) break;
+			if( dmstatus & (1<<9) ) break;
+			// Quick ones come back right away, don't slow them down.
+			if( GetTimeMicroseconds() - start > 1000 )
+				MCF.DelayUS( dev, 1000 );
+		} while( GetTimeMicroseconds() - start < (uint64_t)timeout_ms * 1000 );
+
+		if( !( dmstatus & (1<<9) ) )
+		{
+			MCF.WriteReg32( dev, DMCONTROL, 0x80000001 ); // haltreq
+			MCF.FlushLLCommands( dev );
+			MCF.DelayUS( dev, 1000 );
+		}
+		MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 );
+		MCF.ReadCPURegister( dev, 0x7b1, &c->stopped_at );
+		if( c->stopped_at == trampoline || c->stopped_at == trampoline + 2 )
+		{
+			MCF.ReadCPURegister( dev, 0x100a, &c->ret[0] );
+			MCF.ReadCPURegister( dev, 0x100b, &c->ret[1] );
+			c->status = 0;
+		}
+		else if( dmstatus & (1<<9) )
+			c->status = -2;
+		if( c->status ) r = c->status;
+	}
+
+	// Put everything back the way the firmware had it.
+	MCF.WriteCPURegister( dev, 0x7b0, dcsr );
+	MCF.WriteAllCPURegisters( dev, saved );
+	MCF.VoidHighLevelState( dev );
+	// The functions could have changed anything.
+	MemoryCacheInvalidate();
+	if( was_running )
+		MCF.HaltMode( dev, HALT_MODE_RESUME );
+	return r;
+}
+
 static int DefaultHaltMode( void * dev, int mode )
 {
 	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
@@ -2682,6 +3073,8 @@ int SetupAutomaticHighLevelFunctions( void * dev )
 		MCF.ReadAllCPURegisters = DefaultReadAllCPURegisters;
 	if( !MCF.SetEnableBreakpoints )
 		MCF.SetEnableBreakpoints = DefaultSetEnableBreakpoints;
+	if( !MCF.CallFunctions )
+		MCF.CallFunctions = DefaultCallFunctions;
 	if( !MCF.ReadWord )
 		MCF.ReadWord = DefaultReadWord;
 	if( !MCF.ReadHalfWord )
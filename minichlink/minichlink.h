@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 enum RAMSplit;
+struct MiniChlinkCall;
 
 struct MiniChlinkFunctions
 {
@@ -80,6 +81,22 @@ struct MiniChlinkFunctions
 
 	int (*WriteByte)( void * dev, uint32_t address_to_write, uint8_t data );
 	int (*ReadByte)( void * dev, uint32_t address_to_read, uint8_t * data );
+
+	// Calls functions on the target, one after another, with the core's state saved once
+	// around all of them.  Returns 0 if every call returned, see each call's status.
+	int (*CallFunctions)( void * dev, struct MiniChlinkCall * calls, int count, int timeout_ms );
+
+	// Releases the USB or serial handle and frees dev, safe to call if the programmer was unplugged.
+	int (*Close)( void * dev );
+};
+
+struct MiniChlinkCall
+{
+	uint32_t address;   // Function to call.
+	uint32_t args[6];   // In a0-a5.
+	uint32_t ret[2];    // a0 and a1 when it returned.
+	uint32_t stopped_at; // Where the core was if it didn't come back.
+	int status;         // 0 if it returned, -1 if it timed out, -2 if it stopped somewhere else, -3 if not run, -4 if its registers couldn't be set.
 };
 
 /** If you are writing a driver, the minimal number of functions you can implement are:
@@ -166,6 +183,9 @@ struct InternalState
 	uint32_t target_chip_id;
 	uint8_t flash_sector_status[MAX_FLASH_SECTORS];  // 0 means unerased/unknown. 1 means erased.
 	int nr_registers_for_debug; // Updated by PostSetupConfigureInterface
+	int terminal_input_max; // Bytes of input per PollTerminal, up to 7 using both DMDATA0 and DMDATA1
+	int bulk_register_access; // 0 = not probed yet, 1 = aarpostincrement works, -1 = it doesn't.
+	int probing; // Looking for a target that may not be there, failed debug module accesses are expected.
 };
 
 
@@ -209,6 +229,15 @@ struct InternalState
 
 #define TERMINAL_BUFFER_SIZE 512
 
+// Bounds for how often the target is polled for printf while the terminal is idle.
+#ifndef TERMINAL_POLL_MIN_US
+#define TERMINAL_POLL_MIN_US 500
+#endif
+
+#ifndef TERMINAL_POLL_MAX_US
+#define TERMINAL_POLL_MAX_US 20000
+#endif
+
 #define STR_(x) #x
 #define STR(x) STR_(x)
 
@@ -230,9 +259,12 @@ struct InternalState
 typedef struct {
 	const char * serial_port;
 	const char * specific_programmer;
+	const char * usb_serial;
+	const char * usb_path;
 } init_hints_t;
 
 void * MiniCHLinkInitAsDLL(struct MiniChlinkFunctions ** MCFO, const init_hints_t* init_hints) DLLDECORATE;
+void MiniCHLinkClose( void * dev ) DLLDECORATE; // Lets go of the programmer and frees dev, so it can be opened again.
 extern struct MiniChlinkFunctions MCF;
 
 // Returns 'dev' on success, else 0.
@@ -242,24 +274,166 @@ void * TryInit_NHCLink042(void);
 void * TryInit_B003Fun(uint32_t id);
 void * TryInit_Ardulink(const init_hints_t*);
 
+// One scan of the USB bus for every known programmer, kept until released (minichusb.c).
+enum ProgrammerKind
+{
+	PROGRAMMER_NONE,
+	PROGRAMMER_LINKE,
+	PROGRAMMER_LINKE_ARM,
+	PROGRAMMER_LINKE_IAP,
+	PROGRAMMER_ESP32S2,
+	PROGRAMMER_NHCLINK,
+	PROGRAMMER_B003FUN,
+	PROGRAMMER_RV003USB,
+};
+
+struct ProgrammerFound
+{
+	enum ProgrammerKind kind;
+	const char * name;
+	uint16_t vid, pid;
+	char path[32];     // bus-port.port..., the physical port it's plugged into.
+	char serial[64];   // Only read if selecting or listing by it.
+	uint8_t serial_index;
+	void * usbdev;     // libusb_device *
+};
+
+void * ProgrammerUSBContext( void ); // libusb_context *
+int ProgrammerScan( uint32_t b003_id ); // Returns how many were found.
+const struct ProgrammerFound * ProgrammerFind( enum ProgrammerKind kind );
+void ProgrammerScanRelease( void );
+void ProgrammerSelect( const char * serial, const char * path ); // Only use the programmer with this USB serial and/or port path.
+int ProgrammerResolveSlot( const char * file, const char * slot, const char ** serial, const char ** path );
+int ProgrammerList( void );
+int ProgrammerWait( uint32_t b003_id, int timeout_ms ); // Rescans, then waits for one to be plugged in if there's none, -1 = forever.  Returns how many.
+int ProgrammerLost( void ); // One that was found by the last scan has been unplugged since, only noticed once waiting for one.
+int ProgrammerUnplugged( void ); // For backends whose transfer found the device gone, nonzero if that's being dealt with.
+
 // Returns 0 if ok, populated, 1 if not populated.
 int SetupAutomaticHighLevelFunctions( void * dev );
+void PostSetupConfigureInterface( void * dev ); // Sizes from the chip type, once SetupInterface found it.
 
 // Useful for converting numbers like 0x, etc.
 int64_t SimpleReadNumberInt( const char * number, int64_t defaultNumber );
 
 // For drivers to call
 int DefaultVoidHighLevelState( void * dev );
+int DefaultDelayUS( void * dev, int us );
 int InternalUnlockBootloader( void * dev );
 int InternalIsMemoryErased( struct InternalState * iss, uint32_t address );
 void InternalMarkMemoryNotErased( struct InternalState * iss, uint32_t address );
 int InternalUnlockFlash( void * dev, struct InternalState * iss );
 
+// Stops the core for memory accesses through the program buffer, and puts it back as it was.
+#define TARGET_HOLD_SCRATCH_FIRST 8 // x8-x15, the same as the GDB server's SCRATCH_REGISTERS.
+#define TARGET_HOLD_SCRATCH_COUNT 8
+struct TargetHold
+{
+	int flags;
+	int was_running;
+	uint32_t scratch[TARGET_HOLD_SCRATCH_COUNT];
+	uint32_t data0, data1; // DMDATA0/1, with TARGET_HOLD_MAILBOX
+};
+#define TARGET_HOLD_MAILBOX 1      // Keep the terminal's DMDATA0/1 intact.
+#define TARGET_HOLD_MAILBOX_IDLE 2 // With TARGET_HOLD_MAILBOX, don't stop while the terminal has a word waiting.
+int TargetHold( void * dev, struct TargetHold * h, int flags ); // 0 = held, 1 = terminal busy, try later, -1 = core didn't stop, -5 = error.  Only 0 needs a TargetRelease().
+void TargetRelease( void * dev, struct TargetHold * h );
+
 // GDBSever Functions
 int SetupGDBServer( void * dev );
 int PollGDBServer( void * dev );
 int IsGDBServerInShadowHaltState( void * dev );
+int IsGDBServerBusy( void * dev ); // Has work to do without waiting for the socket.
 void ExitGDBServer( void * dev );
+int GetGDBServerPollFD( void * dev ); // -1 if there is nothing to wait on.
+
+// Cache of target memory in front of ReadBinaryBlob, installed by the command line tool.
+int MemoryCacheInstall( void * dev );
+void MemoryCacheUninstall( void ); // Puts MCF back as it was, before the programmer is closed.
+void MemoryCacheHalted( void * dev, uint32_t sp ); // The core stopped, the stack above sp gets read in one go when first needed.
+void MemoryCacheSetAccessHook( void (*hook)( void * dev, int whole_core ) ); // Called before anything goes to the target, whole_core if it may lose all the registers.
+void MemoryCacheInvalidate( void );
+int MemoryCacheFlush( void * dev ); // Programs any flash writes being held back.
+void MemoryCacheSetWriteBack( void * dev, int enable ); // Hold back partial flash writes until MemoryCacheFlush(), off by default.
+
+// Terminal Functions (-T / -G), returns only if the terminal died.
+int RunTerminal( void * dev, int with_gdb );
+void TerminalOutput( const void * data, int len );
+int TerminalSetCapture( const char * filename, uint64_t limit ); // limit = 0 for no rotation.
+
+// Deferred formatting log decoder, see minichlog.h for the firmware side.
+int LogDecoderLoad( const char * elffile );
+int LogDecoderActive( void );
+void LogDecoderFeed( const uint8_t * data, int len, void (*emit)( const void * data, int len ) );
+
+// Virtual channels over the terminal, see minichchan.h for the firmware side.
+int ChannelConfigure( const char * spec );
+int ChannelsActive( void );
+void ChannelsFeed( const uint8_t * data, int len, void (*console)( const uint8_t * data, int len ) );
+int ChannelsPoll( void ); // Nonzero if a channel still has data waiting.
+void ChannelsClose( void );
+int TerminalQueueInput( const uint8_t * data, int len ); // Sent to the target along with keyboard input.
+
+// Statistical profiler (--profile), samples the PC while the target runs.
+void ProfileSetRate( int hz ); // 0 = as fast as the programmer can.
+int RunProfile( void * dev, const char * elffile, int seconds, const char * foldedfile );
+
+// Live watch of variables while the terminal runs (--watch), samples go to a CSV file or tcp:port.
+int WatchConfigure( const char * elffile, const char * variables, const char * output );
+void WatchSetRate( int hz );
+int WatchActive( void );
+int WatchPoll( void * dev ); // Samples if it's time, returns microseconds until the next one.
+
+// Instruction trace by single stepping (--trace), and its offline decoder.
+void TraceSetRegisters( int enable ); // Also record register changes, much slower.
+void TraceSetWaitTimeout( int ms ); // How long to wait for the core to reach the start, 0 = forever.
+int RunTrace( void * dev, const char * elffile, const char * start, int steps, const char * tracefile );
+int TraceDump( const char * tracefile, const char * elffile );
+
+// Calls target functions from the command line (--call), i.e. "selftest();calibrate(3,4)"
+int RunCalls( void * dev, const char * elffile, const char * calls, int timeout_ms );
+// Cycles and instructions per call of one target function (--bench), JSON to a file or -.
+void BenchSetRepetitions( int reps );
+int RunBench( void * dev, const char * elffile, const char * call, int iterations, const char * jsonfile, int timeout_ms );
+int TerminalInputSpace( void );
+int TerminalInputRead( uint8_t * data, int len ); // Keyboard input for the host, i.e. semihosting.
+
+// Whole target state as an ELF core file (--snapshot), and written back (--restore).
+int RunSnapshot( void * dev, const char * corefile );
+int RunRestore( void * dev, const char * corefile );
+
+// Peripheral registers, decoded from the ch32fun.h layouts (--periph), and compared (--periph-diff).
+int RunPeriph( void * dev, const char * selection, const char * file );
+int RunPeriphDiff( void * dev, const char * before_file, const char * after_file );
+
+// Streaming output formats for -r: raw, hex dump, Intel HEX, S-records or a C array, picked from the file name.
+#define DUMP_READ_CHUNK 16384
+struct DumpEncoder;
+struct DumpEncoder * DumpOpen( const char * fname, uint32_t address );
+int DumpWrite( struct DumpEncoder * e, const uint8_t * data, uint32_t len );
+int DumpClose( struct DumpEncoder * e );
+
+// Production station (--station), flashes, verifies and numbers each board as it is connected.
+int StationSetSerial( uint32_t address, const char * counterfile );
+void StationSetHook( const char * command );
+void * StationConnect( const init_hints_t * hints ); // Waits for a programmer, then opens it.
+int RunStation( void * dev, const init_hints_t * hints, const char * imagefile, uint32_t address, const char * logfile );
+
+// RISC-V semihosting (--semihost), served from the -T / -G loop.
+void SemihostEnable( void );
+int SemihostActive( void );
+int SemihostWantsInput( void ); // A console read is waiting on the keyboard.
+int SemihostStart( void * dev, void (*console)( const void * data, int len ), int (*input)( uint8_t * data, int len ) );
+int SemihostHalted( void * dev ); // Core is halted, 1 = call answered, 2 = call waiting on input, 0 = not a call.
+int SemihostPoll( void * dev ); // As above, 0 = running, -1 = halted for something else.
+
+// Terminal published as a pseudo-terminal (--pty) or TCP port (--tcp), POSIX only.
+int TerminalRemoteSetupPTY( const char * linkpath );
+int TerminalRemoteSetupTCP( int port );
+int TerminalRemoteActive( void );
+void TerminalRemoteOutput( const void * data, int len );
+int TerminalRemoteGetPollFDs( int * fds, int * events, int max ); // events: 1 = read, 2 = write
+int TerminalRemotePoll( int * got_input ); // Nonzero if output is still waiting.
 
 #endif
 
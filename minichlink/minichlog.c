@@ -0,0 +1,299 @@
+// Host side of deferred formatting logs, see minichlog.h for the firmware
+// side and the wire format.
+//
+// Bytes from the terminal are fed through a small state machine.  Plain text
+// passes straight through, 0xFF starts a frame.  The format string is walked
+// as the arguments arrive, so a frame can be split across any number of
+// PollTerminal chunks.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "minichlink.h"
+#include "minichelf.h"
+
+#define LOG_FRAME_MARKER 0xff      // Must match MINICHLOG_FRAME_MARKER
+#define LOG_MAX_LINE 4096
+
+enum LogState
+{
+	LOG_TEXT,
+	LOG_INDEX,
+	LOG_INT,
+	LOG_FLOAT,
+	LOG_STRLEN,
+	LOG_STRDATA,
+};
+
+enum LogArgType
+{
+	LOG_ARG_INT32,
+	LOG_ARG_INT64,
+	LOG_ARG_FLOAT,
+	LOG_ARG_STRING,
+};
+
+static struct MiniElf log_elf;
+static const char * log_strings;
+static uint32_t log_strings_size;
+static uint32_t log_strings_addr;   // Indices are addresses, so this is 0 unless the section is loaded.
+
+static enum LogState log_state;
+static enum LogArgType log_argtype;
+static uint64_t log_acc;
+static int log_shift;
+static uint32_t log_strlen;
+static uint32_t log_strpos;
+static char log_strbuf[256];
+static uint8_t log_floatbuf[4];
+static int log_floatpos;
+
+static const char * log_fmt;       // Where we are in the current format string.
+static char log_spec[32];          // Current conversion, cleaned up for snprintf.
+static char log_line[LOG_MAX_LINE];
+static int log_linelen;
+
+int LogDecoderLoad( const char * elffile )
+{
+	struct MiniElfSection sec;
+	if( MiniElfLoad( &log_elf, elffile ) ) return -1;
+	if( MiniElfFindSection( &log_elf, ".minichlog", &sec ) || !sec.data )
+	{
+		fprintf( stderr, "Error: %s has no .minichlog section, is the firmware using minichlog.h?\n", elffile );
+		MiniElfFree( &log_elf );
+		return -2;
+	}
+	if( sec.flags & 2 )
+	{
+		fprintf( stderr, "Warning: .minichlog is loaded to the target, format strings are using flash. See minichlog.h\n" );
+	}
+	if( sec.size == 0 || sec.data[sec.size-1] )
+	{
+		fprintf( stderr, "Error: .minichlog in %s doesn't end in a terminated string\n", elffile );
+		MiniElfFree( &log_elf );
+		return -2;
+	}
+	log_strings = (const char*)sec.data;
+	log_strings_size = sec.size;
+	log_strings_addr = sec.addr;
+	log_state = LOG_TEXT;
+	return 0;
+}
+
+int LogDecoderActive( void )
+{
+	return log_strings != 0;
+}
+
+static void LogFlushLine( void (*emit)( const void * data, int len ) )
+{
+	if( log_linelen ) emit( log_line, log_linelen );
+	log_linelen = 0;
+}
+
+static void LogAppend( const char * str, int len, void (*emit)( const void * data, int len ) )
+{
+	while( len > 0 )
+	{
+		int space = LOG_MAX_LINE - log_linelen;
+		if( space == 0 )
+		{
+			LogFlushLine( emit );
+			continue;
+		}
+		int chunk = ( len < space ) ? len : space;
+		memcpy( log_line + log_linelen, str, chunk );
+		log_linelen += chunk;
+		str += chunk;
+		len -= chunk;
+	}
+}
+
+// Copies literal text up to the next conversion that needs an argument, and
+// sets up the state to receive it.  Finishes the frame at the end of the string.
+static void LogNextArg( void (*emit)( const void * data, int len ) )
+{
+	while( *log_fmt )
+	{
+		const char * pct = strchr( log_fmt, '%' );
+		if( !pct )
+		{
+			LogAppend( log_fmt, strlen( log_fmt ), emit );
+			break;
+		}
+		LogAppend( log_fmt, pct - log_fmt, emit );
+
+		// Parse %[flags][width][.precision][length]conversion
+		const char * s = pct + 1;
+		int speclen = 0;
+		int is64 = 0;
+		log_spec[speclen++] = '%';
+		while( *s && strchr( "-+ #0123456789.", *s ) && speclen < (int)sizeof( log_spec ) - 4 )
+			log_spec[speclen++] = *(s++);
+		while( *s && strchr( "hlLqjzt", *s ) )
+		{
+			if( *s == 'j' || *s == 'q' || ( s[0] == 'l' && s[1] == 'l' ) ) is64 = 1;
+			s++;
+		}
+		char conv = *s;
+		log_fmt = conv ? s + 1 : s;
+
+		if( conv == '%' )
+		{
+			LogAppend( "%", 1, emit );
+			continue;
+		}
+		if( conv && strchr( "diuxXoc", conv ) )
+		{
+			if( is64 && conv != 'c' )
+			{
+				log_spec[speclen++] = 'l';
+				log_spec[speclen++] = 'l';
+			}
+			log_argtype = ( is64 && conv != 'c' ) ? LOG_ARG_INT64 : LOG_ARG_INT32;
+			log_state = LOG_INT;
+		}
+		else if( conv == 'p' )
+		{
+			speclen = 1;
+			log_spec[speclen++] = '#';
+			log_spec[speclen++] = '0';
+			log_spec[speclen++] = '1';
+			log_spec[speclen++] = '0';
+			conv = 'x';
+			log_argtype = LOG_ARG_INT32;
+			log_state = LOG_INT;
+		}
+		else if( conv && strchr( "fFeEgGaA", conv ) )
+		{
+			log_argtype = LOG_ARG_FLOAT;
+			log_state = LOG_FLOAT;
+			log_floatpos = 0;
+		}
+		else if( conv == 's' )
+		{
+			log_argtype = LOG_ARG_STRING;
+			log_state = LOG_STRLEN;
+		}
+		else
+		{
+			// Something we can't take an argument for, i.e. %n or %*d.  Show it as-is.
+			LogAppend( pct, log_fmt - pct, emit );
+			continue;
+		}
+		log_spec[speclen++] = conv;
+		log_spec[speclen] = 0;
+		log_acc = 0;
+		log_shift = 0;
+		return;
+	}
+
+	LogFlushLine( emit );
+	log_state = LOG_TEXT;
+}
+
+static void LogRenderArg( void (*emit)( const void * data, int len ) )
+{
+	char out[512];
+	int len = 0;
+	switch( log_argtype )
+	{
+	case LOG_ARG_INT32:
+	{
+		uint32_t u = (uint32_t)log_acc;
+		int32_t v = (int32_t)( ( u >> 1 ) ^ -( u & 1 ) );
+		len = snprintf( out, sizeof( out ), log_spec, v );
+		break;
+	}
+	case LOG_ARG_INT64:
+	{
+		int64_t v = (int64_t)( ( log_acc >> 1 ) ^ -( log_acc & 1 ) );
+		len = snprintf( out, sizeof( out ), log_spec, (long long)v );
+		break;
+	}
+	case LOG_ARG_FLOAT:
+	{
+		union { float f; uint32_t u; } c;
+		c.u = log_floatbuf[0] | (log_floatbuf[1]<<8) | (log_floatbuf[2]<<16) | ((uint32_t)log_floatbuf[3]<<24);
+		len = snprintf( out, sizeof( out ), log_spec, (double)c.f );
+		break;
+	}
+	case LOG_ARG_STRING:
+		log_strbuf[log_strpos < sizeof( log_strbuf ) ? log_strpos : sizeof( log_strbuf ) - 1] = 0;
+		len = snprintf( out, sizeof( out ), log_spec, log_strbuf );
+		break;
+	}
+	if( len > (int)sizeof( out ) - 1 ) len = sizeof( out ) - 1;
+	if( len > 0 ) LogAppend( out, len, emit );
+	LogNextArg( emit );
+}
+
+void LogDecoderFeed( const uint8_t * data, int len, void (*emit)( const void * data, int len ) )
+{
+	int i = 0;
+	while( i < len )
+	{
+		uint8_t b = data[i];
+		switch( log_state )
+		{
+		case LOG_TEXT:
+		{
+			// Pass runs of plain text through in one go.
+			int start = i;
+			while( i < len && data[i] != LOG_FRAME_MARKER ) i++;
+			if( i > start ) emit( data + start, i - start );
+			if( i < len )
+			{
+				log_state = LOG_INDEX;
+				log_acc = 0;
+				log_shift = 0;
+				i++;
+			}
+			continue;
+		}
+		case LOG_INDEX:
+		case LOG_INT:
+		case LOG_STRLEN:
+			if( log_shift < 64 ) log_acc |= (uint64_t)( b & 0x7f ) << log_shift;
+			log_shift += 7;
+			if( b & 0x80 ) break;
+			if( log_state == LOG_INDEX )
+			{
+				uint64_t offset = log_acc - log_strings_addr;
+				if( log_acc < log_strings_addr || offset >= log_strings_size )
+				{
+					char err[64];
+					int elen = snprintf( err, sizeof( err ), "<minichlog: bad index %llu>\n", (unsigned long long)log_acc );
+					emit( err, elen );
+					log_state = LOG_TEXT;
+					break;
+				}
+				log_fmt = log_strings + offset;
+				log_linelen = 0;
+				LogNextArg( emit );
+			}
+			else if( log_state == LOG_INT )
+			{
+				LogRenderArg( emit );
+			}
+			else
+			{
+				log_strlen = log_acc;
+				log_strpos = 0;
+				log_state = LOG_STRDATA;
+				if( log_strlen == 0 ) LogRenderArg( emit );
+			}
+			break;
+		case LOG_FLOAT:
+			log_floatbuf[log_floatpos++] = b;
+			if( log_floatpos == 4 ) LogRenderArg( emit );
+			break;
+		case LOG_STRDATA:
+			if( log_strpos < sizeof( log_strbuf ) - 1 ) log_strbuf[log_strpos] = b;
+			log_strpos++;
+			if( log_strpos == log_strlen ) LogRenderArg( emit );
+			break;
+		}
+		i++;
+	}
+}
@@ -0,0 +1,147 @@
+// Deferred formatting ("defmt" style) logging for firmware, decoded by
+// minichlink -T with --log-elf [firmware.elf].
+//
+// Instead of formatting on the target and pushing the text through the
+// debug terminal, MINICHLOG( "x=%d y=%s\n", x, name ) sends a frame of
+//   0xFF, ULEB128( format string index ), arguments...
+// and minichlink looks the format string up in the .minichlog section of the
+// firmware ELF and renders it on the host.  Plain printf text can be freely
+// mixed in, since 0xFF never appears in ASCII or UTF-8.
+//
+// Arguments are encoded by their C type:
+//   integers up to 32 bits   ZigZag then ULEB128 of the value as an int32_t
+//   long long                ZigZag then ULEB128 of the value as an int64_t (use %ll)
+//   float / double           4 bytes, IEEE754 single precision, little endian
+//   char *                   ULEB128 length, then the bytes (up to MINICHLOG_MAX_STRING)
+//
+// The format strings should not take up flash.  Add this to the SECTIONS of
+// your linker script, it's never loaded, and the string's address becomes its
+// index:
+//
+//   .minichlog 0 (INFO) : { KEEP(*(.minichlog)) }
+//
+// Needs GCC (for _Generic and ##__VA_ARGS__), and up to 8 arguments per call.
+//
+// If the firmware also uses channels (minichchan.h), #define MINICHLOG_CHANNEL
+// to the channel the log frames should be wrapped in, usually 0, the console.
+// Otherwise their argument bytes could be mistaken for channel frames.
+
+#ifndef _MINICHLOG_H
+#define _MINICHLOG_H
+
+#include <stdint.h>
+
+#ifndef MINICHLOG_MAX_STRING
+#define MINICHLOG_MAX_STRING 24
+#endif
+
+#define MINICHLOG_FRAME_MARKER 0xff
+#define MINICHLOG_MAX_FRAME ( 1 + 5 + 8 * ( 5 + MINICHLOG_MAX_STRING + 1 ) ) // Must stay under 256 for MINICHLOG_CHANNEL
+
+#ifdef MINICHLOG_CHANNEL
+#define _MINICHLOG_HEADER 3
+#else
+#define _MINICHLOG_HEADER 0
+#endif
+
+int _write(int fd, const char *buf, int size);
+
+static inline uint8_t * _minichlog_uleb( uint8_t * p, uint64_t v )
+{
+	while( v >= 0x80 )
+	{
+		*(p++) = v | 0x80;
+		v >>= 7;
+	}
+	*(p++) = v;
+	return p;
+}
+
+// Separate 32-bit version, so the common case stays cheap on RV32.
+static inline uint8_t * _minichlog_uleb32( uint8_t * p, uint32_t v )
+{
+	while( v >= 0x80 )
+	{
+		*(p++) = v | 0x80;
+		v >>= 7;
+	}
+	*(p++) = v;
+	return p;
+}
+
+static inline uint8_t * _minichlog_i32( uint8_t * p, int32_t v )
+{
+	return _minichlog_uleb32( p, ( (uint32_t)v << 1 ) ^ (uint32_t)( v >> 31 ) );
+}
+
+static inline uint8_t * _minichlog_i64( uint8_t * p, int64_t v )
+{
+	return _minichlog_uleb( p, ( (uint64_t)v << 1 ) ^ (uint64_t)( v >> 63 ) );
+}
+
+static inline uint8_t * _minichlog_ptr( uint8_t * p, const void * v )
+{
+	return _minichlog_i32( p, (int32_t)(uintptr_t)v );
+}
+
+static inline uint8_t * _minichlog_f32( uint8_t * p, float v )
+{
+	union { float f; uint32_t u; } c = { v };
+	*(p++) = c.u;
+	*(p++) = c.u >> 8;
+	*(p++) = c.u >> 16;
+	*(p++) = c.u >> 24;
+	return p;
+}
+
+static inline uint8_t * _minichlog_str( uint8_t * p, const char * s )
+{
+	int len = 0;
+	while( s[len] && len < MINICHLOG_MAX_STRING ) len++;
+	p = _minichlog_uleb32( p, len );
+	while( len-- ) *(p++) = *(s++);
+	return p;
+}
+
+static inline void _minichlog_send( uint8_t * buf, int len )
+{
+#ifdef MINICHLOG_CHANNEL
+	buf[0] = 0xfe; // MINICHCHAN_FRAME_MARKER
+	buf[1] = MINICHLOG_CHANNEL;
+	buf[2] = len - _MINICHLOG_HEADER;
+#endif
+	_write( 0, (const char*)buf, len );
+}
+
+#define _MINICHLOG_ARG( p, x ) p = _Generic( (x), \
+	float : _minichlog_f32, double : _minichlog_f32, \
+	char * : _minichlog_str, const char * : _minichlog_str, \
+	void * : _minichlog_ptr, const void * : _minichlog_ptr, \
+	long long : _minichlog_i64, unsigned long long : _minichlog_i64, \
+	default : _minichlog_i32 )( p, x );
+
+#define _MINICHLOG_EACH_0( p )
+#define _MINICHLOG_EACH_1( p, a ) _MINICHLOG_ARG( p, a )
+#define _MINICHLOG_EACH_2( p, a, ... ) _MINICHLOG_ARG( p, a ) _MINICHLOG_EACH_1( p, __VA_ARGS__ )
+#define _MINICHLOG_EACH_3( p, a, ... ) _MINICHLOG_ARG( p, a ) _MINICHLOG_EACH_2( p, __VA_ARGS__ )
+#define _MINICHLOG_EACH_4( p, a, ... ) _MINICHLOG_ARG( p, a ) _MINICHLOG_EACH_3( p, __VA_ARGS__ )
+#define _MINICHLOG_EACH_5( p, a, ... ) _MINICHLOG_ARG( p, a ) _MINICHLOG_EACH_4( p, __VA_ARGS__ )
+#define _MINICHLOG_EACH_6( p, a, ... ) _MINICHLOG_ARG( p, a ) _MINICHLOG_EACH_5( p, __VA_ARGS__ )
+#define _MINICHLOG_EACH_7( p, a, ... ) _MINICHLOG_ARG( p, a ) _MINICHLOG_EACH_6( p, __VA_ARGS__ )
+#define _MINICHLOG_EACH_8( p, a, ... ) _MINICHLOG_ARG( p, a ) _MINICHLOG_EACH_7( p, __VA_ARGS__ )
+#define _MINICHLOG_COUNT( ... ) _MINICHLOG_COUNT_( _, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0 )
+#define _MINICHLOG_COUNT_( _, a1, a2, a3, a4, a5, a6, a7, a8, n, ... ) n
+#define _MINICHLOG_CAT( a, b ) _MINICHLOG_CAT_( a, b )
+#define _MINICHLOG_CAT_( a, b ) a##b
+
+#define MINICHLOG( fmt, ... ) do { \
+		static const char _minichlog_fmt[] __attribute__((section(".minichlog"), used)) = fmt; \
+		uint8_t _minichlog_buf[_MINICHLOG_HEADER + MINICHLOG_MAX_FRAME]; \
+		uint8_t * _minichlog_p = _minichlog_buf + _MINICHLOG_HEADER; \
+		*(_minichlog_p++) = MINICHLOG_FRAME_MARKER; \
+		_minichlog_p = _minichlog_uleb32( _minichlog_p, (uintptr_t)_minichlog_fmt ); \
+		_MINICHLOG_CAT( _MINICHLOG_EACH_, _MINICHLOG_COUNT( __VA_ARGS__ ) )( _minichlog_p, ##__VA_ARGS__ ) \
+		_minichlog_send( _minichlog_buf, _minichlog_p - _minichlog_buf ); \
+	} while( 0 )
+
+#endif
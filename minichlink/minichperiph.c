@@ -0,0 +1,670 @@
+// Peripheral register viewer, --periph and --periph-diff.
+//
+// Block addresses and register layouts come straight from ch32fun.h: every
+// register is placed with offsetof() on the header's _TypeDef, every block at
+// the header's _BASE, and decoded fields are the header's own bit masks, so
+// this can't drift from what firmware is compiled against.
+//
+// A block is read in as few ReadBinaryBlob spans as possible.  Neighbouring
+// registers are merged into one aligned span, reserved words in between
+// included, unless the gap is large.  Registers where the read itself does
+// something (popping a data register, finishing a flag clear sequence) are
+// marked PERIPH_SKIP and are never read, spans are split around them.
+//
+// Like --watch, the core is only held for the reads and let go again, so this
+// can be pointed at a running board.  A capture can be saved as text, one
+// register per line, and two captures, or a capture and the live board, can be
+// compared with --periph-diff.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <ctype.h>
+#include "terminalhelp.h"
+#include "minichlink.h"
+#include "ch32fun.h"
+
+#define PERIPH_SKIP 1           // Reading it has a side effect, never read.
+#define PERIPH_WO 2             // Write only, reads back as nothing useful, not shown.
+#define PERIPH_MERGE_GAP 32     // Bytes we'd rather read for nothing than start another span.
+#define PERIPH_MAX_SPAN 256
+
+struct PeriphField
+{
+	const char * name;
+	uint32_t mask;
+};
+
+struct PeriphRegister
+{
+	const char * name;
+	uint16_t offset;
+	uint8_t size;
+	uint8_t flags;
+	const struct PeriphField * fields;
+};
+
+struct PeriphBlock
+{
+	const char * name;
+	uint32_t base;
+	const struct PeriphRegister * regs;
+};
+
+struct PeriphValue
+{
+	char name[32];
+	uint32_t address;
+	uint32_t value;
+};
+
+struct PeriphCapture
+{
+	struct PeriphValue * v;
+	int count;
+};
+
+#define PF( prefix, f ) { #f, prefix##f }
+#define PREG( type, reg, flags, fields ) { #reg, offsetof( type, reg ), sizeof( ((type*)0)->reg ), flags, fields }
+
+static const struct PeriphField periph_rcc_ctlr[] = { PF( RCC_, HSION ), PF( RCC_, HSIRDY ), PF( RCC_, HSITRIM ), PF( RCC_, HSICAL ),
+	PF( RCC_, HSEON ), PF( RCC_, HSERDY ), PF( RCC_, HSEBYP ), PF( RCC_, CSSON ), PF( RCC_, PLLON ), PF( RCC_, PLLRDY ), { 0 } };
+static const struct PeriphField periph_rcc_cfgr0[] = { PF( RCC_, SW ), PF( RCC_, SWS ), PF( RCC_, HPRE ), PF( RCC_, ADCPRE ),
+	PF( RCC_, PLLSRC ), PF( RCC_CFGR0_, MCO ), { 0 } };
+static const struct PeriphField periph_rcc_ahbpcenr[] = { PF( RCC_, DMA1EN ), PF( RCC_, SRAMEN ), { 0 } };
+static const struct PeriphField periph_rcc_apb2pcenr[] = { PF( RCC_, AFIOEN ), PF( RCC_, IOPAEN ), PF( RCC_, IOPCEN ), PF( RCC_, IOPDEN ),
+	PF( RCC_, ADC1EN ), PF( RCC_, TIM1EN ), PF( RCC_, SPI1EN ), PF( RCC_, USART1EN ), { 0 } };
+static const struct PeriphField periph_rcc_apb1pcenr[] = { PF( RCC_, TIM2EN ), PF( RCC_, WWDGEN ), PF( RCC_, I2C1EN ), PF( RCC_, PWREN ), { 0 } };
+static const struct PeriphField periph_rcc_rstsckr[] = { PF( RCC_, LSION ), PF( RCC_, LSIRDY ), PF( RCC_, PINRSTF ), PF( RCC_, PORRSTF ),
+	PF( RCC_, SFTRSTF ), PF( RCC_, IWDGRSTF ), PF( RCC_, WWDGRSTF ), PF( RCC_, LPWRRSTF ), { 0 } };
+
+static const struct PeriphRegister periph_rcc[] = {
+	PREG( RCC_TypeDef, CTLR, 0, periph_rcc_ctlr ),
+	PREG( RCC_TypeDef, CFGR0, 0, periph_rcc_cfgr0 ),
+	PREG( RCC_TypeDef, INTR, 0, 0 ),
+	PREG( RCC_TypeDef, APB2PRSTR, 0, 0 ),
+	PREG( RCC_TypeDef, APB1PRSTR, 0, 0 ),
+	PREG( RCC_TypeDef, AHBPCENR, 0, periph_rcc_ahbpcenr ),
+	PREG( RCC_TypeDef, APB2PCENR, 0, periph_rcc_apb2pcenr ),
+	PREG( RCC_TypeDef, APB1PCENR, 0, periph_rcc_apb1pcenr ),
+	PREG( RCC_TypeDef, RSTSCKR, 0, periph_rcc_rstsckr ),
+	{ 0 } };
+
+static const struct PeriphField periph_flash_actlr[] = { PF( FLASH_ACTLR_, LATENCY ), { 0 } };
+static const struct PeriphField periph_flash_statr[] = { PF( FLASH_STATR_, BSY ), PF( FLASH_STATR_, WRPRTERR ), PF( FLASH_STATR_, EOP ),
+	PF( FLASH_STATR_, MODE ), PF( FLASH_STATR_, LOCK ), { 0 } };
+static const struct PeriphField periph_flash_ctlr[] = { PF( FLASH_CTLR_, PG ), PF( FLASH_CTLR_, PER ), PF( FLASH_CTLR_, STRT ), PF( FLASH_CTLR_, LOCK ), { 0 } };
+
+static const struct PeriphRegister periph_flash[] = {
+	PREG( FLASH_TypeDef, ACTLR, 0, periph_flash_actlr ),
+	PREG( FLASH_TypeDef, KEYR, PERIPH_WO, 0 ),
+	PREG( FLASH_TypeDef, OBKEYR, PERIPH_WO, 0 ),
+	PREG( FLASH_TypeDef, STATR, 0, periph_flash_statr ),
+	PREG( FLASH_TypeDef, CTLR, 0, periph_flash_ctlr ),
+	PREG( FLASH_TypeDef, ADDR, PERIPH_WO, 0 ),
+	PREG( FLASH_TypeDef, OBR, 0, 0 ),
+	PREG( FLASH_TypeDef, WPR, 0, 0 ),
+	PREG( FLASH_TypeDef, MODEKEYR, PERIPH_WO, 0 ),
+	PREG( FLASH_TypeDef, BOOT_MODEKEYR, PERIPH_WO, 0 ),
+	{ 0 } };
+
+static const struct PeriphRegister periph_afio[] = {
+	PREG( AFIO_TypeDef, PCFR1, 0, 0 ),
+	PREG( AFIO_TypeDef, EXTICR, 0, 0 ),
+	{ 0 } };
+
+static const struct PeriphRegister periph_exti[] = {
+	PREG( EXTI_TypeDef, INTENR, 0, 0 ),
+	PREG( EXTI_TypeDef, EVENR, 0, 0 ),
+	PREG( EXTI_TypeDef, RTENR, 0, 0 ),
+	PREG( EXTI_TypeDef, FTENR, 0, 0 ),
+	PREG( EXTI_TypeDef, SWIEVR, 0, 0 ),
+	PREG( EXTI_TypeDef, INTFR, 0, 0 ),
+	{ 0 } };
+
+// Pins are decoded separately, see PeriphPrintGpio().
+static const struct PeriphRegister periph_gpio[] = {
+	PREG( GPIO_TypeDef, CFGLR, 0, 0 ),
+	PREG( GPIO_TypeDef, CFGHR, 0, 0 ),
+	PREG( GPIO_TypeDef, INDR, 0, 0 ),
+	PREG( GPIO_TypeDef, OUTDR, 0, 0 ),
+	PREG( GPIO_TypeDef, BSHR, PERIPH_WO, 0 ),
+	PREG( GPIO_TypeDef, BCR, PERIPH_WO, 0 ),
+	PREG( GPIO_TypeDef, LCKR, 0, 0 ),
+	{ 0 } };
+
+static const struct PeriphField periph_pwr_ctlr[] = { PF( PWR_CTLR_, PDDS ), PF( PWR_CTLR_, PVDE ), { 0 } };
+static const struct PeriphField periph_pwr_csr[] = { PF( PWR_CSR_, PVDO ), { 0 } };
+
+static const struct PeriphRegister periph_pwr[] = {
+	PREG( PWR_TypeDef, CTLR, 0, periph_pwr_ctlr ),
+	PREG( PWR_TypeDef, CSR, 0, periph_pwr_csr ),
+	PREG( PWR_TypeDef, AWUCSR, 0, 0 ),
+	PREG( PWR_TypeDef, AWUWR, 0, 0 ),
+	PREG( PWR_TypeDef, AWUPSC, 0, 0 ),
+	{ 0 } };
+
+static const struct PeriphField periph_iwdg_statr[] = { PF( IWDG_, PVU ), PF( IWDG_, RVU ), { 0 } };
+
+static const struct PeriphRegister periph_iwdg[] = {
+	PREG( IWDG_TypeDef, CTLR, PERIPH_WO, 0 ),
+	PREG( IWDG_TypeDef, PSCR, 0, 0 ),
+	PREG( IWDG_TypeDef, RLDR, 0, 0 ),
+	PREG( IWDG_TypeDef, STATR, 0, periph_iwdg_statr ),
+	{ 0 } };
+
+static const struct PeriphField periph_wwdg_ctlr[] = { PF( WWDG_CTLR_, WDGA ), { 0 } };
+
+static const struct PeriphRegister periph_wwdg[] = {
+	PREG( WWDG_TypeDef, CTLR, 0, periph_wwdg_ctlr ),
+	PREG( WWDG_TypeDef, CFGR, 0, 0 ),
+	PREG( WWDG_TypeDef, STATR, 0, 0 ),
+	{ 0 } };
+
+static const struct PeriphField periph_tim_ctlr1[] = { PF( TIM_, CEN ), PF( TIM_, OPM ), PF( TIM_, DIR ), PF( TIM_, ARPE ), { 0 } };
+static const struct PeriphField periph_tim_intfr[] = { PF( TIM_, UIF ), { 0 } };
+static const struct PeriphField periph_tim_bdtr[] = { PF( TIM_, MOE ), { 0 } };
+
+static const struct PeriphRegister periph_tim[] = {
+	PREG( TIM_TypeDef, CTLR1, 0, periph_tim_ctlr1 ),
+	PREG( TIM_TypeDef, CTLR2, 0, 0 ),
+	PREG( TIM_TypeDef, SMCFGR, 0, 0 ),
+	PREG( TIM_TypeDef, DMAINTENR, 0, 0 ),
+	PREG( TIM_TypeDef, INTFR, 0, periph_tim_intfr ),
+	PREG( TIM_TypeDef, SWEVGR, PERIPH_WO, 0 ),
+	PREG( TIM_TypeDef, CHCTLR1, 0, 0 ),
+	PREG( TIM_TypeDef, CHCTLR2, 0, 0 ),
+	PREG( TIM_TypeDef, CCER, 0, 0 ),
+	PREG( TIM_TypeDef, CNT, 0, 0 ),
+	PREG( TIM_TypeDef, PSC, 0, 0 ),
+	PREG( TIM_TypeDef, ATRLR, 0, 0 ),
+	PREG( TIM_TypeDef, RPTCR, 0, 0 ),
+	PREG( TIM_TypeDef, CH1CVR, 0, 0 ),
+	PREG( TIM_TypeDef, CH2CVR, 0, 0 ),
+	PREG( TIM_TypeDef, CH3CVR, 0, 0 ),
+	PREG( TIM_TypeDef, CH4CVR, 0, 0 ),
+	PREG( TIM_TypeDef, BDTR, 0, periph_tim_bdtr ),
+	PREG( TIM_TypeDef, DMACFGR, 0, 0 ),
+	{ 0 } };
+
+static const struct PeriphField periph_usart_statr[] = { PF( USART_STATR_, PE ), PF( USART_STATR_, FE ), PF( USART_STATR_, NE ),
+	PF( USART_STATR_, ORE ), PF( USART_STATR_, IDLE ), PF( USART_STATR_, RXNE ), PF( USART_STATR_, TC ), PF( USART_STATR_, TXE ), { 0 } };
+static const struct PeriphField periph_usart_ctlr1[] = { PF( USART_CTLR1_, RE ), PF( USART_CTLR1_, TE ), PF( USART_CTLR1_, UE ), { 0 } };
+static const struct PeriphField periph_usart_ctlr3[] = { PF( USART_CTLR3_, DMAR ), PF( USART_CTLR3_, DMAT ), { 0 } };
+
+// Reading DATAR after STATR clears RXNE, ORE and friends.
+static const struct PeriphRegister periph_usart[] = {
+	PREG( USART_TypeDef, STATR, 0, periph_usart_statr ),
+	PREG( USART_TypeDef, DATAR, PERIPH_SKIP, 0 ),
+	PREG( USART_TypeDef, BRR, 0, 0 ),
+	PREG( USART_TypeDef, CTLR1, 0, periph_usart_ctlr1 ),
+	PREG( USART_TypeDef, CTLR2, 0, 0 ),
+	PREG( USART_TypeDef, CTLR3, 0, periph_usart_ctlr3 ),
+	PREG( USART_TypeDef, GPR, 0, 0 ),
+	{ 0 } };
+
+static const struct PeriphField periph_spi_ctlr1[] = { PF( SPI_CTLR1_, MSTR ), PF( SPI_CTLR1_, SPE ), { 0 } };
+static const struct PeriphField periph_spi_statr[] = { PF( SPI_STATR_, RXNE ), PF( SPI_STATR_, TXE ), PF( SPI_STATR_, UDR ),
+	PF( SPI_STATR_, CRCERR ), PF( SPI_STATR_, MODF ), PF( SPI_STATR_, OVR ), PF( SPI_STATR_, BSY ), { 0 } };
+
+static const struct PeriphRegister periph_spi[] = {
+	PREG( SPI_TypeDef, CTLR1, 0, periph_spi_ctlr1 ),
+	PREG( SPI_TypeDef, CTLR2, 0, 0 ),
+	PREG( SPI_TypeDef, STATR, 0, periph_spi_statr ),
+	PREG( SPI_TypeDef, DATAR, PERIPH_SKIP, 0 ),
+	PREG( SPI_TypeDef, CRCR, 0, 0 ),
+	PREG( SPI_TypeDef, RCRCR, 0, 0 ),
+	PREG( SPI_TypeDef, TCRCR, 0, 0 ),
+	PREG( SPI_TypeDef, HSCR, 0, 0 ),
+	{ 0 } };
+
+static const struct PeriphField periph_i2c_ctlr1[] = { PF( I2C_CTLR1_, PE ), PF( I2C_CTLR1_, START ), PF( I2C_CTLR1_, STOP ), { 0 } };
+static const struct PeriphField periph_i2c_star1[] = { PF( I2C_STAR1_, SB ), PF( I2C_STAR1_, ADDR ), PF( I2C_STAR1_, BTF ),
+	PF( I2C_STAR1_, STOPF ), PF( I2C_STAR1_, RXNE ), PF( I2C_STAR1_, TXE ), PF( I2C_STAR1_, BERR ), PF( I2C_STAR1_, ARLO ),
+	PF( I2C_STAR1_, AF ), PF( I2C_STAR1_, OVR ), { 0 } };
+
+// STAR1 then STAR2 is how ADDR gets cleared, so STAR2 is left for the firmware.
+static const struct PeriphRegister periph_i2c[] = {
+	PREG( I2C_TypeDef, CTLR1, 0, periph_i2c_ctlr1 ),
+	PREG( I2C_TypeDef, CTLR2, 0, 0 ),
+	PREG( I2C_TypeDef, OADDR1, 0, 0 ),
+	PREG( I2C_TypeDef, OADDR2, 0, 0 ),
+	PREG( I2C_TypeDef, DATAR, PERIPH_SKIP, 0 ),
+	PREG( I2C_TypeDef, STAR1, 0, periph_i2c_star1 ),
+	PREG( I2C_TypeDef, STAR2, PERIPH_SKIP, 0 ),
+	PREG( I2C_TypeDef, CKCFGR, 0, 0 ),
+	{ 0 } };
+
+static const struct PeriphField periph_adc_statr[] = { PF( ADC_, EOC ), PF( ADC_, JEOC ), PF( ADC_, STRT ), { 0 } };
+static const struct PeriphField periph_adc_ctlr2[] = { PF( ADC_, ADON ), PF( ADC_, CONT ), PF( ADC_, DMA ), { 0 } };
+
+// Reading RDATAR clears EOC.
+static const struct PeriphRegister periph_adc[] = {
+	PREG( ADC_TypeDef, STATR, 0, periph_adc_statr ),
+	PREG( ADC_TypeDef, CTLR1, 0, 0 ),
+	PREG( ADC_TypeDef, CTLR2, 0, periph_adc_ctlr2 ),
+	PREG( ADC_TypeDef, SAMPTR1, 0, 0 ),
+	PREG( ADC_TypeDef, SAMPTR2, 0, 0 ),
+	PREG( ADC_TypeDef, WDHTR, 0, 0 ),
+	PREG( ADC_TypeDef, WDLTR, 0, 0 ),
+	PREG( ADC_TypeDef, RSQR1, 0, 0 ),
+	PREG( ADC_TypeDef, RSQR2, 0, 0 ),
+	PREG( ADC_TypeDef, RSQR3, 0, 0 ),
+	PREG( ADC_TypeDef, ISQR, 0, 0 ),
+	PREG( ADC_TypeDef, IDATAR1, 0, 0 ),
+	PREG( ADC_TypeDef, IDATAR2, 0, 0 ),
+	PREG( ADC_TypeDef, IDATAR3, 0, 0 ),
+	PREG( ADC_TypeDef, IDATAR4, 0, 0 ),
+	PREG( ADC_TypeDef, RDATAR, PERIPH_SKIP, 0 ),
+	PREG( ADC_TypeDef, DLYR, 0, 0 ),
+	{ 0 } };
+
+static const struct PeriphRegister periph_dma[] = {
+	PREG( DMA_TypeDef, INTFR, 0, 0 ),
+	PREG( DMA_TypeDef, INTFCR, PERIPH_WO, 0 ),
+	{ 0 } };
+
+static const struct PeriphField periph_dma_cfgr[] = { PF( DMA_CFGR1_, EN ), PF( DMA_CFGR1_, TCIE ), PF( DMA_CFGR1_, DIR ), PF( DMA_CFGR1_, CIRC ), { 0 } };
+
+static const struct PeriphRegister periph_dma_channel[] = {
+	PREG( DMA_Channel_TypeDef, CFGR, 0, periph_dma_cfgr ),
+	PREG( DMA_Channel_TypeDef, CNTR, 0, 0 ),
+	PREG( DMA_Channel_TypeDef, PADDR, 0, 0 ),
+	PREG( DMA_Channel_TypeDef, MADDR, 0, 0 ),
+	{ 0 } };
+
+static const struct PeriphField periph_exten_ctr[] = { PF( EXTEN_, LOCKUP_EN ), PF( EXTEN_, LOCKUP_RSTF ), PF( EXTEN_, OPA_EN ), { 0 } };
+
+static const struct PeriphRegister periph_exten[] = {
+	PREG( EXTEN_TypeDef, EXTEN_CTR, 0, periph_exten_ctr ),
+	{ 0 } };
+
+// Only the first 64 interrupts, which is all these parts have.
+static const struct PeriphRegister periph_pfic[] = {
+	PREG( PFIC_Type, ISR[0], 0, 0 ),
+	PREG( PFIC_Type, ISR[1], 0, 0 ),
+	PREG( PFIC_Type, IPR[0], 0, 0 ),
+	PREG( PFIC_Type, IPR[1], 0, 0 ),
+	PREG( PFIC_Type, ITHRESDR, 0, 0 ),
+	PREG( PFIC_Type, CFGR, 0, 0 ),
+	PREG( PFIC_Type, GISR, 0, 0 ),
+	PREG( PFIC_Type, VTFADDR[0], 0, 0 ),
+	PREG( PFIC_Type, VTFADDR[1], 0, 0 ),
+	PREG( PFIC_Type, IACTR[0], 0, 0 ),
+	PREG( PFIC_Type, IACTR[1], 0, 0 ),
+	PREG( PFIC_Type, SCTLR, 0, 0 ),
+	{ 0 } };
+
+static const struct PeriphRegister periph_systick[] = {
+	PREG( SysTick_Type, CTLR, 0, 0 ),
+	PREG( SysTick_Type, SR, 0, 0 ),
+	PREG( SysTick_Type, CNT, 0, 0 ),
+	PREG( SysTick_Type, CMP, 0, 0 ),
+	{ 0 } };
+
+static const struct PeriphBlock periph_blocks[] = {
+	{ "RCC", RCC_BASE, periph_rcc },
+	{ "FLASH", FLASH_R_BASE, periph_flash },
+	{ "PWR", PWR_BASE, periph_pwr },
+	{ "AFIO", AFIO_BASE, periph_afio },
+	{ "EXTI", EXTI_BASE, periph_exti },
+	{ "GPIOA", GPIOA_BASE, periph_gpio },
+	{ "GPIOC", GPIOC_BASE, periph_gpio },
+	{ "GPIOD", GPIOD_BASE, periph_gpio },
+	{ "IWDG", IWDG_BASE, periph_iwdg },
+	{ "WWDG", WWDG_BASE, periph_wwdg },
+	{ "TIM1", TIM1_BASE, periph_tim },
+	{ "TIM2", TIM2_BASE, periph_tim },
+	{ "USART1", USART1_BASE, periph_usart },
+	{ "SPI1", SPI1_BASE, periph_spi },
+	{ "I2C1", I2C1_BASE, periph_i2c },
+	{ "ADC1", ADC1_BASE, periph_adc },
+	{ "DMA1", DMA1_BASE, periph_dma },
+	{ "DMA1_CH1", DMA1_Channel1_BASE, periph_dma_channel },
+	{ "DMA1_CH2", DMA1_Channel2_BASE, periph_dma_channel },
+	{ "DMA1_CH3", DMA1_Channel3_BASE, periph_dma_channel },
+	{ "DMA1_CH4", DMA1_Channel4_BASE, periph_dma_channel },
+	{ "DMA1_CH5", DMA1_Channel5_BASE, periph_dma_channel },
+	{ "DMA1_CH6", DMA1_Channel6_BASE, periph_dma_channel },
+	{ "DMA1_CH7", DMA1_Channel7_BASE, periph_dma_channel },
+	{ "EXTEN", EXTEN_BASE, periph_exten },
+	{ "PFIC", PFIC_BASE, periph_pfic },
+	{ "SysTick", SysTick_BASE, periph_systick },
+};
+
+#define PERIPH_NBLOCKS ( (int)( sizeof( periph_blocks ) / sizeof( periph_blocks[0] ) ) )
+
+static const char * periph_gpio_in[] = { "analog", "floating", "pull-up/down", "reserved" };
+static const char * periph_gpio_out[] = { "push-pull", "open-drain", "AF push-pull", "AF open-drain" };
+static const char * periph_gpio_speed[] = { 0, "10MHz", "2MHz", "30MHz" };
+
+// Case insensitive prefix match of a block name against one entry of a comma separated list.
+static int PeriphSelected( const struct PeriphBlock * b, const char * selection )
+{
+	const char * s = selection;
+	if( strcmp( selection, "all" ) == 0 )
+		return 1;
+	while( *s )
+	{
+		int len = 0;
+		while( s[len] && s[len] != ',' ) len++;
+		int i = 0;
+		while( i < len && b->name[i] && toupper( (unsigned char)b->name[i] ) == toupper( (unsigned char)s[i] ) ) i++;
+		if( len && i == len )
+			return 1;
+		s += len;
+		if( *s ) s++;
+	}
+	return 0;
+}
+
+static int PeriphInCapture( const struct PeriphBlock * b, const struct PeriphCapture * c )
+{
+	int i;
+	for( i = 0; i < c->count; i++ )
+	{
+		int prefix = strlen( b->name );
+		if( strncmp( c->v[i].name, b->name, prefix ) == 0 && c->v[i].name[prefix] == '.' )
+			return 1;
+	}
+	return 0;
+}
+
+static void PeriphAdd( struct PeriphCapture * c, const char * block, const char * reg, uint32_t address, uint32_t value )
+{
+	c->v = realloc( c->v, ( c->count + 1 ) * sizeof( struct PeriphValue ) );
+	struct PeriphValue * v = &c->v[c->count++];
+	if( snprintf( v->name, sizeof( v->name ), "%s.%s", block, reg ) >= (int)sizeof( v->name ) )
+		fprintf( stderr, "Warning: %s.%s is shortened to %s\n", block, reg, v->name );
+	v->address = address;
+	v->value = value;
+}
+
+// Reads every readable register of a block, in as few spans as the side effects allow.
+static int PeriphReadBlock( void * dev, const struct PeriphBlock * b, struct PeriphCapture * c, int * spans )
+{
+	uint8_t buffer[PERIPH_MAX_SPAN];
+	const struct PeriphRegister * regs = b->regs;
+	int i = 0, r = 0;
+
+	while( regs[i].name && !r )
+	{
+		if( regs[i].flags & PERIPH_SKIP )
+		{
+			i++;
+			continue;
+		}
+		int last = i;
+		while( regs[last+1].name && !( regs[last+1].flags & PERIPH_SKIP ) &&
+			regs[last+1].offset - ( regs[last].offset + regs[last].size ) <= PERIPH_MERGE_GAP &&
+			regs[last+1].offset + regs[last+1].size - ( regs[i].offset & ~3 ) <= PERIPH_MAX_SPAN )
+			last++;
+		uint32_t start = regs[i].offset & ~3;
+		uint32_t end = ( regs[last].offset + regs[last].size + 3 ) & ~3;
+		r = MCF.ReadBinaryBlob( dev, b->base + start, end - start, buffer );
+		(*spans)++;
+		for( ; i <= last && !r; i++ )
+		{
+			const uint8_t * d = buffer + regs[i].offset - start;
+			uint32_t value = d[0];
+			if( regs[i].size >= 2 ) value |= d[1] << 8;
+			if( regs[i].size == 4 ) value |= ( d[2] << 16 ) | ( (uint32_t)d[3] << 24 );
+			if( !( regs[i].flags & PERIPH_WO ) )
+				PeriphAdd( c, b->name, regs[i].name, b->base + regs[i].offset, value );
+		}
+	}
+	return r;
+}
+
+// Stops the core, reads the blocks that are picked by selection (or that appear in like), and lets it go.
+static int PeriphCaptureLive( void * dev, const char * selection, const struct PeriphCapture * like, struct PeriphCapture * c )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int i, r = 0, blocks = 0, spans = 0;
+
+	if( !MCF.ReadBinaryBlob || !MCF.ReadCPURegister || !MCF.WriteCPURegister )
+	{
+		fprintf( stderr, "Error: Reading peripherals needs debug module access, which this programmer doesn't have\n" );
+		return -5;
+	}
+	if( iss->target_chip_type && iss->target_chip_type != CHIP_CH32V003 )
+		fprintf( stderr, "Warning: Register layouts are from the CH32V003 headers, blocks this part doesn't share may read wrong\n" );
+
+	uint64_t start = GetTimeMicroseconds();
+	struct TargetHold hold;
+	r = TargetHold( dev, &hold, TARGET_HOLD_MAILBOX );
+	if( r )
+	{
+		fprintf( stderr, r == -1 ? "Error: Core did not stop, it may be asleep\n" : "Error: Could not save the core's registers\n" );
+		return -5;
+	}
+	for( i = 0; i < PERIPH_NBLOCKS && !r; i++ )
+	{
+		const struct PeriphBlock * b = &periph_blocks[i];
+		if( selection ? !PeriphSelected( b, selection ) : !PeriphInCapture( b, like ) )
+			continue;
+		r = PeriphReadBlock( dev, b, c, &spans );
+		if( r )
+			fprintf( stderr, "Error: Could not read %s at 0x%08x\n", b->name, b->base );
+		blocks++;
+	}
+	TargetRelease( dev, &hold );
+
+	if( !r && !blocks )
+	{
+		fprintf( stderr, "Error: No peripheral matches %s, try one of", selection ? selection : "the capture" );
+		for( i = 0; i < PERIPH_NBLOCKS; i++ )
+			fprintf( stderr, " %s", periph_blocks[i].name );
+		fprintf( stderr, "\n" );
+		return -9;
+	}
+	fprintf( stderr, "Read %d registers from %d blocks in %d spans, core %s for %llu us\n", c->count, blocks, spans,
+		hold.was_running ? "held" : "halted", (unsigned long long)( GetTimeMicroseconds() - start ) );
+	return r ? -5 : 0;
+}
+
+static int PeriphLoad( const char * file, struct PeriphCapture * c )
+{
+	char line[256];
+	FILE * f = fopen( file, "r" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: Could not open %s\n", file );
+		return -9;
+	}
+	while( fgets( line, sizeof( line ), f ) )
+	{
+		char name[32];
+		uint32_t address, value;
+		if( line[0] == '#' )
+			continue;
+		if( sscanf( line, "%31s %x %x", name, &address, &value ) == 3 )
+		{
+			char * dot = strchr( name, '.' );
+			if( !dot ) continue;
+			*dot = 0;
+			PeriphAdd( c, name, dot + 1, address, value );
+		}
+	}
+	fclose( f );
+	if( !c->count )
+	{
+		fprintf( stderr, "Error: %s has no registers in it\n", file );
+		return -9;
+	}
+	return 0;
+}
+
+static int PeriphSave( const char * file, const struct PeriphCapture * c )
+{
+	int i;
+	FILE * f = fopen( file, "w" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: Could not open %s\n", file );
+		return -9;
+	}
+	fprintf( f, "# register address value\n" );
+	for( i = 0; i < c->count; i++ )
+		fprintf( f, "%s %08x %08x\n", c->v[i].name, c->v[i].address, c->v[i].value );
+	fclose( f );
+	return 0;
+}
+
+static const struct PeriphRegister * PeriphLookup( uint32_t address, const struct PeriphBlock ** block )
+{
+	int i, j;
+	for( i = 0; i < PERIPH_NBLOCKS; i++ )
+	{
+		const struct PeriphBlock * b = &periph_blocks[i];
+		for( j = 0; b->regs[j].name; j++ )
+			if( b->base + b->regs[j].offset == address )
+			{
+				*block = b;
+				return &b->regs[j];
+			}
+	}
+	return 0;
+}
+
+static uint32_t PeriphFieldValue( uint32_t value, uint32_t mask )
+{
+	uint32_t v = value & mask;
+	while( mask && !( mask & 1 ) )
+	{
+		mask >>= 1;
+		v >>= 1;
+	}
+	return v;
+}
+
+// Every field of a register, or with a previous value, only the ones that changed.
+static void PeriphPrintFields( const struct PeriphRegister * reg, uint32_t value, const uint32_t * previous )
+{
+	const struct PeriphField * f;
+	for( f = reg ? reg->fields : 0; f && f->name; f++ )
+	{
+		uint32_t v = PeriphFieldValue( value, f->mask );
+		if( !previous )
+			printf( " %s=%x", f->name, v );
+		else if( v != PeriphFieldValue( *previous, f->mask ) )
+			printf( " %s %x->%x", f->name, PeriphFieldValue( *previous, f->mask ), v );
+	}
+}
+
+static void PeriphDescribePin( char * out, int len, uint32_t cfg, int pull_up )
+{
+	if( cfg & 3 )
+		snprintf( out, len, "out %s %s", periph_gpio_out[cfg>>2], periph_gpio_speed[cfg&3] );
+	else if( ( cfg >> 2 ) == 2 )
+		snprintf( out, len, "in pull-%s", pull_up ? "up" : "down" );
+	else
+		snprintf( out, len, "in %s", periph_gpio_in[cfg>>2] );
+}
+
+// Mode of each pin, with what is seen on it and what is driven.  With before, only pins that changed.
+static void PeriphPrintGpio( const struct PeriphBlock * b, const struct PeriphCapture * c, const struct PeriphCapture * before )
+{
+	uint32_t now[4] = { 0 }, then[4] = { 0 };
+	int have = 0, had = 0, i, pin;
+	for( i = 0; i < 4; i++ )
+	{
+		uint32_t address = b->base + b->regs[i].offset;
+		int k;
+		for( k = 0; k < c->count; k++ )
+			if( c->v[k].address == address ) { now[i] = c->v[k].value; have |= 1<<i; }
+		for( k = 0; before && k < before->count; k++ )
+			if( before->v[k].address == address ) { then[i] = before->v[k].value; had |= 1<<i; }
+	}
+	if( ( have & 0xd ) != 0xd || ( before && ( had & 0xd ) != 0xd ) )
+		return;
+	int pins = ( now[1] != 0x44444444 || ( before && then[1] != 0x44444444 ) ) ? 16 : 8;
+	for( pin = 0; pin < pins; pin++ )
+	{
+		char desc[64], was[64];
+		uint32_t cfg = ( now[pin>>3] >> ( ( pin & 7 ) * 4 ) ) & 0xf;
+		int in = ( now[2] >> pin ) & 1, out = ( now[3] >> pin ) & 1;
+		PeriphDescribePin( desc, sizeof( desc ), cfg, out );
+		if( !before )
+		{
+			printf( "  P%c%-2d %-24s in=%d out=%d\n", b->name[4], pin, desc, in, out );
+			continue;
+		}
+		uint32_t cfg_was = ( then[pin>>3] >> ( ( pin & 7 ) * 4 ) ) & 0xf;
+		int in_was = ( then[2] >> pin ) & 1, out_was = ( then[3] >> pin ) & 1;
+		if( cfg == cfg_was && in == in_was && out == out_was )
+			continue;
+		PeriphDescribePin( was, sizeof( was ), cfg_was, out_was );
+		printf( "  P%c%-2d %s in=%d out=%d -> %s in=%d out=%d\n", b->name[4], pin, was, in_was, out_was, desc, in, out );
+	}
+}
+
+static void PeriphPrint( const struct PeriphCapture * c )
+{
+	const struct PeriphBlock * last = 0;
+	int i;
+	for( i = 0; i < c->count; i++ )
+	{
+		const struct PeriphBlock * b = 0;
+		const struct PeriphRegister * reg = PeriphLookup( c->v[i].address, &b );
+		if( b != last && last && last->regs == periph_gpio )
+			PeriphPrintGpio( last, c, 0 );
+		if( b != last && b )
+			printf( "%s @ %08x\n", b->name, b->base );
+		last = b;
+		printf( "  %-16s %08x = %0*x", c->v[i].name, c->v[i].address, reg && reg->size == 2 ? 4 : 8, c->v[i].value );
+		PeriphPrintFields( reg, c->v[i].value, 0 );
+		printf( "\n" );
+	}
+	if( last && last->regs == periph_gpio )
+		PeriphPrintGpio( last, c, 0 );
+}
+
+int RunPeriph( void * dev, const char * selection, const char * file )
+{
+	struct PeriphCapture c = { 0 };
+	int r = PeriphCaptureLive( dev, selection, 0, &c );
+	if( !r )
+	{
+		PeriphPrint( &c );
+		if( strcmp( file, "-" ) != 0 )
+			r = PeriphSave( file, &c );
+	}
+	free( c.v );
+	return r;
+}
+
+int RunPeriphDiff( void * dev, const char * before_file, const char * after_file )
+{
+	struct PeriphCapture before = { 0 }, after = { 0 };
+	const struct PeriphBlock * gpio_done = 0;
+	int i, k, changed = 0;
+	int r = PeriphLoad( before_file, &before );
+	if( !r )
+		r = strcmp( after_file, "-" ) ? PeriphLoad( after_file, &after ) : PeriphCaptureLive( dev, 0, &before, &after );
+	for( i = 0; i < after.count && !r; i++ )
+	{
+		for( k = 0; k < before.count && before.v[k].address != after.v[i].address; k++ );
+		if( k == before.count || before.v[k].value == after.v[i].value )
+			continue;
+		const struct PeriphBlock * b = 0;
+		const struct PeriphRegister * reg = PeriphLookup( after.v[i].address, &b );
+		int width = reg && reg->size == 2 ? 4 : 8;
+		printf( "%-16s %08x %0*x -> %0*x", after.v[i].name, after.v[i].address, width, before.v[k].value, width, after.v[i].value );
+		PeriphPrintFields( reg, after.v[i].value, &before.v[k].value );
+		printf( "\n" );
+		// Pins once per port, on the first of its registers that changed.
+		if( b && b->regs == periph_gpio && reg->offset <= offsetof( GPIO_TypeDef, OUTDR ) && b != gpio_done )
+		{
+			PeriphPrintGpio( b, &after, &before );
+			gpio_done = b;
+		}
+		changed++;
+	}
+	if( !r )
+		fprintf( stderr, "%d register%s changed\n", changed, changed == 1 ? "" : "s" );
+	free( before.v );
+	free( after.v );
+	return r;
+}
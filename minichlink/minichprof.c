@@ -0,0 +1,305 @@
+// Statistical profiler, --profile.  Stops the core every so often, reads
+// where it was (DPC), and lets it go again.  The samples are resolved against
+// the firmware's ELF afterwards, so nothing but the sampling itself happens
+// while the target is running.
+//
+// The halt window is kept as short as the debug module allows: halt request,
+// a sentinel into DATA0, the abstract register read, and resume request.
+// DATA0 is also the terminal's mailbox, so it's read first and put back.
+// HaltMode() isn't used, it waits milliseconds for things we don't need.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "terminalhelp.h"
+#include "minichlink.h"
+#include "minichelf.h"
+
+#define PROFILE_DMI_PER_SAMPLE 8 // haltreq, save data0, sentinel, abstractauto, command, data0, restore data0, resumereq
+#define PROFILE_TOP_LINES 20
+
+struct ProfileEntry
+{
+	uint32_t pc;
+	uint32_t count;
+	const char * function;
+	const char * file;
+	uint32_t line;
+};
+
+static int profile_rate_hz; // 0 = as fast as the programmer goes.
+
+static struct ProfileEntry * profile_table; // Open addressing on pc.
+static uint32_t profile_table_size;
+static uint32_t profile_unique;
+
+void ProfileSetRate( int hz )
+{
+	profile_rate_hz = hz;
+}
+
+static void ProfileAdd( uint32_t pc )
+{
+	if( profile_unique * 2 >= profile_table_size )
+	{
+		struct ProfileEntry * old = profile_table;
+		uint32_t oldsize = profile_table_size, i;
+		profile_table_size = oldsize ? oldsize * 2 : 1024;
+		profile_table = calloc( profile_table_size, sizeof( struct ProfileEntry ) );
+		profile_unique = 0;
+		for( i = 0; i < oldsize; i++ )
+		{
+			if( !old[i].count ) continue;
+			uint32_t h = ( old[i].pc >> 1 ) & ( profile_table_size - 1 );
+			while( profile_table[h].count ) h = ( h + 1 ) & ( profile_table_size - 1 );
+			profile_table[h] = old[i];
+			profile_unique++;
+		}
+		free( old );
+	}
+
+	uint32_t h = ( pc >> 1 ) & ( profile_table_size - 1 );
+	while( profile_table[h].count && profile_table[h].pc != pc )
+		h = ( h + 1 ) & ( profile_table_size - 1 );
+	if( !profile_table[h].count )
+	{
+		profile_table[h].pc = pc;
+		profile_unique++;
+	}
+	profile_table[h].count++;
+}
+
+// One sample, returns 0 and the PC if the core really stopped for it.
+static int ProfileSample( void * dev, uint32_t * pc )
+{
+	uint32_t mailbox = 0;
+	MCF.WriteReg32( dev, DMCONTROL, 0x80000001 ); // Request halt
+	// A terminal word the firmware posted, or input on its way to it, has to survive the sample.
+	if( MCF.ReadReg32( dev, DMDATA0, &mailbox ) )
+	{
+		MCF.WriteReg32( dev, DMCONTROL, 0x40000001 );
+		if( MCF.FlushLLCommands ) MCF.FlushLLCommands( dev );
+		return -1;
+	}
+	// DPC is always even, so if this survives the read, the read didn't happen.
+	MCF.WriteReg32( dev, DMDATA0, 1 );
+	int r = MCF.ReadCPURegister( dev, 0x7b1, pc );
+	MCF.WriteReg32( dev, DMDATA0, mailbox );
+	MCF.WriteReg32( dev, DMCONTROL, 0x40000001 ); // Request resume
+	if( MCF.FlushLLCommands ) MCF.FlushLLCommands( dev );
+	if( r || ( *pc & 1 ) )
+	{
+		// Clear cmderr, or every abstract command after this gets ignored too.
+		MCF.WriteReg32( dev, DMABSTRACTCS, 0x00000700 );
+		return -1;
+	}
+	return 0;
+}
+
+// Flash is also visible at 0x08000000, the ELF may be linked at either.
+static const char * ProfileResolve( struct MiniElf * elf, struct MiniElfLines * lines, struct ProfileEntry * e )
+{
+	uint32_t alias = ( e->pc >= 0x08000000 ) ? e->pc - 0x08000000 : e->pc + 0x08000000;
+	e->function = MiniElfSymbolForAddress( elf, e->pc, 0 );
+	if( !e->function ) e->function = MiniElfSymbolForAddress( elf, alias, 0 );
+	if( MiniElfLineForAddress( lines, e->pc, &e->file, &e->line ) &&
+		MiniElfLineForAddress( lines, alias, &e->file, &e->line ) )
+	{
+		e->file = 0;
+		e->line = 0;
+	}
+	if( !e->function ) e->function = "[unknown]";
+	return e->function;
+}
+
+static int ProfileCompareCount( const void * a, const void * b )
+{
+	const struct ProfileEntry * ea = a, * eb = b;
+	if( ea->count != eb->count ) return ( ea->count > eb->count ) ? -1 : 1;
+	return ( ea->pc < eb->pc ) ? -1 : ( ea->pc > eb->pc );
+}
+
+static int ProfileCompareFunction( const void * a, const void * b )
+{
+	const struct ProfileEntry * ea = a, * eb = b;
+	return strcmp( ea->function, eb->function );
+}
+
+static int ProfileCompareLine( const void * a, const void * b )
+{
+	const struct ProfileEntry * ea = a, * eb = b;
+	int r = strcmp( ea->file ? ea->file : "", eb->file ? eb->file : "" );
+	if( r ) return r;
+	if( ea->line != eb->line ) return ( ea->line < eb->line ) ? -1 : 1;
+	// Unknown lines stay separate per address.
+	return ea->file ? 0 : ( ea->pc < eb->pc ) ? -1 : ( ea->pc > eb->pc );
+}
+
+static const char * ProfileLineName( struct ProfileEntry * e, char * buf, int len )
+{
+	if( e->file )
+		snprintf( buf, len, "%s:%u", e->file, e->line );
+	else
+		snprintf( buf, len, "0x%08x", e->pc );
+	return buf;
+}
+
+// Merges runs of entries that compare equal, returns the new count.
+static int ProfileMerge( struct ProfileEntry * e, int n, int (*cmp)( const void *, const void * ) )
+{
+	int i, out = 0;
+	qsort( e, n, sizeof( *e ), cmp );
+	for( i = 0; i < n; i++ )
+	{
+		if( out && cmp( &e[out-1], &e[i] ) == 0 )
+			e[out-1].count += e[i].count;
+		else
+			e[out++] = e[i];
+	}
+	qsort( e, out, sizeof( *e ), ProfileCompareCount );
+	return out;
+}
+
+int RunProfile( void * dev, const char * elffile, int seconds, const char * foldedfile )
+{
+	struct MiniElf elf;
+	struct MiniElfLines lines;
+	uint32_t dmstatus = 0, pc;
+	uint64_t samples = 0, failed = 0, halt_total = 0, halt_max = 0;
+	int i, n;
+
+	if( !MCF.WriteReg32 || !MCF.ReadReg32 || !MCF.ReadCPURegister )
+	{
+		fprintf( stderr, "Error: Profiling needs debug module access, which this programmer doesn't have\n" );
+		return -5;
+	}
+	if( MiniElfLoad( &elf, elffile ) )
+		return -9;
+	MiniElfLoadLines( &elf, &lines );
+	if( !lines.count )
+		fprintf( stderr, "Warning: %s has no line info, profiling by function only\n", elffile );
+
+	// Anything still held back has to be on the target before it runs.
+	MemoryCacheFlush( dev );
+	MCF.ReadReg32( dev, DMSTATUS, &dmstatus );
+	if( dmstatus & 0x200 )
+	{
+		fprintf( stderr, "Target is halted, resuming it to profile\n" );
+		if( MCF.HaltMode ) MCF.HaltMode( dev, HALT_MODE_RESUME );
+	}
+
+	fprintf( stderr, "Profiling for %d s", seconds );
+	if( profile_rate_hz ) fprintf( stderr, " at up to %d Hz", profile_rate_hz );
+	fprintf( stderr, "...\n" );
+
+	uint64_t period = profile_rate_hz ? 1000000 / profile_rate_hz : 0;
+	uint64_t start = GetTimeMicroseconds();
+	uint64_t end = start + (uint64_t)seconds * 1000000;
+	uint64_t next = start;
+	uint64_t now = start;
+	while( now < end )
+	{
+		if( period )
+		{
+			if( now < next )
+			{
+				if( MCF.DelayUS ) MCF.DelayUS( dev, next - now );
+				now = GetTimeMicroseconds();
+				continue;
+			}
+			next += period;
+			// Don't try to make up for time lost on a slow link.
+			if( next < now ) next = now + period;
+		}
+
+		uint64_t before = GetTimeMicroseconds();
+		int r = ProfileSample( dev, &pc );
+		now = GetTimeMicroseconds();
+
+		uint64_t window = now - before;
+		halt_total += window;
+		if( window > halt_max ) halt_max = window;
+		if( r )
+			failed++;
+		else
+		{
+			ProfileAdd( pc );
+			samples++;
+		}
+	}
+	double elapsed = ( now - start ) / 1000000.0;
+	MemoryCacheInvalidate();
+	if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+
+	fprintf( stderr, "%llu samples in %.2f s, %.1f Hz", (unsigned long long)samples, elapsed, elapsed > 0 ? samples / elapsed : 0 );
+	if( failed ) fprintf( stderr, " (%llu failed)", (unsigned long long)failed );
+	if( samples + failed )
+	{
+		fprintf( stderr, ", halt window %llu us average, %llu us max, %d DMI transactions per sample\n",
+			(unsigned long long)( halt_total / ( samples + failed ) ), (unsigned long long)halt_max, PROFILE_DMI_PER_SAMPLE );
+	}
+	else
+		fprintf( stderr, "\n" );
+	if( !samples )
+	{
+		fprintf( stderr, "Error: No samples, is the core running?\n" );
+		MiniElfFreeLines( &lines );
+		MiniElfFree( &elf );
+		return -1;
+	}
+
+	// Pack the hash table down and resolve each distinct PC once.
+	struct ProfileEntry * entries = malloc( profile_unique * sizeof( struct ProfileEntry ) );
+	struct ProfileEntry * work = malloc( profile_unique * sizeof( struct ProfileEntry ) );
+	int unique = 0;
+	for( i = 0; i < (int)profile_table_size; i++ )
+	{
+		if( !profile_table[i].count ) continue;
+		entries[unique] = profile_table[i];
+		ProfileResolve( &elf, &lines, &entries[unique] );
+		unique++;
+	}
+
+	char where[256];
+	memcpy( work, entries, unique * sizeof( *work ) );
+	n = ProfileMerge( work, unique, ProfileCompareFunction );
+	printf( "  Samples      %%  Function\n" );
+	for( i = 0; i < n; i++ )
+		printf( " %8u %6.2f  %s\n", work[i].count, work[i].count * 100.0 / samples, work[i].function );
+
+	memcpy( work, entries, unique * sizeof( *work ) );
+	n = ProfileMerge( work, unique, ProfileCompareLine );
+	printf( "\n  Samples      %%  Line\n" );
+	for( i = 0; i < n && i < PROFILE_TOP_LINES; i++ )
+		printf( " %8u %6.2f  %s (%s)\n", work[i].count, work[i].count * 100.0 / samples, ProfileLineName( &work[i], where, sizeof( where ) ), work[i].function );
+
+	int ret = 0;
+	if( foldedfile && strcmp( foldedfile, "-" ) != 0 )
+	{
+		// Folded stacks, "function;file:line count", for flamegraph.pl, speedscope, or pprof via a converter.
+		FILE * f = fopen( foldedfile, "w" );
+		if( !f )
+		{
+			fprintf( stderr, "Error: Could not open %s\n", foldedfile );
+			ret = -9;
+		}
+		else
+		{
+			memcpy( work, entries, unique * sizeof( *work ) );
+			n = ProfileMerge( work, unique, ProfileCompareLine );
+			for( i = 0; i < n; i++ )
+				fprintf( f, "%s;%s %u\n", work[i].function, ProfileLineName( &work[i], where, sizeof( where ) ), work[i].count );
+			fclose( f );
+			fprintf( stderr, "Wrote %s\n", foldedfile );
+		}
+	}
+
+	free( work );
+	free( entries );
+	free( profile_table );
+	profile_table = 0;
+	profile_table_size = profile_unique = 0;
+	MiniElfFreeLines( &lines );
+	MiniElfFree( &elf );
+	return ret;
+}
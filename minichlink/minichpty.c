@@ -0,0 +1,299 @@
+// Publishes the -T terminal to other programs, as a pseudo-terminal (--pty)
+// and/or a TCP port (--tcp), alongside the normal console.
+//
+// Everything here is non-blocking.  Target output is copied into a backlog
+// per endpoint and written out as the consumer takes it.  If a consumer falls
+// too far behind, its output is dropped rather than stalling the target.
+// Input from either endpoint goes into the same queue as the keyboard.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // posix_openpt() and friends, cfmakeraw()
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "minichlink.h"
+
+#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+
+int TerminalRemoteSetupPTY( const char * linkpath )
+{
+	fprintf( stderr, "Error: --pty is not supported on this platform\n" );
+	return -1;
+}
+
+int TerminalRemoteSetupTCP( int port )
+{
+	fprintf( stderr, "Error: --tcp is not supported on this platform\n" );
+	return -1;
+}
+
+int TerminalRemoteActive( void ) { return 0; }
+void TerminalRemoteOutput( const void * data, int len ) { }
+int TerminalRemoteGetPollFDs( int * fds, int * events, int max ) { return 0; }
+int TerminalRemotePoll( int * got_input ) { return 0; }
+
+#else
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define REMOTE_BACKLOG (1<<16) // Must be a power of two.
+
+struct TerminalEndpoint
+{
+	const char * name;
+	int fd;         // Where data is exchanged, -1 if nobody is connected.
+	int listenfd;   // TCP only.
+	int is_socket;
+	uint8_t * backlog;
+	uint32_t head, tail;
+	uint64_t dropped;
+};
+
+static struct TerminalEndpoint remote_pty = { .name = "pty", .fd = -1, .listenfd = -1, .is_socket = 0 };
+static struct TerminalEndpoint remote_tcp = { .name = "tcp", .fd = -1, .listenfd = -1, .is_socket = 1 };
+static int remote_pty_slave = -1; // Held open, so the master doesn't see EIO between clients.
+static char * remote_pty_link;
+static int remote_active;
+
+static void TerminalRemoteClose()
+{
+	if( remote_pty_link ) unlink( remote_pty_link );
+	if( remote_pty.dropped )
+		fprintf( stderr, "PTY dropped %llu bytes\n", (unsigned long long)remote_pty.dropped );
+	if( remote_tcp.dropped )
+		fprintf( stderr, "TCP dropped %llu bytes\n", (unsigned long long)remote_tcp.dropped );
+}
+
+static void TerminalRemoteActivate( struct TerminalEndpoint * e )
+{
+	e->backlog = malloc( REMOTE_BACKLOG );
+	if( !remote_active ) atexit( TerminalRemoteClose );
+	remote_active = 1;
+}
+
+int TerminalRemoteSetupPTY( const char * linkpath )
+{
+	int master = posix_openpt( O_RDWR | O_NOCTTY );
+	if( master < 0 || grantpt( master ) || unlockpt( master ) )
+	{
+		fprintf( stderr, "Error: Could not create pseudo-terminal\n" );
+		return -1;
+	}
+	const char * slavename = ptsname( master );
+	remote_pty_slave = open( slavename, O_RDWR | O_NOCTTY );
+	if( remote_pty_slave < 0 )
+	{
+		fprintf( stderr, "Error: Could not open %s\n", slavename );
+		return -1;
+	}
+
+	// Raw, so binary data and control characters make it through untouched.
+	struct termios term;
+	tcgetattr( remote_pty_slave, &term );
+	cfmakeraw( &term );
+	tcsetattr( remote_pty_slave, TCSANOW, &term );
+	fcntl( master, F_SETFL, O_NONBLOCK );
+
+	struct stat st;
+	if( lstat( linkpath, &st ) == 0 )
+	{
+		if( !S_ISLNK( st.st_mode ) )
+		{
+			fprintf( stderr, "Error: %s exists and is not a symlink\n", linkpath );
+			return -1;
+		}
+		unlink( linkpath );
+	}
+	if( symlink( slavename, linkpath ) )
+	{
+		fprintf( stderr, "Error: Could not link %s to %s\n", linkpath, slavename );
+		return -1;
+	}
+	remote_pty_link = strdup( linkpath );
+	remote_pty.fd = master;
+	TerminalRemoteActivate( &remote_pty );
+	fprintf( stderr, "Terminal available on %s (%s)\n", linkpath, slavename );
+	return 0;
+}
+
+int TerminalRemoteSetupTCP( int port )
+{
+	struct sockaddr_in sin;
+	int reusevar = 1;
+	int s = socket( AF_INET, SOCK_STREAM, 0 );
+	if( s < 0 )
+	{
+		fprintf( stderr, "Error: Cannot create socket.\n" );
+		return -1;
+	}
+	setsockopt( s, SOL_SOCKET, SO_REUSEADDR, &reusevar, sizeof( reusevar ) );
+	memset( &sin, 0, sizeof( sin ) );
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = INADDR_ANY;
+	sin.sin_port = htons( port );
+	if( bind( s, (struct sockaddr *)&sin, sizeof( sin ) ) || listen( s, 1 ) )
+	{
+		fprintf( stderr, "Error: Could not bind to socket: %d\n", port );
+		close( s );
+		return -1;
+	}
+	fcntl( s, F_SETFL, O_NONBLOCK );
+	remote_tcp.listenfd = s;
+	TerminalRemoteActivate( &remote_tcp );
+	fprintf( stderr, "Terminal available on TCP port %d\n", port );
+	return 0;
+}
+
+int TerminalRemoteActive( void )
+{
+	return remote_active;
+}
+
+static void TerminalEndpointDisconnect( struct TerminalEndpoint * e )
+{
+	close( e->fd );
+	e->fd = -1;
+	e->tail = e->head;
+	fprintf( stderr, "Terminal client on %s disconnected\n", e->name );
+}
+
+// Returns bytes still waiting.
+static int TerminalEndpointFlush( struct TerminalEndpoint * e )
+{
+	while( e->fd >= 0 && e->head != e->tail )
+	{
+		uint32_t start = e->tail & ( REMOTE_BACKLOG - 1 );
+		uint32_t len = e->head - e->tail;
+		if( start + len > REMOTE_BACKLOG ) len = REMOTE_BACKLOG - start;
+		int w = e->is_socket ?
+			send( e->fd, e->backlog + start, len, MSG_NOSIGNAL ) :
+			write( e->fd, e->backlog + start, len );
+		if( w < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+			break;
+		if( w <= 0 )
+		{
+			TerminalEndpointDisconnect( e );
+			break;
+		}
+		e->tail += w;
+	}
+	return e->head - e->tail;
+}
+
+static void TerminalEndpointOutput( struct TerminalEndpoint * e, const uint8_t * data, int len )
+{
+	if( !e->backlog ) return;
+	if( e->fd < 0 )
+	{
+		// Nobody to see it.  The pty is always "connected" since we hold the slave.
+		return;
+	}
+	while( len > 0 )
+	{
+		uint32_t space = REMOTE_BACKLOG - ( e->head - e->tail );
+		if( space == 0 )
+		{
+			e->dropped += len;
+			break;
+		}
+		uint32_t start = e->head & ( REMOTE_BACKLOG - 1 );
+		uint32_t chunk = len;
+		if( chunk > space ) chunk = space;
+		if( chunk > REMOTE_BACKLOG - start ) chunk = REMOTE_BACKLOG - start;
+		memcpy( e->backlog + start, data, chunk );
+		e->head += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+	TerminalEndpointFlush( e );
+}
+
+void TerminalRemoteOutput( const void * data, int len )
+{
+	TerminalEndpointOutput( &remote_pty, data, len );
+	TerminalEndpointOutput( &remote_tcp, data, len );
+}
+
+static int TerminalEndpointPollFD( struct TerminalEndpoint * e, int * fds, int * events, int n, int max )
+{
+	int fd = ( e->fd >= 0 ) ? e->fd : e->listenfd;
+	if( fd < 0 || n >= max ) return n;
+	// Don't wake up for input we have no room for, or output nobody is taking.
+	int ev = 0;
+	if( e->fd < 0 || TerminalInputSpace() > 0 ) ev |= 1;
+	if( e->fd >= 0 && e->head != e->tail ) ev |= 2;
+	if( !ev ) return n;
+	fds[n] = fd;
+	events[n] = ev;
+	return n + 1;
+}
+
+// events: 1 = wait for readable, 2 = wait for writable.
+int TerminalRemoteGetPollFDs( int * fds, int * events, int max )
+{
+	int n = 0;
+	n = TerminalEndpointPollFD( &remote_pty, fds, events, n, max );
+	n = TerminalEndpointPollFD( &remote_tcp, fds, events, n, max );
+	return n;
+}
+
+static int TerminalEndpointRead( struct TerminalEndpoint * e )
+{
+	uint8_t buf[256];
+	int total = 0;
+	while( e->fd >= 0 )
+	{
+		// Leave it in the kernel if our input queue can't take it, that's the backpressure.
+		int want = TerminalInputSpace();
+		if( want > (int)sizeof( buf ) ) want = sizeof( buf );
+		if( want <= 0 ) break;
+		int r = e->is_socket ?
+			recv( e->fd, buf, want, MSG_DONTWAIT ) :
+			read( e->fd, buf, want );
+		if( r < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+			break;
+		if( r <= 0 )
+		{
+			TerminalEndpointDisconnect( e );
+			break;
+		}
+		TerminalQueueInput( buf, r );
+		total += r;
+	}
+	return total;
+}
+
+// Accepts clients, takes their input and flushes output.  Returns nonzero if
+// output is still waiting on a slow client.
+int TerminalRemotePoll( int * got_input )
+{
+	int input = 0;
+	if( remote_tcp.listenfd >= 0 && remote_tcp.fd < 0 )
+	{
+		remote_tcp.fd = accept( remote_tcp.listenfd, 0, 0 );
+		if( remote_tcp.fd >= 0 )
+		{
+			fcntl( remote_tcp.fd, F_SETFL, O_NONBLOCK );
+			remote_tcp.head = remote_tcp.tail = 0;
+			fprintf( stderr, "Terminal client connected on tcp\n" );
+		}
+	}
+	input += TerminalEndpointRead( &remote_pty );
+	input += TerminalEndpointRead( &remote_tcp );
+	if( got_input ) *got_input = input;
+	return TerminalEndpointFlush( &remote_pty ) + TerminalEndpointFlush( &remote_tcp );
+}
+
+#endif
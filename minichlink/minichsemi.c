@@ -0,0 +1,389 @@
+// RISC-V semihosting, --semihost.  Firmware asks the host to do file I/O by
+// executing the standard sequence, all uncompressed:
+//
+//   slli x0, x0, 0x1f   # 0x01f01013
+//   ebreak              # 0x00100073
+//   srai x0, x0, 7      # 0x40705013
+//
+// with the operation in a0 and a pointer to its parameter block in a1, the
+// same convention ARM uses, and what newlib's semihosting specs emit.  DCSR's
+// ebreakm makes that ebreak halt the core instead of trapping.  The terminal
+// loop (and the GDB server, before it tells GDB about a halt) notices the
+// halt, checks the instructions around DPC, does the operation, puts the
+// result in a0 and resumes after the ebreak.
+//
+// Buffers move with one ReadBinaryBlob or WriteBinaryBlob each, so bulk
+// transfers go as fast as memory access does, not 7 bytes at a time like the
+// terminal.  Memory access clobbers x8-x15 and DMDATA0/1, the terminal's
+// mailbox, and a0-a3 are among those registers.  TargetHold() reads them all
+// first and everything is put back before a0 gets the result.
+//
+// The console, ":tt", is the terminal: output goes wherever target printf
+// output goes, and input is taken from the terminal's keyboard queue.  A read
+// with nothing typed yet leaves the core halted until there is something.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include "terminalhelp.h"
+#include "minichlink.h"
+
+#define SYS_OPEN 0x01
+#define SYS_CLOSE 0x02
+#define SYS_WRITEC 0x03
+#define SYS_WRITE0 0x04
+#define SYS_WRITE 0x05
+#define SYS_READ 0x06
+#define SYS_READC 0x07
+#define SYS_ISTTY 0x09
+#define SYS_SEEK 0x0a
+#define SYS_FLEN 0x0c
+#define SYS_CLOCK 0x10
+#define SYS_TIME 0x11
+#define SYS_ERRNO 0x13
+#define SYS_EXIT 0x18
+#define SYS_EXIT_EXTENDED 0x20
+
+#define ADP_Stopped_ApplicationExit 0x20026
+
+#define SEMIHOST_FILES 32        // Handles 1-3 are the console, files start at 4.
+#define SEMIHOST_CONSOLE_IN 1
+#define SEMIHOST_CONSOLE_OUT 2
+#define SEMIHOST_CONSOLE_ERR 3
+#define SEMIHOST_MAX_TRANSFER 65536 // Per call, the rest is reported as not transferred.
+#define SEMIHOST_MAX_STRING 4096
+
+static int semihost_enabled;
+static int semihost_waiting;     // Halted in a console read, nothing typed yet.
+static int semihost_errno;
+static uint64_t semihost_start_us;
+static FILE * semihost_files[SEMIHOST_FILES];
+static void (*semihost_console)( const void * data, int len ) = TerminalOutput;
+static int (*semihost_input)( uint8_t * data, int len );
+
+void SemihostEnable( void )
+{
+	semihost_enabled = 1;
+}
+
+int SemihostActive( void )
+{
+	return semihost_enabled;
+}
+
+int SemihostWantsInput( void )
+{
+	return semihost_waiting;
+}
+
+// Turns on ebreakm, which only takes while the core is halted.
+int SemihostStart( void * dev, void (*console)( const void * data, int len ), int (*input)( uint8_t * data, int len ) )
+{
+	uint32_t dmstatus = 0;
+	if( !semihost_enabled ) return 0;
+	if( !MCF.ReadReg32 || !MCF.WriteReg32 || !MCF.ReadCPURegister || !MCF.WriteCPURegister || !MCF.ReadBinaryBlob || !MCF.WriteBinaryBlob || !MCF.SetEnableBreakpoints )
+	{
+		fprintf( stderr, "Error: Semihosting needs debug module access, which this programmer doesn't have\n" );
+		return -5;
+	}
+	if( console ) semihost_console = console;
+	semihost_input = input;
+	semihost_start_us = GetTimeMicroseconds();
+
+	MCF.ReadReg32( dev, DMSTATUS, &dmstatus );
+	int was_running = !( dmstatus & (1<<9) );
+	if( was_running )
+		MCF.HaltMode( dev, HALT_MODE_HALT_BUT_NO_RESET );
+	MCF.SetEnableBreakpoints( dev, 1, 0 );
+	if( was_running )
+		MCF.HaltMode( dev, HALT_MODE_RESUME );
+	fprintf( stderr, "Semihosting enabled\n" );
+	return 0;
+}
+
+static int SemihostRead( void * dev, uint32_t address, void * data, int len )
+{
+	return MCF.ReadBinaryBlob( dev, address, len, data );
+}
+
+static int SemihostReadString( void * dev, uint32_t address, int len, char * str, int max )
+{
+	if( len < 0 || len >= max || SemihostRead( dev, address, str, len ) )
+		return -1;
+	str[len] = 0;
+	return 0;
+}
+
+static FILE * SemihostFile( uint32_t handle )
+{
+	if( handle <= SEMIHOST_CONSOLE_ERR || handle >= SEMIHOST_FILES ) return 0;
+	return semihost_files[handle];
+}
+
+static uint32_t SemihostOpen( void * dev, const uint32_t * p )
+{
+	static const char * modes[12] = { "r", "rb", "r+", "r+b", "w", "wb", "w+", "w+b", "a", "ab", "a+", "a+b" };
+	char name[SEMIHOST_MAX_STRING];
+	uint32_t i;
+
+	if( p[1] > 11 || SemihostReadString( dev, p[0], p[2], name, sizeof( name ) ) )
+	{
+		semihost_errno = EINVAL;
+		return -1;
+	}
+	// The console, by convention opened "r" for stdin, "w" for stdout and "a" for stderr.
+	if( strcmp( name, ":tt" ) == 0 )
+		return ( p[1] < 4 ) ? SEMIHOST_CONSOLE_IN : ( p[1] < 8 ) ? SEMIHOST_CONSOLE_OUT : SEMIHOST_CONSOLE_ERR;
+
+	for( i = SEMIHOST_CONSOLE_ERR + 1; i < SEMIHOST_FILES && semihost_files[i]; i++ );
+	if( i == SEMIHOST_FILES )
+	{
+		semihost_errno = EMFILE;
+		return -1;
+	}
+	semihost_files[i] = fopen( name, modes[p[1]] );
+	if( !semihost_files[i] )
+	{
+		semihost_errno = errno;
+		fprintf( stderr, "Semihosting: could not open %s (%s)\n", name, modes[p[1]] );
+		return -1;
+	}
+	return i;
+}
+
+// Returns how many bytes were not written, as the convention has it.
+static uint32_t SemihostWrite( void * dev, const uint32_t * p )
+{
+	uint32_t len = p[2] > SEMIHOST_MAX_TRANSFER ? SEMIHOST_MAX_TRANSFER : p[2];
+	FILE * f = SemihostFile( p[0] );
+	if( !len ) return p[2];
+	if( !f && p[0] != SEMIHOST_CONSOLE_OUT && p[0] != SEMIHOST_CONSOLE_ERR )
+	{
+		semihost_errno = EBADF;
+		return p[2];
+	}
+	uint8_t * data = malloc( len );
+	if( SemihostRead( dev, p[1], data, len ) )
+	{
+		free( data );
+		semihost_errno = EIO;
+		return p[2];
+	}
+	if( p[0] == SEMIHOST_CONSOLE_OUT )
+		semihost_console( data, len );
+	else if( p[0] == SEMIHOST_CONSOLE_ERR )
+		fwrite( data, 1, len, stderr );
+	else
+	{
+		len = fwrite( data, 1, len, f );
+		if( len < p[2] ) semihost_errno = errno;
+	}
+	free( data );
+	return p[2] - len;
+}
+
+// Returns how many bytes were not read, all of them at end of file.  -2 = wait for input.
+static int64_t SemihostReadFile( void * dev, const uint32_t * p )
+{
+	uint32_t len = p[2] > SEMIHOST_MAX_TRANSFER ? SEMIHOST_MAX_TRANSFER : p[2];
+	FILE * f = SemihostFile( p[0] );
+	if( !f && p[0] != SEMIHOST_CONSOLE_IN )
+	{
+		semihost_errno = EBADF;
+		return -1;
+	}
+	if( !len ) return 0;
+	uint8_t * data = malloc( len );
+	int got;
+	if( f )
+	{
+		got = fread( data, 1, len, f );
+		if( got < (int)len && ferror( f ) ) semihost_errno = errno;
+	}
+	else
+	{
+		got = semihost_input ? semihost_input( data, len ) : 0;
+		if( !got && semihost_input )
+		{
+			free( data );
+			return -2;
+		}
+	}
+	if( got && MCF.WriteBinaryBlob( dev, p[1], got, data ) )
+	{
+		semihost_errno = EIO;
+		got = 0;
+	}
+	free( data );
+	return p[2] - got;
+}
+
+static int64_t SemihostCall( void * dev, uint32_t op, uint32_t arg )
+{
+	uint32_t p[3] = { 0 };
+	int nparams = 0;
+	char str[SEMIHOST_MAX_STRING];
+	FILE * f;
+
+	switch( op )
+	{
+	case SYS_OPEN: case SYS_WRITE: case SYS_READ: nparams = 3; break;
+	case SYS_SEEK: case SYS_EXIT_EXTENDED: nparams = 2; break;
+	case SYS_CLOSE: case SYS_ISTTY: case SYS_FLEN: nparams = 1; break;
+	}
+	if( nparams && SemihostRead( dev, arg, p, nparams * 4 ) )
+	{
+		semihost_errno = EIO;
+		return -1;
+	}
+
+	switch( op )
+	{
+	case SYS_OPEN:
+		return SemihostOpen( dev, p );
+	case SYS_CLOSE:
+		if( p[0] <= SEMIHOST_CONSOLE_ERR && p[0] ) return 0;
+		if( !( f = SemihostFile( p[0] ) ) )
+		{
+			semihost_errno = EBADF;
+			return -1;
+		}
+		semihost_files[p[0]] = 0;
+		return fclose( f ) ? -1 : 0;
+	case SYS_WRITEC:
+		if( SemihostRead( dev, arg, str, 1 ) ) return -1;
+		semihost_console( str, 1 );
+		return 0;
+	case SYS_WRITE0:
+	{
+		int len = 0;
+		// Read in pieces until the terminator shows up.
+		while( len < SEMIHOST_MAX_STRING - 64 )
+		{
+			if( SemihostRead( dev, arg + len, str + len, 64 ) ) break;
+			char * end = memchr( str + len, 0, 64 );
+			if( end )
+			{
+				len = end - str;
+				break;
+			}
+			len += 64;
+		}
+		semihost_console( str, len );
+		return 0;
+	}
+	case SYS_WRITE:
+		return SemihostWrite( dev, p );
+	case SYS_READ:
+		return SemihostReadFile( dev, p );
+	case SYS_READC:
+	{
+		uint8_t c;
+		if( !semihost_input ) return -1;
+		return semihost_input( &c, 1 ) ? c : -2;
+	}
+	case SYS_ISTTY:
+		return p[0] && p[0] <= SEMIHOST_CONSOLE_ERR;
+	case SYS_SEEK:
+		if( !( f = SemihostFile( p[0] ) ) || fseek( f, p[1], SEEK_SET ) )
+		{
+			semihost_errno = f ? errno : EBADF;
+			return -1;
+		}
+		return 0;
+	case SYS_FLEN:
+	{
+		if( !( f = SemihostFile( p[0] ) ) )
+		{
+			semihost_errno = EBADF;
+			return -1;
+		}
+		long pos = ftell( f );
+		fseek( f, 0, SEEK_END );
+		long len = ftell( f );
+		fseek( f, pos, SEEK_SET );
+		return len;
+	}
+	case SYS_CLOCK:
+		return ( GetTimeMicroseconds() - semihost_start_us ) / 10000; // Centiseconds.
+	case SYS_TIME:
+		return (uint32_t)time( 0 );
+	case SYS_ERRNO:
+		return semihost_errno;
+	case SYS_EXIT:
+	case SYS_EXIT_EXTENDED:
+	{
+		// RV32 passes the reason itself to SYS_EXIT, and [reason, code] to SYS_EXIT_EXTENDED.
+		uint32_t reason = ( op == SYS_EXIT ) ? arg : p[0];
+		int code = ( reason != ADP_Stopped_ApplicationExit ) ? 1 : ( op == SYS_EXIT ) ? 0 : (int)p[1];
+		fprintf( stderr, "\nTarget exited, code %d, leaving it halted\n", code );
+		exit( code );
+	}
+	default:
+	{
+		static uint32_t warned[4];
+		int i;
+		for( i = 0; i < 4 && warned[i] && warned[i] != op; i++ );
+		if( i < 4 && !warned[i] )
+		{
+			fprintf( stderr, "Semihosting: operation 0x%02x isn't supported\n", op );
+			warned[i] = op;
+		}
+		semihost_errno = ENOSYS;
+		return -1;
+	}
+	}
+}
+
+// The core is known to be halted.  Returns 1 if it's a semihosting call, which
+// has been answered, 2 if it's one waiting on input, 0 if it stopped for some other reason.
+int SemihostHalted( void * dev )
+{
+	uint32_t pc = 0;
+	uint32_t insn[3];
+	struct TargetHold hold;
+
+	if( !semihost_enabled ) return 0;
+	// Already halted, so this only keeps x8-x15, where a0 and a1 are too, and
+	// any terminal word the firmware posted before the ebreak.
+	if( TargetHold( dev, &hold, TARGET_HOLD_MAILBOX ) )
+		return 0;
+	if( MCF.ReadCPURegister( dev, 0x7b1, &pc ) )
+	{
+		TargetRelease( dev, &hold );
+		return 0;
+	}
+	uint32_t a0 = hold.scratch[2], a1 = hold.scratch[3];
+
+	int is_call = ( pc >= 4 ) && MCF.ReadBinaryBlob( dev, pc - 4, 12, (uint8_t*)insn ) == 0 &&
+		insn[0] == 0x01f01013 && insn[1] == 0x00100073 && insn[2] == 0x40705013;
+	int64_t ret = is_call ? SemihostCall( dev, a0, a1 ) : 0;
+
+	semihost_waiting = ( ret == -2 );
+	if( is_call && !semihost_waiting )
+	{
+		// Before the release, register writes go through DMDATA0, which it puts back last.
+		hold.scratch[2] = (uint32_t)ret; // a0
+		MCF.WriteCPURegister( dev, 0x7b1, pc + 4 ); // On to the srai, which does nothing.
+	}
+	TargetRelease( dev, &hold );
+	if( !is_call || semihost_waiting )
+		return is_call ? 2 : 0;
+
+	MCF.WriteReg32( dev, DMCONTROL, 0x40000001 ); // Request resume
+	if( MCF.FlushLLCommands ) MCF.FlushLLCommands( dev );
+	return 1;
+}
+
+// For the terminal loop.  As SemihostHalted(), but 0 if the core is running,
+// and -1 if it's halted for some other reason.
+int SemihostPoll( void * dev )
+{
+	uint32_t dmstatus = 0;
+	if( !semihost_enabled || MCF.ReadReg32( dev, DMSTATUS, &dmstatus ) || !( dmstatus & (1<<9) ) )
+		return 0;
+	int r = SemihostHalted( dev );
+	return r ? r : -1;
+}
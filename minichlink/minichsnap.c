@@ -0,0 +1,403 @@
+// Snapshot and restore of the whole target state, --snapshot and --restore.
+//
+// A snapshot is a standard ELF core file, so GDB can open it offline with
+// the firmware's ELF, "gdb firmware.elf -c fault.core":
+//
+//   PT_NOTE   NT_PRSTATUS "CORE"  x1-x31 and the PC, where GDB expects them.
+//             NT_PRPSINFO "CORE"
+//             1 "MINICHLINK"      Chip type, RAM base and size, then pairs of
+//                                 CSR number and value (mstatus, mepc,
+//                                 mcause...).  readelf -n shows it raw.
+//   PT_LOAD   All of RAM.
+//   PT_LOAD   Each peripheral block in snapshot_peripherals that could be
+//             read, flagged read only (PF_R).
+//
+// RAM comes over in one ReadBinaryBlob per 2kB, the fastest path the
+// programmer has.  Memory access clobbers x8-x15 and the terminal's DMDATA0/1,
+// so the registers are read before anything else, and TargetHold() puts those
+// back afterwards.  If the core was running it's let go again.
+//
+// A restore writes RAM, the CSRs and the registers back and leaves the core
+// halted, so a test can be replayed from that point.  Peripherals are not
+// written back, too many of their registers do something when written.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "terminalhelp.h"
+#include "minichlink.h"
+#include "minichelf.h"
+
+#define SNAPSHOT_CHUNK 2048        // All RAM sizes are a multiple of this.
+#define SNAPSHOT_NOTE_TYPE 1
+#define SNAPSHOT_PRSTATUS_SIZE 204 // struct elf_prstatus on RV32, as BFD wants it.
+#define SNAPSHOT_PRSTATUS_REGS 72
+#define SNAPSHOT_PRPSINFO_SIZE 128
+#define SNAPSHOT_MAX_SEGMENTS 16
+
+struct SnapshotRegion
+{
+	const char * name;
+	uint32_t address;
+	uint32_t size;
+};
+
+// Only registers that can be read without side effects, no data registers.
+static const struct SnapshotRegion snapshot_peripherals[] = {
+	{ "RCC", 0x40021000, 0x28 },
+	{ "FLASH", 0x40022000, 0x24 },
+	{ "AFIO", 0x40010000, 0x20 },
+	{ "EXTI", 0x40010400, 0x18 },
+	{ "GPIOA", 0x40010800, 0x1c },
+	{ "GPIOB", 0x40010c00, 0x1c },
+	{ "GPIOC", 0x40011000, 0x1c },
+	{ "GPIOD", 0x40011400, 0x1c },
+	{ "PFIC", 0xe000e000, 0x310 },
+	{ "SysTick", 0xe000f000, 0x18 },
+};
+
+// misa and dcsr are kept for reference, but not restored.
+static const uint16_t snapshot_csrs[] = { 0x300, 0x301, 0x305, 0x340, 0x341, 0x342, 0x343, 0x804, 0xbc0, 0x7b0 };
+
+static const char * snapshot_causes[] = {
+	"instruction address misaligned", "instruction access fault", "illegal instruction", "breakpoint",
+	"load address misaligned", "load access fault", "store address misaligned", "store access fault",
+	"ecall from U-mode", "ecall from S-mode", 0, "ecall from M-mode",
+};
+
+struct SnapshotBuffer
+{
+	uint8_t * data;
+	uint32_t len;
+	uint32_t alloc;
+};
+
+static void SnapshotAppend( struct SnapshotBuffer * b, const void * data, uint32_t len )
+{
+	if( b->len + len > b->alloc )
+	{
+		b->alloc = ( b->len + len ) * 2;
+		b->data = realloc( b->data, b->alloc );
+	}
+	if( data )
+		memcpy( b->data + b->len, data, len );
+	else
+		memset( b->data + b->len, 0, len );
+	b->len += len;
+}
+
+static void SnapshotPut32( uint8_t * p, uint32_t v )
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static uint32_t SnapshotGet32( const uint8_t * p )
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static void SnapshotNote( struct SnapshotBuffer * b, const char * name, uint32_t type, const void * desc, uint32_t descsz )
+{
+	uint8_t h[12];
+	uint32_t namesz = strlen( name ) + 1;
+	SnapshotPut32( h, namesz );
+	SnapshotPut32( h + 4, descsz );
+	SnapshotPut32( h + 8, type );
+	SnapshotAppend( b, h, 12 );
+	SnapshotAppend( b, name, namesz );
+	SnapshotAppend( b, 0, ( 4 - ( namesz & 3 ) ) & 3 );
+	SnapshotAppend( b, desc, descsz );
+	SnapshotAppend( b, 0, ( 4 - ( descsz & 3 ) ) & 3 );
+}
+
+static void SnapshotPrintCause( uint32_t mcause, uint32_t mepc, uint32_t mtval )
+{
+	if( mcause & 0x80000000 )
+		fprintf( stderr, "mcause %08x (interrupt %u), mepc %08x\n", mcause, mcause & 0x7fffffff, mepc );
+	else if( mcause < sizeof( snapshot_causes ) / sizeof( snapshot_causes[0] ) && snapshot_causes[mcause] )
+		fprintf( stderr, "mcause %08x (%s), mepc %08x, mtval %08x\n", mcause, snapshot_causes[mcause], mepc, mtval );
+	else
+		fprintf( stderr, "mcause %08x, mepc %08x, mtval %08x\n", mcause, mepc, mtval );
+}
+
+int RunSnapshot( void * dev, const char * corefile )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int nregions = sizeof( snapshot_peripherals ) / sizeof( snapshot_peripherals[0] );
+	int ncsrs = sizeof( snapshot_csrs ) / sizeof( snapshot_csrs[0] );
+	uint32_t regs[33] = { 0 }, csrs[2*16];
+	uint32_t seg_addr[SNAPSHOT_MAX_SEGMENTS], seg_size[SNAPSHOT_MAX_SEGMENTS];
+	uint8_t * seg_data[SNAPSHOT_MAX_SEGMENTS];
+	int nsegs = 0, ncsr_read = 0, i, r = 0;
+	uint32_t mepc = 0, mcause = 0, mtval = 0;
+
+	if( !MCF.ReadAllCPURegisters || !MCF.ReadCPURegister || !MCF.WriteCPURegister || !MCF.ReadBinaryBlob )
+	{
+		fprintf( stderr, "Error: Snapshots need debug module access, which this programmer doesn't have\n" );
+		return -5;
+	}
+
+	uint64_t start = GetTimeMicroseconds();
+	MemoryCacheFlush( dev );
+	struct TargetHold hold;
+	if( TargetHold( dev, &hold, TARGET_HOLD_MAILBOX ) )
+	{
+		fprintf( stderr, "Error: Could not stop the core\n" );
+		return -5;
+	}
+
+	int nrregs = iss->nr_registers_for_debug;
+	uint32_t all[33];
+	if( MCF.ReadAllCPURegisters( dev, all ) )
+	{
+		fprintf( stderr, "Error: Could not read the core's registers\n" );
+		r = -5;
+		goto release;
+	}
+	// all[] is x0..x(n-1) then DPC, the core file wants the PC first, then x1-x31.
+	regs[0] = all[nrregs];
+	for( i = 1; i < nrregs; i++ )
+		regs[i] = all[i];
+
+	for( i = 0; i < ncsrs; i++ )
+	{
+		uint32_t v;
+		if( MCF.ReadCPURegister( dev, snapshot_csrs[i], &v ) )
+		{
+			MCF.WriteReg32( dev, DMABSTRACTCS, 0x00000700 ); // Not on this core, clear cmderr.
+			continue;
+		}
+		csrs[ncsr_read*2] = snapshot_csrs[i];
+		csrs[ncsr_read*2+1] = v;
+		ncsr_read++;
+		if( snapshot_csrs[i] == 0x341 ) mepc = v;
+		if( snapshot_csrs[i] == 0x342 ) mcause = v;
+		if( snapshot_csrs[i] == 0x343 ) mtval = v;
+	}
+
+	// RAM, stopping at the first piece that can't be read, in case this part has less than we think.
+	seg_addr[0] = iss->ram_base;
+	seg_size[0] = 0;
+	seg_data[0] = malloc( iss->ram_size ? iss->ram_size : 1 );
+	while( seg_size[0] < iss->ram_size )
+	{
+		if( MCF.ReadBinaryBlob( dev, iss->ram_base + seg_size[0], SNAPSHOT_CHUNK, seg_data[0] + seg_size[0] ) )
+		{
+			MCF.WriteReg32( dev, DMABSTRACTCS, 0x00000700 );
+			MCF.VoidHighLevelState( dev );
+			fprintf( stderr, "Warning: RAM stops being readable at 0x%08x\n", iss->ram_base + seg_size[0] );
+			break;
+		}
+		seg_size[0] += SNAPSHOT_CHUNK;
+	}
+	nsegs = 1;
+	uint32_t ram_bytes = seg_size[0];
+
+	for( i = 0; i < nregions && nsegs < SNAPSHOT_MAX_SEGMENTS; i++ )
+	{
+		const struct SnapshotRegion * p = &snapshot_peripherals[i];
+		seg_data[nsegs] = malloc( p->size );
+		if( MCF.ReadBinaryBlob( dev, p->address, p->size, seg_data[nsegs] ) )
+		{
+			MCF.WriteReg32( dev, DMABSTRACTCS, 0x00000700 );
+			MCF.VoidHighLevelState( dev );
+			free( seg_data[nsegs] );
+			continue;
+		}
+		seg_addr[nsegs] = p->address;
+		seg_size[nsegs] = p->size;
+		nsegs++;
+	}
+
+release:
+	TargetRelease( dev, &hold );
+	uint64_t elapsed = GetTimeMicroseconds() - start;
+	if( r ) return r;
+
+	// Notes first, their size decides where the segments go.
+	struct SnapshotBuffer notes = { 0, 0, 0 };
+	uint8_t prstatus[SNAPSHOT_PRSTATUS_SIZE] = { 0 };
+	prstatus[12] = 5; // pr_cursig, SIGTRAP
+	SnapshotPut32( prstatus + 24, 1 ); // pr_pid
+	for( i = 0; i < 32; i++ )
+		SnapshotPut32( prstatus + SNAPSHOT_PRSTATUS_REGS + i * 4, regs[i] );
+	SnapshotNote( &notes, "CORE", 1, prstatus, sizeof( prstatus ) );
+	uint8_t prpsinfo[SNAPSHOT_PRPSINFO_SIZE] = { 0 };
+	SnapshotPut32( prpsinfo + 16, 1 ); // pr_pid
+	strcpy( (char*)prpsinfo + 32, "firmware" );
+	strcpy( (char*)prpsinfo + 48, "minichlink --snapshot" );
+	SnapshotNote( &notes, "CORE", 3, prpsinfo, sizeof( prpsinfo ) );
+	uint8_t mine[16 + sizeof( csrs )];
+	SnapshotPut32( mine, iss->target_chip_type );
+	SnapshotPut32( mine + 4, iss->ram_base );
+	SnapshotPut32( mine + 8, ram_bytes );
+	SnapshotPut32( mine + 12, ncsr_read );
+	for( i = 0; i < ncsr_read * 2; i++ )
+		SnapshotPut32( mine + 16 + i * 4, csrs[i] );
+	SnapshotNote( &notes, "MINICHLINK", SNAPSHOT_NOTE_TYPE, mine, 16 + ncsr_read * 8 );
+
+	struct SnapshotBuffer out = { 0, 0, 0 };
+	uint8_t ehdr[52] = { 0x7f, 'E', 'L', 'F', 1, 1, 1 };
+	uint32_t phnum = 1 + nsegs;
+	ehdr[16] = 4; // ET_CORE
+	ehdr[18] = 243; // EM_RISCV
+	ehdr[20] = 1; // EV_CURRENT
+	SnapshotPut32( ehdr + 28, 52 ); // e_phoff
+	SnapshotPut32( ehdr + 36, ( nrregs == 16 ) ? 0x9 : 0x1 ); // EF_RISCV_RVC, EF_RISCV_RVE
+	ehdr[40] = 52; // e_ehsize
+	ehdr[42] = 32; // e_phentsize
+	ehdr[44] = phnum;
+	ehdr[46] = 40; // e_shentsize
+	SnapshotAppend( &out, ehdr, sizeof( ehdr ) );
+
+	uint32_t offset = 52 + phnum * 32;
+	uint8_t ph[32] = { 0 };
+	SnapshotPut32( ph, 4 ); // PT_NOTE
+	SnapshotPut32( ph + 4, offset );
+	SnapshotPut32( ph + 16, notes.len );
+	SnapshotPut32( ph + 28, 4 );
+	SnapshotAppend( &out, ph, 32 );
+	offset += notes.len;
+	for( i = 0; i < nsegs; i++ )
+	{
+		memset( ph, 0, sizeof( ph ) );
+		SnapshotPut32( ph, 1 ); // PT_LOAD
+		SnapshotPut32( ph + 4, offset );
+		SnapshotPut32( ph + 8, seg_addr[i] );
+		SnapshotPut32( ph + 12, seg_addr[i] );
+		SnapshotPut32( ph + 16, seg_size[i] );
+		SnapshotPut32( ph + 20, seg_size[i] );
+		SnapshotPut32( ph + 24, i ? 4 : 6 ); // PF_R, RAM is PF_R | PF_W
+		SnapshotPut32( ph + 28, 4 );
+		SnapshotAppend( &out, ph, 32 );
+		offset += seg_size[i];
+	}
+	SnapshotAppend( &out, notes.data, notes.len );
+	for( i = 0; i < nsegs; i++ )
+	{
+		SnapshotAppend( &out, seg_data[i], seg_size[i] );
+		free( seg_data[i] );
+	}
+	free( notes.data );
+
+	FILE * f = fopen( corefile, "wb" );
+	if( !f || fwrite( out.data, out.len, 1, f ) != 1 )
+	{
+		fprintf( stderr, "Error: Could not write %s\n", corefile );
+		r = -9;
+	}
+	if( f ) fclose( f );
+	free( out.data );
+	if( r ) return r;
+
+	fprintf( stderr, "Snapshot of %u bytes of RAM, %d peripheral blocks and %d CSRs in %llu ms (%.1f kB/s), written to %s\n",
+		ram_bytes, nsegs - 1, ncsr_read, (unsigned long long)( elapsed / 1000 ), elapsed ? ram_bytes * 1000.0 / elapsed : 0, corefile );
+	fprintf( stderr, "pc %08x, sp %08x, ra %08x, ", regs[0], regs[2], regs[1] );
+	SnapshotPrintCause( mcause, mepc, mtval );
+	return 0;
+}
+
+int RunRestore( void * dev, const char * corefile )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	struct MiniElf elf;
+	struct MiniElfSegment seg;
+	const uint8_t * prstatus = 0, * mine = 0;
+	uint32_t i, minesz = 0, written = 0;
+	int r = 0;
+
+	if( !MCF.WriteAllCPURegisters || !MCF.WriteCPURegister || !MCF.WriteBinaryBlob )
+	{
+		fprintf( stderr, "Error: Restoring needs debug module access, which this programmer doesn't have\n" );
+		return -5;
+	}
+	if( MiniElfLoad( &elf, corefile ) )
+		return -9;
+	if( elf.type != 4 )
+	{
+		fprintf( stderr, "Error: %s is not a core file\n", corefile );
+		MiniElfFree( &elf );
+		return -9;
+	}
+
+	// Find the registers and CSRs in the notes.
+	for( i = 0; i < elf.phnum; i++ )
+	{
+		if( MiniElfGetSegment( &elf, i, &seg ) || seg.type != 4 ) continue;
+		const uint8_t * n = seg.data, * end = seg.data + seg.filesz;
+		while( n + 12 <= end )
+		{
+			uint32_t namesz = SnapshotGet32( n ), descsz = SnapshotGet32( n + 4 ), type = SnapshotGet32( n + 8 );
+			const uint8_t * desc = n + 12 + ( ( namesz + 3 ) & ~3 );
+			if( desc + descsz > end ) break;
+			if( namesz == 5 && memcmp( n + 12, "CORE", 5 ) == 0 && type == 1 && descsz >= SNAPSHOT_PRSTATUS_REGS + 128 )
+				prstatus = desc;
+			if( namesz == 11 && memcmp( n + 12, "MINICHLINK", 11 ) == 0 && type == SNAPSHOT_NOTE_TYPE && descsz >= 16 )
+			{
+				mine = desc;
+				minesz = descsz;
+			}
+			n = desc + ( ( descsz + 3 ) & ~3 );
+		}
+	}
+	if( !prstatus )
+	{
+		fprintf( stderr, "Error: %s has no registers (NT_PRSTATUS)\n", corefile );
+		MiniElfFree( &elf );
+		return -9;
+	}
+	if( mine && SnapshotGet32( mine ) != iss->target_chip_type )
+		fprintf( stderr, "Warning: %s was taken from a different kind of chip\n", corefile );
+
+	MemoryCacheFlush( dev );
+	MCF.HaltMode( dev, HALT_MODE_HALT_BUT_NO_RESET );
+
+	// RAM first, it uses the registers that are about to be put back.
+	for( i = 0; i < elf.phnum && !r; i++ )
+	{
+		if( MiniElfGetSegment( &elf, i, &seg ) || seg.type != 1 ) continue;
+		if( ( seg.vaddr & 0xf0000000 ) != ( iss->ram_base & 0xf0000000 ) )
+			continue; // Peripherals are for looking at.
+		if( MCF.WriteBinaryBlob( dev, seg.vaddr, seg.filesz, seg.data ) )
+		{
+			fprintf( stderr, "Error: Could not write RAM at 0x%08x\n", seg.vaddr );
+			r = -9;
+		}
+		written += seg.filesz;
+	}
+
+	if( !r && mine )
+	{
+		uint32_t count = SnapshotGet32( mine + 12 );
+		for( i = 0; i < count && 16 + i * 8 + 8 <= minesz; i++ )
+		{
+			uint32_t csr = SnapshotGet32( mine + 16 + i * 8 ), v = SnapshotGet32( mine + 20 + i * 8 );
+			if( csr == 0x301 || csr == 0x7b0 ) continue;
+			if( MCF.WriteCPURegister( dev, csr, v ) )
+			{
+				MCF.WriteReg32( dev, DMABSTRACTCS, 0x00000700 );
+				fprintf( stderr, "Warning: Could not restore CSR 0x%03x\n", csr );
+			}
+		}
+	}
+
+	if( !r )
+	{
+		uint32_t all[33] = { 0 };
+		int nrregs = iss->nr_registers_for_debug;
+		for( i = 1; i < (uint32_t)nrregs; i++ )
+			all[i] = SnapshotGet32( prstatus + SNAPSHOT_PRSTATUS_REGS + i * 4 );
+		all[nrregs] = SnapshotGet32( prstatus + SNAPSHOT_PRSTATUS_REGS );
+		if( MCF.WriteAllCPURegisters( dev, all ) )
+		{
+			fprintf( stderr, "Error: Could not write the core's registers\n" );
+			r = -5;
+		}
+		MCF.VoidHighLevelState( dev );
+		if( !r )
+			fprintf( stderr, "Restored %u bytes of RAM and the registers from %s, halted at pc %08x (-e to run)\n", written, corefile, all[nrregs] );
+	}
+	MemoryCacheInvalidate();
+	MiniElfFree( &elf );
+	return r;
+}
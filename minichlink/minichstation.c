@@ -0,0 +1,367 @@
+// Production station (--station).
+//
+// minichlink stays running with the programmer open, and every board that is
+// connected to it gets the same treatment: flashed, read back and compared,
+// optionally given the next serial number, then started.  The result is
+// printed, a CSV row with how long each step took is logged, and a hook
+// command is run, i.e. to light a lamp on the fixture.  Then it waits for the
+// board to be taken off before looking for the next one.
+//
+// Boards are noticed by polling DMSTATUS through the programmer.  Between
+// boards only the target's debug module is set up again, the programmer
+// itself stays open, so there is no USB enumeration per board.  A board has to
+// answer STATION_SETTLE_POLLS times in a row before a cycle starts, so pogo
+// pins that are still settling don't start one, and be gone as many times in
+// a row to count as removed.
+//
+// If the programmer is unplugged, minichusb.c notices, and the station waits
+// for it to come back.  Programmers without debug module access (the B003Fun
+// bootloader) are the board: each one that shows up on USB is flashed and
+// started, which makes it go away again, then the next one is waited for.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "terminalhelp.h"
+#include "minichlink.h"
+
+#define STATION_POLL_US 50000
+#define STATION_SETTLE_POLLS 3
+#define STATION_VERIFY_CHUNK 4096
+#define STATION_NOT_RUN ((uint64_t)-1)
+
+enum StationTime
+{
+	STATION_SETUP,
+	STATION_FLASH,
+	STATION_VERIFY,
+	STATION_TOTAL,
+	STATION_TIMES,
+};
+
+static uint32_t station_serial_address;
+static const char * station_serial_file;
+static uint32_t station_serial_next;
+static const char * station_hook;
+
+int StationSetSerial( uint32_t address, const char * counterfile )
+{
+	FILE * f = fopen( counterfile, "r" );
+	int64_t next = 1; // A new counter file starts at 1.
+	if( address & 3 )
+	{
+		fprintf( stderr, "Error: The serial number address 0x%08x isn't 4 byte aligned\n", address );
+		return -9;
+	}
+	if( f )
+	{
+		char line[64];
+		next = fgets( line, sizeof( line ), f ) ? SimpleReadNumberInt( line, -1 ) : -1;
+		fclose( f );
+		if( next < 0 || next > 0xffffffff )
+		{
+			fprintf( stderr, "Error: %s should hold the next serial number\n", counterfile );
+			return -9;
+		}
+	}
+	station_serial_address = address;
+	station_serial_file = counterfile;
+	station_serial_next = next;
+	return 0;
+}
+
+void StationSetHook( const char * command )
+{
+	station_hook = command;
+}
+
+static int StationSaveSerial( void )
+{
+	FILE * f = fopen( station_serial_file, "w" );
+	int r = f ? fprintf( f, "%u\n", station_serial_next ) : -1;
+	if( !f || fclose( f ) || r < 0 )
+	{
+		fprintf( stderr, "Error: Could not save the next serial number (%u) to %s\n", station_serial_next, station_serial_file );
+		return -9;
+	}
+	return 0;
+}
+
+void * StationConnect( const init_hints_t * hints )
+{
+	uint32_t b003_id = SimpleReadNumberInt( hints->serial_port, 0x1209b003 );
+	int tries = 0;
+	void * dev;
+	for( ;; )
+	{
+		// -C ardulink and friends aren't on USB, so can only be tried.
+		if( !hints->specific_programmer && !ProgrammerWait( b003_id, 0 ) )
+		{
+			fprintf( stderr, "Waiting for a programmer\n" );
+			ProgrammerWait( b003_id, -1 );
+		}
+		if( ( dev = MiniCHLinkInitAsDLL( 0, hints ) ) )
+			return dev;
+		// Just plugged in, udev may not have given us permission to open it yet.
+		if( ++tries > 10 )
+			return 0;
+		DefaultDelayUS( 0, 500000 );
+	}
+}
+
+// The old programmer is gone, or was the last board.  It's closed first, so
+// MCF is the new one's, then the memory cache goes back in front of it.
+static void * StationReconnect( void * dev, const init_hints_t * hints )
+{
+	MiniCHLinkClose( dev );
+	dev = StationConnect( hints );
+	if( dev )
+		MemoryCacheInstall( dev );
+	return dev;
+}
+
+// Whatever was learned about the last board doesn't hold for the next one.
+static void StationForgetTarget( void * dev )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	iss->statetag = 0;
+	iss->target_chip_id = 0;
+	iss->target_chip_type = CHIP_UNKNOWN;
+	iss->flash_unlocked = 0;
+	iss->flash_size = 0;
+	iss->bulk_register_access = 0;
+	memset( iss->flash_sector_status, 0, sizeof( iss->flash_sector_status ) );
+	MemoryCacheInvalidate();
+}
+
+static int StationTargetPresent( void * dev )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	uint32_t dmstatus = 0;
+	int r;
+
+	iss->probing = 1;
+	if( !iss->target_chip_id )
+		iss->statetag = 0; // So the WCH-LinkE tries attaching again when the read fails.
+	if( MCF.WriteReg32 )
+		MCF.WriteReg32( dev, DMSHDWCFGR, 0x5aa50000 | (1<<10) ); // As in DefaultSetupInterface, wakes up a fresh chip's debug interface.
+	r = MCF.ReadReg32( dev, DMSTATUS, &dmstatus );
+	iss->probing = 0;
+	return r >= 0 && dmstatus != 0x00000000 && dmstatus != 0xffffffff;
+}
+
+// Waits until the target is there (want = 1) or gone (want = 0), or for the programmer to come back if it went away.
+static void * StationWaitForTarget( void * dev, const init_hints_t * hints, int want )
+{
+	int same = 0;
+	while( same < STATION_SETTLE_POLLS )
+	{
+		if( ProgrammerLost() )
+		{
+			fprintf( stderr, "Programmer unplugged, waiting for it to come back\n" );
+			dev = StationReconnect( dev, hints );
+			if( !dev || !MCF.ReadReg32 )
+				return dev;
+			same = 0;
+			continue;
+		}
+		same = ( StationTargetPresent( dev ) == want ) ? same + 1 : 0;
+		if( same < STATION_SETTLE_POLLS )
+			DefaultDelayUS( dev, STATION_POLL_US );
+	}
+	return dev;
+}
+
+static int StationVerify( void * dev, uint32_t address, const uint8_t * expect, uint32_t len )
+{
+	uint8_t buffer[STATION_VERIFY_CHUNK];
+	uint32_t done, i;
+	for( done = 0; done < len; done += STATION_VERIFY_CHUNK )
+	{
+		uint32_t chunk = ( len - done > STATION_VERIFY_CHUNK ) ? STATION_VERIFY_CHUNK : len - done;
+		if( MCF.ReadBinaryBlob( dev, address + done, chunk, buffer ) < 0 )
+		{
+			fprintf( stderr, "Error: Could not read back 0x%08x\n", address + done );
+			return -1;
+		}
+		if( memcmp( buffer, expect + done, chunk ) == 0 )
+			continue;
+		for( i = 0; buffer[i] == expect[done+i]; i++ );
+		fprintf( stderr, "Error: Verify failed at 0x%08x, read %02x, wrote %02x\n", address + done + i, buffer[i], expect[done+i] );
+		return -1;
+	}
+	return 0;
+}
+
+// One board, returns 0 if it passed, otherwise the step that failed.  Times of the steps it got through are filled in.
+static const char * StationBoard( void * dev, uint8_t * image, uint32_t len, uint32_t address, uint64_t * times )
+{
+	uint64_t t = GetTimeMicroseconds();
+	uint8_t serial[4] = { station_serial_next, station_serial_next >> 8, station_serial_next >> 16, station_serial_next >> 24 };
+	int serial_apart = station_serial_file && ( station_serial_address < address || station_serial_address + 4 > address + len );
+
+	StationForgetTarget( dev );
+	if( MCF.SetupInterface && MCF.SetupInterface( dev ) < 0 )
+		return "setup";
+	PostSetupConfigureInterface( dev );
+	times[STATION_SETUP] = GetTimeMicroseconds() - t;
+	t += times[STATION_SETUP];
+
+	// A serial number inside the image goes in with it, not as a second write to the same sector.
+	if( station_serial_file && !serial_apart )
+		memcpy( image + station_serial_address - address, serial, 4 );
+	if( MCF.HaltMode )
+		MCF.HaltMode( dev, HALT_MODE_HALT_AND_RESET );
+	if( MCF.WriteBinaryBlob( dev, address, len, image ) ||
+		( serial_apart && MCF.WriteBinaryBlob( dev, station_serial_address, 4, serial ) ) ||
+		MemoryCacheFlush( dev ) )
+		return "flash";
+	times[STATION_FLASH] = GetTimeMicroseconds() - t;
+	t += times[STATION_FLASH];
+
+	MemoryCacheInvalidate(); // Compare with the chip, not with what the cache remembers writing.
+	if( StationVerify( dev, address, image, len ) || ( serial_apart && StationVerify( dev, station_serial_address, serial, 4 ) ) )
+		return "verify";
+	times[STATION_VERIFY] = GetTimeMicroseconds() - t;
+
+	if( MCF.HaltMode )
+		MCF.HaltMode( dev, HALT_MODE_REBOOT );
+	return 0;
+}
+
+static int StationReport( FILE * log, int board, const char * failed, const uint64_t * times )
+{
+	char when[32], command[1024];
+	time_t now = time( 0 );
+	strftime( when, sizeof( when ), "%Y-%m-%d %H:%M:%S", localtime( &now ) );
+
+	if( failed )
+		fprintf( stderr, "Board %d FAILED at %s, %llu ms\n", board, failed, (unsigned long long)times[STATION_TOTAL] / 1000 );
+	else if( station_serial_file )
+		fprintf( stderr, "Board %d passed, serial %u, %llu ms (setup %llu, flash %llu, verify %llu)\n", board, station_serial_next,
+			(unsigned long long)times[STATION_TOTAL] / 1000, (unsigned long long)times[STATION_SETUP] / 1000,
+			(unsigned long long)times[STATION_FLASH] / 1000, (unsigned long long)times[STATION_VERIFY] / 1000 );
+	else
+		fprintf( stderr, "Board %d passed, %llu ms (setup %llu, flash %llu, verify %llu)\n", board,
+			(unsigned long long)times[STATION_TOTAL] / 1000, (unsigned long long)times[STATION_SETUP] / 1000,
+			(unsigned long long)times[STATION_FLASH] / 1000, (unsigned long long)times[STATION_VERIFY] / 1000 );
+
+	// Steps that didn't get to run are left empty.
+	fprintf( log, "%s,%d,%s,", when, board, failed ? failed : "pass" );
+	if( station_serial_file && !failed ) fprintf( log, "%u", station_serial_next );
+	int i;
+	for( i = 0; i < STATION_TIMES; i++ )
+	{
+		if( times[i] != STATION_NOT_RUN )
+			fprintf( log, ",%llu", (unsigned long long)times[i] / 1000 );
+		else
+			fprintf( log, "," );
+	}
+	fprintf( log, "\n" );
+	fflush( log );
+
+	if( station_hook )
+	{
+		snprintf( command, sizeof( command ), "%s %s %d %u", station_hook, failed ? "fail" : "pass", board,
+			( station_serial_file && !failed ) ? station_serial_next : 0 );
+		int r = system( command );
+		if( r )
+			fprintf( stderr, "Warning: --station-hook returned %d\n", r );
+	}
+
+	if( station_serial_file && !failed )
+	{
+		station_serial_next++;
+		if( StationSaveSerial() )
+			return -9; // Better to stop than to hand out the same number twice.
+	}
+	return 0;
+}
+
+int RunStation( void * dev, const init_hints_t * hints, const char * imagefile, uint32_t address, const char * logfile )
+{
+	uint32_t b003_id = SimpleReadNumberInt( hints->serial_port, 0x1209b003 );
+	uint64_t times[STATION_TIMES];
+	int board = 0, i;
+	long len;
+
+	if( !MCF.WriteBinaryBlob || !MCF.ReadBinaryBlob )
+	{
+		fprintf( stderr, "Error: --station needs a programmer that can write and read memory\n" );
+		return -5;
+	}
+
+	FILE * f = fopen( imagefile, "rb" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: Could not open %s\n", imagefile );
+		return -9;
+	}
+	fseek( f, 0, SEEK_END );
+	len = ftell( f );
+	fseek( f, 0, SEEK_SET );
+	uint8_t * image = malloc( len );
+	if( len <= 0 || fread( image, len, 1, f ) != 1 )
+	{
+		fprintf( stderr, "Error: Could not read %s\n", imagefile );
+		fclose( f );
+		free( image );
+		return -9;
+	}
+	fclose( f );
+
+	FILE * log = strcmp( logfile, "-" ) == 0 ? stdout : fopen( logfile, "a" );
+	if( !log )
+	{
+		fprintf( stderr, "Error: Could not open %s\n", logfile );
+		free( image );
+		return -9;
+	}
+	fseek( log, 0, SEEK_END );
+	if( log == stdout || ftell( log ) == 0 )
+		fprintf( log, "time,board,result,serial,setup_ms,flash_ms,verify_ms,total_ms\n" );
+
+	ProgrammerLost(); // From here on, programmers that go away are noticed.
+	fprintf( stderr, "Station ready, %ld bytes to 0x%08x\n", len, address );
+
+	for( ;; )
+	{
+		int board_is_programmer = !MCF.ReadReg32;
+		if( !board_is_programmer )
+		{
+			fprintf( stderr, "Waiting for a board\n" );
+			if( !( dev = StationWaitForTarget( dev, hints, 1 ) ) )
+				break;
+		}
+
+		board++;
+		for( i = 0; i < STATION_TIMES; i++ )
+			times[i] = STATION_NOT_RUN;
+		uint64_t start = GetTimeMicroseconds();
+		const char * failed = StationBoard( dev, image, len, address, times );
+		times[STATION_TOTAL] = GetTimeMicroseconds() - start;
+		if( StationReport( log, board, failed, times ) )
+			break;
+
+		if( board_is_programmer )
+		{
+			// Starting the firmware took the bootloader off the bus, the next one to show up is the next board.
+			while( ProgrammerWait( b003_id, 0 ) )
+				DefaultDelayUS( dev, STATION_POLL_US * 5 );
+			if( !( dev = StationReconnect( dev, hints ) ) )
+				break;
+		}
+		else
+		{
+			fprintf( stderr, "Remove board %d\n", board );
+			if( !( dev = StationWaitForTarget( dev, hints, 0 ) ) )
+				break;
+		}
+	}
+
+	if( log != stdout )
+		fclose( log );
+	free( image );
+	return -9;
+}
@@ -0,0 +1,731 @@
+// Terminal (-T) and Terminal + GDB (-G) main loop.
+//
+// The loop is event driven: the keyboard and the GDB socket are waited on
+// with poll(), and the target is only polled over the programmer when it is
+// due.  The target poll interval tightens to zero while there is traffic and
+// backs off exponentially up to TERMINAL_POLL_MAX_US while idle.
+//
+// Output to stdout never happens inline with USB polling.  It is pushed into
+// a single-producer/single-consumer lock-free ring, which a writer thread
+// drains, so a slow terminal can't stall target printf.
+//
+// With --capture, nothing is rendered.  Every chunk received from the target
+// is appended, as-is, to a capture file along with the host time it arrived.
+//
+// With --chan, channel frames are split off first (minichchan.c).  What's
+// left is the console, which with --log-elf goes through the deferred
+// formatting log decoder (minichlog.c).  The result is what gets shown or
+// captured.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "terminalhelp.h"
+#include "minichlink.h"
+
+#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+#include <io.h>
+extern int isatty(int);
+#else
+#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#endif
+
+#define TERMINAL_OUTPUT_QUEUE_SIZE (1<<20) // Must be a power of two.
+#define TERMINAL_OUTPUT_QUEUE_MASK (TERMINAL_OUTPUT_QUEUE_SIZE-1)
+
+#if defined(__TINYC__)
+// TCC does not have the __atomic builtins, but only targets x86 where plain
+// volatile loads and stores already have acquire/release ordering.
+#define LOAD_ACQUIRE( x )       (x)
+#define STORE_RELEASE( x, v )   ((x) = (v))
+#define EXCHANGE( x, v )        InterlockedExchange( (volatile long*)&(x), (v) )
+#else
+#define LOAD_ACQUIRE( x )       __atomic_load_n( &(x), __ATOMIC_ACQUIRE )
+#define STORE_RELEASE( x, v )   __atomic_store_n( &(x), (v), __ATOMIC_RELEASE )
+#define EXCHANGE( x, v )        __atomic_exchange_n( &(x), (v), __ATOMIC_SEQ_CST )
+#endif
+
+static uint8_t term_out_queue[TERMINAL_OUTPUT_QUEUE_SIZE];
+static volatile uint32_t term_out_head;  // Only written by the terminal loop.
+static volatile uint32_t term_out_tail;  // Only written by the writer thread.
+static volatile int term_writer_sleeping;
+static volatile int term_writer_quit;
+static int term_writer_running;
+
+#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+static HANDLE term_writer_event;
+static HANDLE term_writer_thread;
+#else
+static int term_writer_wakepipe[2];
+static pthread_t term_writer_thread;
+#endif
+
+static void TerminalWakeWriter()
+{
+	if( !EXCHANGE( term_writer_sleeping, 0 ) ) return;
+#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+	SetEvent( term_writer_event );
+#else
+	char c = 0;
+	if( write( term_writer_wakepipe[1], &c, 1 ) < 0 ) { }
+#endif
+}
+
+static void TerminalWriterSleep()
+{
+	// Announce we are going to sleep, then re-check so we can't miss a wakeup.
+	EXCHANGE( term_writer_sleeping, 1 );
+	if( LOAD_ACQUIRE( term_out_head ) != term_out_tail || term_writer_quit )
+	{
+		term_writer_sleeping = 0;
+		return;
+	}
+#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+	WaitForSingleObject( term_writer_event, 100 );
+#else
+	struct pollfd pfd = { term_writer_wakepipe[0], POLLIN, 0 };
+	if( poll( &pfd, 1, 100 ) > 0 )
+	{
+		char drain[64];
+		if( read( term_writer_wakepipe[0], drain, sizeof( drain ) ) < 0 ) { }
+	}
+#endif
+}
+
+#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+static DWORD WINAPI TerminalWriterThread( LPVOID v )
+#else
+static void * TerminalWriterThread( void * v )
+#endif
+{
+	int fd = fileno( stdout );
+	while( 1 )
+	{
+		uint32_t tail = term_out_tail;
+		uint32_t head = LOAD_ACQUIRE( term_out_head );
+		if( head == tail )
+		{
+			if( term_writer_quit ) break;
+			TerminalWriterSleep();
+			continue;
+		}
+		uint32_t start = tail & TERMINAL_OUTPUT_QUEUE_MASK;
+		uint32_t len = head - tail;
+		if( start + len > TERMINAL_OUTPUT_QUEUE_SIZE )
+			len = TERMINAL_OUTPUT_QUEUE_SIZE - start;
+		int w = write( fd, term_out_queue + start, len );
+		if( w <= 0 )
+		{
+#if !defined(WINDOWS) && !defined(WIN32) && !defined(_WIN32)
+			if( w < 0 && errno == EINTR ) continue;
+#endif
+			w = len; // Output is gone.  Drop the data, rather than stalling the target.
+		}
+		STORE_RELEASE( term_out_tail, tail + w );
+	}
+	return 0;
+}
+
+static void TerminalStopWriter()
+{
+	if( !term_writer_running ) return;
+	term_writer_quit = 1;
+	term_writer_sleeping = 1;
+	TerminalWakeWriter();
+#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+	WaitForSingleObject( term_writer_thread, 1000 );
+#else
+	pthread_join( term_writer_thread, 0 );
+#endif
+	term_writer_running = 0;
+}
+
+static void TerminalStartWriter()
+{
+	fflush( stdout );
+#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+	term_writer_event = CreateEvent( 0, FALSE, FALSE, 0 );
+	term_writer_thread = CreateThread( 0, 0, TerminalWriterThread, 0, 0, 0 );
+	if( !term_writer_thread ) return;
+#else
+	if( pipe( term_writer_wakepipe ) ) return;
+	fcntl( term_writer_wakepipe[0], F_SETFL, O_NONBLOCK );
+	fcntl( term_writer_wakepipe[1], F_SETFL, O_NONBLOCK );
+	if( pthread_create( &term_writer_thread, 0, TerminalWriterThread, 0 ) ) return;
+#endif
+	term_writer_running = 1;
+	atexit( TerminalStopWriter ); // Drains the queue, i.e. on Ctrl+C.
+}
+
+void TerminalOutput( const void * data, int len )
+{
+	const uint8_t * d = (const uint8_t*)data;
+	if( !term_writer_running )
+	{
+		fwrite( d, len, 1, stdout );
+		fflush( stdout );
+		return;
+	}
+	while( len > 0 )
+	{
+		uint32_t head = term_out_head;
+		uint32_t space = TERMINAL_OUTPUT_QUEUE_SIZE - ( head - LOAD_ACQUIRE( term_out_tail ) );
+		if( space == 0 )
+		{
+			// Only happens if the terminal can't keep up with a full megabyte.
+			TerminalWakeWriter();
+#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+			Sleep( 1 );
+#else
+			usleep( 1000 );
+#endif
+			continue;
+		}
+		uint32_t start = head & TERMINAL_OUTPUT_QUEUE_MASK;
+		uint32_t chunk = len;
+		if( chunk > space ) chunk = space;
+		if( chunk > TERMINAL_OUTPUT_QUEUE_SIZE - start ) chunk = TERMINAL_OUTPUT_QUEUE_SIZE - start;
+		memcpy( term_out_queue + start, d, chunk );
+		STORE_RELEASE( term_out_head, head + chunk );
+		d += chunk;
+		len -= chunk;
+	}
+	TerminalWakeWriter();
+}
+
+// Capture file format.  After the 8 byte TERMINAL_CAPTURE_MAGIC, the file is
+// a sequence of records, all little endian:
+//   uint64_t host time in microseconds (GetTimeMicroseconds)
+//   uint32_t length
+//   uint8_t  data[length]
+#define TERMINAL_CAPTURE_MAGIC "MCLCAP1\n"
+#define TERMINAL_CAPTURE_BUFFER (1<<20)
+#define TERMINAL_CAPTURE_KEEP 9      // Rotated files kept, file.1 being the newest.
+#define TERMINAL_CAPTURE_FLUSH_US 1000000
+
+static FILE * term_capture;
+static char * term_capture_name;
+static char * term_capture_buffer;
+static uint64_t term_capture_limit;  // 0 = unlimited.
+static uint64_t term_capture_written;
+static uint64_t term_capture_last_flush;
+static int term_capture_dirty;
+
+static int TerminalCaptureOpen()
+{
+	term_capture = fopen( term_capture_name, "wb" );
+	if( !term_capture )
+	{
+		fprintf( stderr, "Error: Could not open capture file \"%s\"\n", term_capture_name );
+		return -9;
+	}
+	setvbuf( term_capture, term_capture_buffer, _IOFBF, TERMINAL_CAPTURE_BUFFER );
+	fwrite( TERMINAL_CAPTURE_MAGIC, 8, 1, term_capture );
+	term_capture_written = 8;
+	return 0;
+}
+
+static void TerminalCaptureClose()
+{
+	if( term_capture ) fclose( term_capture );
+	term_capture = 0;
+}
+
+// Shifts file -> file.1 -> file.2 ... and starts a fresh file.
+static int TerminalCaptureRotate()
+{
+	char from[1024];
+	char to[1024];
+	int i;
+
+	TerminalCaptureClose();
+	snprintf( to, sizeof( to ), "%s.%d", term_capture_name, TERMINAL_CAPTURE_KEEP );
+	remove( to );
+	for( i = TERMINAL_CAPTURE_KEEP - 1; i >= 0; i-- )
+	{
+		if( i )
+			snprintf( from, sizeof( from ), "%s.%d", term_capture_name, i );
+		else
+			snprintf( from, sizeof( from ), "%s", term_capture_name );
+		snprintf( to, sizeof( to ), "%s.%d", term_capture_name, i + 1 );
+		rename( from, to );
+	}
+	return TerminalCaptureOpen();
+}
+
+int TerminalSetCapture( const char * filename, uint64_t limit )
+{
+	term_capture_name = strdup( filename );
+	term_capture_limit = limit;
+	term_capture_buffer = malloc( TERMINAL_CAPTURE_BUFFER );
+	if( TerminalCaptureOpen() ) return -9;
+	term_capture_last_flush = GetTimeMicroseconds();
+	atexit( TerminalCaptureClose );
+	return 0;
+}
+
+static void TerminalCaptureChunk( uint64_t timestamp, const uint8_t * data, int len )
+{
+	uint8_t header[12];
+	int i;
+
+	if( !term_capture ) return;
+	if( term_capture_limit && term_capture_written + sizeof( header ) + len > term_capture_limit && term_capture_written > 8 )
+	{
+		if( TerminalCaptureRotate() ) return;
+	}
+
+	for( i = 0; i < 8; i++ )
+		header[i] = timestamp >> (i*8);
+	for( i = 0; i < 4; i++ )
+		header[i+8] = (uint32_t)len >> (i*8);
+	fwrite( header, sizeof( header ), 1, term_capture );
+	fwrite( data, len, 1, term_capture );
+	term_capture_written += sizeof( header ) + len;
+	term_capture_dirty = 1;
+}
+
+// Push buffered capture data to disk once things have been quiet for a bit,
+// so a long soak run doesn't lose much if the host goes down.
+static void TerminalCaptureIdle( uint64_t now )
+{
+	if( !term_capture_dirty || now - term_capture_last_flush < TERMINAL_CAPTURE_FLUSH_US ) return;
+	fflush( term_capture );
+	term_capture_dirty = 0;
+	term_capture_last_flush = now;
+}
+
+// Where target output ends up after any decoding.
+static void TerminalEmit( const void * data, int len )
+{
+	if( TerminalRemoteActive() )
+		TerminalRemoteOutput( data, len );
+	if( term_capture )
+		TerminalCaptureChunk( GetTimeMicroseconds(), data, len );
+	else
+		TerminalOutput( data, len );
+}
+
+// Console part of the stream, after channels are split off.
+static void TerminalConsole( const uint8_t * data, int len )
+{
+	if( LogDecoderActive() )
+		LogDecoderFeed( data, len, TerminalEmit );
+	else
+		TerminalEmit( data, len );
+}
+
+// Bytes waiting to go to the target, from the keyboard or i.e. channel flow control.
+#define TERMINAL_INPUT_QUEUE_SIZE 4096 // Must be a power of two.
+static uint8_t term_in_queue[TERMINAL_INPUT_QUEUE_SIZE];
+static uint32_t term_in_head, term_in_tail;
+
+int TerminalQueueInput( const uint8_t * data, int len )
+{
+	int i;
+	for( i = 0; i < len && term_in_head - term_in_tail < TERMINAL_INPUT_QUEUE_SIZE; i++ )
+		term_in_queue[(term_in_head++) & ( TERMINAL_INPUT_QUEUE_SIZE - 1 )] = data[i];
+	return i;
+}
+
+int TerminalInputSpace( void )
+{
+	return TERMINAL_INPUT_QUEUE_SIZE - ( term_in_head - term_in_tail );
+}
+
+static int TerminalInputPending()
+{
+	return term_in_head - term_in_tail;
+}
+
+static int TerminalInputFull()
+{
+	return term_in_head - term_in_tail >= TERMINAL_INPUT_QUEUE_SIZE;
+}
+
+static uint8_t TerminalInputPop()
+{
+	return term_in_queue[(term_in_tail++) & ( TERMINAL_INPUT_QUEUE_SIZE - 1 )];
+}
+
+// Takes keyboard input for the host's own use, i.e. semihosting console reads.
+int TerminalInputRead( uint8_t * data, int len )
+{
+	int i;
+	for( i = 0; i < len && TerminalInputPending(); i++ )
+		data[i] = TerminalInputPop();
+	return i;
+}
+
+static void TerminalOutputString( const char * str ) __attribute__((used));
+static void TerminalOutputString( const char * str )
+{
+	TerminalOutput( str, strlen( str ) );
+}
+
+// Waits up to timeout_us for keyboard input, GDB socket or --pty/--tcp activity.
+// Returns positive if something is ready, 0 on timeout.
+static int TerminalWaitForEvents( int timeout_us, int wait_stdin, int gdbfd, const int * extrafds, const int * extraevents, int nextra )
+{
+	if( timeout_us <= 0 ) return 0;
+#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+	// No way to wait on a console and a socket together, so sleep in short slices.
+	int slept = 0;
+	do
+	{
+		if( wait_stdin && IsKBHit() ) return 1;
+		Sleep( 1 );
+		slept += 1000;
+	} while( slept < timeout_us && slept < 5000 );
+	return 0;
+#else
+	struct pollfd pfds[8];
+	int npfds = 0;
+	int i;
+	if( wait_stdin )
+	{
+		pfds[npfds].fd = fileno( stdin );
+		pfds[npfds].events = POLLIN;
+		pfds[npfds].revents = 0;
+		npfds++;
+	}
+	if( gdbfd >= 0 )
+	{
+		pfds[npfds].fd = gdbfd;
+		pfds[npfds].events = POLLIN;
+		pfds[npfds].revents = 0;
+		npfds++;
+	}
+	for( i = 0; i < nextra && npfds < (int)( sizeof( pfds ) / sizeof( pfds[0] ) ); i++ )
+	{
+		pfds[npfds].fd = extrafds[i];
+		pfds[npfds].events = ( ( extraevents[i] & 1 ) ? POLLIN : 0 ) | ( ( extraevents[i] & 2 ) ? POLLOUT : 0 );
+		pfds[npfds].revents = 0;
+		npfds++;
+	}
+	int r = poll( pfds, npfds, ( timeout_us + 999 ) / 1000 );
+	return ( r > 0 ) ? r : 0;
+#endif
+}
+
+int RunTerminal( void * dev, int with_gdb )
+{
+	if( with_gdb && SetupGDBServer( dev ) )
+	{
+		fprintf( stderr, "Error: can't start GDB server\n" );
+		return -1;
+	}
+	if( with_gdb )
+	{
+		fprintf( stderr, "GDBServer Running\n" );
+	}
+	else
+	{
+		// In case we aren't running already.
+		MCF.HaltMode( dev, 2 );
+	}
+
+	CaptureKeyboardInput();
+	if( term_capture )
+		fprintf( stderr, "Terminal started, capturing to %s\n", term_capture_name );
+	else
+		printf( "Terminal started\n\n" );
+
+#if TERMINAL_INPUT_BUFFER
+	char pline_buf[256]; // Buffer that contains current line that is being printed to
+	char input_buf[128]; // Buffer that contains user input until it is sent out
+	memset( pline_buf, 0, sizeof(pline_buf) );
+	memset( input_buf, 0, sizeof(input_buf) );
+	uint8_t input_pos = 0;
+	uint8_t to_send = 0;
+	uint8_t nice_terminal = isatty( fileno(stdout) ) && !term_capture && !LogDecoderActive() && !ChannelsActive() && !TerminalRemoteActive() && !SemihostActive();
+#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+	unsigned long console_mode;
+	void* handle_output = GetStdHandle(STD_OUTPUT_HANDLE);
+	GetConsoleMode(handle_output, &console_mode);
+	console_mode |= ENABLE_PROCESSED_OUTPUT | ENABLE_VIRTUAL_TERMINAL_PROCESSING;
+	uint8_t set_result = SetConsoleMode(handle_output, console_mode);
+	if ( set_result == 0 ) nice_terminal = 0;
+#else
+	if( nice_terminal > 0 )
+	{
+		fflush( stdin );
+		fprintf( stdout, "\x1b[6n" );
+		fflush( stdout );
+		read( fileno(stdin), input_buf, 10 );
+		if (input_buf[0] != 27)
+		{
+			nice_terminal = 0;
+		}
+		else
+		{
+			printf( TERMINAL_SEND_LABEL );
+			fflush( stdout );
+		}
+		memset( input_buf, 0, sizeof(input_buf) );
+	}
+#endif
+#endif
+
+	if( !term_capture )
+		TerminalStartWriter();
+
+	if( SemihostStart( dev, TerminalEmit, TerminalInputRead ) )
+		return -1;
+
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	uint32_t appendword = 0;
+	uint32_t appendwordB = 0;      // Input bytes 4-7, go into DATA1.
+	int stdin_live = 1;
+	int stray_halt_reported = 0;   // With --semihost, the core stopped on something else.
+	int poll_interval = 0;         // Microseconds between target polls, adapts to traffic.
+	uint64_t next_target_poll = 0;
+	do
+	{
+		uint8_t buffer[256];
+#if TERMINAL_INPUT_BUFFER
+		char print_buf[TERMINAL_BUFFER_SIZE]; // Buffer that is filled with everything and will be written to stdout (basically it's for formatting)
+		uint8_t update = 0;
+#endif
+		int shadow_halted = IsGDBServerInShadowHaltState( dev );
+
+		// Keyboard is drained on every pass, so a pending key can never make poll() spin.
+		if( !shadow_halted && stdin_live )
+		{
+#if TERMINAL_INPUT_BUFFER
+			if ( nice_terminal > 0 )
+			{
+				if( IsKBHit() > 0 && to_send == 0 )
+				{
+					uint8_t c = ReadKBByte();
+					if ( c == 8 || c == 127 )
+					{
+						input_buf[input_pos - 1] = 0;
+						if ( input_pos > 0 ) input_pos--;
+					}
+					else if ( c > 31 && c < 127 )
+					{
+						input_buf[input_pos] = c;
+						input_pos++;
+					}
+					else if ( c == '\n' || c == 10 )
+					{
+						to_send = input_pos;
+					}
+					update = 1;
+					next_target_poll = 0;
+				}
+			}
+			else
+#endif
+			{
+				while( !TerminalInputFull() && IsKBHit() > 0 )
+				{
+					int c = ReadKBByte();
+					if( c < 0 ) break;
+					uint8_t b = c;
+					TerminalQueueInput( &b, 1 );
+					next_target_poll = 0;
+				}
+			}
+			if( IsKBHit() < 0 ) stdin_live = 0; // EOF on stdin, stop waiting on it.
+		}
+
+		int remote_input = 0;
+		if( TerminalRemoteActive() )
+			TerminalRemotePoll( &remote_input );
+		if( remote_input ) next_target_poll = 0;
+
+		uint64_t now = GetTimeMicroseconds();
+		if( !shadow_halted && now >= next_target_poll )
+		{
+			int activity = 0;
+#if TERMINAL_INPUT_BUFFER
+			if ( nice_terminal > 0 )
+			{
+				// Process incomming buffer during sending
+				if( to_send > 0 && appendword == 0 )
+				{
+					int i;
+					for( i = 0; i < 3; i++ )
+					{
+						appendword |= input_buf[input_pos - to_send] << ( i * 8 + 8 );
+						to_send--;
+						if ( to_send == 0 ) break;
+					}
+					if( to_send == 0 )
+					{
+						snprintf(print_buf, TERMINAL_BUFFER_SIZE - 1, "%s%s%s\n%s%s", TERMINAL_CLEAR_CUR, TERMIANL_INPUT_SENT, input_buf, pline_buf, TERMINAL_SEND_LABEL);
+						TerminalOutputString( print_buf );
+						input_pos = 0;
+						memset( input_buf, 0, sizeof( input_buf ) );
+					}
+					appendword |= i + 4;
+					activity = 1;
+				}
+			}
+			else
+#endif
+			{
+				if( appendword == 0 )
+				{
+					// Pack as much as the link can carry, bytes 1-3 of DATA0, then all of DATA1.
+					int i;
+					// A semihosting read waiting on the keyboard gets it first.
+					for( i = 0; i < iss->terminal_input_max && TerminalInputPending() && !SemihostWantsInput(); i++ )
+					{
+						if( i < 3 )
+							appendword |= (uint32_t)TerminalInputPop() << (i*8+8);
+						else
+							appendwordB |= (uint32_t)TerminalInputPop() << ((i-3)*8);
+					}
+					if( i ) activity = 1;
+					appendword |= i+4; // Will go into DATA0.
+				}
+			}
+
+			int r = MCF.PollTerminal( dev, buffer, sizeof( buffer ), appendword, appendwordB );
+#if TERMINAL_INPUT_BUFFER
+			if( (nice_terminal > 0) && ( r == -1 || r == 0 ) && update > 0 )
+			{
+				strncpy( print_buf, TERMINAL_CLEAR_CUR, TERMINAL_BUFFER_SIZE - 1 );
+				if ( to_send > 0 ) strncat( print_buf, TERMINAL_DIM, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) );
+				strncat( print_buf, TERMINAL_SEND_LABEL, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) );
+				strncat( print_buf, input_buf, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) );
+				TerminalOutputString( print_buf );
+			}
+#endif
+			if( r < -5 )
+			{
+				fprintf( stderr, "Terminal dead.  code %d\n", r );
+				return -32;
+			}
+			else if( r < 0 )
+			{
+				// Other end ack'd without printf. (Or there is another situation)
+				appendword = 0;
+				appendwordB = 0;
+				if( TerminalInputPending() ) activity = 1;
+			}
+			else if( r > 0 )
+			{
+#if TERMINAL_INPUT_BUFFER
+				if ( nice_terminal )
+				{
+					int new_line = -1;
+					int i;
+					for( i = r; i > 0; i-- )
+					{
+						if( buffer[i-1] == '\n' )
+						{
+							new_line = r - i;
+							break;
+						}
+					}
+					if( new_line < 0 )
+					{
+						strncpy( print_buf, TERMINAL_CLEAR_PREV, TERMINAL_BUFFER_SIZE - 1 ); //  Go one line up and erase it
+						strncat( pline_buf, (char *)buffer, r); // Add newly received chars to line buffer
+					}
+					else
+					{
+						strncpy( print_buf, TERMINAL_CLEAR_CUR, TERMINAL_BUFFER_SIZE - 1 ); // Go to the start of the line and erase it
+						strncat( pline_buf, (char *)buffer, r - new_line ); // Add newly received chars to line buffer
+					}
+					strncat( print_buf, pline_buf, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) ); // Add line to buffer
+					if( new_line >= 0 )
+					{
+						memset( pline_buf, 0, sizeof( pline_buf ) );
+					}
+					if( new_line > 0)
+					{
+						strncat( pline_buf, (char *)buffer+r-new_line, new_line );
+						strncat( print_buf, pline_buf, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) ); // Add line to buffer
+					}
+
+					if( to_send > 0 ) strncat( print_buf, TERMINAL_DIM, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) );
+					strncat( print_buf, TERMINAL_SEND_LABEL, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) ); // Print styled "Send" label
+					strncat( print_buf, input_buf, TERMINAL_BUFFER_SIZE - 1 - strlen(print_buf) ); // Print current input
+					TerminalOutputString( print_buf );
+					print_buf[0] = 0;
+				}
+				else
+#endif
+				{
+					if( ChannelsActive() )
+						ChannelsFeed( buffer, r, TerminalConsole );
+					else
+						TerminalConsole( buffer, r );
+				}
+				// Otherwise it's basically just an ack for appendword.
+				appendword = 0;
+				appendwordB = 0;
+				activity = 1;
+			}
+
+			if( SemihostActive() )
+			{
+				int sr = SemihostPoll( dev );
+				if( sr == 1 )
+					activity = 1;
+				else if( sr < 0 && !with_gdb && !stray_halt_reported )
+					fprintf( stderr, "Target halted, but not for semihosting\n" );
+				stray_halt_reported = ( sr < 0 );
+			}
+
+			// Tighten right up while there is traffic, back off when idle.
+			if( activity )
+				poll_interval = 0;
+			else
+			{
+				if( term_capture )
+					TerminalCaptureIdle( now );
+				if( poll_interval < TERMINAL_POLL_MAX_US )
+				{
+					poll_interval = poll_interval ? poll_interval * 2 : TERMINAL_POLL_MIN_US;
+					if( poll_interval > TERMINAL_POLL_MAX_US ) poll_interval = TERMINAL_POLL_MAX_US;
+				}
+			}
+			next_target_poll = now + poll_interval;
+		}
+
+		if( with_gdb )
+		{
+			PollGDBServer( dev );
+		}
+
+		int watch_wait = TERMINAL_POLL_MAX_US;
+		if( WatchActive() && !IsGDBServerInShadowHaltState( dev ) )
+			watch_wait = WatchPoll( dev );
+
+		int want_stdin = stdin_live && !shadow_halted && !TerminalInputFull();
+#if TERMINAL_INPUT_BUFFER
+		if( to_send ) want_stdin = 0;
+#endif
+		int timeout = shadow_halted ? TERMINAL_POLL_MAX_US : (int)( next_target_poll - GetTimeMicroseconds() );
+		if( with_gdb && IsGDBServerBusy( dev ) )
+			timeout = 0;
+		if( watch_wait < timeout )
+			timeout = watch_wait;
+		// Channel consumers that can't keep up get retried soon, rather than at the idle rate.
+		if( ChannelsActive() && ChannelsPoll() && timeout > TERMINAL_POLL_MIN_US )
+			timeout = TERMINAL_POLL_MIN_US;
+		int remotefds[4], remoteevents[4];
+		int nremote = TerminalRemoteGetPollFDs( remotefds, remoteevents, 4 );
+		if( TerminalWaitForEvents( timeout, want_stdin, with_gdb ? GetGDBServerPollFD( dev ) : -1, remotefds, remoteevents, nremote ) )
+		{
+			// Someone is interacting, don't make them wait for the backoff.
+			poll_interval = 0;
+			next_target_poll = 0;
+		}
+	} while( 1 );
+
+	// Currently unreachable - consider reachable-ing
+	TerminalStopWriter();
+	if( with_gdb )
+		ExitGDBServer( dev );
+	return 0;
+}
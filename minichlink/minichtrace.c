@@ -0,0 +1,471 @@
+// Instruction trace by single stepping, --trace, and its offline decoder,
+// --trace-dump.
+//
+// The core runs until it reaches the start address (a hardware trigger), then
+// is stepped with DCSR.step.  Each step is just a resume request and an abstract
+// read of DPC, three DMI transactions, so nothing else about the core is saved
+// or restored in between.  With --trace-regs the whole register file is read
+// each step as well, and only registers which changed are recorded.
+//
+// Trace file, little endian:
+//   "MCLTRC1\n"
+//   uint32_t flags         1 = register deltas present
+//   uint32_t registers     Number of GPRs, if flags & 1
+//   uint32_t count         Number of records
+//   uint32_t initial[registers]   if flags & 1
+//   records:
+//     ZigZag ULEB128 of the PC minus the previous one (0 before the first)
+//     if flags & 1: ULEB128 mask of changed GPRs, then each new value, 4 bytes
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "terminalhelp.h"
+#include "minichlink.h"
+#include "minichelf.h"
+
+#define TRACE_MAGIC "MCLTRC1\n"
+#define TRACE_FLAG_REGS 1
+#define TRACE_CHECK_EVERY 64      // Steps between checks that the abstract commands are working.
+#define TRACE_SYMBOL_CACHE 4096   // Must be a power of two.
+
+#define CSR_TSELECT 0x7a0
+#define CSR_TDATA1  0x7a1
+#define CSR_TDATA2  0x7a2
+#define MCONTROL_TYPE   (2<<28)
+#define MCONTROL_DMODE  (1<<27)
+#define MCONTROL_ACTION_DEBUG (1<<12)
+#define MCONTROL_M      (1<<6)
+#define MCONTROL_U      (1<<3)
+#define MCONTROL_EXECUTE (1<<2)
+
+static int trace_regs;
+static int trace_wait_ms = 10000;
+
+static const char * trace_reg_names[32] = {
+	"zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "s0", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+	"a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6" };
+
+void TraceSetRegisters( int enable )
+{
+	trace_regs = enable;
+}
+
+void TraceSetWaitTimeout( int ms )
+{
+	trace_wait_ms = ms;
+}
+
+struct TraceBuffer
+{
+	uint8_t * data;
+	uint32_t len;
+	uint32_t alloc;
+};
+
+static void TraceAppend( struct TraceBuffer * b, const void * data, uint32_t len )
+{
+	if( b->len + len > b->alloc )
+	{
+		b->alloc = ( b->len + len ) * 2 + 4096;
+		b->data = realloc( b->data, b->alloc );
+	}
+	memcpy( b->data + b->len, data, len );
+	b->len += len;
+}
+
+static void TraceAppendULEB( struct TraceBuffer * b, uint32_t v )
+{
+	uint8_t buf[5];
+	int n = 0;
+	while( v >= 0x80 )
+	{
+		buf[n++] = v | 0x80;
+		v >>= 7;
+	}
+	buf[n++] = v;
+	TraceAppend( b, buf, n );
+}
+
+static void TraceAppend32( struct TraceBuffer * b, uint32_t v )
+{
+	uint8_t buf[4] = { v, v >> 8, v >> 16, v >> 24 };
+	TraceAppend( b, buf, 4 );
+}
+
+// Abstract access to a CSR, checking cmderr, since trigger CSRs may not exist.
+static int TraceCSR( void * dev, int write, uint32_t csr, uint32_t * value )
+{
+	uint32_t abstractcs;
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 );
+	if( write ) MCF.WriteReg32( dev, DMDATA0, *value );
+	MCF.WriteReg32( dev, DMCOMMAND, ( write ? 0x00230000 : 0x00220000 ) | csr );
+	if( MCF.ReadReg32( dev, DMABSTRACTCS, &abstractcs ) ) return -1;
+	if( abstractcs & 0x700 )
+	{
+		MCF.WriteReg32( dev, DMABSTRACTCS, 0x700 ); // Clear cmderr
+		return -2;
+	}
+	if( !write && MCF.ReadReg32( dev, DMDATA0, value ) ) return -1;
+	return 0;
+}
+
+// Arms trigger 0 to halt on executing address, or disarms it if address is 0.
+static int TraceArmTrigger( void * dev, uint32_t address )
+{
+	uint32_t tselect = 0;
+	uint32_t off = MCONTROL_TYPE | MCONTROL_DMODE;
+	uint32_t tdata1 = MCONTROL_TYPE | MCONTROL_DMODE | MCONTROL_ACTION_DEBUG | MCONTROL_M | MCONTROL_U | MCONTROL_EXECUTE;
+	uint32_t readback = 0;
+	if( TraceCSR( dev, 1, CSR_TSELECT, &tselect ) || TraceCSR( dev, 1, CSR_TDATA1, &off ) )
+		return -1;
+	if( !address ) return 0;
+	if( TraceCSR( dev, 1, CSR_TDATA2, &address ) || TraceCSR( dev, 1, CSR_TDATA1, &tdata1 ) ||
+		TraceCSR( dev, 0, CSR_TDATA1, &readback ) || !( readback & MCONTROL_EXECUTE ) )
+	{
+		TraceCSR( dev, 1, CSR_TDATA1, &off );
+		return -1;
+	}
+	return 0;
+}
+
+static int TraceCommandError( void * dev )
+{
+	uint32_t abstractcs = 0;
+	if( MCF.ReadReg32( dev, DMABSTRACTCS, &abstractcs ) ) return -1;
+	if( !( abstractcs & 0x700 ) ) return 0;
+	MCF.WriteReg32( dev, DMABSTRACTCS, 0x700 ); // Clear cmderr
+	return -1;
+}
+
+int RunTrace( void * dev, const char * elffile, const char * start, int steps, const char * tracefile )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	int nrregs = iss->nr_registers_for_debug;
+	uint32_t address = 0;
+	uint32_t dmstatus = 0;
+	uint32_t regs[33], prev[33];
+	int from_here = strcmp( start, "here" ) == 0;
+	int i, r = 0;
+
+	if( !MCF.WriteReg32 || !MCF.ReadReg32 || !MCF.ReadCPURegister || !MCF.SetEnableBreakpoints || !MCF.HaltMode )
+	{
+		fprintf( stderr, "Error: Tracing needs debug module access, which this programmer doesn't have\n" );
+		return -5;
+	}
+	if( trace_regs && !MCF.ReadAllCPURegisters )
+	{
+		fprintf( stderr, "Error: --trace-regs needs to read all registers, which this programmer can't\n" );
+		return -5;
+	}
+
+	if( !from_here )
+	{
+		if( start[0] >= '0' && start[0] <= '9' )
+			address = SimpleReadNumberInt( start, 0 );
+		else
+		{
+			struct MiniElf elf;
+			if( strcmp( elffile, "-" ) == 0 )
+			{
+				fprintf( stderr, "Error: --trace needs the firmware's ELF file to find %s\n", start );
+				return -9;
+			}
+			if( MiniElfLoad( &elf, elffile ) )
+				return -9;
+			r = MiniElfFindSymbol( &elf, start, &address, 0 );
+			MiniElfFree( &elf );
+			if( r )
+			{
+				fprintf( stderr, "Error: --trace can't find %s in the ELF\n", start );
+				return -9;
+			}
+		}
+	}
+
+	FILE * f = fopen( tracefile, "wb" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: Could not open %s\n", tracefile );
+		return -9;
+	}
+
+	MCF.HaltMode( dev, HALT_MODE_HALT_BUT_NO_RESET );
+	if( !from_here )
+	{
+		if( TraceArmTrigger( dev, address ) )
+		{
+			fprintf( stderr, "Error: Could not set a hardware breakpoint at 0x%08x, try starting from \"here\"\n", address );
+			fclose( f );
+			return -9;
+		}
+		fprintf( stderr, "Waiting for the core to reach 0x%08x, Enter to give up\n", address );
+		MCF.SetEnableBreakpoints( dev, 1, 0 ); // In case something left DCSR.step on.
+		MCF.HaltMode( dev, HALT_MODE_RESUME );
+		uint64_t wait_start = GetTimeMicroseconds();
+		do
+		{
+			if( MCF.DelayUS ) MCF.DelayUS( dev, 1000 );
+			if( MCF.ReadReg32( dev, DMSTATUS, &dmstatus ) )
+			{
+				fprintf( stderr, "Error: Lost the target while waiting\n" );
+				fclose( f );
+				return -9;
+			}
+			if( !( dmstatus & 0x200 ) && ( IsKBHit() > 0 ||
+				( trace_wait_ms && GetTimeMicroseconds() - wait_start >= (uint64_t)trace_wait_ms * 1000 ) ) )
+			{
+				// Take the trigger back out, it would stop the firmware later on.
+				MCF.HaltMode( dev, HALT_MODE_HALT_BUT_NO_RESET );
+				TraceArmTrigger( dev, 0 );
+				MCF.HaltMode( dev, HALT_MODE_RESUME );
+				fprintf( stderr, "Error: The core didn't reach 0x%08x, left it running, see --trace-wait\n", address );
+				fclose( f );
+				return -9;
+			}
+		} while( !( dmstatus & 0x200 ) );
+		TraceArmTrigger( dev, 0 );
+	}
+
+	// From here on, the core is only ever stepped, so nothing cached about it holds.
+	MemoryCacheInvalidate();
+	MCF.SetEnableBreakpoints( dev, 1, 1 );
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0 );
+
+	struct TraceBuffer b = { 0, 0, 0 };
+	uint32_t flags = trace_regs ? TRACE_FLAG_REGS : 0;
+	TraceAppend( &b, TRACE_MAGIC, 8 );
+	TraceAppend32( &b, flags );
+	TraceAppend32( &b, trace_regs ? nrregs : 0 );
+	TraceAppend32( &b, 0 ); // Count, filled in at the end.
+
+	if( trace_regs )
+	{
+		r = MCF.ReadAllCPURegisters( dev, regs );
+		for( i = 0; i < nrregs; i++ )
+			TraceAppend32( &b, regs[i] );
+		memcpy( prev, regs, sizeof( prev ) );
+	}
+	else
+	{
+		r = MCF.ReadCPURegister( dev, 0x7b1, &regs[nrregs] );
+	}
+	if( r )
+	{
+		fprintf( stderr, "Error: Could not read the starting PC\n" );
+		fclose( f );
+		free( b.data );
+		return -9;
+	}
+
+	uint32_t last_pc = 0;
+	uint32_t count = 0;
+	uint32_t checked_len = b.len, checked_count = 0;
+	uint64_t t0 = GetTimeMicroseconds();
+	for( i = 0; i <= steps; i++ )
+	{
+		if( i )
+		{
+			MCF.WriteReg32( dev, DMCONTROL, 0x40000001 ); // Resume, DCSR.step makes it one instruction.
+			if( trace_regs )
+				r = MCF.ReadAllCPURegisters( dev, regs );
+			else
+			{
+				MCF.WriteReg32( dev, DMCOMMAND, 0x00220000 | 0x7b1 ); // Read DPC into DATA0.
+				r = MCF.ReadReg32( dev, DMDATA0, &regs[nrregs] );
+			}
+			if( r ) break;
+		}
+
+		uint32_t pc = regs[nrregs];
+		int32_t delta = pc - last_pc;
+		TraceAppendULEB( &b, ( (uint32_t)delta << 1 ) ^ (uint32_t)( delta >> 31 ) );
+		last_pc = pc;
+		if( trace_regs )
+		{
+			uint32_t mask = 0;
+			int j;
+			for( j = 1; j < nrregs; j++ )
+				if( regs[j] != prev[j] ) mask |= 1u << j;
+			TraceAppendULEB( &b, mask );
+			for( j = 1; j < nrregs; j++ )
+				if( mask & ( 1u << j ) ) TraceAppend32( &b, regs[j] );
+			memcpy( prev, regs, sizeof( prev ) );
+		}
+		count++;
+
+		// A failed read would leave the last PC in DATA0, so only keep what's known good.
+		if( ( count % TRACE_CHECK_EVERY ) == 0 || i == steps )
+		{
+			if( TraceCommandError( dev ) )
+			{
+				fprintf( stderr, "Error: Abstract command failed within the last %d steps, the trace stops there\n", TRACE_CHECK_EVERY );
+				break;
+			}
+			checked_len = b.len;
+			checked_count = count;
+		}
+	}
+	uint64_t t1 = GetTimeMicroseconds();
+
+	MCF.SetEnableBreakpoints( dev, 1, 0 );
+	if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev );
+
+	b.len = checked_len;
+	b.data[16] = checked_count;
+	b.data[17] = checked_count >> 8;
+	b.data[18] = checked_count >> 16;
+	b.data[19] = checked_count >> 24;
+	int ok = fwrite( b.data, b.len, 1, f ) == 1;
+	fclose( f );
+	free( b.data );
+	if( !ok )
+	{
+		fprintf( stderr, "Error: Could not write %s\n", tracefile );
+		return -9;
+	}
+
+	double elapsed = ( t1 - t0 ) / 1000000.0;
+	fprintf( stderr, "Traced %u instructions in %.2f s (%.0f/s), %u bytes, core left halted at 0x%08x\n",
+		checked_count, elapsed, elapsed > 0 ? checked_count / elapsed : 0, checked_len, last_pc );
+	return ( checked_count == (uint32_t)steps + 1 ) ? 0 : -9;
+}
+
+struct TraceSymbol
+{
+	uint32_t pc;
+	int valid;
+	const char * function;
+	uint32_t offset;
+	const char * file;
+	uint32_t line;
+};
+
+static uint32_t TraceReadULEB( const uint8_t ** p, const uint8_t * end )
+{
+	uint32_t v = 0;
+	int shift = 0;
+	while( *p < end )
+	{
+		uint8_t c = *((*p)++);
+		if( shift < 32 ) v |= (uint32_t)( c & 0x7f ) << shift;
+		shift += 7;
+		if( !( c & 0x80 ) ) break;
+	}
+	return v;
+}
+
+static uint32_t TraceRead32( const uint8_t * p )
+{
+	return p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( (uint32_t)p[3] << 24 );
+}
+
+// Prints a trace file, symbolized if an ELF is given.  Needs no programmer.
+int TraceDump( const char * tracefile, const char * elffile )
+{
+	struct MiniElf elf;
+	struct MiniElfLines lines = { 0, 0 };
+	struct TraceSymbol * symbols = 0;
+	int have_elf = elffile && strcmp( elffile, "-" ) != 0;
+	uint32_t regs[32] = { 0 };
+
+	FILE * f = fopen( tracefile, "rb" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: Could not open %s\n", tracefile );
+		return -9;
+	}
+	fseek( f, 0, SEEK_END );
+	long len = ftell( f );
+	fseek( f, 0, SEEK_SET );
+	uint8_t * data = malloc( len > 0 ? len : 1 );
+	int ok = len >= 20 && fread( data, len, 1, f ) == 1;
+	fclose( f );
+	if( !ok || memcmp( data, TRACE_MAGIC, 8 ) )
+	{
+		fprintf( stderr, "Error: %s is not a minichlink trace\n", tracefile );
+		free( data );
+		return -9;
+	}
+	uint32_t flags = TraceRead32( data + 8 );
+	uint32_t nrregs = TraceRead32( data + 12 );
+	uint32_t count = TraceRead32( data + 16 );
+	const uint8_t * p = data + 20;
+	const uint8_t * end = data + len;
+	uint32_t i, j;
+	if( nrregs > 32 || ( ( flags & TRACE_FLAG_REGS ) && end - p < nrregs * 4 ) )
+	{
+		fprintf( stderr, "Error: %s is corrupt\n", tracefile );
+		free( data );
+		return -9;
+	}
+	if( flags & TRACE_FLAG_REGS )
+	{
+		for( i = 0; i < nrregs; i++, p += 4 )
+			regs[i] = TraceRead32( p );
+	}
+
+	if( have_elf )
+	{
+		if( MiniElfLoad( &elf, elffile ) )
+		{
+			free( data );
+			return -9;
+		}
+		MiniElfLoadLines( &elf, &lines );
+		symbols = calloc( TRACE_SYMBOL_CACHE, sizeof( struct TraceSymbol ) );
+	}
+
+	uint32_t pc = 0;
+	for( i = 0; i < count && p < end; i++ )
+	{
+		uint32_t z = TraceReadULEB( &p, end );
+		pc += (int32_t)( ( z >> 1 ) ^ -( z & 1 ) );
+		printf( "%8u  0x%08x", i, pc );
+		if( have_elf )
+		{
+			// Loops visit the same few addresses over and over, only look each up once.
+			struct TraceSymbol * s = &symbols[( pc >> 1 ) & ( TRACE_SYMBOL_CACHE - 1 )];
+			if( !s->valid || s->pc != pc )
+			{
+				s->pc = pc;
+				s->valid = 1;
+				s->function = MiniElfSymbolForAddress( &elf, pc, &s->offset );
+				if( MiniElfLineForAddress( &lines, pc, &s->file, &s->line ) )
+					s->file = 0;
+			}
+			char where[128];
+			if( s->function )
+				snprintf( where, sizeof( where ), "%s+0x%x", s->function, s->offset );
+			else
+				snprintf( where, sizeof( where ), "?" );
+			printf( "  %-32s", where );
+			if( s->file )
+				printf( "  %s:%u", s->file, s->line );
+		}
+		if( flags & TRACE_FLAG_REGS )
+		{
+			uint32_t mask = TraceReadULEB( &p, end );
+			for( j = 1; j < nrregs; j++ )
+			{
+				if( !( mask & ( 1u << j ) ) ) continue;
+				if( end - p < 4 ) break;
+				regs[j] = TraceRead32( p );
+				p += 4;
+				printf( "  %s=0x%08x", trace_reg_names[j], regs[j] );
+			}
+		}
+		printf( "\n" );
+	}
+	if( i < count )
+		fprintf( stderr, "Warning: %s ends after %u of %u records\n", tracefile, i, count );
+
+	if( have_elf )
+	{
+		free( symbols );
+		MiniElfFreeLines( &lines );
+		MiniElfFree( &elf );
+	}
+	free( data );
+	return 0;
+}
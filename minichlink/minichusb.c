@@ -0,0 +1,358 @@
+// Finding programmers, in one pass over the USB bus.
+//
+// Every programmer we know of is a USB device, even the HID ones, so a single
+// libusb_get_device_list() is enough to tell which are plugged in.  The
+// backends are then only asked to open what was actually found: the libusb
+// ones open the device straight from this list, the HID ones still go through
+// hid_open(), but only for a VID/PID that's known to be there.
+//
+// With several programmers on one host, the one to use can be picked by USB
+// serial number (--serial) or by the physical port it's plugged into
+// (--usb-path, as bus-port.port...  like Linux sysfs), or by a slot name
+// looked up in a file that binds slots to either (--slot).  Anything that
+// doesn't match is left out of the scan, so the backends never see it.  The
+// serial number means opening the device, so that's only done when asked for.
+//
+// The list and the libusb context are kept, so anything that needs a
+// programmer again, or more than one, doesn't pay for another scan.  Call
+// ProgrammerScanRelease() to drop the list and see the bus as it is now.  The
+// context stays for the life of the process, open handles belong to it.
+//
+// Station mode (--station) sits waiting for programmers to come and go.  Where
+// libusb can, that's a hotplug callback, which only notes that a known VID/PID
+// arrived or that one of the programmers found went away.  The rescan happens
+// afterwards, outside the callback.  Without hotplug, there's a rescan every
+// PROGRAMMER_WAIT_POLL_MS, and a programmer going away is only noticed when a
+// transfer to it fails, see ProgrammerUnplugged().
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "libusb.h"
+#include "terminalhelp.h"
+#include "minichlink.h"
+
+#define PROGRAMMER_MAX_FOUND 32
+#define PROGRAMMER_MAX_DEPTH 7 // USB allows at most this many tiers of hubs.
+#define PROGRAMMER_WAIT_POLL_MS 1000
+
+static const struct
+{
+	uint16_t vid, pid;
+	enum ProgrammerKind kind;
+	const char * name;
+} programmer_ids[] = {
+	{ 0x1a86, 0x8010, PROGRAMMER_LINKE, "WCH-LinkE" },
+	{ 0x1a86, 0x8012, PROGRAMMER_LINKE_ARM, "WCH-LinkE in ARM mode" },
+	{ 0x4348, 0x55e0, PROGRAMMER_LINKE_IAP, "WCH-LinkE in IAP mode" },
+	{ 0x303a, 0x4004, PROGRAMMER_ESP32S2, "ESP32S2 programmer" },
+	{ 0x1206, 0x5d10, PROGRAMMER_ESP32S2, "RVSWDIO003" },
+	{ 0x1986, 0x0034, PROGRAMMER_NHCLINK, "NHC-Link042" },
+	{ 0x1209, 0xd003, PROGRAMMER_RV003USB, "rv003usb application" },
+};
+
+static libusb_context * programmer_ctx;
+static libusb_device ** programmer_list;
+static int programmer_scanned;
+static int programmer_count;
+static struct ProgrammerFound programmer_found[PROGRAMMER_MAX_FOUND];
+static const char * programmer_want_serial;
+static const char * programmer_want_path;
+static uint32_t programmer_b003_id = 0x1209b003;
+static int programmer_quiet;
+static int programmer_hotplug = -1; // -1 = not set up yet, 0 = not supported.
+static int programmer_changed;
+static int programmer_lost;
+
+void * ProgrammerUSBContext( void )
+{
+	if( !programmer_ctx )
+	{
+		int status = libusb_init( &programmer_ctx );
+		if( status < 0 )
+		{
+			fprintf( stderr, "Error: libusb_init_context() returned %d\n", status );
+			exit( status );
+		}
+	}
+	return programmer_ctx;
+}
+
+void ProgrammerScanRelease( void )
+{
+	if( programmer_list )
+		libusb_free_device_list( programmer_list, 1 ); // Open handles hold their own reference.
+	programmer_list = 0;
+	programmer_scanned = 0;
+	programmer_count = 0;
+	programmer_lost = 0;
+}
+
+void ProgrammerSelect( const char * serial, const char * path )
+{
+	programmer_want_serial = serial;
+	programmer_want_path = path;
+	ProgrammerScanRelease();
+}
+
+static void ProgrammerPath( libusb_device * d, char * out, int len )
+{
+	uint8_t ports[PROGRAMMER_MAX_DEPTH];
+	int n = libusb_get_port_numbers( d, ports, PROGRAMMER_MAX_DEPTH ), i;
+	int pos = snprintf( out, len, "%d-", libusb_get_bus_number( d ) );
+	if( n <= 0 )
+		snprintf( out + pos, len - pos, "%d", libusb_get_port_number( d ) );
+	for( i = 0; i < n && pos < len; i++ )
+		pos += snprintf( out + pos, len - pos, i ? ".%d" : "%d", ports[i] );
+}
+
+static int ProgrammerReadSerial( libusb_device * d, uint8_t index, char * out, int len )
+{
+	libusb_device_handle * h;
+	int r;
+	out[0] = 0;
+	if( !index || libusb_open( d, &h ) )
+		return -1;
+	r = libusb_get_string_descriptor_ascii( h, index, (unsigned char *)out, len );
+	libusb_close( h );
+	if( r < 0 )
+	{
+		out[0] = 0;
+		return -1;
+	}
+	return 0;
+}
+
+int ProgrammerScan( uint32_t b003_id )
+{
+	ssize_t cnt, i;
+	int k, skipped = 0;
+
+	if( programmer_scanned )
+		return programmer_count;
+
+	programmer_b003_id = b003_id;
+	cnt = libusb_get_device_list( ProgrammerUSBContext(), &programmer_list );
+	if( cnt < 0 )
+	{
+		fprintf( stderr, "Error: libusb_get_device_list() returned %d\n", (int)cnt );
+		programmer_list = 0;
+		cnt = 0;
+	}
+	programmer_scanned = 1;
+	programmer_count = 0;
+
+	for( i = 0; i < cnt && programmer_count < PROGRAMMER_MAX_FOUND; i++ )
+	{
+		struct libusb_device_descriptor desc;
+		if( libusb_get_device_descriptor( programmer_list[i], &desc ) )
+			continue;
+
+		struct ProgrammerFound * p = &programmer_found[programmer_count];
+		p->kind = PROGRAMMER_NONE;
+		// The bootloader's ID can be changed with -c, so it isn't in the table.
+		if( desc.idVendor == ( b003_id >> 16 ) && desc.idProduct == ( b003_id & 0xffff ) )
+		{
+			p->kind = PROGRAMMER_B003FUN;
+			p->name = "B003Fun bootloader";
+		}
+		for( k = 0; p->kind == PROGRAMMER_NONE && k < sizeof( programmer_ids ) / sizeof( programmer_ids[0] ); k++ )
+		{
+			if( desc.idVendor == programmer_ids[k].vid && desc.idProduct == programmer_ids[k].pid )
+			{
+				p->kind = programmer_ids[k].kind;
+				p->name = programmer_ids[k].name;
+			}
+		}
+		if( p->kind == PROGRAMMER_NONE )
+			continue;
+
+		p->vid = desc.idVendor;
+		p->pid = desc.idProduct;
+		p->usbdev = programmer_list[i];
+		p->serial_index = desc.iSerialNumber;
+		p->serial[0] = 0;
+		ProgrammerPath( programmer_list[i], p->path, sizeof( p->path ) );
+
+		if( programmer_want_path && strcmp( p->path, programmer_want_path ) != 0 )
+		{
+			skipped++;
+			continue;
+		}
+		if( programmer_want_serial &&
+			( ProgrammerReadSerial( programmer_list[i], desc.iSerialNumber, p->serial, sizeof( p->serial ) ) ||
+			strcmp( p->serial, programmer_want_serial ) != 0 ) )
+		{
+			skipped++;
+			continue;
+		}
+		programmer_count++;
+	}
+
+	if( ( programmer_want_serial || programmer_want_path ) && !programmer_quiet )
+	{
+		if( !programmer_count )
+			fprintf( stderr, "Error: No programmer with %s %s, %d other%s found\n", programmer_want_serial ? "serial" : "USB path",
+				programmer_want_serial ? programmer_want_serial : programmer_want_path, skipped, skipped == 1 ? "" : "s" );
+		for( k = 0; k < programmer_count; k++ )
+		{
+			enum ProgrammerKind kind = programmer_found[k].kind;
+			if( kind == PROGRAMMER_ESP32S2 || kind == PROGRAMMER_B003FUN || kind == PROGRAMMER_RV003USB )
+				fprintf( stderr, "Warning: %s is opened through hidapi, which takes the first one with its VID/PID, not necessarily this one\n",
+					programmer_found[k].name );
+		}
+	}
+	return programmer_count;
+}
+
+const struct ProgrammerFound * ProgrammerFind( enum ProgrammerKind kind )
+{
+	int i;
+	for( i = 0; i < programmer_count; i++ )
+		if( programmer_found[i].kind == kind )
+			return &programmer_found[i];
+	return 0;
+}
+
+static int ProgrammerKnown( uint16_t vid, uint16_t pid )
+{
+	int k;
+	if( vid == ( programmer_b003_id >> 16 ) && pid == ( programmer_b003_id & 0xffff ) )
+		return 1;
+	for( k = 0; k < sizeof( programmer_ids ) / sizeof( programmer_ids[0] ); k++ )
+		if( vid == programmer_ids[k].vid && pid == programmer_ids[k].pid )
+			return 1;
+	return 0;
+}
+
+// Called from inside libusb's event handling, so only takes notes.
+static int LIBUSB_CALL ProgrammerHotplug( libusb_context * ctx, libusb_device * d, libusb_hotplug_event event, void * user )
+{
+	struct libusb_device_descriptor desc;
+	int i;
+	if( event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT )
+	{
+		// The scan's list holds a reference to each device, so it's the same libusb_device.
+		for( i = 0; i < programmer_count; i++ )
+			if( programmer_found[i].usbdev == d )
+				programmer_lost = 1;
+	}
+	else if( libusb_get_device_descriptor( d, &desc ) == 0 && ProgrammerKnown( desc.idVendor, desc.idProduct ) )
+		programmer_changed = 1;
+	return 0;
+}
+
+static void ProgrammerWatch( void )
+{
+	libusb_hotplug_callback_handle handle;
+	if( programmer_hotplug >= 0 )
+		return;
+	programmer_hotplug = libusb_has_capability( LIBUSB_CAP_HAS_HOTPLUG ) &&
+		libusb_hotplug_register_callback( ProgrammerUSBContext(), LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			LIBUSB_HOTPLUG_NO_FLAGS, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			ProgrammerHotplug, 0, &handle ) == LIBUSB_SUCCESS;
+	if( !programmer_hotplug )
+		fprintf( stderr, "Warning: No USB hotplug here, looking for programmers every %d ms instead\n", PROGRAMMER_WAIT_POLL_MS );
+}
+
+int ProgrammerWait( uint32_t b003_id, int timeout_ms )
+{
+	uint64_t start = GetTimeMicroseconds();
+	int n;
+
+	ProgrammerWatch();
+	programmer_quiet = 1;
+	ProgrammerScanRelease();
+	n = ProgrammerScan( b003_id );
+	while( !n && ( timeout_ms < 0 || GetTimeMicroseconds() - start < (uint64_t)timeout_ms * 1000 ) )
+	{
+		struct timeval tv = { PROGRAMMER_WAIT_POLL_MS / 1000, ( PROGRAMMER_WAIT_POLL_MS % 1000 ) * 1000 };
+		programmer_changed = 0;
+		// Returns early once the callback sets programmer_changed, otherwise this is the wait between polls.
+		libusb_handle_events_timeout_completed( ProgrammerUSBContext(), &tv, &programmer_changed );
+		if( programmer_changed || !programmer_hotplug )
+		{
+			ProgrammerScanRelease();
+			n = ProgrammerScan( b003_id );
+		}
+	}
+	programmer_quiet = 0;
+	return n;
+}
+
+int ProgrammerLost( void )
+{
+	ProgrammerWatch();
+	if( programmer_hotplug )
+	{
+		struct timeval tv = { 0, 0 };
+		libusb_handle_events_timeout_completed( ProgrammerUSBContext(), &tv, 0 );
+	}
+	return programmer_lost;
+}
+
+int ProgrammerUnplugged( void )
+{
+	if( programmer_hotplug < 0 )
+		return 0; // Nobody's waiting for programmers, so there's nothing better to do than give up.
+	programmer_lost = 1;
+	return 1;
+}
+
+// Slot files are lines of a slot name and a USB port path, or serial:NUMBER.  # starts a comment.
+int ProgrammerResolveSlot( const char * file, const char * slot, const char ** serial, const char ** path )
+{
+	char line[256];
+	int lineno = 0;
+	FILE * f = fopen( file, "r" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: Could not open slot file %s\n", file );
+		return -9;
+	}
+	while( fgets( line, sizeof( line ), f ) )
+	{
+		char name[64], where[128];
+		lineno++;
+		char * hash = strchr( line, '#' );
+		if( hash ) *hash = 0;
+		int n = sscanf( line, "%63s %127s", name, where );
+		if( n <= 0 )
+			continue;
+		if( n != 2 )
+		{
+			fprintf( stderr, "Error: %s:%d should be a slot name then a USB path or serial:NUMBER\n", file, lineno );
+			fclose( f );
+			return -9;
+		}
+		if( strcmp( name, slot ) )
+			continue;
+		fclose( f );
+		if( strncmp( where, "serial:", 7 ) == 0 )
+			*serial = strdup( where + 7 );
+		else
+			*path = strdup( where );
+		return 0;
+	}
+	fclose( f );
+	fprintf( stderr, "Error: There's no slot %s in %s\n", slot, file );
+	return -9;
+}
+
+int ProgrammerList( void )
+{
+	int i;
+	ProgrammerScan( 0x1209b003 );
+	for( i = 0; i < programmer_count; i++ )
+	{
+		struct ProgrammerFound * p = &programmer_found[i];
+		if( !p->serial[0] )
+			ProgrammerReadSerial( p->usbdev, p->serial_index, p->serial, sizeof( p->serial ) );
+		char serial[80];
+		snprintf( serial, sizeof( serial ), p->serial[0] ? "serial:%s" : "-", p->serial );
+		printf( "%-16s %-28s # %s %04x:%04x\n", p->path, serial, p->name, p->vid, p->pid );
+	}
+	if( !programmer_count )
+		fprintf( stderr, "No programmers found\n" );
+	return programmer_count;
+}
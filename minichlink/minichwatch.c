@@ -0,0 +1,433 @@
+// Live watch of target variables while the terminal runs, --watch.
+//
+// Every tick the core is stopped, the watched words are read, and it is let go
+// again.  Variables are sorted by address and read in as few ReadBinaryBlob
+// spans as possible, merging ones that are close together, since each extra
+// span costs more than a few extra words.  Reading memory goes through the
+// program buffer, which clobbers x8-x15, so TargetHold() saves those and
+// puts them back around the reads.  DMDATA0/1 too, which carry the terminal's
+// printf and input as well as the data for each access.  A tick
+// that finds a printf word the terminal hasn't taken yet is put off a little
+// rather than risk it.
+//
+// Each sample is a CSV row of host time, the values and how long the core was
+// held, written to a file or to whoever is connected on a TCP port.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "terminalhelp.h"
+#include "minichlink.h"
+#include "minichelf.h"
+
+#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+#define WATCH_NO_SOCKETS
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+#define WATCH_MAX 64
+#define WATCH_MAX_SPANS WATCH_MAX
+#define WATCH_MERGE_GAP 16        // Bytes we'd rather read for nothing than start another span.
+#define WATCH_DEFAULT_RATE 10
+#define WATCH_RETRY_US 2000       // When the terminal still has a word to collect.
+
+enum WatchType
+{
+	WATCH_U8,
+	WATCH_I8,
+	WATCH_U16,
+	WATCH_I16,
+	WATCH_U32,
+	WATCH_I32,
+	WATCH_F32,
+};
+
+static const struct
+{
+	const char * name;
+	int size;
+} watch_types[] = {
+	{ "u8", 1 }, { "i8", 1 }, { "u16", 2 }, { "i16", 2 }, { "u32", 4 }, { "i32", 4 }, { "f32", 4 },
+};
+
+struct WatchVariable
+{
+	char * name;
+	uint32_t address;
+	enum WatchType type;
+	uint32_t offset;  // Into the sample buffer.
+};
+
+struct WatchSpan
+{
+	uint32_t address;
+	uint32_t size;
+	uint32_t offset;  // Into the sample buffer.
+};
+
+static struct WatchVariable watch_vars[WATCH_MAX];
+static int watch_count;
+static struct WatchSpan watch_spans[WATCH_MAX_SPANS];
+static int watch_span_count;
+static uint8_t * watch_buffer;
+static uint32_t watch_buffer_size;
+
+static int watch_rate_hz = WATCH_DEFAULT_RATE;
+static uint64_t watch_next;
+static uint64_t watch_start;
+
+static FILE * watch_file;
+static int watch_listenfd = -1;
+static int watch_clientfd = -1;
+
+static uint64_t watch_samples, watch_failed, watch_dropped;
+static uint64_t watch_halt_total, watch_halt_max;
+
+void WatchSetRate( int hz )
+{
+	watch_rate_hz = hz;
+}
+
+int WatchActive( void )
+{
+	return watch_count > 0;
+}
+
+static void WatchClose( void )
+{
+	if( watch_samples + watch_failed )
+	{
+		fprintf( stderr, "Watch: %llu samples", (unsigned long long)watch_samples );
+		if( watch_failed ) fprintf( stderr, " (%llu failed)", (unsigned long long)watch_failed );
+		if( watch_dropped ) fprintf( stderr, " (%llu not sent)", (unsigned long long)watch_dropped );
+		fprintf( stderr, ", halt window %llu us average, %llu us max\n",
+			(unsigned long long)( watch_halt_total / ( watch_samples + watch_failed ) ), (unsigned long long)watch_halt_max );
+	}
+	if( watch_file ) fclose( watch_file );
+	watch_file = 0;
+}
+
+// name[+offset][:type] or address[:type]
+static int WatchParseVariable( struct MiniElf * elf, const char * spec )
+{
+	char * s = strdup( spec );
+	char * type = strchr( s, ':' );
+	char * plus = strchr( s, '+' );
+	uint32_t address = 0, size = 4;
+	int i;
+
+	if( watch_count == WATCH_MAX )
+	{
+		fprintf( stderr, "Error: --watch can only take %d variables\n", WATCH_MAX );
+		goto fail;
+	}
+	if( type ) *(type++) = 0;
+	if( plus ) *(plus++) = 0;
+
+	if( s[0] >= '0' && s[0] <= '9' )
+		address = SimpleReadNumberInt( s, 0 );
+	else if( MiniElfFindSymbol( elf, s, &address, &size ) )
+	{
+		fprintf( stderr, "Error: --watch can't find %s in the ELF\n", s );
+		goto fail;
+	}
+	if( plus ) address += SimpleReadNumberInt( plus, 0 );
+
+	struct WatchVariable * v = &watch_vars[watch_count];
+	v->name = strdup( spec );
+	v->address = address;
+	v->type = ( size == 1 ) ? WATCH_U8 : ( size == 2 ) ? WATCH_U16 : WATCH_U32;
+	if( type )
+	{
+		for( i = 0; i < (int)( sizeof( watch_types ) / sizeof( watch_types[0] ) ); i++ )
+			if( strcmp( type, watch_types[i].name ) == 0 ) break;
+		if( i == sizeof( watch_types ) / sizeof( watch_types[0] ) )
+		{
+			fprintf( stderr, "Error: --watch type %s is not one of u8, i8, u16, i16, u32, i32, f32\n", type );
+			free( v->name );
+			goto fail;
+		}
+		v->type = i;
+	}
+	if( v->address & ( watch_types[v->type].size - 1 ) )
+	{
+		fprintf( stderr, "Error: --watch %s is not aligned\n", spec );
+		free( v->name );
+		goto fail;
+	}
+	watch_count++;
+	free( s );
+	return 0;
+fail:
+	free( s );
+	return -1;
+}
+
+static int WatchCompareAddress( const void * a, const void * b )
+{
+	const struct WatchVariable * va = a, * vb = b;
+	return ( va->address < vb->address ) ? -1 : ( va->address > vb->address );
+}
+
+// Groups the variables into word aligned spans, and lays the spans out in watch_buffer.
+static void WatchPlanSpans( void )
+{
+	int i;
+	uint32_t offset = 0;
+	struct WatchVariable * sorted = malloc( watch_count * sizeof( struct WatchVariable ) );
+	memcpy( sorted, watch_vars, watch_count * sizeof( struct WatchVariable ) );
+	qsort( sorted, watch_count, sizeof( struct WatchVariable ), WatchCompareAddress );
+
+	watch_span_count = 0;
+	for( i = 0; i < watch_count; i++ )
+	{
+		uint32_t start = sorted[i].address & ~3;
+		uint32_t end = ( sorted[i].address + watch_types[sorted[i].type].size + 3 ) & ~3;
+		struct WatchSpan * last = watch_span_count ? &watch_spans[watch_span_count-1] : 0;
+		// Never merge across regions, the gap could be a peripheral that doesn't like being read.
+		if( last && start <= last->address + last->size + WATCH_MERGE_GAP && ( start >> 24 ) == ( last->address >> 24 ) )
+		{
+			if( end > last->address + last->size )
+				last->size = end - last->address;
+		}
+		else
+		{
+			watch_spans[watch_span_count].address = start;
+			watch_spans[watch_span_count].size = end - start;
+			watch_span_count++;
+		}
+	}
+	free( sorted );
+
+	for( i = 0; i < watch_span_count; i++ )
+	{
+		watch_spans[i].offset = offset;
+		offset += watch_spans[i].size;
+	}
+	watch_buffer_size = offset;
+	watch_buffer = malloc( watch_buffer_size );
+
+	// Each variable remembers where in the buffer its span put it.
+	for( i = 0; i < watch_count; i++ )
+	{
+		int j;
+		for( j = 0; j < watch_span_count; j++ )
+		{
+			struct WatchSpan * s = &watch_spans[j];
+			if( watch_vars[i].address >= s->address && watch_vars[i].address < s->address + s->size )
+				watch_vars[i].offset = s->offset + watch_vars[i].address - s->address;
+		}
+	}
+}
+
+static int WatchHeader( char * line, int len )
+{
+	int i, n = snprintf( line, len, "time_us" );
+	for( i = 0; i < watch_count && n < len; i++ )
+		n += snprintf( line + n, len - n, ",%s", watch_vars[i].name );
+	if( n < len ) n += snprintf( line + n, len - n, ",halt_us\n" );
+	return ( n < len ) ? n : len - 1;
+}
+
+#ifndef WATCH_NO_SOCKETS
+static int WatchListen( int port )
+{
+	struct sockaddr_in sin;
+	int reusevar = 1;
+	int s = socket( AF_INET, SOCK_STREAM, 0 );
+	if( s < 0 )
+	{
+		fprintf( stderr, "Error: Cannot create socket.\n" );
+		return -1;
+	}
+	setsockopt( s, SOL_SOCKET, SO_REUSEADDR, &reusevar, sizeof( reusevar ) );
+	memset( &sin, 0, sizeof( sin ) );
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = INADDR_ANY;
+	sin.sin_port = htons( port );
+	if( bind( s, (struct sockaddr *)&sin, sizeof( sin ) ) || listen( s, 1 ) )
+	{
+		fprintf( stderr, "Error: Could not bind to socket: %d\n", port );
+		close( s );
+		return -1;
+	}
+	fcntl( s, F_SETFL, O_NONBLOCK );
+	watch_listenfd = s;
+	fprintf( stderr, "Watch samples available on TCP port %d\n", port );
+	return 0;
+}
+
+static void WatchSend( const char * line, int len )
+{
+	if( watch_listenfd < 0 ) return;
+	if( watch_clientfd < 0 )
+	{
+		watch_clientfd = accept( watch_listenfd, 0, 0 );
+		if( watch_clientfd < 0 ) return;
+		fcntl( watch_clientfd, F_SETFL, O_NONBLOCK );
+		char header[4096];
+		int hlen = WatchHeader( header, sizeof( header ) );
+		send( watch_clientfd, header, hlen, MSG_NOSIGNAL );
+	}
+	int w = send( watch_clientfd, line, len, MSG_NOSIGNAL );
+	if( w < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+	{
+		// A slow reader loses rows, it doesn't get to hold up the target.
+		watch_dropped++;
+	}
+	else if( w < len )
+	{
+		close( watch_clientfd );
+		watch_clientfd = -1;
+	}
+}
+#else
+static void WatchSend( const char * line, int len ) { }
+#endif
+
+int WatchConfigure( const char * elffile, const char * variables, const char * output )
+{
+	struct MiniElf elf;
+	const char * p = variables;
+
+	if( MiniElfLoad( &elf, elffile ) )
+		return -9;
+	while( *p )
+	{
+		char spec[256];
+		int len = strcspn( p, "," );
+		if( len >= (int)sizeof( spec ) ) len = sizeof( spec ) - 1;
+		memcpy( spec, p, len );
+		spec[len] = 0;
+		p += len;
+		if( *p == ',' ) p++;
+		if( !spec[0] ) continue;
+		if( WatchParseVariable( &elf, spec ) )
+		{
+			MiniElfFree( &elf );
+			return -9;
+		}
+	}
+	MiniElfFree( &elf );
+	if( !watch_count )
+	{
+		fprintf( stderr, "Error: --watch needs at least one variable\n" );
+		return -9;
+	}
+
+	if( strncmp( output, "tcp:", 4 ) == 0 )
+	{
+#ifdef WATCH_NO_SOCKETS
+		fprintf( stderr, "Error: --watch to tcp: is not supported on this platform\n" );
+		return -9;
+#else
+		if( WatchListen( SimpleReadNumberInt( output + 4, 0 ) ) )
+			return -9;
+#endif
+	}
+	else
+	{
+		watch_file = fopen( output, "w" );
+		if( !watch_file )
+		{
+			fprintf( stderr, "Error: Could not open %s\n", output );
+			return -9;
+		}
+		char header[4096];
+		fwrite( header, WatchHeader( header, sizeof( header ) ), 1, watch_file );
+	}
+
+	WatchPlanSpans();
+	fprintf( stderr, "Watching %d variable%s with %d read%s of %u bytes total, at %d Hz\n",
+		watch_count, watch_count == 1 ? "" : "s", watch_span_count, watch_span_count == 1 ? "" : "s", watch_buffer_size, watch_rate_hz );
+	atexit( WatchClose );
+	return 0;
+}
+
+// Stops the core, reads every span, and lets it go.  Returns 0 if all went well, 1 if
+// it has to wait for the terminal.
+static int WatchSample( void * dev )
+{
+	struct TargetHold hold;
+	int i, r = TargetHold( dev, &hold, TARGET_HOLD_MAILBOX | TARGET_HOLD_MAILBOX_IDLE );
+	if( r )
+		return r;
+	for( i = 0; i < watch_span_count && !r; i++ )
+		r = MCF.ReadBinaryBlob( dev, watch_spans[i].address, watch_spans[i].size, watch_buffer + watch_spans[i].offset );
+	TargetRelease( dev, &hold );
+	return r;
+}
+
+static int WatchFormat( char * line, int len, uint64_t time_us, uint64_t halt_us )
+{
+	int i, n = snprintf( line, len, "%llu", (unsigned long long)time_us );
+	for( i = 0; i < watch_count && n < len; i++ )
+	{
+		struct WatchVariable * v = &watch_vars[i];
+		const uint8_t * d = watch_buffer + v->offset;
+		uint32_t u = d[0];
+		if( watch_types[v->type].size >= 2 ) u |= d[1] << 8;
+		if( watch_types[v->type].size == 4 ) u |= ( d[2] << 16 ) | ( (uint32_t)d[3] << 24 );
+		switch( v->type )
+		{
+		case WATCH_I8: n += snprintf( line + n, len - n, ",%d", (int8_t)u ); break;
+		case WATCH_I16: n += snprintf( line + n, len - n, ",%d", (int16_t)u ); break;
+		case WATCH_I32: n += snprintf( line + n, len - n, ",%d", (int32_t)u ); break;
+		case WATCH_F32:
+		{
+			union { uint32_t u; float f; } c = { u };
+			n += snprintf( line + n, len - n, ",%g", c.f );
+			break;
+		}
+		default: n += snprintf( line + n, len - n, ",%u", u ); break;
+		}
+	}
+	if( n < len ) n += snprintf( line + n, len - n, ",%llu\n", (unsigned long long)halt_us );
+	return ( n < len ) ? n : len - 1;
+}
+
+// Takes a sample if one is due.  Returns microseconds until the next one.
+int WatchPoll( void * dev )
+{
+	uint64_t now = GetTimeMicroseconds();
+	uint64_t period = watch_rate_hz > 0 ? 1000000 / watch_rate_hz : 1000000;
+	if( !watch_start ) watch_start = watch_next = now;
+	if( now < watch_next ) return watch_next - now;
+	watch_next += period;
+	if( watch_next < now ) watch_next = now + period; // Don't try to catch up after a stall.
+
+	int r = WatchSample( dev );
+	uint64_t after = GetTimeMicroseconds();
+	uint64_t halt = after - now;
+	watch_halt_total += halt;
+	if( halt > watch_halt_max ) watch_halt_max = halt;
+	if( r > 0 )
+	{
+		watch_next = after + WATCH_RETRY_US;
+		return WATCH_RETRY_US;
+	}
+	if( r )
+	{
+		watch_failed++;
+		return watch_next - after;
+	}
+	watch_samples++;
+
+	char line[4096];
+	int len = WatchFormat( line, sizeof( line ), now - watch_start, halt );
+	if( watch_file )
+	{
+		fwrite( line, len, 1, watch_file );
+		fflush( watch_file );
+	}
+	WatchSend( line, len );
+	return ( watch_next > after ) ? watch_next - after : 0;
+}
@@ -12,6 +12,7 @@ static int NHCLinkReadReg32(void * dev, uint8_t reg_7_bit, uint32_t * commandres
 static int NHCLinkFlushLLCommands(void * dev);
 static int NHCLinkDelayUS(void * dev, int microseconds);
 static int NHCLinkExit(void * dev);
+static int NHCLinkClose(void * dev);
 
 static libusb_device_handle *hdev = 0;
 
@@ -123,23 +124,24 @@ int NHCLinkExit(void * dev)
     return 0;
 }
 
+int NHCLinkClose(void * dev)
+{
+    libusb_close(hdev);
+    hdev = 0;
+    return 0;
+}
+
 void * TryInit_NHCLink042(void)
 {
-    libusb_context * ctx = 0;
 	int status;
     uint8_t buff[64];
     int32_t len;
 
-	status = libusb_init(&ctx);
-	if (status < 0) {
-		fprintf( stderr, "Error: libusb_init_context() returned %d\n", status );
-		exit( status );
-	}
-	
-	hdev = libusb_open_device_with_vid_pid(ctx, 0x1986, 0x0034);
-
-	if( !hdev )
+	ProgrammerScan( 0x1209b003 ); // Already done, unless this programmer was asked for by name.
+	const struct ProgrammerFound * p = ProgrammerFind( PROGRAMMER_NHCLINK );
+	if( !p || libusb_open( p->usbdev, &hdev ) )
 	{
+		hdev = 0;
 		return 0;
 	}
 		
@@ -158,6 +160,7 @@ void * TryInit_NHCLink042(void)
     MCF.DelayUS = NHCLinkDelayUS;
     MCF.FlushLLCommands = NHCLinkFlushLLCommands;
 	MCF.Exit = NHCLinkExit;
+	MCF.Close = NHCLinkClose;
 
 	return hdev;
 }
@@ -457,6 +457,8 @@ static int InternalB003FunBoot( void * dev )
 static int B003FunSetupInterface( void * dev )
 {
 	struct B003FunProgrammerStruct * eps = (struct B003FunProgrammerStruct*) dev;
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	iss->terminal_input_max = 3; // Terminal input is only known to work through DMDATA0 here.
 	printf( "Halting Boot Countdown\n" );
 	ResetOp( eps );
 	WriteOpArb( eps, halt_wait_blob, sizeof(halt_wait_blob) );
@@ -469,6 +471,13 @@ static int B003FunExit( void * dev )
 	return 0;
 }
 
+static int B003FunClose( void * dev )
+{
+	hid_close( ((struct B003FunProgrammerStruct*)dev)->hd );
+	free( dev );
+	return 0;
+}
+
 // MUST be 4-byte-aligned.
 static int B003FunWriteWord( void * dev, uint32_t address_to_write, uint32_t data )
 {
@@ -679,6 +688,7 @@ void * TryInit_B003Fun(uint32_t id)
 	MCF.Control3v3 = 0;
 	MCF.SetupInterface = B003FunSetupInterface;
 	MCF.Exit = B003FunExit;
+	MCF.Close = B003FunClose;
 	MCF.HaltMode = 0;
 	MCF.VoidHighLevelState = 0;
 	MCF.PollTerminal = B003PollTerminal;
@@ -557,6 +557,7 @@ void * TryInit_ESP32S2CHFUN()
 	MCF.DelayUS = ESPDelayUS;
 	MCF.Control3v3 = ESPControl3v3;
 	MCF.Exit = ESPExit;
+	MCF.Close = ESPExit;
 	MCF.VoidHighLevelState = ESPVoidHighLevelState;
 	MCF.VendorCommand = ESPVendorCommand;
 
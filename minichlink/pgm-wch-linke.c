@@ -140,6 +140,11 @@ void wch_link_command( libusb_device_handle * devh, const void * command_v, int
 	if( status ) goto sendfail;
 	return;
 sendfail:
+	if( status == LIBUSB_ERROR_NO_DEVICE && ProgrammerUnplugged() )
+	{
+		*transferred = 0;
+		return;
+	}
 	fprintf( stderr, "Error sending WCH command (%s): ", got_to_recv?"on recv":"on send" );
 	int i;
 	for( i = 0; i < commandlen; i++ )
@@ -165,30 +170,13 @@ static void wch_link_multicommands( libusb_device_handle * devh, int nrcommands,
 
 static inline libusb_device_handle * wch_link_base_setup( int inhibit_startup )
 {
-	libusb_context * ctx = 0;
 	int status;
-	status = libusb_init(&ctx);
-	if (status < 0) {
-		fprintf( stderr, "Error: libusb_init_context() returned %d\n", status );
-		exit( status );
-	}
-	
-	libusb_device **list;
-	ssize_t cnt = libusb_get_device_list(ctx, &list);
-	ssize_t i = 0;
+	const struct ProgrammerFound * p;
 
-	libusb_device *found = NULL;
-	libusb_device * found_arm_programmer = NULL;
-	libusb_device * found_programmer_in_iap = NULL;
-
-	for (i = 0; i < cnt; i++) {
-		libusb_device *device = list[i];
-		struct libusb_device_descriptor desc;
-		int r = libusb_get_device_descriptor(device,&desc);
-		if( r == 0 && desc.idVendor == 0x1a86 && desc.idProduct == 0x8010 ) { found = device; }
-		if( r == 0 && desc.idVendor == 0x1a86 && desc.idProduct == 0x8012) { found_arm_programmer = device; }
-		if( r == 0 && desc.idVendor == 0x4348 && desc.idProduct == 0x55e0) { found_programmer_in_iap = device; }
-	}
+	ProgrammerScan( 0x1209b003 ); // Already done, unless this programmer was asked for by name.
+	libusb_device * found = ( p = ProgrammerFind( PROGRAMMER_LINKE ) ) ? p->usbdev : NULL;
+	libusb_device * found_arm_programmer = ( p = ProgrammerFind( PROGRAMMER_LINKE_ARM ) ) ? p->usbdev : NULL;
+	libusb_device * found_programmer_in_iap = ( p = ProgrammerFind( PROGRAMMER_LINKE_IAP ) ) ? p->usbdev : NULL;
 
 	if( !found )
 	{
@@ -282,11 +270,12 @@ int LEWriteReg32( void * dev, uint8_t reg_7_bit, uint32_t command )
 		struct InternalState *iss = (struct InternalState *)( ( (struct ProgrammerStructBase *)dev )->internal );
 		if ( !iss->target_chip_id && !iss->statetag )
 		{
-			fprintf( stderr, "Programmer wasn't initialized? Fixing\n" );
+			if( !iss->probing )
+				fprintf( stderr, "Programmer wasn't initialized? Fixing\n" );
 			wch_link_command( devh, "\x81\x0d\x01\x02", 4, &resplen, resp, sizeof( resp ) );
 			iss->statetag = STTAG( "INIT" );
 		}
-		else
+		else if( !iss->probing )
 		{
 			fprintf( stderr, "Error setting write reg. Tell cnlohr. Maybe we should allow retries here?\n" );
 			fprintf( stderr, "RR: %d :", resplen );
@@ -297,7 +286,8 @@ int LEWriteReg32( void * dev, uint8_t reg_7_bit, uint32_t command )
 			}
 			fprintf( stderr, "\n" );
 		}
-		fprintf( stderr, "\n" );
+		if( !iss->probing )
+			fprintf( stderr, "\n" );
 		return -1;
 	}
 	return 0;
@@ -320,11 +310,12 @@ int LEReadReg32( void * dev, uint8_t reg_7_bit, uint32_t * commandresp )
 		struct InternalState *iss = (struct InternalState *)( ( (struct ProgrammerStructBase *)dev )->internal );
 		if ( !iss->target_chip_id && !iss->statetag )
 		{
-			fprintf( stderr, "Programmer wasn't initialized? Fixing\n" );
+			if( !iss->probing )
+				fprintf( stderr, "Programmer wasn't initialized? Fixing\n" );
 			wch_link_command( devh, "\x81\x0d\x01\x02", 4, (int *)&transferred, rbuff, sizeof( rbuff ) );
 			iss->statetag = STTAG( "INIT" );
 		}
-		else
+		else if( !iss->probing )
 		{
 			fprintf( stderr, "Error setting read reg. Tell cnlohr. Maybe we should allow retries here?\n" );
 			fprintf( stderr, "RR: %d :", transferred );
@@ -663,6 +654,13 @@ int LEExit( void * d )
 	return 0;
 }
 
+static int LEClose( void * d )
+{
+	libusb_close( ((struct LinkEProgrammerStruct*)d)->devh );
+	free( d );
+	return 0;
+}
+
 void * TryInit_WCHLinkE()
 {
 	libusb_device_handle * wch_linke_devh;
@@ -686,6 +684,7 @@ void * TryInit_WCHLinkE()
 	MCF.ConfigureReadProtection = LEConfigureReadProtection;
 
 	MCF.Exit = LEExit;
+	MCF.Close = LEClose;
 	return ret;
 };
 
@@ -141,7 +141,7 @@ static int ReadKBByte()
 	int rread = read(fileno(stdin), (char*)&rxchar, 1);
 
 	if( rread > 0 ) // Tricky: getchar can't be used with arrow keys.
-		return rxchar;
+		return (uint8_t)rxchar;
 	else
 		return -1;
 }
@@ -149,7 +149,7 @@ static int ReadKBByte()
 static int IsKBHit()
 {
 	if( is_eofd ) return -1;
-	int byteswaiting;
+	int byteswaiting = 0;
 	ioctl(0, FIONREAD, &byteswaiting);
 	if( !byteswaiting && write( fileno(stdin), 0, 0 ) != 0 ) { is_eofd = 1; return -1; } // Is end-of-file for 
 	return !!byteswaiting;